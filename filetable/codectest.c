@@ -0,0 +1,410 @@
+/*
+ * codectest.c: checks the encodings a table goes over the wire in: varints,
+ * paths coded against the one before, times as zigzagged differences, and
+ * whole tables; and that a body cut short, or running on past what it
+ * should hold, is turned down
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "filetable.h"
+#include "flattable.h"
+#include "../messaging/segment.h"
+#include "unittest.h"
+
+// a reader over the first len bytes encoded into w
+static WireReader reader_of(WireBuf *w, size_t len)
+{
+  WireReader r;
+  memset(&r, 0, sizeof(r));
+  r.data = w->data;
+  r.len = len;
+  r.fd = -1;
+  return r;
+}
+
+// a reader over the bytes given
+static WireReader reader_at(const char *bytes, size_t len)
+{
+  WireBuf w = {.data = (char *) bytes};
+  return reader_of(&w, len);
+}
+
+static void test_varint()
+{
+  uint64_t values[] = {0, 1, 127, 128, 16383, 16384, 1526000000, (uint64_t) 1 << 56,
+      ((uint64_t) 1 << 63) - 1, (uint64_t) 1 << 63, UINT64_MAX};
+  size_t sizes[] = {1, 1, 1, 2, 2, 3, 5, 9, 9, 10, 10};
+  int n = sizeof(values) / sizeof(values[0]);
+
+  // seven bits a byte, and each decodes back
+  WireBuf w = {.fd = -1};
+  int ok = 1;
+  for (int i = 0; i < n; i++) {
+    size_t before = w.len;
+    wire_put_varint(&w, values[i]);
+    ok &= (w.len - before == sizes[i]);
+  }
+  CHECK(ok, "varints take seven bits a byte");
+  WireReader r = reader_of(&w, w.len);
+  ok = 1;
+  for (int i = 0; i < n; i++) {
+    ok &= (wire_get_varint(&r) == values[i]);
+  }
+  CHECK(ok && wire_done(&r), "varints decode back");
+
+  // one cut short, before the byte without the top bit
+  wire_free(&w);
+  wire_put_varint(&w, 16384);
+  r = reader_of(&w, 2);
+  CHECK(wire_get_varint(&r) == 0 && r.error, "truncated varint");
+
+  // more than ten bytes, or a tenth with more than the one bit left
+  char eleven[] = {(char) 0x80, (char) 0x80, (char) 0x80, (char) 0x80, (char) 0x80,
+      (char) 0x80, (char) 0x80, (char) 0x80, (char) 0x80, (char) 0x80, 0x00};
+  r = reader_at(eleven, sizeof(eleven));
+  CHECK(wire_get_varint(&r) == 0 && r.error, "varint of eleven bytes");
+  char wide[] = {(char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff,
+      (char) 0xff, (char) 0xff, (char) 0xff, (char) 0xff, 0x03};
+  r = reader_at(wide, sizeof(wide));
+  CHECK(wire_get_varint(&r) == 0 && r.error, "varint past 64 bits");
+
+  // a count of more items than there are bytes left
+  char count[] = {0x05, 'a', 'b', 'c'};
+  r = reader_at(count, sizeof(count));
+  CHECK(wire_get_count(&r) == 0 && r.error, "count past the bytes left");
+  count[0] = 0x03;
+  r = reader_at(count, sizeof(count));
+  CHECK(wire_get_count(&r) == 3 && !r.error, "count of the bytes left");
+
+  wire_free(&w);
+}
+
+static void test_paths()
+{
+  char *paths[] = {"photos/2018/05/IMG_0001.jpg", "photos/2018/05/IMG_0002.jpg",
+      "photos/2018/06/a.jpg", "photos", "photos/2018/06/a.jpg/x", "", "zz", "zz"};
+  int n = sizeof(paths) / sizeof(paths[0]);
+
+  WireBuf w = {.fd = -1};
+  size_t sizes[sizeof(paths) / sizeof(paths[0])];
+  for (int i = 0; i < n; i++) {
+    size_t before = w.len;
+    wire_put_path(&w, paths[i], strlen(paths[i]));
+    sizes[i] = w.len - before;
+  }
+
+  // each keeps what it shares with the one before, and sends the rest
+  CHECK(sizes[0] == 2 + strlen(paths[0]), "first path goes whole");
+  CHECK(sizes[1] == 2 + strlen("2.jpg"), "path keeps the prefix it shares");
+  CHECK(sizes[3] == 2, "prefix of the path before is all kept");
+  CHECK(sizes[7] == 2, "same path again is all kept");
+
+  WireReader r = reader_of(&w, w.len);
+  int ok = 1;
+  for (int i = 0; i < n; i++) {
+    uint32_t len;
+    const char *path = wire_get_path(&r, 1024, &len);
+    ok &= (path != NULL && len == strlen(paths[i]) && strcmp(path, paths[i]) == 0);
+  }
+  CHECK(ok && wire_done(&r), "paths decode back");
+  wire_release(&r);
+
+  // cut anywhere short of the end, the path is turned down
+  ok = 1;
+  for (size_t cut = 0; cut < sizes[0]; cut++) {
+    r = reader_of(&w, cut);
+    uint32_t len;
+    ok &= (wire_get_path(&r, 1024, &len) == NULL && r.error);
+    wire_release(&r);
+  }
+  CHECK(ok, "truncated path");
+
+  // longer than the reader takes, by itself or with what it keeps
+  r = reader_of(&w, w.len);
+  uint32_t len;
+  CHECK(wire_get_path(&r, strlen(paths[0]) - 1, &len) == NULL && r.error, "path too long");
+  wire_release(&r);
+  r = reader_of(&w, w.len);
+  wire_get_path(&r, 1024, &len);
+  CHECK(wire_get_path(&r, strlen(paths[1]) - 1, &len) == NULL && r.error,
+      "path too long with what it keeps");
+  wire_release(&r);
+
+  // keeping more than the path before had
+  char keep[] = {0x03, 0x01, 'a'};
+  r = reader_at(keep, sizeof(keep));
+  CHECK(wire_get_path(&r, 1024, &len) == NULL && r.error, "keeps more than there was");
+  wire_release(&r);
+
+  // a path both ends know without sending is still coded against
+  wire_free(&w);
+  wire_skip_path(&w, "dir/a", 5);
+  wire_put_path(&w, "dir/b", 5);
+  CHECK(w.len == 3, "path after a skipped one keeps its prefix");
+  r = reader_of(&w, w.len);
+  wire_saw_path(&r, "dir/a", 5);
+  const char *path = wire_get_path(&r, 1024, &len);
+  CHECK(path != NULL && strcmp(path, "dir/b") == 0, "path after a seen one");
+  wire_release(&r);
+
+  wire_free(&w);
+}
+
+static void test_times()
+{
+  int64_t times[] = {0, 1, 0, -1, 1526000000, 1526000001, 1525999999, INT64_MAX,
+      INT64_MIN, 0, INT64_MIN, INT64_MAX};
+  int n = sizeof(times) / sizeof(times[0]);
+
+  WireBuf w = {.fd = -1};
+  for (int i = 0; i < n; i++) {
+    wire_put_time(&w, times[i]);
+  }
+  WireReader r = reader_of(&w, w.len);
+  int ok = 1;
+  for (int i = 0; i < n; i++) {
+    ok &= (wire_get_time(&r) == times[i]);
+  }
+  CHECK(ok && wire_done(&r), "times decode back, however far apart");
+
+  // a difference of up to 64 either way takes a byte
+  wire_free(&w);
+  w = (WireBuf) {.fd = -1};
+  wire_put_time(&w, 63);
+  CHECK(w.len == 1, "63 ahead takes a byte");
+  wire_put_time(&w, -1);
+  CHECK(w.len == 2, "64 back takes a byte");
+  wire_put_time(&w, 63);
+  CHECK(w.len == 4, "64 ahead takes two");
+  r = reader_of(&w, w.len);
+  CHECK(wire_get_time(&r) == 63 && wire_get_time(&r) == -1 && wire_get_time(&r) == 63,
+      "small differences decode back");
+
+  // and a time cut short is an error
+  r = reader_of(&w, 3);
+  wire_get_time(&r);
+  wire_get_time(&r);
+  wire_get_time(&r);
+  CHECK(r.error, "truncated time");
+
+  wire_free(&w);
+}
+
+// a file to insert; the table keeps a copy
+static void insert(FileTable *ft, char *path, unsigned int size, time_t last_modified,
+    int is_dir, char *ip, int port)
+{
+  FileInfo_FS *file = fileinfo_init();
+  if (file == NULL || fileinfo_set_path(file, path) < 0) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  file->size = size;
+  file->last_modified = last_modified;
+  file->is_dir = is_dir;
+  filetable_insert(ft, file, ip, port);
+  fileinfo_destroy(file);
+}
+
+// a table of a few hundred files, some of them on two peers
+static FileTable *sample_table()
+{
+  FileTable *ft = filetable_init();
+  insert(ft, "photos", 0, 1526000000, 1, "10.0.0.1", 4000);
+  char path[64];
+  for (int i = 0; i < 300; i++) {
+    sprintf(path, "photos/2018/%02d/IMG_%04d.jpg", i / 30, i);
+    insert(ft, path, 100000 + i * 37, 1526000000 + i * 60, 0, "10.0.0.1", 4000);
+    if (i % 3 == 0) {
+      filetable_addPeer(ft, path, "10.0.0.2", 4001, 100000 + i * 37);
+    }
+  }
+  return ft;
+}
+
+static int same_tables(FileTable *a, FileTable *b)
+{
+  if (a->numfiles != b->numfiles) {
+    return 0;
+  }
+  TableEntry *x = a->head, *y = b->head;
+  for (; x != NULL && y != NULL; x = x->next, y = y->next) {
+    if (strcmp(x->file->filepath, y->file->filepath) != 0 || x->file->size != y->file->size ||
+        x->file->last_modified != y->file->last_modified || x->file->is_dir != y->file->is_dir ||
+        filetable_getNumPeers(a, x->file->filepath) != filetable_getNumPeers(b, y->file->filepath)) {
+      return 0;
+    }
+  }
+  return x == NULL && y == NULL;
+}
+
+static void test_table()
+{
+  FileTable *ft = sample_table();
+  WireBuf w = {.fd = -1};
+  filetable_encode(&w, ft);
+
+  // the whole table decodes back, as a table and as a flat table
+  WireReader r = reader_of(&w, w.len);
+  FileTable *copy = filetable_decode(&r);
+  CHECK(copy != NULL && wire_done(&r) && same_tables(ft, copy), "table decodes back");
+  filetable_destroy(copy);
+  wire_release(&r);
+
+  r = reader_of(&w, w.len);
+  FlatTable *flat = flattable_decode(&r, 0);
+  CHECK(flat != NULL && wire_done(&r), "flat table decodes");
+  CHECK(flat != NULL && flattable_find(flat, "photos/2018/09/IMG_0299.jpg") >= 0,
+      "flat table has the last file");
+  flattable_destroy(flat);
+  wire_release(&r);
+
+  // about what the wire format promises a file costs
+  CHECK(w.len < (size_t) ft->numfiles * 24, "files are coded small");
+
+  // cut anywhere short of the end, it is turned down
+  int ok = 1;
+  for (size_t cut = 0; cut < w.len; cut++) {
+    r = reader_of(&w, cut);
+    copy = filetable_decode(&r);
+    ok &= (copy == NULL || !wire_done(&r));
+    filetable_destroy(copy);
+    wire_release(&r);
+
+    r = reader_of(&w, cut);
+    flat = flattable_decode(&r, 0);
+    ok &= (flat == NULL || !wire_done(&r));
+    flattable_destroy(flat);
+    wire_release(&r);
+  }
+  CHECK(ok, "truncated table");
+
+  // a byte past the end is left over, which a message won't allow
+  wire_put_u8(&w, 0);
+  r = reader_of(&w, w.len);
+  copy = filetable_decode(&r);
+  CHECK(copy != NULL && !wire_done(&r), "byte past the table is left over");
+  filetable_destroy(copy);
+  wire_release(&r);
+
+  // a count of more files than there are bytes for
+  wire_free(&w);
+  wire_put_varint(&w, 1);
+  wire_put_varint(&w, 1000000);
+  wire_put_varint(&w, 0);
+  r = reader_of(&w, w.len);
+  CHECK(filetable_decode(&r) == NULL, "file count past the bytes left");
+  wire_release(&r);
+
+  wire_free(&w);
+  filetable_destroy(ft);
+}
+
+// the bytes of a whole TABLE_UPDATE message, as sent
+static char *table_message(FileTable *ft, size_t *len)
+{
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    perror("socketpair");
+    exit(1);
+  }
+  CHECK(send_table_update(fds[0], ft) == 1, "send table");
+  close(fds[0]);
+
+  char *msg = NULL;
+  size_t cap = 0;
+  *len = 0;
+  ssize_t n;
+  do {
+    if (*len == cap) {
+      cap = cap ? 2 * cap : 4096;
+      msg = realloc(msg, cap);
+      if (msg == NULL) {
+        fprintf(stderr, "malloc\n");
+        exit(1);
+      }
+    }
+    n = read(fds[1], msg + *len, cap - *len);
+    *len += (n > 0) ? n : 0;
+  } while (n > 0);
+  close(fds[1]);
+  return msg;
+}
+
+// receives the message made of the first len bytes at msg, with its header
+// saying its payload is payload bytes long
+static int receive(const char *msg, size_t len, uint32_t payload)
+{
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    perror("socketpair");
+    exit(1);
+  }
+
+  char *copy = malloc(len);
+  if (copy == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  memcpy(copy, msg, len);
+  copy[8] = payload >> 24;
+  copy[9] = payload >> 16;
+  copy[10] = payload >> 8;
+  copy[11] = payload;
+  if (write(fds[0], copy, len) != (ssize_t) len) {
+    perror("write");
+    exit(1);
+  }
+  free(copy);
+  close(fds[0]);
+
+  Message m;
+  int res = recv_message(fds[1], &m);
+  if (res == 1 && m.type == TABLE_UPDATE) {
+    TableUpdateBody *body = m.body;
+    flattable_destroy(body->flat_table);
+    filetable_destroy(body->table);
+  }
+  free(res == 1 ? m.body : NULL);
+  close(fds[1]);
+  return res;
+}
+
+// a whole message of a table is taken; one whose header leaves some of the
+// table out, or says there is more to it than the table, is turned down
+static void test_message()
+{
+  FileTable *ft = sample_table();
+  size_t len;
+  char *msg = table_message(ft, &len);
+  uint32_t payload = len - WIRE_HEADER;
+
+  CHECK(receive(msg, len, payload) == 1, "whole message");
+
+  msg = realloc(msg, len + 1);
+  msg[len] = 0;
+  CHECK(receive(msg, len + 1, payload + 1) == -1, "message running past its table");
+  CHECK(receive(msg, len - 1, payload - 1) == -1, "message cut at the last byte");
+  CHECK(receive(msg, WIRE_HEADER + payload / 2, payload / 2) == -1, "message cut halfway");
+  CHECK(receive(msg, WIRE_HEADER, 0) == -1, "message with no body");
+
+  free(msg);
+  filetable_destroy(ft);
+}
+
+int main()
+{
+  test_varint();
+  test_paths();
+  test_times();
+  test_table();
+  test_message();
+
+  return check_report("codectest");
+}
@@ -0,0 +1,207 @@
+/*
+ * colscan.c for the vector kernels filecolumns_compare runs over columns
+ *
+ * written by team Fleetwood MAC
+ * CS60, May 2018
+ */
+
+
+#include <stdint.h>
+#include <time.h>
+
+#include "colscan.h"
+
+#if defined(__x86_64__) && defined(__SSE2__)
+#define COLSCAN_SSE2
+#include <emmintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define COLSCAN_NEON
+#include <arm_neon.h>
+#endif
+
+#if defined(COLSCAN_SSE2) || defined(COLSCAN_NEON)
+// the kernels load times two to a 128-bit vector
+_Static_assert(sizeof(time_t) == 8, "time_t is 64 bits");
+#endif
+
+// enum FileCompare's SAME, which the others are one either side of
+#define SAME 2
+
+
+/*          Local function declarations           */
+
+#ifdef COLSCAN_SSE2
+static inline __m128i gt_epi64(__m128i a, __m128i b);
+static inline __m128i low_halves(__m128i m0, __m128i m1);
+#endif
+
+
+/*      Public functions                */
+
+// colscan_classify
+void colscan_classify(int n, const time_t *file_mtime, const time_t *row_mtime,
+    const unsigned int *file_size, const unsigned int *row_size,
+    const unsigned char *found, unsigned char *result, unsigned char *resized)
+{
+  int i = 0;
+
+#if defined(COLSCAN_SSE2)
+  // eight pairs at a time: each comparison leaves a lane of all ones or all
+  // zeros, which are narrowed to a byte a pair. A mask byte is -1 where it
+  // holds, so SAME - newer + older is the pair's enum FileCompare
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i same = _mm_set1_epi8(SAME);
+  const __m128i one = _mm_set1_epi8(1);
+  for (; i + 8 <= n; i += 8) {
+    __m128i newer[4], older[4];
+    for (int k = 0; k < 4; k++) {
+      __m128i f = _mm_loadu_si128((const __m128i *) (file_mtime + i + 2 * k));
+      __m128i r = _mm_loadu_si128((const __m128i *) (row_mtime + i + 2 * k));
+      newer[k] = gt_epi64(f, r);
+      older[k] = gt_epi64(r, f);
+    }
+    __m128i newer8 = _mm_packs_epi16(_mm_packs_epi32(low_halves(newer[0], newer[1]),
+          low_halves(newer[2], newer[3])), zero);
+    __m128i older8 = _mm_packs_epi16(_mm_packs_epi32(low_halves(older[0], older[1]),
+          low_halves(older[2], older[3])), zero);
+
+    __m128i eq0 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (file_size + i)),
+        _mm_loadu_si128((const __m128i *) (row_size + i)));
+    __m128i eq1 = _mm_cmpeq_epi32(_mm_loadu_si128((const __m128i *) (file_size + i + 4)),
+        _mm_loadu_si128((const __m128i *) (row_size + i + 4)));
+    __m128i eq8 = _mm_packs_epi16(_mm_packs_epi32(eq0, eq1), zero);
+
+    __m128i missing = _mm_cmpeq_epi8(_mm_loadl_epi64((const __m128i *) (found + i)), zero);
+    __m128i compare = _mm_add_epi8(_mm_sub_epi8(same, newer8), older8);
+    _mm_storel_epi64((__m128i *) (result + i), _mm_andnot_si128(missing, compare));
+    _mm_storel_epi64((__m128i *) (resized + i),
+        _mm_andnot_si128(missing, _mm_andnot_si128(eq8, one)));
+  }
+#elif defined(COLSCAN_NEON)
+  // eight pairs at a time, as for SSE2, narrowing each lane to a byte
+  const uint8x8_t same = vdup_n_u8(SAME);
+  const uint8x8_t one = vdup_n_u8(1);
+  for (; i + 8 <= n; i += 8) {
+    uint64x2_t newer[4], older[4];
+    for (int k = 0; k < 4; k++) {
+      int64x2_t f = vld1q_s64((const int64_t *) (file_mtime + i + 2 * k));
+      int64x2_t r = vld1q_s64((const int64_t *) (row_mtime + i + 2 * k));
+      newer[k] = vcgtq_s64(f, r);
+      older[k] = vcltq_s64(f, r);
+    }
+    uint8x8_t newer8 = vmovn_u16(vcombine_u16(
+          vmovn_u32(vcombine_u32(vmovn_u64(newer[0]), vmovn_u64(newer[1]))),
+          vmovn_u32(vcombine_u32(vmovn_u64(newer[2]), vmovn_u64(newer[3])))));
+    uint8x8_t older8 = vmovn_u16(vcombine_u16(
+          vmovn_u32(vcombine_u32(vmovn_u64(older[0]), vmovn_u64(older[1]))),
+          vmovn_u32(vcombine_u32(vmovn_u64(older[2]), vmovn_u64(older[3])))));
+
+    uint32x4_t eq0 = vceqq_u32(vld1q_u32(file_size + i), vld1q_u32(row_size + i));
+    uint32x4_t eq1 = vceqq_u32(vld1q_u32(file_size + i + 4), vld1q_u32(row_size + i + 4));
+    uint8x8_t eq8 = vmovn_u16(vcombine_u16(vmovn_u32(eq0), vmovn_u32(eq1)));
+
+    uint8x8_t f = vld1_u8(found + i);
+    uint8x8_t present = vtst_u8(f, f);
+    uint8x8_t compare = vadd_u8(vsub_u8(same, newer8), older8);
+    vst1_u8(result + i, vand_u8(present, compare));
+    vst1_u8(resized + i, vand_u8(present, vbic_u8(one, eq8)));
+  }
+#endif
+
+  // what is left past the last whole vector
+  colscan_classifyScalar(n - i, file_mtime + i, row_mtime + i, file_size + i, row_size + i,
+      found + i, result + i, resized + i);
+}
+
+// colscan_classifyScalar
+void colscan_classifyScalar(int n, const time_t *file_mtime, const time_t *row_mtime,
+    const unsigned int *file_size, const unsigned int *row_size,
+    const unsigned char *found, unsigned char *result, unsigned char *resized)
+{
+  for (int i = 0; i < n; i++) {
+    int newer = file_mtime[i] > row_mtime[i];
+    int older = file_mtime[i] < row_mtime[i];
+    result[i] = found[i] * (SAME + newer - older);
+    resized[i] = found[i] & (file_size[i] != row_size[i]);
+  }
+}
+
+// colscan_matchRun
+int colscan_matchRun(const uint32_t *files, const uint32_t *rows, int n)
+{
+  int i = 0;
+
+#if defined(COLSCAN_SSE2)
+  // four ids at a time, as long as all four match
+  const __m128i zero = _mm_setzero_si128();
+  for (; i + 4 <= n; i += 4) {
+    __m128i f = _mm_loadu_si128((const __m128i *) (files + i));
+    __m128i r = _mm_loadu_si128((const __m128i *) (rows + i));
+    __m128i match = _mm_andnot_si128(_mm_cmpeq_epi32(f, zero), _mm_cmpeq_epi32(f, r));
+    int mask = _mm_movemask_ps(_mm_castsi128_ps(match));
+    if (mask != 0xf) {
+      return i + __builtin_ctz(~mask);
+    }
+  }
+#elif defined(COLSCAN_NEON)
+  // four ids at a time; the first vector that doesn't all match is left to
+  // the plain loop
+  for (; i + 4 <= n; i += 4) {
+    uint32x4_t f = vld1q_u32(files + i);
+    uint32x4_t match = vandq_u32(vceqq_u32(f, vld1q_u32(rows + i)), vtstq_u32(f, f));
+    if (vminvq_u32(match) == 0) {
+      break;
+    }
+  }
+#endif
+
+  return i + colscan_matchRunScalar(files + i, rows + i, n - i);
+}
+
+// colscan_matchRunScalar
+int colscan_matchRunScalar(const uint32_t *files, const uint32_t *rows, int n)
+{
+  int i = 0;
+  while (i < n && files[i] != 0 && files[i] == rows[i]) {
+    i++;
+  }
+  return i;
+}
+
+
+/*                  local functions                 */
+
+#ifdef COLSCAN_SSE2
+/*
+ * gt_epi64
+ *  Signed a > b in each 64-bit lane, which SSE2 can't compare directly: the
+ *  high halves decide as signed numbers unless they are equal, and then the
+ *  low halves do as unsigned ones, compared signed with their top bits
+ *  flipped
+ * Ret: all ones in each lane where a is greater, else zeros
+ */
+static inline __m128i gt_epi64(__m128i a, __m128i b)
+{
+  const __m128i flip = _mm_set1_epi32(INT32_MIN);
+  __m128i high_gt = _mm_cmpgt_epi32(a, b);
+  __m128i high_eq = _mm_cmpeq_epi32(a, b);
+  __m128i low_gt = _mm_cmpgt_epi32(_mm_xor_si128(a, flip), _mm_xor_si128(b, flip));
+
+  // each lane's low result up beside its high ones, then the high half's
+  // answer across the whole lane
+  low_gt = _mm_shuffle_epi32(low_gt, _MM_SHUFFLE(2, 2, 0, 0));
+  __m128i gt = _mm_or_si128(high_gt, _mm_and_si128(high_eq, low_gt));
+  return _mm_shuffle_epi32(gt, _MM_SHUFFLE(3, 3, 1, 1));
+}
+
+/*
+ * low_halves
+ *  Packs the four 64-bit lanes of m0 and m1, each all ones or all zeros,
+ *  into the four 32-bit lanes of one vector
+ */
+static inline __m128i low_halves(__m128i m0, __m128i m1)
+{
+  return _mm_unpacklo_epi64(_mm_shuffle_epi32(m0, _MM_SHUFFLE(2, 0, 2, 0)),
+      _mm_shuffle_epi32(m1, _MM_SHUFFLE(2, 0, 2, 0)));
+}
+#endif
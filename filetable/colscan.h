@@ -0,0 +1,53 @@
+/*
+ * colscan.h
+ * 	Kernels over the columns filecolumns_compare lines up, several rows an
+ * 	instruction where the machine has vectors for it
+ *
+ * 	Each kernel is built with SSE2 on x86-64 and with NEON on AArch64, both
+ * 	of which every such machine has, and as a plain loop elsewhere. The
+ * 	plain loops are kept for every build too: they finish what is left
+ * 	past the last whole vector, and are what the kernels are checked against.
+ *
+ * written by team Fleetwood MAC
+ * CS60, May 2018
+ */
+
+#ifndef COLSCAN_H
+#define COLSCAN_H
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * colscan_classify
+ *  For each of n pairs, sets result to its enum FileCompare, by whether the
+ *  file's modification time is before, the same as or after the row's, and
+ *  resized to whether the sizes differ; both are 0 where found is 0
+ */
+void colscan_classify(int n, const time_t *file_mtime, const time_t *row_mtime,
+		const unsigned int *file_size, const unsigned int *row_size,
+		const unsigned char *found, unsigned char *result, unsigned char *resized);
+
+/*
+ * colscan_classifyScalar
+ *  colscan_classify, one pair at a time
+ */
+void colscan_classifyScalar(int n, const time_t *file_mtime, const time_t *row_mtime,
+		const unsigned int *file_size, const unsigned int *row_size,
+		const unsigned char *found, unsigned char *result, unsigned char *resized);
+
+/*
+ * colscan_matchRun
+ *  Compares the path ids of files with those of rows, pair by pair, up to n
+ * ret: how many pairs from the start have the same id, not counting id 0,
+ *  which means no id
+ */
+int colscan_matchRun(const uint32_t *files, const uint32_t *rows, int n);
+
+/*
+ * colscan_matchRunScalar
+ *  colscan_matchRun, one pair at a time
+ */
+int colscan_matchRunScalar(const uint32_t *files, const uint32_t *rows, int n);
+
+#endif //COLSCAN_H
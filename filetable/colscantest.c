@@ -0,0 +1,264 @@
+/*
+ * colscantest.c: checks the vector kernels in colscan.c against the plain
+ * loops they stand for, on every length around a whole vector and on the
+ * times and sizes at the edges of their types; the path ids they match by;
+ * and that comparing files with a table lines them up as a search row by
+ * row would, whether the table is a FileTable or a flat copy of one
+ *
+ * written by team Fleetwood MAC
+ * CS60, May 2018
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
+#include "colscan.h"
+#include "filetable.h"
+#include "flattable.h"
+#include "unittest.h"
+
+#define MAXN 70
+
+// times that differ in either half, and at the ends of the range
+static time_t times[] = {0, 1, -1, 1000, 1001, 0x100000000LL, 0x100000001LL, 0xffffffffLL,
+  -0x100000000LL, 0x7fffffff, 0x80000000LL, INT64_MAX, INT64_MIN, INT64_MAX - 1,
+  INT64_MIN + 1};
+#define NTIMES (sizeof(times) / sizeof(times[0]))
+
+static unsigned int sizes[] = {0, 1, 2, 0x7fffffff, 0x80000000u, UINT_MAX};
+#define NSIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static void test_classify()
+{
+  srand(11);
+  time_t file_mtime[MAXN], row_mtime[MAXN];
+  unsigned int file_size[MAXN], row_size[MAXN];
+  unsigned char found[MAXN];
+  unsigned char result[MAXN + 1], resized[MAXN + 1], want[MAXN], want_resized[MAXN];
+
+  int ok = 1, past_end = 1;
+  for (int round = 0; round < 200; round++) {
+    for (int n = 0; n < MAXN; n++) {
+      for (int i = 0; i < n; i++) {
+        file_mtime[i] = times[rand() % NTIMES];
+        row_mtime[i] = (rand() % 3 == 0) ? file_mtime[i] : times[rand() % NTIMES];
+        file_size[i] = sizes[rand() % NSIZES];
+        row_size[i] = (rand() % 2 == 0) ? file_size[i] : sizes[rand() % NSIZES];
+        found[i] = rand() % 4 != 0;
+      }
+      result[n] = resized[n] = 0xaa;
+      colscan_classify(n, file_mtime, row_mtime, file_size, row_size, found, result, resized);
+      colscan_classifyScalar(n, file_mtime, row_mtime, file_size, row_size, found, want,
+          want_resized);
+      ok &= (memcmp(result, want, n) == 0 && memcmp(resized, want_resized, n) == 0);
+      past_end &= (result[n] == 0xaa && resized[n] == 0xaa);
+    }
+  }
+  CHECK(ok, "classify kernel agrees with the plain loop");
+  CHECK(past_end, "classify writes nothing past n");
+
+  // and the answers themselves
+  time_t f[] = {5, 5, 5, INT64_MIN, 0x100000000LL};
+  time_t r[] = {4, 5, 6, INT64_MAX, 0xffffffffLL};
+  unsigned int fs[] = {1, 1, 1, 1, 0}, rs[] = {1, 2, 1, 1, UINT_MAX};
+  unsigned char present[] = {1, 1, 1, 1, 0};
+  colscan_classify(5, f, r, fs, rs, present, result, resized);
+  CHECK(result[0] == FILE_NEWER && result[1] == FILE_SAME && result[2] == FILE_OLDER &&
+      result[3] == FILE_OLDER && result[4] == FILE_ABSENT, "classify by time");
+  CHECK(!resized[0] && resized[1] && !resized[2] && !resized[4], "resized by size");
+}
+
+static void test_matchRun()
+{
+  srand(12);
+  uint32_t files[MAXN], rows[MAXN];
+
+  int ok = 1;
+  for (int round = 0; round < 2000; round++) {
+    int n = rand() % MAXN;
+    for (int i = 0; i < n; i++) {
+      files[i] = rows[i] = 1 + rand() % 5;
+    }
+    // a miss somewhere, or none, or an id of 0
+    if (n > 0 && rand() % 4 != 0) {
+      int at = rand() % n;
+      if (rand() % 2 == 0) {
+        rows[at] ^= 0x80000000u;
+      }
+      else {
+        files[at] = rows[at] = 0;
+      }
+    }
+    ok &= (colscan_matchRun(files, rows, n) == colscan_matchRunScalar(files, rows, n));
+  }
+  CHECK(ok, "matchRun kernel agrees with the plain loop");
+
+  uint32_t a[] = {1, 2, 3, 4, 5, 6, 7, 8, 9}, b[] = {1, 2, 3, 4, 5, 6, 7, 0, 9};
+  CHECK(colscan_matchRun(a, a, 9) == 9 && colscan_matchRun(a, b, 9) == 7 &&
+      colscan_matchRun(b, b, 9) == 7 && colscan_matchRun(a, a + 1, 9) == 0,
+      "matchRun stops at the first miss or id 0");
+}
+
+static void test_ids()
+{
+  char name[32];
+  char *held[500];
+  uint32_t ids[500];
+  int unique = 1;
+  for (int i = 0; i < 500; i++) {
+    sprintf(name, "ids/%d", i);
+    held[i] = path_intern(name);
+    ids[i] = path_id(held[i]);
+    unique &= (ids[i] != 0);
+    for (int j = 0; j < i; j++) {
+      unique &= (ids[i] != ids[j]);
+    }
+  }
+  CHECK(unique, "pooled paths have ids of their own");
+
+  char *again = path_intern("ids/7");
+  CHECK(again == held[7] && path_id(again) == ids[7], "same path, same id");
+  path_release(again);
+  CHECK(path_id(NULL) == 0, "no id for NULL");
+
+  // ids come back once their paths are gone, still unique among the living
+  for (int i = 0; i < 500; i += 2) {
+    path_release(held[i]);
+  }
+  for (int i = 0; i < 500; i += 2) {
+    sprintf(name, "ids/new%d", i);
+    held[i] = path_intern(name);
+    ids[i] = path_id(held[i]);
+  }
+  unique = 1;
+  for (int i = 0; i < 500; i++) {
+    for (int j = 0; j < i; j++) {
+      unique &= (ids[i] != ids[j]);
+    }
+  }
+  CHECK(unique, "ids handed out again stay unique");
+  for (int i = 0; i < 500; i++) {
+    path_release(held[i]);
+  }
+}
+
+// whether cmp is what looking each file up in the columns gives
+static int lined_up(FileComparison *cmp, int nfiles)
+{
+  FileColumns *cols = cmp->table;
+  if (cmp->n != nfiles) {
+    return 0;
+  }
+  int *taken = calloc(cols->n + 1, sizeof(int));
+  int ok = 1;
+  for (int i = 0; i < cmp->n; i++) {
+    FileInfo_FS *file = cmp->files[i];
+    int row = -1;
+    for (int j = 0; j < cols->n; j++) {
+      if (strcmp(cols->paths[j], file->filepath) == 0) {
+        row = j;
+      }
+    }
+    ok &= (cmp->rows[i] == row);
+    if (row < 0) {
+      ok &= (cmp->result[i] == FILE_ABSENT && !cmp->resized[i]);
+      continue;
+    }
+    taken[row] = 1;
+    time_t ours = file->last_modified, theirs = cols->last_modified[row];
+    ok &= (cmp->result[i] == (ours > theirs ? FILE_NEWER : ours < theirs ? FILE_OLDER : FILE_SAME));
+    ok &= (cmp->resized[i] == (file->size != cols->sizes[row]));
+  }
+  for (int j = 0; j < cols->n; j++) {
+    ok &= (cmp->matched[j] == taken[j]);
+  }
+  free(taken);
+  return ok;
+}
+
+// the whole of ft as a peer decodes it
+static FlatTable *flat_of(FileTable *ft)
+{
+  WireBuf w = {.fd = -1};
+  filetable_encode(&w, ft);
+  WireReader r;
+  memset(&r, 0, sizeof(r));
+  r.data = w.data;
+  r.len = w.len;
+  r.fd = -1;
+  FlatTable *t = flattable_decode(&r, 0);
+  if (t == NULL || !wire_done(&r)) {
+    fprintf(stderr, "table doesn't decode\n");
+    exit(1);
+  }
+  wire_release(&r);
+  wire_free(&w);
+  return t;
+}
+
+static void test_compare()
+{
+  srand(13);
+  char path[32];
+  int ok = 1, flat_ok = 1;
+  for (int round = 0; round < 300; round++) {
+    // long runs of rows the files agree with, broken up now and then
+    FileTable *ft = filetable_init();
+    FileInfo_FS *files = NULL;
+    int nfiles = 0;
+    int npaths = rand() % 120;
+    for (int p = 0; p < npaths; p++) {
+      sprintf(path, "d%d/f%03d", p % 3, p);
+      FileInfo_FS *file = fileinfo_init();
+      if (file == NULL || fileinfo_set_path(file, path) < 0) {
+        fprintf(stderr, "malloc\n");
+        exit(1);
+      }
+      file->size = rand() % 3;
+      file->last_modified = 1000 + rand() % 3;
+      if (rand() % 10 != 0) {
+        filetable_insert(ft, file, "10.0.0.1", 5000);
+      }
+      if (rand() % 10 != 0) {
+        file->size = rand() % 3;
+        file->last_modified = 1000 + rand() % 3;
+        // and now and then the same path twice
+        int copies = (rand() % 20 == 0) ? 2 : 1;
+        for (int c = 0; c < copies; c++) {
+          FileInfo_FS *copy = fileinfo_clone(file);
+          copy->next = files;
+          files = copy;
+          nfiles++;
+        }
+      }
+      fileinfo_destroy(file);
+    }
+
+    FileComparison *cmp = filetable_compare(ft, files);
+    ok &= lined_up(cmp, nfiles);
+    filecomparison_destroy(cmp);
+
+    FlatTable *t = flat_of(ft);
+    cmp = flattable_compare(t, files);
+    flat_ok &= lined_up(cmp, nfiles);
+    filecomparison_destroy(cmp);
+    flattable_destroy(t);
+
+    fileinfo_destroy_all(files);
+    filetable_destroy(ft);
+  }
+  CHECK(ok, "files lined up with a table's rows");
+  CHECK(flat_ok, "files lined up with a flat table's rows");
+}
+
+int main()
+{
+  test_classify();
+  test_matchRun();
+  test_ids();
+  test_compare();
+
+  return check_report("colscantest");
+}
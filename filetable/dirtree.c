@@ -0,0 +1,332 @@
+/*
+ * dirtree.c for indexing the file table by directory
+ *
+ * written by team Fleetwood MAC
+ * CS60, May 2018
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "dirtree.h"
+
+// initial number of hash buckets; doubled whenever the load factor passes 1
+#define INIT_BUCKETS 64
+
+
+/*          Local function declarations           */
+
+static unsigned int node_hash(DirNode *parent, const char *name, int len);
+static DirNode *child_find(DirTree *tree, DirNode *parent, const char *name, int len);
+static DirNode *child_add(DirTree *tree, DirNode *parent, const char *name, int len);
+static void node_free(DirTree *tree, DirNode *node);
+static void hash_resize(DirTree *tree, int nbuckets);
+
+
+/*      Public functions                */
+
+// dirtree_init
+DirTree *dirtree_init()
+{
+  DirTree *tree = calloc(1, sizeof(DirTree));
+  if (tree == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  tree->root = calloc(1, sizeof(DirNode));
+  tree->nbuckets = INIT_BUCKETS;
+  tree->buckets = calloc(tree->nbuckets, sizeof(DirNode *));
+  if (tree->root == NULL || tree->buckets == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  tree->root->name = calloc(1, 1);
+  return tree;
+}
+
+// dirtree_destroy
+void dirtree_destroy(DirTree *tree)
+{
+  if (tree == NULL) {
+    return;
+  }
+
+  // every node other than the root is in exactly one bucket
+  for (int i = 0; i < tree->nbuckets; i++) {
+    for (DirNode *cur = tree->buckets[i]; cur != NULL; cur = tree->buckets[i]) {
+      tree->buckets[i] = cur->hnext;
+      free(cur->name);
+      free(cur);
+    }
+  }
+
+  free(tree->root->name);
+  free(tree->root);
+  free(tree->buckets);
+  free(tree);
+}
+
+// find or create the node for path, one component at a time
+DirNode *dirtree_insert(DirTree *tree, const char *path)
+{
+  if (tree == NULL || path == NULL) {
+    return NULL;
+  }
+
+  DirNode *cur = tree->root;
+  const char *comp = path;
+  while (*comp != '\0') {
+    const char *end = strchr(comp, '/');
+    int len = (end == NULL) ? strlen(comp) : end - comp;
+
+    // skip empty components from doubled slashes
+    if (len > 0) {
+      DirNode *child = child_find(tree, cur, comp, len);
+      if (child == NULL) {
+        child = child_add(tree, cur, comp, len);
+      }
+      cur = child;
+    }
+
+    if (end == NULL) {
+      break;
+    }
+    comp = end + 1;
+  }
+
+  return cur;
+}
+
+// find the node for path without creating anything
+DirNode *dirtree_find(DirTree *tree, const char *path)
+{
+  if (tree == NULL || path == NULL) {
+    return NULL;
+  }
+
+  DirNode *cur = tree->root;
+  const char *comp = path;
+  while (cur != NULL && *comp != '\0') {
+    const char *end = strchr(comp, '/');
+    int len = (end == NULL) ? strlen(comp) : end - comp;
+
+    if (len > 0) {
+      cur = child_find(tree, cur, comp, len);
+    }
+
+    if (end == NULL) {
+      break;
+    }
+    comp = end + 1;
+  }
+
+  return cur;
+}
+
+// preorder successor of node within the subtree rooted at top
+DirNode *dirtree_next(DirNode *node, DirNode *top)
+{
+  if (node == NULL) {
+    return NULL;
+  }
+
+  // go down first
+  if (node->children != NULL) {
+    return node->children;
+  }
+
+  // otherwise go sideways, climbing until there is a sibling to visit
+  while (node != top) {
+    if (node->next != NULL) {
+      return node->next;
+    }
+    node = node->parent;
+  }
+
+  return NULL;
+}
+
+// free node and its whole subtree, deepest nodes first
+void dirtree_remove(DirTree *tree, DirNode *node)
+{
+  if (tree == NULL || node == NULL) {
+    return;
+  }
+
+  // the root itself stays; only its children go
+  if (node == tree->root) {
+    while (node->children != NULL) {
+      dirtree_remove(tree, node->children);
+    }
+    return;
+  }
+
+  DirNode *parent = node->parent;
+  DirNode *cur = node;
+  while (1) {
+    // descend to a leaf, free it, then continue from its parent
+    while (cur->children != NULL) {
+      cur = cur->children;
+    }
+
+    DirNode *up = cur->parent;
+    int done = (cur == node);
+    node_free(tree, cur);
+    if (done) {
+      break;
+    }
+    cur = up;
+  }
+
+  dirtree_prune(tree, parent);
+}
+
+// free node and its parents while they are empty
+void dirtree_prune(DirTree *tree, DirNode *node)
+{
+  if (tree == NULL) {
+    return;
+  }
+
+  while (node != NULL && node != tree->root &&
+         node->entry == NULL && node->children == NULL) {
+    DirNode *parent = node->parent;
+    node_free(tree, node);
+    node = parent;
+  }
+}
+
+
+/*                  local functions                 */
+
+/*
+ * node_hash
+ *  FNV-1a hash of a component name, seeded with its parent
+ */
+static unsigned int node_hash(DirNode *parent, const char *name, int len)
+{
+  unsigned int hash = 2166136261u ^ (unsigned int) ((uintptr_t) parent >> 4);
+  for (int i = 0; i < len; i++) {
+    hash ^= (unsigned char) name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/*
+ * child_find
+ *  Finds the child of parent named by the first len chars of name
+ */
+static DirNode *child_find(DirTree *tree, DirNode *parent, const char *name, int len)
+{
+  unsigned int hash = node_hash(parent, name, len);
+  for (DirNode *cur = tree->buckets[hash % tree->nbuckets]; cur != NULL; cur = cur->hnext) {
+    if (cur->hash == hash && cur->parent == parent &&
+        strncmp(cur->name, name, len) == 0 && cur->name[len] == '\0') {
+      return cur;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * child_add
+ *  Creates a child of parent named by the first len chars of name
+ */
+static DirNode *child_add(DirTree *tree, DirNode *parent, const char *name, int len)
+{
+  DirNode *node = calloc(1, sizeof(DirNode));
+  if (node == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  node->name = calloc(len + 1, sizeof(char));
+  if (node->name == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  memcpy(node->name, name, len);
+
+  // link at the front of the parent's children
+  node->parent = parent;
+  node->next = parent->children;
+  if (node->next != NULL) {
+    node->next->prev = node;
+  }
+  parent->children = node;
+
+  // and into the hash
+  if (tree->nnodes + 1 > tree->nbuckets) {
+    hash_resize(tree, tree->nbuckets * 2);
+  }
+  node->hash = node_hash(parent, name, len);
+  DirNode **bucket = &tree->buckets[node->hash % tree->nbuckets];
+  node->hnext = *bucket;
+  *bucket = node;
+  tree->nnodes++;
+
+  return node;
+}
+
+/*
+ * node_free
+ *  Unlinks a childless node from its parent and the hash, then frees it
+ */
+static void node_free(DirTree *tree, DirNode *node)
+{
+  if (node->prev == NULL) {
+    node->parent->children = node->next;
+  }
+  else {
+    node->prev->next = node->next;
+  }
+  if (node->next != NULL) {
+    node->next->prev = node->prev;
+  }
+
+  DirNode **link = &tree->buckets[node->hash % tree->nbuckets];
+  while (*link != NULL && *link != node) {
+    link = &(*link)->hnext;
+  }
+  if (*link != NULL) {
+    *link = node->hnext;
+  }
+  tree->nnodes--;
+
+  free(node->name);
+  free(node);
+}
+
+/*
+ * hash_resize
+ *  Rehashes every node into nbuckets buckets
+ */
+static void hash_resize(DirTree *tree, int nbuckets)
+{
+  DirNode **buckets = calloc(nbuckets, sizeof(DirNode *));
+  if (buckets == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < tree->nbuckets; i++) {
+    DirNode *cur = tree->buckets[i];
+    while (cur != NULL) {
+      DirNode *next = cur->hnext;
+      DirNode **bucket = &buckets[cur->hash % nbuckets];
+      cur->hnext = *bucket;
+      *bucket = cur;
+      cur = next;
+    }
+  }
+
+  free(tree->buckets);
+  tree->buckets = buckets;
+  tree->nbuckets = nbuckets;
+}
@@ -0,0 +1,118 @@
+/*
+ * dirtree.h
+ * 	Path-component trie used by the FileTable to find everything below a
+ * 	directory without scanning the whole table.
+ *
+ * 	Each node is one component of a path ("sub" and "g.txt" for "sub/g.txt").
+ * 	Nodes for directories that have no entry of their own still exist so that
+ * 	their children can be reached; they are pruned once they become empty.
+ * 	Children are found through a hash keyed on (parent, name), so building
+ * 	and searching the tree is constant time per component.
+ *
+ * written by team Fleetwood MAC
+ * CS60, May 2018
+ */
+
+#ifndef DIRTREE_H
+#define DIRTREE_H
+
+#include <stdint.h>
+#include <time.h>
+
+struct TableEntry;
+
+// Totals over the entries at and below a node, kept up to date by the table
+// as entries change, so a directory can be summed up without visiting it
+typedef struct DirStats {
+	// Number of entries
+	int files;
+	// Their total size
+	uint64_t bytes;
+	// Newest modification time among them
+	time_t newest;
+	// Files with fewer than the table's MIN_REPLICAS peers
+	int thin;
+} DirStats;
+
+// A node of the tree
+typedef struct DirNode {
+	// Last component of the path, "" for the root
+	char *name;
+	// Table entry for this exact path, NULL if none
+	struct TableEntry *entry;
+	// Parent directory, NULL for the root
+	struct DirNode *parent;
+	// First child; children are kept in no particular order
+	struct DirNode *children;
+	// Siblings under the same parent
+	struct DirNode *next;
+	struct DirNode *prev;
+	// Next node in the same hash bucket
+	struct DirNode *hnext;
+	// Hash of (parent, name)
+	unsigned int hash;
+	// Digest of the entry and everything below, summed by the table
+	uint64_t digest;
+	// Totals over the entry and everything below
+	DirStats stats;
+	// Whether stats.newest may be too new, after the newest entry below
+	// went away; worked out again from the children when next asked for
+	int stale;
+} DirNode;
+
+// The tree, with its (parent, name) hash
+typedef struct DirTree {
+	DirNode *root;
+	DirNode **buckets;
+	int nbuckets;
+	int nnodes;
+} DirTree;
+
+/*
+ * dirtree_init
+ *  Creates an empty tree holding only the root
+ * ret: initialized tree that must be free'd
+ */
+DirTree *dirtree_init();
+
+/*
+ * dirtree_destroy
+ *  Frees every node of the tree; entries are left alone
+ */
+void dirtree_destroy(DirTree *tree);
+
+/*
+ * dirtree_insert
+ *  Finds the node for path, creating it and any missing parents
+ * ret: the node for path
+ */
+DirNode *dirtree_insert(DirTree *tree, const char *path);
+
+/*
+ * dirtree_find
+ *  Finds the node for path. The empty path is the root.
+ * ret: the node, or NULL if nothing is stored at or below path
+ */
+DirNode *dirtree_find(DirTree *tree, const char *path);
+
+/*
+ * dirtree_next
+ *  Steps through the subtree rooted at top in preorder, starting from top
+ * ret: the node after node, or NULL once the subtree is exhausted
+ */
+DirNode *dirtree_next(DirNode *node, DirNode *top);
+
+/*
+ * dirtree_remove
+ *  Frees node and everything below it, then prunes empty parents
+ *  Entries of the removed nodes must already have been dealt with
+ */
+void dirtree_remove(DirTree *tree, DirNode *node);
+
+/*
+ * dirtree_prune
+ *  Frees node and its parents for as long as they have no entry and no children
+ */
+void dirtree_prune(DirTree *tree, DirNode *node);
+
+#endif //DIRTREE_H
@@ -14,12 +14,109 @@
 #include "filetable.h"
 #include "fileinfo.h"
 #include "fileevent.h"
-
+#include "colscan.h"
+
+
+// initial number of hash buckets; doubled whenever the load factor passes 1
+#define INIT_BUCKETS 64
+
+// radix sort hands runs shorter than this to insertion sort
+#define RADIX_CUTOFF 32
+
+// removed entries kept for reuse by each table, at most
+#define MAX_SPARE 1024
+
+// marks the start of a record written by filetable_save
+#define SAVE_MAGIC 0x4c534654
+
+// A record written by filetable_save: this header, then each entry and each
+// removal as a SavedEntry followed by its path. Fields are fixed width, so a
+// record reads back the same whatever build wrote it
+typedef struct {
+  uint32_t magic;
+  uint32_t numfiles;
+  uint32_t numremoved;
+  uint32_t check;       // checksum of the length bytes after the header
+  uint64_t base;
+  uint64_t version;
+  uint64_t length;
+} SaveHeader;
+
+typedef struct {
+  uint64_t version;
+  int64_t last_modified;
+  uint32_t size;
+  uint32_t is_dir;
+  uint32_t pathlen;
+  uint32_t pad;
+} SavedEntry;
+
+// What a batch of events does to one path, folded in the order they came
+typedef struct {
+  char *path;             // interned, so the pointer is the path's key
+  TableEntry *entry;      // the path's entry before the batch, or NULL
+  int present;            // whether the path is in the table by now
+  int is_dir;
+  unsigned int size;
+  time_t last_modified;
+  int recreated;          // removed and then created again
+  int peers;              // what happens to the entry's peers
+} PathChange;
+
+enum { PEERS_KEEP, PEERS_RESET, PEERS_ADD };
+
+// A run of a batch's events, folded by path
+typedef struct {
+  PathChange *changes;    // one per path, in the order first seen
+  int nchanges;
+  PathChange **slots;     // open-addressed index by path pointer
+  int nslots;
+} ChangeRun;
 
 /*          Local function declarations           */
 
-static void ip_destroy(IP *iphead);
 void tableentry_destroy(TableEntry *entry);
+static IP *entry_peerlist(TableEntry *entry);
+static unsigned int path_hash(const char *path);
+static void index_add(FileTable *ft, TableEntry *entry);
+static void index_remove(FileTable *ft, TableEntry *entry);
+static void hash_add(FileTable *ft, TableEntry *entry);
+static void hash_remove(FileTable *ft, TableEntry *entry);
+static void index_resize(FileTable *ft, int nbuckets);
+static TableEntry *sorted_prev(FileTable *ft, const char *path);
+static void list_link(FileTable *ft, TableEntry *prv, TableEntry *entry);
+static void list_unlink(FileTable *ft, TableEntry *entry);
+static void entry_remove(FileTable *ft, TableEntry *entry, unsigned long version);
+static void entry_touch(FileTable *ft, TableEntry *entry, unsigned long version);
+static TableEntry *entry_alloc(FileTable *ft);
+static void entry_free(FileTable *ft, TableEntry *entry);
+static PathChange *run_find(FileTable *ft, ChangeRun *run, char *path);
+static void run_flush(FileTable *ft, ChangeRun *run, char *ip, int port,
+    unsigned long *version, FileEvent ***tail);
+static unsigned long batch_version(FileTable *ft, unsigned long *version);
+static int compare_change(const void *a, const void *b);
+static void columns_free(FileColumns *cols);
+static void digests_sum(FileTable *ft);
+static DirStats entry_stats(TableEntry *entry);
+static void stats_change(DirNode *node, DirStats *old, DirStats *new);
+static time_t stats_newest(DirNode *node);
+static uint64_t entry_digest(TableEntry *entry);
+static unsigned long next_version(FileTable *ft);
+static void vlist_unlink(FileTable *ft, TableEntry *entry);
+static void vlist_build(FileTable *ft);
+static TableEntry *entry_append(FileTable *ft, const char *path, time_t last_modified,
+    unsigned int size, int is_dir, unsigned long version);
+static void tombstone_add(FileTable *ft, char *filepath, uint32_t id, unsigned long version);
+static TableEntry *entry_copy(TableEntry *entry, PeerRegistry *registry);
+static TableEntry **changed_since(FileTable *ft, unsigned long since, int *n);
+static FileInfo_FS **sorted_files(FileInfo_FS *files, int *n);
+static void radix_sort(FileInfo_FS **files, FileInfo_FS **tmp, int n, int depth);
+static FileEvent *event_append(FileEvent ***tail, enum ActionType action, FileInfo_FS *file);
+static int compare_path(const void *a, const void *b);
+static int compare_version(const void *a, const void *b);
+static void table_encode(WireBuf *w, FileTable *table, TableEntry **entries, int nentries,
+    unsigned long since);
+static uint32_t save_checksum(const char *buf, size_t len);
 
 
 /*      Public functions                */
@@ -35,6 +132,15 @@ FileTable *filetable_init()
   ft->head = NULL;
   ft->numfiles = 0;
 
+  ft->nbuckets = INIT_BUCKETS;
+  ft->buckets = calloc(ft->nbuckets, sizeof(TableEntry *));
+  if (ft->buckets == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  ft->tree = dirtree_init();
+  ft->peers = peerregistry_init();
+
   ft->lock = calloc(1, sizeof(pthread_mutex_t));
   pthread_mutex_init(ft->lock, NULL);
 
@@ -54,6 +160,25 @@ void filetable_destroy(FileTable *ft)
     tableentry_destroy(cur);
   }
 
+  // and every removal still remembered
+  filetable_trimRemoved(ft, ft->version);
+
+  // the columns,
+  columns_free(ft->columns);
+
+  // and the entries kept for reuse
+  for (TableEntry *cur = ft->spare; cur != NULL; cur = ft->spare) {
+    ft->spare = cur->next;
+    tableentry_destroy(cur);
+  }
+
+  // the snapshot lives on for as long as anyone else holds it
+  filetable_release(ft->snap);
+
+  free(ft->buckets);
+  dirtree_destroy(ft->tree);
+  peerregistry_destroy(ft->peers);
+
   // Destroy the lock
   if(ft->lock != NULL) {
     pthread_mutex_destroy(ft->lock);
@@ -87,129 +212,84 @@ int filetable_insert(FileTable *ft, FileInfo_FS *file, char *creationip, int cre
   }
 
   // Get the file's place in the filetable
-  TableEntry *prv = NULL;
-  TableEntry *cur;
-  for (cur = ft->head; cur != NULL; cur = cur->next) {
-    if (strcmp(file->filepath, cur->file->filepath) < 0) {
-      break;
-    }
-    prv = cur;
-  }
-
-  // Look and see if file already exists (check if prv == file)
-  if (prv != NULL &&
-      (strcmp(file->filepath, prv->file->filepath) == 0)) {
-    return -1;
-  }
+  TableEntry *prv = sorted_prev(ft, file->filepath);
 
-  // Copy the file
-  FileInfo_FS *file_copy = fileinfo_init();
+  // Copy the file, sharing its interned path
+  FileInfo_FS *file_copy = fileinfo_clone(file);
   if (file_copy == NULL) {
     fprintf(stderr, "malloc err\n");
     exit(1);
   }
 
-  memcpy(file_copy, file, sizeof(FileInfo_FS));
-
   // Create the table entry and file info
-  TableEntry *entry = calloc(1, sizeof(TableEntry));
-  if (entry == NULL) {
-    fprintf(stderr, "malloc\n");
-    exit(1);
-  }
+  TableEntry *entry = entry_alloc(ft);
 
   entry->file = file_copy;
+  entry->registry = ft->peers;
 
-  // Create the ip address linked list
-  IP *ip = calloc(1, sizeof(IP));
-  if (ip == NULL) {
-    fprintf(stderr, "malloc\n");
-    exit(1);
+  // The creating peer is the only one with the file
+  int id = peerregistry_add(ft->peers, creationip, creationport);
+  if (id >= 0) {
+    peerset_add(&entry->peers, id);
   }
-  // Copy the ip address
-  strcpy(ip->ip, creationip);
-  // Set the port
-  ip->port = creationport;
-  ip->next = NULL;
 
   // Set the number of peers
-  entry->numpeers = 1;
-
-  // Link ip address to entry
-  entry->iphead = ip;
+  entry->numpeers = peerset_count(&entry->peers);
 
   // now insert the file in the correct place
-  if (prv == NULL) {
-    entry->next = ft->head; // Insert at the head
-    ft->head = entry;
-  }
-  else {
-    entry->next = prv->next; // Insert between prv and prv->next
-    prv->next = entry;
-  }
+  list_link(ft, prv, entry);
+  index_add(ft, entry);
+  ft->cursor = entry;
+  entry_touch(ft, entry, next_version(ft));
+
   // Increment number of files
   ft->numfiles++;
   return 0;
 }
 
-// remove given filename from the file table
-int filetable_remove(FileTable *ft, char *filename)
+// insert a list of files; ascending input hits the tail/cursor fast path
+int filetable_bulkload(FileTable *ft, FileInfo_FS *files, char *creationip, int creationport)
 {
-  if (ft == NULL || filename == NULL) {
+  if (ft == NULL || creationip == NULL) {
     return -1;
   }
-  // Iterate through files
-  TableEntry *prv = NULL;
-  TableEntry *cur;
-  int cmp;
-  for (cur = ft->head; cur != NULL; cur = cur->next) {
-    cmp = strcmp(filename, cur->file->filepath);
-    if (cmp == 0) {
-      break;
-    }
-    prv = cur;
-  }
 
-  // Filename not found
-  if (cur == NULL) {
-    return -1;
-  }
+  // sort the files so each insert resumes where the last one left off
+  int nfiles;
+  FileInfo_FS **sorted = sorted_files(files, &nfiles);
 
-  // If removing a directory
-  if (cur->file->is_dir) {
-    char *dirname = calloc(1, sizeof(cur->file->filepath) + 1);
-    if(dirname == NULL) {
-      return -1;
+  // size the index up front so loading doesn't rehash along the way
+  int n = ft->numfiles + nfiles;
+  if (n > ft->nbuckets) {
+    int nbuckets = ft->nbuckets;
+    while (nbuckets < n) {
+      nbuckets *= 2;
     }
+    index_resize(ft, nbuckets);
+  }
 
-    strcpy(dirname, cur->file->filepath);
+  for (int i = 0; i < nfiles; i++) {
+    filetable_insert(ft, sorted[i], creationip, creationport);
+  }
 
-    // Delete all the files in the directory, recursively
-    int dirlen = strlen(dirname);
-    cur->file->is_dir = false; // prevent infinite recursive loop
-    for (TableEntry *sub = ft->head; sub != NULL; sub = sub->next) {
-      if (strncmp(dirname, sub->file->filepath, dirlen) == 0 && strcmp(dirname, sub->file->filepath) != 0) {
-        printf("remove sub file %s\n", sub->file->filepath);
-        filetable_remove(ft, sub->file->filepath);
-      }
-    }
+  free(sorted);
+  return 0;
+}
 
-    free(dirname);
+// remove given filename from the file table
+int filetable_remove(FileTable *ft, char *filename)
+{
+  if (ft == NULL || filename == NULL) {
+    return -1;
   }
+  TableEntry *cur = filetable_getEntry(ft, filename);
 
-  // if deleted the head, update the head
-  if (prv == NULL) {
-    ft->head = cur->next;   // The file was first in the list
-  }
-  else { // otherwise skip over removed file in the list 
-    prv->next = cur->next;
+  // Filename not found
+  if (cur == NULL) {
+    return -1;
   }
 
-  // Destroy cur
-  tableentry_destroy(cur);
-
-  // Decrement the number of files
-  ft->numfiles--;
+  entry_remove(ft, cur, next_version(ft));
 
   return 0;
 }
@@ -227,13 +307,8 @@ int filetable_updateMod(FileTable *ft, FileInfo_FS *file, char *ip, int port)
     return -2;
   }
 
-  // iterate through the filetable to find the file
-  TableEntry *cur;
-  for (cur = ft->head; cur != NULL; cur = cur->next) {
-    if (strcmp(file->filepath, cur->file->filepath) == 0) {
-      break;
-    }
-  }
+  // look the file up in the index
+  TableEntry *cur = filetable_getEntry(ft, file->filepath);
 
   // File not found
   if (cur == NULL) {
@@ -244,22 +319,17 @@ int filetable_updateMod(FileTable *ft, FileInfo_FS *file, char *ip, int port)
   cur->file->last_modified = file->last_modified;
   cur->file->size = file->size;
 
-  // delete every peer except the one that modified it
-  ip_destroy(cur->iphead); // Delete the peer list
-
-  // then insert the peer that modified it as the only valid peeer
-  cur->iphead = calloc(1, sizeof(IP)); 
-  if (cur->iphead == NULL) {
-    fprintf(stderr, "malloc\n");
-    exit(1);
+  // delete every peer, then insert the peer that modified it as the only
+  // valid peer
+  int id = peerregistry_add(ft->peers, ip, port);
+  peerset_clear(&cur->peers);
+  if (id >= 0) {
+    peerset_add(&cur->peers, id);
   }
 
-  memcpy(cur->iphead->ip, ip, iplen + 1); // Copy the ip
-  cur->iphead->port = port;
-  cur->iphead->next = NULL;
-  
   // reset the number of peers to 1
-  cur->numpeers = 1;
+  cur->numpeers = peerset_count(&cur->peers);
+  entry_touch(ft, cur, next_version(ft));
 
   return 0;
 }
@@ -283,31 +353,16 @@ int filetable_addPeer(FileTable *ft, char *filename, char *ip, int port, int siz
     return 0;
   }
 
-  // if this peer already in the list, don't add as a duplicate
-  IP *cur = entry->iphead;
-  while (cur != NULL) {
-    if (strcmp(cur->ip, ip) == 0) {
-      return 0;
-    }
-    cur = cur->next;
+  int id = peerregistry_add(ft->peers, ip, port);
+  if (id < 0) {
+    return -1;
   }
 
-  // Add a peer to the peer list
-  IP *newpeer = calloc(1, sizeof(IP));
-  if (newpeer == NULL) {
-    fprintf(stderr, "malloc\n");
-    exit(1);
+  // if this peer already in the list, don't add as a duplicate
+  if (peerset_add(&entry->peers, id)) {
+    entry->numpeers++;
+    entry_touch(ft, entry, next_version(ft));
   }
-  //  Copy the ip
-  int iplen = strlen(ip);
-  memcpy(newpeer->ip, ip, iplen + 1);
-  //  Set the port
-  newpeer->port = port;
-
-  //  Link to the head of the list
-  newpeer->next = entry->iphead;
-  entry->iphead = newpeer;
-  entry->numpeers++;
 
   return 0;
 }
@@ -320,6 +375,12 @@ int filetable_entryContainsPeer(TableEntry *entry, char *ip, int port)
     return 0;
   }
 
+  // entries in a table test their peer set
+  if (entry->registry != NULL) {
+    return peerset_contains(&entry->peers, peerregistry_find(entry->registry, ip, port));
+  }
+
+  // detached copies only have the list
   IP *head = entry->iphead;
   while (head != NULL) {
     if (strcmp(head->ip, ip) == 0 && port == head->port) {
@@ -331,56 +392,73 @@ int filetable_entryContainsPeer(TableEntry *entry, char *ip, int port)
   return 0;
 }
 
-// remove peer ip/port from this entry if it exists
-int filetable_entryRemovePeer(TableEntry *entry, char *ip, int port)
+// remove peer from all places it appears
+int filetable_removePeerAll(FileTable *ft, char *ip, int port)
 {
-  if (entry == NULL || ip == NULL) {
+  if (ft == NULL || ip == NULL) {
     return -1;
   }
 
-  IP *prev = NULL;
-  IP *cur = entry->iphead;
-  while (cur != NULL) {
-    if (strcmp(ip, cur->ip) == 0 && port == cur->port) {
-      // when we find it, break
-      break;
-    }
+  IP peer;
+  memset(&peer, 0, sizeof(peer));
+  snprintf(peer.ip, sizeof(peer.ip), "%s", ip);
+  peer.port = port;
+  return filetable_removePeers(ft, &peer);
+}
 
-    prev = cur;
-    cur = cur->next;
+// remove every peer in a list from all places it appears, in one walk
+int filetable_removePeers(FileTable *ft, IP *peers)
+{
+  if (ft == NULL) {
+    return -1;
   }
 
-  // peer not found, return
-  if (cur == NULL) {
-    return 0;
+  // peers that were never registered aren't listed anywhere
+  int n_ids = 0;
+  for (IP *p = peers; p != NULL; p = p->next) {
+    n_ids++;
   }
-
-  if (prev == NULL) {
-    entry->iphead = entry->iphead->next;
-  } else {
-    prev->next = cur->next;
+  int *ids = malloc((n_ids + 1) * sizeof(int));
+  if (ids == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  n_ids = 0;
+  for (IP *p = peers; p != NULL; p = p->next) {
+    int id = peerregistry_find(ft->peers, p->ip, p->port);
+    int k = 0;
+    while (k < n_ids && ids[k] != id) {
+      k++;
+    }
+    if (id >= 0 && k == n_ids) {
+      ids[n_ids++] = id;
+    }
+  }
+  if (n_ids == 0) {
+    free(ids);
+    return 0;
   }
 
-  entry->numpeers--;
-
-  free(cur);
-
-  return 0;
-}
-
-// remove peer from all places it appears
-int filetable_removePeerAll(FileTable *ft, char *ip, int port)
-{
-  if (ft == NULL || ip == NULL) {
-    return -1;
+  // clearing a peer's bit is one word operation per entry; every entry
+  // that changes shares the one new version
+  unsigned long version = next_version(ft);
+  for (TableEntry *cur = ft->head; cur != NULL; cur = cur->next) {
+    int removed = 0;
+    for (int i = 0; i < n_ids; i++) {
+      removed += peerset_remove(&cur->peers, ids[i]);
+    }
+    if (removed > 0) {
+      cur->numpeers -= removed;
+      entry_touch(ft, cur, version);
+    }
   }
 
-  TableEntry *cur = ft->head;
-  while (cur != NULL) {
-    filetable_entryRemovePeer(cur, ip, port);
-    cur = cur->next;
+  // no entry mentions the ids anymore, so they can be reused
+  for (int i = 0; i < n_ids; i++) {
+    peerregistry_remove(ft->peers, ids[i]);
   }
 
+  free(ids);
   return 0;
 }
 
@@ -390,10 +468,11 @@ TableEntry *filetable_getEntry(FileTable *ft, char *filename)
   if (ft == NULL || filename == NULL) {
     return NULL;
   }
-  // Iterate through the filetable to find the file
+  // Walk the bucket the filename hashes to
+  unsigned int hash = path_hash(filename);
   TableEntry *cur;
-  for (cur = ft->head; cur != NULL; cur = cur->next) {
-    if (strcmp(filename, cur->file->filepath) == 0) {
+  for (cur = ft->buckets[hash % ft->nbuckets]; cur != NULL; cur = cur->hnext) {
+    if (cur->hash == hash && strcmp(filename, cur->file->filepath) == 0) {
       break;
     }
   }
@@ -401,6 +480,15 @@ TableEntry *filetable_getEntry(FileTable *ft, char *filename)
   return cur;
 }
 
+// filetable_getDir
+DirNode *filetable_getDir(FileTable *ft, char *dirname)
+{
+  if (ft == NULL || dirname == NULL) {
+    return NULL;
+  }
+  return dirtree_find(ft->tree, dirname);
+}
+
 // filetable_getPeers
 IP *filetable_getPeers(FileTable *ft, char *filename)
 {
@@ -408,7 +496,7 @@ IP *filetable_getPeers(FileTable *ft, char *filename)
   if (entry == NULL) {
     return NULL;
   }
-  return entry->iphead;
+  return entry_peerlist(entry);
 }
 
 // filetable_getNumPeers
@@ -421,351 +509,2295 @@ int filetable_getNumPeers(FileTable *ft, char *filename)
   return entry->numpeers;
 }
 
-// filetable_merge
-// used to merge a complete list of files on a peer into a file table
-// @return the FileEvents needed to make the table match, which can then be broadcasted
-FileEvent *filetable_merge(FileTable *ft, FileInfo_FS *peer_files, char *ip, int port)
-{
-  FileEvent *events = filetable_fileDiff(ft, peer_files);
-  filetable_eventMerge(ft, events, ip, port);
-  // Free events
-  /*for (FileEvent *cur = events; cur != NULL; cur = events) {
-    fileevent_print(cur);
-    events = events->next;
-  }*/
-  return events;
-}
-
-// filetable_fileDiff
-// compare files against what's currently in table, and generate the correct
-// FileEvents needed to make table match the files
-FileEvent *filetable_fileDiff(FileTable *ft, FileInfo_FS *files)
+// copy what changed after since into a snapshot that can be read unlocked
+FileTable *filetable_snapshot(FileTable *ft, unsigned long since)
 {
-  // Nothing to add
-  if (files == NULL) {
+  if (ft == NULL) {
     return NULL;
   }
 
-  FileInfo_FS *tomerge = files;
-  FileEvent *events = NULL;
-
-  // Iterate through files to merge
-  while (tomerge != NULL) {
-    // event for the current fileinfo
-    FileEvent *evt = NULL;
-
-    // first, see if the entry is in the table
-    TableEntry *entry = filetable_getEntry(ft, tomerge->filepath);
-
-    // if it isn't, insert and make a CREATE event
-    if (entry == NULL) {
-      // FILE_CREATED file event
-      evt = fileevent_init();
-      if (evt == NULL) {
-        fprintf(stderr, "malloc\n");
-        exit(1);
-      }
+  // removals before base are gone; the whole table never needs them
+  if (since != 0 && since < ft->base) {
+    return NULL;
+  }
 
-      evt->action = FILE_CREATED;
-      evt->file = tomerge;
-    } else {
-      // there's an entry with that filename
-      // if the file on client is newer, use it instead
-      if (entry->file->last_modified < tomerge->last_modified) {
-        // FILE_MODIFIED file event
-        evt = fileevent_init();
-        if (evt == NULL) {
-          fprintf(stderr, "malloc\n");
-          exit(1);
-        }
-        evt->action = FILE_MODIFIED;
-        evt->file = tomerge;
-      } else if (entry->file->last_modified == tomerge->last_modified) {
+  // the last snapshot still does if nothing changed since it was taken and it
+  // reaches back far enough; at one version, a snapshot with as many entries
+  // as the table has all of them
+  FileTable *snap = ft->snap;
+  if (snap != NULL && snap->version == ft->version &&
+      (since == 0 ? snap->numfiles == ft->numfiles : snap->base <= since)) {
+    return filetable_retain(snap);
+  }
 
-        // if they're the same last modified, we add this peer as having the latest
-        // by using the download complete event
+  // gather the entries, in path order
+  int n = ft->numfiles;
+  TableEntry **entries = NULL;
+  if (since != 0) {
+    entries = changed_since(ft, since, &n);
+  }
 
-        evt = fileevent_init();
-        if (evt == NULL) {
-          fprintf(stderr, "malloc\n");
-          exit(1);
-        }
-        evt->action = DOWNLOAD_COMPLETE;
-        evt->file = tomerge;
+  snap = filetable_init();
+  index_resize(snap, n > INIT_BUCKETS ? n : INIT_BUCKETS);
+  snap->version = ft->version;
+  snap->base = (since > ft->base) ? since : ft->base;
 
-      }
+  // same ids as the table, so the peer sets copy over as they are
+  for (int id = 0; id < ft->peers->nslots; id++) {
+    IP *addr = peerregistry_get(ft->peers, id);
+    if (addr != NULL) {
+      peerregistry_put(snap->peers, id, addr->ip, addr->port);
     }
+  }
 
-    // Insert the file event at the head
-    if (evt != NULL) {
-      if (events != NULL) {
-        evt->next = events;
-        events = evt;
-      }
-      else {
-        evt->next = NULL;
-        events = evt;
-      }
+  TableEntry *cur = ft->head;
+  for (int i = 0; i < n; i++) {
+    if (entries != NULL) {
+      cur = entries[i];
     }
-
-    // move to next file
-    tomerge = tomerge->next;
+    TableEntry *entry = entry_copy(cur, snap->peers);
+    list_link(snap, snap->tail, entry);
+    index_add(snap, entry);
+    snap->numfiles++;
+    cur = cur->next;
   }
+  free(entries);
 
-  return events;
-}
-
-
-// update table based on events from specified peer w/ ip/port
-void filetable_eventMerge(FileTable *ft, FileEvent *e, char *ip, int port)
-{
-  if (ft == NULL || e == NULL || ip == NULL) {
-    return;
+  for (Tombstone *t = ft->removed; t != NULL; t = t->next) {
+    if (t->version > snap->base) {
+      tombstone_add(snap, t->filepath, t->id, t->version);
+    }
   }
 
-  // Iterate through events 
-  for (FileEvent *cur = e; cur != NULL; cur = cur->next) {
-    // for each event, just update, insert, remove, or add peer based on the
-    // event action type
-    switch(cur->action) {
-      case FILE_MODIFIED:
-        filetable_updateMod(ft, cur->file, ip, port);
-        break;
-
-      case FILE_CREATED:
-        filetable_insert(ft, cur->file, ip, port);
-        break;
+  vlist_build(snap);
 
-      case FILE_DELETED:
-        filetable_remove(ft, cur->file->filepath);
-        break;
+  // one reference for the caller and one while it is the latest snapshot
+  snap->refs = 2;
+  filetable_release(ft->snap);
+  ft->snap = snap;
 
-      case DOWNLOAD_COMPLETE:
-        filetable_addPeer(ft, cur->file->filepath, ip, port, cur->file->size);
-        break;
-    }
-  }
+  return snap;
 }
 
-
-
-// print the entire file table, with peers and entries
-void filetable_print(FileTable *ft)
+// filetable_retain
+FileTable *filetable_retain(FileTable *snap)
 {
-  printf("=============== filetable (%4d entries) ===============\n", ft->numfiles);
-  if (ft != NULL) {
-    printf("# Peers | Size     | Last Modified | Filepath \n");
-    printf("--------------------------------------------\n");
-    for (TableEntry *cur = ft->head; cur != NULL; cur = cur->next) {
-      filetable_entryprint(cur);
-    }
-  }
-  else {
-    printf("               (null)\n");
+  if (snap == NULL) {
+    return NULL;
   }
-  printf("==========================================================\n");
-}
 
+  pthread_mutex_lock(snap->lock);
+  snap->refs++;
+  pthread_mutex_unlock(snap->lock);
 
+  return snap;
+}
 
-// print out a file entry 
-void filetable_entryprint(TableEntry *entry)
+// filetable_release
+void filetable_release(FileTable *snap)
 {
-  if (entry == NULL) {
+  if (snap == NULL) {
     return;
   }
-  printf("%6d | %8d | %13ld | %s\n      \\___ ", entry->numpeers, entry->file->size,
-    entry->file->last_modified, entry->file->filepath);
-  filepeer_print(entry->iphead);
-}
 
+  pthread_mutex_lock(snap->lock);
+  int refs = --snap->refs;
+  pthread_mutex_unlock(snap->lock);
 
+  if (refs == 0) {
+    filetable_destroy(snap);
+  }
+}
 
-// print out a peer in human-readable form
-void filepeer_print(IP *peers)
+// forget removals every peer has seen
+void filetable_trimRemoved(FileTable *ft, unsigned long version)
 {
-  if (peers != NULL) {
-    for (IP *cur = peers; cur != NULL; cur = cur->next) {
-      printf("%s:%d   ", cur->ip, cur->port);
-    }
-    printf("\n");
+  if (ft == NULL) {
+    return;
   }
-  else {
-    printf("(null)\n");
+
+  while (ft->removed != NULL && ft->removed->version <= version) {
+    Tombstone *t = ft->removed;
+    ft->removed = t->next;
+    path_release(t->filepath);
+    free(t);
+    ft->numremoved--;
+  }
+  if (ft->removed == NULL) {
+    ft->removedtail = NULL;
+  }
+
+  if (version > ft->base) {
+    ft->base = version;
   }
 }
 
-// frees all memory associated with entry
-void tableentry_destroy(TableEntry *entry)
+// apply a table of changes on top of ft
+int filetable_applyChanges(FileTable *ft, FileTable *changes)
 {
-  if (entry == NULL) {
-    return;
+  if (ft == NULL || changes == NULL || changes->base > ft->version) {
+    return -1;
   }
 
-  fileinfo_destroy(entry->file);
-  ip_destroy(entry->iphead);
-  free(entry);
-}
+  // removals first, so a path removed and then created again ends up present
+  for (Tombstone *t = changes->removed; t != NULL; t = t->next) {
+    TableEntry *entry = filetable_getEntry(ft, t->filepath);
+    if (entry != NULL && entry->version < t->version) {
+      entry_remove(ft, entry, t->version);
+    }
+  }
 
+  // then each changed entry, oldest change first
+  for (TableEntry *change = changes->vhead; change != NULL; change = change->vnext) {
+    TableEntry *entry = filetable_getEntry(ft, change->file->filepath);
 
-// returns a copy of the table entry
+    // already seen this change
+    if (entry != NULL && entry->version >= change->version) {
+      continue;
+    }
+
+    if (entry == NULL) {
+      entry = entry_alloc(ft);
+      entry->file = fileinfo_clone(change->file);
+      entry->registry = ft->peers;
+
+      list_link(ft, sorted_prev(ft, entry->file->filepath), entry);
+      index_add(ft, entry);
+      ft->cursor = entry;
+      ft->numfiles++;
+    }
+    else {
+      entry->file->size = change->file->size;
+      entry->file->last_modified = change->file->last_modified;
+      entry->file->is_dir = change->file->is_dir;
+    }
+
+    // the ids are the sender's, so carry the peers over by address
+    peerset_clear(&entry->peers);
+    for (int id = peerset_next(&change->peers, 0); id >= 0; id = peerset_next(&change->peers, id + 1)) {
+      IP *addr = peerregistry_get(change->registry, id);
+      if (addr != NULL) {
+        peerset_add(&entry->peers, peerregistry_add(ft->peers, addr->ip, addr->port));
+      }
+    }
+    entry->numpeers = peerset_count(&entry->peers);
+
+    entry_touch(ft, entry, change->version);
+  }
+
+  if (changes->version > ft->version) {
+    ft->version = changes->version;
+  }
+
+  return 0;
+}
+
+// join snapshots of disjoint tables into one
+FileTable *filetable_combine(FileTable **snaps, int n, unsigned long version)
+{
+  FileTable *combined = filetable_init();
+  combined->version = version;
+
+  // each snapshot's peer ids, renumbered in the combined registry
+  int total = 0;
+  int **ids = calloc(n > 0 ? n : 1, sizeof(int *));
+  TableEntry **next = calloc(n > 0 ? n : 1, sizeof(TableEntry *));
+  Tombstone **removed = calloc(n > 0 ? n : 1, sizeof(Tombstone *));
+  if (ids == NULL || next == NULL || removed == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  for (int i = 0; i < n; i++) {
+    PeerRegistry *reg = snaps[i]->peers;
+    ids[i] = calloc(reg->nslots > 0 ? reg->nslots : 1, sizeof(int));
+    if (ids[i] == NULL) {
+      fprintf(stderr, "malloc\n");
+      exit(1);
+    }
+    for (int id = 0; id < reg->nslots; id++) {
+      IP *addr = peerregistry_get(reg, id);
+      ids[i][id] = (addr != NULL) ? peerregistry_add(combined->peers, addr->ip, addr->port) : -1;
+    }
+
+    total += snaps[i]->numfiles;
+    next[i] = snaps[i]->head;
+    removed[i] = snaps[i]->removed;
+    if (snaps[i]->base > combined->base) {
+      combined->base = snaps[i]->base;
+    }
+  }
+  index_resize(combined, total > INIT_BUCKETS ? total : INIT_BUCKETS);
+
+  // merge the sorted lists, appending the least path each time
+  while (1) {
+    int least = -1;
+    for (int i = 0; i < n; i++) {
+      if (next[i] != NULL && (least < 0 ||
+          strcmp(next[i]->file->filepath, next[least]->file->filepath) < 0)) {
+        least = i;
+      }
+    }
+    if (least < 0) {
+      break;
+    }
+
+    TableEntry *cur = next[least];
+    TableEntry *entry = entry_copy(cur, combined->peers);
+    peerset_clear(&entry->peers);
+    for (int id = peerset_next(&cur->peers, 0); id >= 0; id = peerset_next(&cur->peers, id + 1)) {
+      peerset_add(&entry->peers, ids[least][id]);
+    }
+
+    list_link(combined, combined->tail, entry);
+    index_add(combined, entry);
+    combined->numfiles++;
+    next[least] = cur->next;
+  }
+
+  // and the removals, oldest first
+  while (1) {
+    int least = -1;
+    for (int i = 0; i < n; i++) {
+      if (removed[i] != NULL && (least < 0 || removed[i]->version < removed[least]->version)) {
+        least = i;
+      }
+    }
+    if (least < 0) {
+      break;
+    }
+    tombstone_add(combined, removed[least]->filepath, removed[least]->id,
+        removed[least]->version);
+    removed[least] = removed[least]->next;
+  }
+
+  vlist_build(combined);
+  combined->refs = 1;
+
+  for (int i = 0; i < n; i++) {
+    free(ids[i]);
+  }
+  free(ids);
+  free(next);
+  free(removed);
+
+  return combined;
+}
+
+// filetable_merge
+// used to merge a complete list of files on a peer into a file table
+// the events come in path order, so each insert resumes from the previous
+// one and the whole merge is a single pass over the table
+// @return the FileEvents needed to make the table match, which can then be broadcasted
+FileEvent *filetable_merge(FileTable *ft, FileInfo_FS *peer_files, char *ip, int port)
+{
+  FileEvent *events = filetable_fileDiff(ft, peer_files);
+  filetable_eventMerge(ft, events, ip, port);
+  // Free events
+  /*for (FileEvent *cur = events; cur != NULL; cur = events) {
+    fileevent_print(cur);
+    events = events->next;
+  }*/
+  return events;
+}
+
+// filetable_fileDiff
+// compare files against what's currently in table, and generate the correct
+// FileEvents needed to make table match the files
+// sorts the files, then walks them and the table side by side, so events come
+// out in path order, with every directory ahead of what's inside it
+FileEvent *filetable_fileDiff(FileTable *ft, FileInfo_FS *files)
+{
+  // Nothing to add
+  if (ft == NULL || files == NULL) {
+    return NULL;
+  }
+
+  FileComparison *cmp = filetable_compare(ft, files);
+
+  FileEvent *events = NULL;
+  FileEvent **tail = &events;
+
+  for (int i = 0; i < cmp->n; i++) {
+    switch (cmp->result[i]) {
+      case FILE_ABSENT:
+        // not in the table: a FILE_CREATED event
+        event_append(&tail, FILE_CREATED, cmp->files[i]);
+        break;
+
+      case FILE_NEWER:
+        // the file on the client is newer, so use it instead
+        event_append(&tail, FILE_MODIFIED, cmp->files[i]);
+        break;
+
+      case FILE_SAME:
+        // if they're the same last modified, we add this peer as having the latest
+        // by using the download complete event
+        event_append(&tail, DOWNLOAD_COMPLETE, cmp->files[i]);
+        break;
+    }
+  }
+
+  filecomparison_destroy(cmp);
+  return events;
+}
+
+// filetable_columns
+FileColumns *filetable_columns(FileTable *ft)
+{
+  if (ft == NULL) {
+    return NULL;
+  }
+
+  // every change advances the version, and at one version the same number
+  // of rows means the same rows
+  FileColumns *cols = ft->columns;
+  if (cols != NULL && cols->version == ft->version && cols->numfiles == ft->numfiles) {
+    return cols;
+  }
+  columns_free(cols);
+
+  cols = calloc(1, sizeof(FileColumns));
+  if (cols == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  int n = ft->numfiles > 0 ? ft->numfiles : 1;
+  cols->paths = malloc(n * sizeof(char *));
+  cols->ids = malloc(n * sizeof(uint32_t));
+  cols->last_modified = malloc(n * sizeof(time_t));
+  cols->sizes = malloc(n * sizeof(unsigned int));
+  cols->is_dir = malloc(n * sizeof(unsigned char));
+  cols->entries = malloc(n * sizeof(TableEntry *));
+  if (cols->paths == NULL || cols->ids == NULL || cols->last_modified == NULL ||
+      cols->sizes == NULL || cols->is_dir == NULL || cols->entries == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  for (TableEntry *cur = ft->head; cur != NULL; cur = cur->next) {
+    int i = cols->n++;
+    cols->paths[i] = cur->file->filepath;
+    cols->ids[i] = path_id(cur->file->filepath);
+    cols->last_modified[i] = cur->file->last_modified;
+    cols->sizes[i] = cur->file->size;
+    cols->is_dir[i] = (cur->file->is_dir != 0);
+    cols->entries[i] = cur;
+  }
+  cols->version = ft->version;
+  cols->numfiles = ft->numfiles;
+
+  ft->columns = cols;
+  return cols;
+}
+
+// filetable_compare
+FileComparison *filetable_compare(FileTable *ft, FileInfo_FS *files)
+{
+  if (ft == NULL) {
+    return NULL;
+  }
+
+  return filecolumns_compare(filetable_columns(ft), files);
+}
+
+// filecolumns_compare
+FileComparison *filecolumns_compare(FileColumns *cols, FileInfo_FS *files)
+{
+  if (cols == NULL) {
+    return NULL;
+  }
+
+  FileComparison *cmp = calloc(1, sizeof(FileComparison));
+  if (cmp == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  cmp->files = sorted_files(files, &cmp->n);
+  cmp->table = cols;
+
+  int n = cmp->n > 0 ? cmp->n : 1;
+  FileColumns *table = cmp->table;
+  cmp->rows = malloc(n * sizeof(int));
+  cmp->result = malloc(n * sizeof(unsigned char));
+  cmp->resized = malloc(n * sizeof(unsigned char));
+  cmp->matched = calloc(table->n > 0 ? table->n : 1, sizeof(unsigned char));
+
+  // the row's side of each pair, gathered next to the file's
+  time_t *file_mtime = malloc(n * sizeof(time_t));
+  time_t *row_mtime = malloc(n * sizeof(time_t));
+  unsigned int *file_size = malloc(n * sizeof(unsigned int));
+  unsigned int *row_size = malloc(n * sizeof(unsigned int));
+  unsigned char *found = malloc(n * sizeof(unsigned char));
+  uint32_t *file_id = malloc(n * sizeof(uint32_t));
+  if (cmp->rows == NULL || cmp->result == NULL || cmp->resized == NULL ||
+      cmp->matched == NULL || file_mtime == NULL || row_mtime == NULL ||
+      file_size == NULL || row_size == NULL || found == NULL || file_id == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  for (int i = 0; i < cmp->n; i++) {
+    file_id[i] = path_id(cmp->files[i]->filepath);
+  }
+
+  // line the files up with the rows; both are in path order. Where the two
+  // agree, the files take the rows that follow one for one, and equal ids
+  // mean equal paths, so runs like that are matched a vector at a time.
+  // Otherwise a table's paths are interned, so a match is usually the same
+  // pointer and only a miss needs strcmp
+  int row = 0;
+  int i = 0;
+  while (i < cmp->n) {
+    // the rows after the one the last file took, or it again for a repeat
+    int start = row + (i > 0 && cmp->rows[i - 1] == row);
+    int run = 0;
+    if (table->ids != NULL && start < table->n) {
+      int most = (cmp->n - i < table->n - start) ? cmp->n - i : table->n - start;
+      run = colscan_matchRun(file_id + i, table->ids + start, most);
+    }
+    if (run > 0) {
+      for (int k = 0; k < run; k++) {
+        found[i + k] = 1;
+        cmp->rows[i + k] = start + k;
+        cmp->matched[start + k] = 1;
+      }
+      i += run;
+      row = start + run - 1;
+      continue;
+    }
+
+    char *path = cmp->files[i]->filepath;
+    int order = 1;
+    while (row < table->n && (order = (table->paths[row] == path) ? 0 :
+          strcmp(path, table->paths[row])) > 0) {
+      row++;
+    }
+
+    found[i] = (row < table->n && order == 0);
+    cmp->rows[i] = found[i] ? row : -1;
+    if (found[i]) {
+      cmp->matched[row] = 1;
+    }
+    i++;
+  }
+
+  for (int i = 0; i < cmp->n; i++) {
+    file_mtime[i] = cmp->files[i]->last_modified;
+    file_size[i] = cmp->files[i]->size;
+    row_mtime[i] = found[i] ? table->last_modified[cmp->rows[i]] : 0;
+    row_size[i] = found[i] ? table->sizes[cmp->rows[i]] : 0;
+  }
+
+  // then classify every pair in one scan over the gathered columns, with
+  // vector compares (see colscan.h)
+  colscan_classify(cmp->n, file_mtime, row_mtime, file_size, row_size, found,
+      cmp->result, cmp->resized);
+
+  free(file_mtime);
+  free(row_mtime);
+  free(file_size);
+  free(row_size);
+  free(found);
+  free(file_id);
+
+  return cmp;
+}
+
+// filecomparison_destroy
+void filecomparison_destroy(FileComparison *cmp)
+{
+  if (cmp == NULL) {
+    return;
+  }
+
+  free(cmp->files);
+  free(cmp->rows);
+  free(cmp->result);
+  free(cmp->resized);
+  free(cmp->matched);
+  free(cmp);
+}
+
+// filetable_digest
+uint64_t filetable_digest(FileTable *ft, char *path)
+{
+  if (ft == NULL || path == NULL) {
+    return 0;
+  }
+
+  digests_sum(ft);
+  DirNode *node = dirtree_find(ft->tree, path);
+  return (node != NULL) ? node->digest : 0;
+}
+
+// filetable_dirStats
+DirStats filetable_dirStats(FileTable *ft, char *dirname)
+{
+  DirStats stats;
+  memset(&stats, 0, sizeof(stats));
+  if (ft == NULL || dirname == NULL) {
+    return stats;
+  }
+
+  DirNode *dir = dirtree_find(ft->tree, dirname);
+  if (dir == NULL) {
+    return stats;
+  }
+
+  stats = dir->stats;
+  stats.newest = stats_newest(dir);
+  return stats;
+}
+
+// filetable_digestChildren
+DigestNode *filetable_digestChildren(FileTable *ft, char *dirname)
+{
+  if (ft == NULL || dirname == NULL) {
+    return NULL;
+  }
+
+  digests_sum(ft);
+  DirNode *dir = dirtree_find(ft->tree, dirname);
+  if (dir == NULL) {
+    return NULL;
+  }
+
+  DigestNode *nodes = NULL;
+  for (DirNode *child = dir->children; child != NULL; child = child->next) {
+    DigestNode *node = calloc(1, sizeof(DigestNode));
+    if (node == NULL) {
+      fprintf(stderr, "malloc\n");
+      exit(1);
+    }
+
+    // a node with an entry is described by it; one without is a directory
+    // that only exists because of what is below it
+    if (child->entry != NULL) {
+      node->file = fileinfo_clone(child->entry->file);
+      node->has_entry = 1;
+    }
+    else {
+      size_t len = strlen(dirname) + strlen(child->name) + 2;
+      char *path = malloc(len);
+      node->file = fileinfo_init();
+      if (path == NULL || node->file == NULL) {
+        fprintf(stderr, "malloc\n");
+        exit(1);
+      }
+      snprintf(path, len, "%s%s%s", dirname, dirname[0] != '\0' ? "/" : "", child->name);
+      fileinfo_set_path(node->file, path);
+      node->file->is_dir = 1;
+      free(path);
+    }
+    node->digest = child->digest;
+    node->has_children = (child->children != NULL);
+
+    node->next = nodes;
+    nodes = node;
+  }
+
+  return nodes;
+}
+
+// filetable_addPeerUnder
+int filetable_addPeerUnder(FileTable *ft, char *dirname, char *ip, int port)
+{
+  if (ft == NULL || dirname == NULL || ip == NULL) {
+    return -1;
+  }
+
+  DirNode *dir = dirtree_find(ft->tree, dirname);
+  if (dir == NULL) {
+    return 0;
+  }
+
+  int id = peerregistry_add(ft->peers, ip, port);
+  if (id < 0) {
+    return -1;
+  }
+
+  // every entry the peer is new to changes at the same version
+  unsigned long version = 0;
+  int added = 0;
+  for (DirNode *n = dir; n != NULL; n = dirtree_next(n, dir)) {
+    TableEntry *entry = n->entry;
+    if (entry != NULL && peerset_add(&entry->peers, id)) {
+      entry->numpeers++;
+      entry_touch(ft, entry, batch_version(ft, &version));
+      added++;
+    }
+  }
+
+  return added;
+}
+
+// digestnode_destroy_all
+void digestnode_destroy_all(DigestNode *nodes)
+{
+  while (nodes != NULL) {
+    DigestNode *next = nodes->next;
+    fileinfo_destroy(nodes->file);
+    free(nodes);
+    nodes = next;
+  }
+}
+
+// digestnode_encode_all
+void digestnode_encode_all(WireBuf *w, DigestNode *nodes)
+{
+  uint32_t n = 0;
+  for (DigestNode *node = nodes; node != NULL; node = node->next) {
+    n++;
+  }
+
+  // the count, then each node's file followed by its digest and a byte with
+  // whether it has an entry and whether it has children
+  wire_put_varint(w, n);
+  for (DigestNode *node = nodes; node != NULL; node = node->next) {
+    fileinfo_encode(w, node->file);
+    wire_put_u64(w, node->digest);
+    wire_put_u8(w, (node->has_entry != 0) | (node->has_children != 0) << 1);
+  }
+}
+
+// digestnode_decode_all
+DigestNode *digestnode_decode_all(WireReader *r, int *n)
+{
+  DigestNode *head = NULL;
+  DigestNode **tail = &head;
+  *n = 0;
+
+  uint32_t count = wire_get_count(r);
+  for (uint32_t i = 0; i < count && !r->error; i++) {
+    FileInfo_FS *info = fileinfo_decode(r);
+    if (info == NULL) {
+      digestnode_destroy_all(head);
+      return NULL;
+    }
+
+    DigestNode *node = calloc(1, sizeof(DigestNode));
+    if (node == NULL) {
+      fprintf(stderr, "malloc\n");
+      exit(1);
+    }
+    node->file = info;
+    node->digest = wire_get_u64(r);
+    uint8_t flags = wire_get_u8(r);
+    node->has_entry = flags & 1;
+    node->has_children = (flags >> 1) & 1;
+    if (flags > 3) {
+      r->error = 1;
+    }
+    *tail = node;
+    tail = &node->next;
+  }
+
+  if (r->error) {
+    digestnode_destroy_all(head);
+    return NULL;
+  }
+
+  *n = count;
+  return head;
+}
+
+
+// update table based on events from specified peer w/ ip/port
+void filetable_eventMerge(FileTable *ft, FileEvent *e, char *ip, int port)
+{
+  if (ft == NULL || e == NULL || ip == NULL) {
+    return;
+  }
+
+  // Iterate through events 
+  for (FileEvent *cur = e; cur != NULL; cur = cur->next) {
+    // for each event, just update, insert, remove, or add peer based on the
+    // event action type
+    switch(cur->action) {
+      case FILE_MODIFIED:
+        filetable_updateMod(ft, cur->file, ip, port);
+        break;
+
+      case FILE_CREATED:
+        filetable_insert(ft, cur->file, ip, port);
+        break;
+
+      case FILE_DELETED:
+        filetable_remove(ft, cur->file->filepath);
+        break;
+
+      case DOWNLOAD_COMPLETE:
+        filetable_addPeer(ft, cur->file->filepath, ip, port, cur->file->size);
+        break;
+    }
+  }
+}
+
+// filetable_applyEvents
+// folds the events on each path into what they add up to, then makes just
+// those changes, in path order so each insert resumes where the last one was
+FileEvent *filetable_applyEvents(FileTable *ft, FileEvent *events, char *ip, int port)
+{
+  if (ft == NULL || events == NULL || ip == NULL) {
+    return NULL;
+  }
+
+  int n = 0;
+  for (FileEvent *cur = events; cur != NULL; cur = cur->next) {
+    n++;
+  }
+
+  ChangeRun run;
+  run.nchanges = 0;
+  run.nslots = 1;
+  while (run.nslots < 2 * n) {
+    run.nslots *= 2;
+  }
+  run.changes = malloc(n * sizeof(PathChange));
+  run.slots = calloc(run.nslots, sizeof(PathChange *));
+  if (run.changes == NULL || run.slots == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  // every change in the batch shares one version, taken at the first
+  unsigned long version = 0;
+  FileEvent *net = NULL;
+  FileEvent **tail = &net;
+
+  for (FileEvent *cur = events; cur != NULL; cur = cur->next) {
+    FileInfo_FS *file = cur->file;
+    PathChange *change = run_find(ft, &run, file->filepath);
+
+    switch (cur->action) {
+      case FILE_CREATED:
+        // dotfiles in the main dir aren't tracked
+        if (file->filepath[0] == '.') {
+          break;
+        }
+        if (!change->present) {
+          change->present = 1;
+          change->is_dir = file->is_dir;
+          change->recreated = (change->entry != NULL);
+        }
+        // always make size 0 for directories
+        change->size = file->is_dir ? 0 : file->size;
+        change->last_modified = file->last_modified;
+        change->peers = PEERS_RESET;
+        break;
+
+      case FILE_MODIFIED:
+        if (change->present) {
+          change->size = file->size;
+          change->last_modified = file->last_modified;
+          change->peers = PEERS_RESET;
+        }
+        break;
+
+      case FILE_DELETED:
+        if (!change->present) {
+          break;
+        }
+        if (!change->is_dir) {
+          change->present = 0;
+          break;
+        }
+
+        // a directory takes everything below it along, which other paths
+        // in the run may have changed; so make the changes so far, then
+        // remove the directory on its own
+        run_flush(ft, &run, ip, port, &version, &tail);
+        TableEntry *dir = filetable_getEntry(ft, file->filepath);
+        if (dir != NULL) {
+          event_append(&tail, FILE_DELETED, fileinfo_clone(dir->file));
+          entry_remove(ft, dir, batch_version(ft, &version));
+        }
+        break;
+
+      case DOWNLOAD_COMPLETE:
+        // only add peer if it has the full file
+        if (change->present && change->size == file->size && change->peers != PEERS_RESET) {
+          change->peers = PEERS_ADD;
+        }
+        break;
+    }
+  }
+  run_flush(ft, &run, ip, port, &version, &tail);
+
+  free(run.changes);
+  free(run.slots);
+
+  return net;
+}
+
+
+
+// print the entire file table, with peers and entries
+void filetable_print(FileTable *ft)
+{
+  printf("=============== filetable (%4d entries) ===============\n", (ft != NULL) ? ft->numfiles : 0);
+  if (ft != NULL) {
+    int n_paths;
+    long n_bytes;
+    path_stats(&n_paths, &n_bytes);
+    printf("(version %lu, %d removals kept; %d paths pooled in %ld bytes)\n",
+      ft->version, ft->numremoved, n_paths, n_bytes);
+    DirStats stats = filetable_dirStats(ft, "");
+    printf("(%llu bytes, newest %ld, %d files on fewer than %d peers)\n",
+      (unsigned long long) stats.bytes, (long) stats.newest, stats.thin, MIN_REPLICAS);
+    printf("# Peers | Size     | Last Modified | Filepath \n");
+    printf("--------------------------------------------\n");
+    for (TableEntry *cur = ft->head; cur != NULL; cur = cur->next) {
+      filetable_entryprint(cur);
+    }
+  }
+  else {
+    printf("               (null)\n");
+  }
+  printf("==========================================================\n");
+}
+
+
+
+// print only the part of the table at or below dirname
+void filetable_printDir(FileTable *ft, char *dirname)
+{
+  DirNode *dir = filetable_getDir(ft, dirname);
+  DirStats stats = filetable_dirStats(ft, dirname);
+  printf("=============== filetable: %s ===============\n", dirname);
+  printf("(%d entries, %llu bytes, newest %ld, %d files on fewer than %d peers)\n",
+    stats.files, (unsigned long long) stats.bytes, (long) stats.newest, stats.thin, MIN_REPLICAS);
+  printf("# Peers | Size     | Last Modified | Filepath \n");
+  printf("--------------------------------------------\n");
+  for (DirNode *n = dir; n != NULL; n = dirtree_next(n, dir)) {
+    filetable_entryprint(n->entry);
+  }
+  printf("==========================================================\n");
+}
+
+
+
+// print out a file entry 
+void filetable_entryprint(TableEntry *entry)
+{
+  if (entry == NULL) {
+    return;
+  }
+  printf("%6d | %8d | %13ld | %s\n      \\___ ", entry->numpeers, entry->file->size,
+    entry->file->last_modified, entry->file->filepath);
+  IP *peers = entry_peerlist(entry);
+  filepeer_print(peers);
+  filepeer_destroy(peers);
+}
+
+
+
+// print out a peer in human-readable form
+void filepeer_print(IP *peers)
+{
+  if (peers != NULL) {
+    for (IP *cur = peers; cur != NULL; cur = cur->next) {
+      printf("%s:%d   ", cur->ip, cur->port);
+    }
+    printf("\n");
+  }
+  else {
+    printf("(null)\n");
+  }
+}
+
+// frees all memory associated with entry
+void tableentry_destroy(TableEntry *entry)
+{
+  if (entry == NULL) {
+    return;
+  }
+
+  fileinfo_destroy(entry->file);
+  peerset_free(&entry->peers);
+  filepeer_destroy(entry->iphead);
+  free(entry);
+}
+
+
+// returns a copy of the table entry
 TableEntry *tableentry_clone(TableEntry *entry)
 {
-  TableEntry *clone = calloc(1, sizeof(TableEntry));
-  if (clone == NULL) {
-    return NULL;
+  TableEntry *clone = calloc(1, sizeof(TableEntry));
+  if (clone == NULL) {
+    return NULL;
+  }
+
+  clone->file = fileinfo_clone(entry->file);
+
+  // resolve the peers now, since the registry may change or go away
+  clone->iphead = entry_peerlist(entry);
+  for (IP *peer = clone->iphead; peer != NULL; peer = peer->next) {
+    clone->numpeers++;
+  }
+
+  return clone;
+}
+
+
+/*                  local functions                 */
+
+/*
+ * filepeer_destroy
+ *  Given the head of a IP linked list, delete it
+ */
+void filepeer_destroy(IP *iphead)
+{
+  for (IP *cur = iphead; cur != NULL; cur = iphead) {
+    iphead = cur->next;
+    free(cur);
+  }
+}
+
+/*
+ * entry_peerlist
+ *  Builds a fresh list of the entry's peers, in id order
+ * Ret: the list, which the caller must free with filepeer_destroy
+ */
+static IP *entry_peerlist(TableEntry *entry)
+{
+  IP *head = NULL;
+  IP **tail = &head;
+
+  if (entry->registry == NULL) {
+    // a detached copy; copy its list
+    for (IP *cur = entry->iphead; cur != NULL; cur = cur->next) {
+      *tail = calloc(1, sizeof(IP));
+      if (*tail == NULL) {
+        fprintf(stderr, "malloc\n");
+        exit(1);
+      }
+      memcpy(*tail, cur, sizeof(IP));
+      (*tail)->next = NULL;
+      tail = &(*tail)->next;
+    }
+    return head;
+  }
+
+  for (int id = peerset_next(&entry->peers, 0); id >= 0; id = peerset_next(&entry->peers, id + 1)) {
+    IP *addr = peerregistry_get(entry->registry, id);
+    if (addr == NULL) {
+      continue;
+    }
+    *tail = calloc(1, sizeof(IP));
+    if (*tail == NULL) {
+      fprintf(stderr, "malloc\n");
+      exit(1);
+    }
+    memcpy(*tail, addr, sizeof(IP));
+    (*tail)->next = NULL;
+    tail = &(*tail)->next;
+  }
+  return head;
+}
+
+/*
+ * path_hash
+ *  FNV-1a hash of a path string
+ */
+static unsigned int path_hash(const char *path)
+{
+  unsigned int hash = 2166136261u;
+  for (const unsigned char *c = (const unsigned char *) path; *c != '\0'; c++) {
+    hash ^= *c;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/*
+ * index_add
+ *  Adds entry to the hash index and the directory tree
+ */
+static void index_add(FileTable *ft, TableEntry *entry)
+{
+  hash_add(ft, entry);
+  entry->node = dirtree_insert(ft->tree, entry->file->filepath);
+  entry->node->entry = entry;
+
+  // count it in every directory above
+  DirStats none;
+  memset(&none, 0, sizeof(none));
+  entry->counted = entry_stats(entry);
+  stats_change(entry->node, &none, &entry->counted);
+}
+
+/*
+ * index_remove
+ *  Removes entry from the hash index and the directory tree
+ */
+static void index_remove(FileTable *ft, TableEntry *entry)
+{
+  hash_remove(ft, entry);
+  if (entry->node != NULL) {
+    DirStats none;
+    memset(&none, 0, sizeof(none));
+    stats_change(entry->node, &entry->counted, &none);
+
+    entry->node->entry = NULL;
+    dirtree_prune(ft->tree, entry->node);
+    entry->node = NULL;
+  }
+}
+
+/*
+ * hash_add
+ *  Adds entry to the hash index, growing it if it gets too full
+ */
+static void hash_add(FileTable *ft, TableEntry *entry)
+{
+  if (ft->numfiles + 1 > ft->nbuckets) {
+    index_resize(ft, ft->nbuckets * 2);
+  }
+
+  entry->hash = path_hash(entry->file->filepath);
+  TableEntry **bucket = &ft->buckets[entry->hash % ft->nbuckets];
+  entry->hnext = *bucket;
+  *bucket = entry;
+}
+
+/*
+ * hash_remove
+ *  Removes entry from the hash index
+ */
+static void hash_remove(FileTable *ft, TableEntry *entry)
+{
+  TableEntry **link = &ft->buckets[entry->hash % ft->nbuckets];
+  while (*link != NULL && *link != entry) {
+    link = &(*link)->hnext;
+  }
+  if (*link != NULL) {
+    *link = entry->hnext;
+  }
+  entry->hnext = NULL;
+}
+
+/*
+ * index_resize
+ *  Rehashes every entry into nbuckets buckets
+ */
+static void index_resize(FileTable *ft, int nbuckets)
+{
+  TableEntry **buckets = calloc(nbuckets, sizeof(TableEntry *));
+  if (buckets == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < ft->nbuckets; i++) {
+    TableEntry *cur = ft->buckets[i];
+    while (cur != NULL) {
+      TableEntry *next = cur->hnext;
+      TableEntry **bucket = &buckets[cur->hash % nbuckets];
+      cur->hnext = *bucket;
+      *bucket = cur;
+      cur = next;
+    }
+  }
+
+  free(ft->buckets);
+  ft->buckets = buckets;
+  ft->nbuckets = nbuckets;
+}
+
+/*
+ * sorted_prev
+ *  Finds the entry that path should follow in sorted order
+ * Ret: the preceding entry, or NULL if path belongs at the head
+ */
+static TableEntry *sorted_prev(FileTable *ft, const char *path)
+{
+  // appending past the tail is the common case for sorted input
+  if (ft->tail == NULL || strcmp(path, ft->tail->file->filepath) > 0) {
+    return ft->tail;
+  }
+
+  // resume from the last insertion point if path comes after it
+  TableEntry *prv = NULL;
+  TableEntry *cur = ft->head;
+  if (ft->cursor != NULL && strcmp(path, ft->cursor->file->filepath) > 0) {
+    prv = ft->cursor;
+    cur = prv->next;
+  }
+
+  for (; cur != NULL; cur = cur->next) {
+    if (strcmp(path, cur->file->filepath) < 0) {
+      break;
+    }
+    prv = cur;
+  }
+  return prv;
+}
+
+/*
+ * list_link
+ *  Links entry into the sorted list after prv (at the head if prv is NULL)
+ */
+static void list_link(FileTable *ft, TableEntry *prv, TableEntry *entry)
+{
+  entry->prev = prv;
+  if (prv == NULL) {
+    entry->next = ft->head; // Insert at the head
+    ft->head = entry;
+  }
+  else {
+    entry->next = prv->next; // Insert between prv and prv->next
+    prv->next = entry;
+  }
+
+  if (entry->next != NULL) {
+    entry->next->prev = entry;
+  }
+  else {
+    ft->tail = entry;
+  }
+}
+
+/*
+ * list_unlink
+ *  Unlinks entry from the sorted list
+ */
+static void list_unlink(FileTable *ft, TableEntry *entry)
+{
+  if (entry->prev == NULL) {
+    ft->head = entry->next;   // The file was first in the list
+  }
+  else { // otherwise skip over removed file in the list
+    entry->prev->next = entry->next;
+  }
+
+  if (entry->next == NULL) {
+    ft->tail = entry->prev;
+  }
+  else {
+    entry->next->prev = entry->prev;
+  }
+
+  if (ft->cursor == entry) {
+    ft->cursor = entry->prev;
+  }
+  entry->next = NULL;
+  entry->prev = NULL;
+}
+
+/*
+ * entry_remove
+ *  Removes entry, and everything below it if it is a directory, remembering
+ *  each removed path as removed at version
+ */
+static void entry_remove(FileTable *ft, TableEntry *cur, unsigned long version)
+{
+  // If removing a directory
+  if (cur->file->is_dir) {
+    // Delete everything below the directory by walking its subtree,
+    // then drop the subtree's nodes all at once
+    DirNode *dir = cur->node;
+    for (DirNode *n = dirtree_next(dir, dir); n != NULL; n = dirtree_next(n, dir)) {
+      TableEntry *sub = n->entry;
+      if (sub == NULL) {
+        continue;
+      }
+      printf("remove sub file %s\n", sub->file->filepath);
+      list_unlink(ft, sub);
+      hash_remove(ft, sub);
+      vlist_unlink(ft, sub);
+      tombstone_add(ft, sub->file->filepath, sub->file->id, version);
+      entry_free(ft, sub);
+      n->entry = NULL;
+      ft->numfiles--;
+    }
+
+    // the directories above lose the whole subtree at once
+    DirStats gone = dir->stats;
+    gone.newest = stats_newest(dir);
+    DirStats none;
+    memset(&none, 0, sizeof(none));
+    stats_change(dir->parent, &gone, &none);
+
+    list_unlink(ft, cur);
+    hash_remove(ft, cur);
+    dir->entry = NULL;
+    dirtree_remove(ft->tree, dir);
+  }
+  else {
+    list_unlink(ft, cur);
+    index_remove(ft, cur);
+  }
+  vlist_unlink(ft, cur);
+  tombstone_add(ft, cur->file->filepath, cur->file->id, version);
+
+  // Destroy cur, keeping it for reuse
+  entry_free(ft, cur);
+
+  // Decrement the number of files
+  ft->numfiles--;
+
+  if (version > ft->version) {
+    ft->version = version;
+  }
+}
+
+/*
+ * entry_touch
+ *  Stamps entry as changed at version, moving it to the end of the
+ *  change-ordered list
+ */
+static void entry_touch(FileTable *ft, TableEntry *entry, unsigned long version)
+{
+  // whatever changed, the directories above count it from now on
+  if (entry->node != NULL) {
+    DirStats now = entry_stats(entry);
+    stats_change(entry->node, &entry->counted, &now);
+    entry->counted = now;
+  }
+
+  vlist_unlink(ft, entry);
+
+  entry->version = version;
+  entry->vprev = ft->vtail;
+  entry->vnext = NULL;
+  if (ft->vtail != NULL) {
+    ft->vtail->vnext = entry;
+  }
+  else {
+    ft->vhead = entry;
+  }
+  ft->vtail = entry;
+}
+
+/*
+ * next_version
+ *  Advances ft to its next version, taken from the clock it shares with
+ *  other tables if it has one
+ * Ret: the new version
+ */
+static unsigned long next_version(FileTable *ft)
+{
+  if (ft->clock != NULL) {
+    pthread_mutex_lock(&ft->clock->lock);
+    ft->version = ++ft->clock->version;
+    pthread_mutex_unlock(&ft->clock->lock);
+  }
+  else {
+    ft->version++;
+  }
+  return ft->version;
+}
+
+/*
+ * vlist_unlink
+ *  Unlinks entry from the change-ordered list
+ */
+static void vlist_unlink(FileTable *ft, TableEntry *entry)
+{
+  if (entry->vprev != NULL) {
+    entry->vprev->vnext = entry->vnext;
+  }
+  else if (ft->vhead == entry) {
+    ft->vhead = entry->vnext;
+  }
+
+  if (entry->vnext != NULL) {
+    entry->vnext->vprev = entry->vprev;
+  }
+  else if (ft->vtail == entry) {
+    ft->vtail = entry->vprev;
+  }
+
+  entry->vnext = NULL;
+  entry->vprev = NULL;
+}
+
+/*
+ * vlist_build
+ *  Rebuilds the change-ordered list from the entries' versions, as after
+ *  receiving a table in path order
+ */
+static void vlist_build(FileTable *ft)
+{
+  ft->vhead = NULL;
+  ft->vtail = NULL;
+  if (ft->numfiles == 0) {
+    return;
+  }
+
+  TableEntry **entries = malloc(ft->numfiles * sizeof(TableEntry *));
+  if (entries == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  int n = 0;
+  for (TableEntry *cur = ft->head; cur != NULL; cur = cur->next) {
+    entries[n++] = cur;
+  }
+  qsort(entries, n, sizeof(TableEntry *), compare_version);
+
+  for (int i = 0; i < n; i++) {
+    entries[i]->vnext = NULL;
+    entries[i]->vprev = NULL;
+    entry_touch(ft, entries[i], entries[i]->version);
+  }
+  free(entries);
+}
+
+/*
+ * entry_append
+ *  Adds an entry for path after the tail, without a new version or peers,
+ *  as when reading back a table saved in path order
+ */
+static TableEntry *entry_append(FileTable *ft, const char *path, time_t last_modified,
+    unsigned int size, int is_dir, unsigned long version)
+{
+  TableEntry *entry = calloc(1, sizeof(TableEntry));
+  FileInfo_FS *info = fileinfo_init();
+  if (entry == NULL || info == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  fileinfo_set_path(info, path);
+  info->size = size;
+  info->last_modified = last_modified;
+  info->is_dir = is_dir;
+
+  entry->file = info;
+  entry->registry = ft->peers;
+  entry->version = version;
+
+  list_link(ft, ft->tail, entry);
+  index_add(ft, entry);
+  ft->numfiles++;
+  return entry;
+}
+
+/*
+ * tombstone_add
+ *  Remembers that filepath, with id, was removed at version
+ */
+static void tombstone_add(FileTable *ft, char *filepath, uint32_t id, unsigned long version)
+{
+  Tombstone *t = calloc(1, sizeof(Tombstone));
+  if (t == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  t->filepath = path_retain(filepath);
+  t->id = id;
+  t->version = version;
+
+  if (ft->removedtail != NULL) {
+    ft->removedtail->next = t;
+  }
+  else {
+    ft->removed = t;
+  }
+  ft->removedtail = t;
+  ft->numremoved++;
+}
+
+/*
+ * changed_since
+ *  Finds the entries changed after version since by walking back from the
+ *  latest change, so it takes time in the number of changes
+ * Ret: the entries in path order, which the caller must free; n is set to
+ *  how many there are
+ */
+static TableEntry **changed_since(FileTable *ft, unsigned long since, int *n)
+{
+  *n = 0;
+  TableEntry *first = NULL;
+  for (TableEntry *cur = ft->vtail; cur != NULL && cur->version > since; cur = cur->vprev) {
+    first = cur;
+    (*n)++;
+  }
+
+  TableEntry **entries = malloc((*n > 0 ? *n : 1) * sizeof(TableEntry *));
+  if (entries == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  int i = 0;
+  for (TableEntry *cur = first; cur != NULL; cur = cur->vnext) {
+    entries[i++] = cur;
+  }
+  qsort(entries, *n, sizeof(TableEntry *), compare_path);
+
+  return entries;
+}
+
+/*
+ * sorted_files
+ *  Puts a list of files in an array sorted by path; the list is left alone
+ * Ret: the array, which the caller must free; n is set to its length
+ */
+static FileInfo_FS **sorted_files(FileInfo_FS *files, int *n)
+{
+  *n = 0;
+  for (FileInfo_FS *f = files; f != NULL; f = f->next) {
+    (*n)++;
+  }
+
+  FileInfo_FS **sorted = malloc((*n > 0 ? *n : 1) * sizeof(FileInfo_FS *));
+  FileInfo_FS **tmp = malloc((*n > 0 ? *n : 1) * sizeof(FileInfo_FS *));
+  if (sorted == NULL || tmp == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  int i = 0;
+  for (FileInfo_FS *f = files; f != NULL; f = f->next) {
+    sorted[i++] = f;
+  }
+  radix_sort(sorted, tmp, *n, 0);
+
+  free(tmp);
+  return sorted;
+}
+
+/*
+ * radix_sort
+ *  Most-significant-byte-first radix sort of files by path, for paths that
+ *  already agree on their first depth bytes. Orders paths as strcmp does.
+ *  tmp is scratch space for n pointers.
+ */
+static void radix_sort(FileInfo_FS **files, FileInfo_FS **tmp, int n, int depth)
+{
+  // short runs: insertion sort on what's left of the paths
+  if (n < RADIX_CUTOFF) {
+    for (int i = 1; i < n; i++) {
+      FileInfo_FS *f = files[i];
+      int j = i;
+      while (j > 0 && strcmp(files[j - 1]->filepath + depth, f->filepath + depth) > 0) {
+        files[j] = files[j - 1];
+        j--;
+      }
+      files[j] = f;
+    }
+    return;
+  }
+
+  // count the paths by their byte at depth; paths that end there go first
+  int count[257] = {0};
+  for (int i = 0; i < n; i++) {
+    count[(unsigned char) files[i]->filepath[depth] + 1]++;
+  }
+  for (int b = 1; b < 257; b++) {
+    count[b] += count[b - 1];
+  }
+
+  // distribute them into tmp, then back, in byte order
+  int start[257];
+  memcpy(start, count, sizeof(start));
+  for (int i = 0; i < n; i++) {
+    tmp[count[(unsigned char) files[i]->filepath[depth]]++] = files[i];
+  }
+  memcpy(files, tmp, n * sizeof(FileInfo_FS *));
+
+  // sort each byte's bucket on the next byte; ended paths are all equal
+  for (int b = 1; b < 256; b++) {
+    int len = start[b + 1] - start[b];
+    if (len > 1) {
+      radix_sort(files + start[b], tmp, len, depth + 1);
+    }
+  }
+}
+
+/*
+ * event_append
+ *  Adds an event for file at the end of a list, through its tail pointer
+ * Ret: the event
+ */
+static FileEvent *event_append(FileEvent ***tail, enum ActionType action, FileInfo_FS *file)
+{
+  FileEvent *evt = fileevent_init();
+  if (evt == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  evt->action = action;
+  evt->file = file;
+  evt->next = NULL;
+
+  **tail = evt;
+  *tail = &evt->next;
+  return evt;
+}
+
+/*
+ * entry_alloc
+ *  Takes a cleared entry for ft, reusing a removed one if ft kept any
+ */
+static TableEntry *entry_alloc(FileTable *ft)
+{
+  TableEntry *entry = ft->spare;
+  if (entry == NULL) {
+    entry = calloc(1, sizeof(TableEntry));
+    if (entry == NULL) {
+      fprintf(stderr, "malloc\n");
+      exit(1);
+    }
+    return entry;
+  }
+
+  ft->spare = entry->next;
+  ft->numspare--;
+
+  // the peer set's words were cleared and stay allocated
+  PeerSet peers = entry->peers;
+  memset(entry, 0, sizeof(TableEntry));
+  entry->peers = peers;
+  return entry;
+}
+
+/*
+ * entry_free
+ *  Frees an entry already unlinked from ft, or keeps it for entry_alloc
+ */
+static void entry_free(FileTable *ft, TableEntry *entry)
+{
+  if (ft->numspare >= MAX_SPARE) {
+    tableentry_destroy(entry);
+    return;
+  }
+
+  fileinfo_destroy(entry->file);
+  entry->file = NULL;
+  filepeer_destroy(entry->iphead);
+  entry->iphead = NULL;
+  peerset_clear(&entry->peers);
+
+  entry->next = ft->spare;
+  ft->spare = entry;
+  ft->numspare++;
+}
+
+/*
+ * run_find
+ *  Finds the change to path in run, starting one from path's entry if the
+ *  run hasn't seen path yet
+ */
+static PathChange *run_find(FileTable *ft, ChangeRun *run, char *path)
+{
+  unsigned int i = (unsigned int) (((uintptr_t) path >> 3) * 2654435761u) & (run->nslots - 1);
+  while (run->slots[i] != NULL) {
+    if (run->slots[i]->path == path) {
+      return run->slots[i];
+    }
+    i = (i + 1) & (run->nslots - 1);
   }
 
-  clone->file = calloc(1, sizeof(FileInfo_FS));
-  memcpy(clone->file, entry->file, sizeof(FileInfo_FS));
+  PathChange *change = &run->changes[run->nchanges++];
+  memset(change, 0, sizeof(PathChange));
+  change->path = path;
+  change->entry = filetable_getEntry(ft, path);
+  if (change->entry != NULL) {
+    change->present = 1;
+    change->is_dir = change->entry->file->is_dir;
+    change->size = change->entry->file->size;
+    change->last_modified = change->entry->file->last_modified;
+  }
+  run->slots[i] = change;
+  return change;
+}
 
-  clone->numpeers = entry->numpeers;
+/*
+ * run_flush
+ *  Makes the changes folded in run, in path order, appending each one that
+ *  changes the table to the list at tail, then empties run
+ */
+static void run_flush(FileTable *ft, ChangeRun *run, char *ip, int port,
+    unsigned long *version, FileEvent ***tail)
+{
+  if (run->nchanges == 0) {
+    return;
+  }
 
-  IP *peer = entry->iphead;
-  while (peer != NULL) {
-    IP *clone_p = calloc(1, sizeof(IP));
-    if (clone_p == NULL) {
-      return NULL;
+  PathChange **sorted = malloc(run->nchanges * sizeof(PathChange *));
+  if (sorted == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  for (int i = 0; i < run->nchanges; i++) {
+    sorted[i] = &run->changes[i];
+  }
+  qsort(sorted, run->nchanges, sizeof(PathChange *), compare_change);
+
+  int id = -1;
+  for (int i = 0; i < run->nchanges; i++) {
+    PathChange *change = sorted[i];
+    TableEntry *entry = change->entry;
+
+    // removed
+    if (!change->present) {
+      if (entry != NULL) {
+        event_append(tail, FILE_DELETED, fileinfo_clone(entry->file));
+        entry_remove(ft, entry, batch_version(ft, version));
+      }
+      continue;
+    }
+
+    if (change->peers != PEERS_KEEP && id < 0) {
+      id = peerregistry_add(ft->peers, ip, port);
+    }
+
+    enum ActionType action = FILE_MODIFIED;
+
+    // added
+    if (entry == NULL) {
+      entry = entry_alloc(ft);
+      entry->file = fileinfo_init();
+      if (entry->file == NULL) {
+        fprintf(stderr, "malloc\n");
+        exit(1);
+      }
+      fileinfo_set_path(entry->file, change->path);
+      entry->registry = ft->peers;
+
+      list_link(ft, sorted_prev(ft, change->path), entry);
+      index_add(ft, entry);
+      ft->cursor = entry;
+      ft->numfiles++;
+      action = FILE_CREATED;
+    }
+    // only a peer added, which changes nothing if it was already listed
+    else if (change->peers == PEERS_ADD && !change->recreated &&
+        change->size == entry->file->size &&
+        change->last_modified == entry->file->last_modified) {
+      if (id < 0 || !peerset_add(&entry->peers, id)) {
+        continue;
+      }
+      entry->numpeers++;
+      event_append(tail, DOWNLOAD_COMPLETE, fileinfo_clone(entry->file));
+      entry_touch(ft, entry, batch_version(ft, version));
+      continue;
+    }
+    // nothing at all
+    else if (change->peers == PEERS_KEEP && !change->recreated &&
+        change->size == entry->file->size &&
+        change->last_modified == entry->file->last_modified) {
+      continue;
     }
 
-    memcpy(clone_p, peer, sizeof(IP));
+    entry->file->is_dir = change->is_dir;
+    entry->file->size = change->size;
+    entry->file->last_modified = change->last_modified;
 
-    clone_p->next = clone->iphead;
-    clone->iphead = clone_p;
+    // whoever created or modified the file has the only copy
+    if (change->peers == PEERS_RESET) {
+      peerset_clear(&entry->peers);
+    }
+    if (change->peers != PEERS_KEEP && id >= 0) {
+      peerset_add(&entry->peers, id);
+    }
+    entry->numpeers = peerset_count(&entry->peers);
 
-    peer = peer->next;
+    event_append(tail, action, fileinfo_clone(entry->file));
+    entry_touch(ft, entry, batch_version(ft, version));
   }
+  free(sorted);
 
-  return clone;
+  memset(run->slots, 0, run->nslots * sizeof(PathChange *));
+  run->nchanges = 0;
 }
 
+/*
+ * batch_version
+ *  The version a batch's changes share, taken when the first is made
+ */
+static unsigned long batch_version(FileTable *ft, unsigned long *version)
+{
+  if (*version == 0) {
+    *version = next_version(ft);
+  }
+  return *version;
+}
 
-/*                  local functions                 */
+/*
+ * entry_copy
+ *  Copies entry for a table whose registry has the same ids as entry's
+ */
+static TableEntry *entry_copy(TableEntry *entry, PeerRegistry *registry)
+{
+  TableEntry *copy = calloc(1, sizeof(TableEntry));
+  if (copy == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  copy->file = fileinfo_clone(entry->file);
+  peerset_copy(&copy->peers, &entry->peers);
+  copy->registry = registry;
+  copy->numpeers = entry->numpeers;
+  copy->version = entry->version;
+
+  return copy;
+}
+
+// qsort comparators over arrays of entries
+static int compare_path(const void *a, const void *b)
+{
+  return strcmp((*(TableEntry **) a)->file->filepath, (*(TableEntry **) b)->file->filepath);
+}
+
+static int compare_version(const void *a, const void *b)
+{
+  unsigned long va = (*(TableEntry **) a)->version;
+  unsigned long vb = (*(TableEntry **) b)->version;
+  return (va > vb) - (va < vb);
+}
 
 /*
- * ip_destroy
- *  Given the head of a IP linked list, delete it
+ * columns_free
+ *  Frees a table's columns
  */
-void ip_destroy(IP *iphead)
+static void columns_free(FileColumns *cols)
 {
-  for (IP *cur = iphead; cur != NULL; cur = iphead) {
-    iphead = cur->next;
-    free(cur);
+  if (cols == NULL) {
+    return;
   }
+
+  free(cols->paths);
+  free(cols->ids);
+  free(cols->last_modified);
+  free(cols->sizes);
+  free(cols->is_dir);
+  free(cols->entries);
+  free(cols);
 }
 
+/*
+ * digests_sum
+ *  Sums the digest of every node of the tree, unless the table is unchanged
+ *  since the last time. Every node is visited after everything below it, so
+ *  each is its own entry's digest combined with its children's, and a change
+ *  anywhere shows in the digest of every directory above it
+ */
+static void digests_sum(FileTable *ft)
+{
+  if (ft->digested == ft->version && ft->digestfiles == ft->numfiles) {
+    return;
+  }
+
+  // preorder puts every node before everything below it, so backwards
+  // puts it after
+  int n = 0;
+  DirNode **order = malloc((ft->tree->nnodes + 1) * sizeof(DirNode *));
+  if (order == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  for (DirNode *node = ft->tree->root; node != NULL; node = dirtree_next(node, ft->tree->root)) {
+    order[n++] = node;
+  }
+
+  for (int i = n - 1; i >= 0; i--) {
+    DirNode *node = order[i];
+    node->digest = (node->entry != NULL) ? entry_digest(node->entry) : 0;
+    for (DirNode *child = node->children; child != NULL; child = child->next) {
+      node->digest ^= child->digest;
+    }
+  }
+
+  free(order);
+  ft->digested = ft->version;
+  ft->digestfiles = ft->numfiles;
+}
 
+/*
+ * entry_stats
+ *  What one entry adds to the stats of the directories it is in
+ */
+static DirStats entry_stats(TableEntry *entry)
+{
+  DirStats stats;
+  stats.files = 1;
+  stats.bytes = entry->file->size;
+  stats.newest = entry->file->last_modified;
+  stats.thin = !entry->file->is_dir && entry->numpeers < MIN_REPLICAS;
+  return stats;
+}
 
-FileTable *filetable_receive(int fd) {
-  FileTable *table = calloc(1, sizeof(FileTable));
-  if (table == NULL) {
-    return NULL;
+/*
+ * stats_change
+ *  Moves the stats of node and every directory above it from counting old
+ *  to counting new. Totals just add up; the newest time only goes up as
+ *  easily, so when it goes down the nodes it might have come from are
+ *  marked to work it out again when asked
+ */
+static void stats_change(DirNode *node, DirStats *old, DirStats *new)
+{
+  for (DirNode *n = node; n != NULL; n = n->parent) {
+    n->stats.files += new->files - old->files;
+    n->stats.bytes += new->bytes - old->bytes;
+    n->stats.thin += new->thin - old->thin;
+
+    if (new->newest < old->newest && old->newest >= n->stats.newest) {
+      n->stale = 1;
+    }
+    if (!n->stale && new->newest > n->stats.newest) {
+      n->stats.newest = new->newest;
+    }
+  }
+}
+
+/*
+ * stats_newest
+ *  The newest modification time at or below node, worked out from its
+ *  entry and children if it went stale
+ */
+static time_t stats_newest(DirNode *node)
+{
+  if (node->stale) {
+    time_t newest = (node->entry != NULL) ? node->entry->counted.newest : 0;
+    for (DirNode *child = node->children; child != NULL; child = child->next) {
+      time_t t = stats_newest(child);
+      if (t > newest) {
+        newest = t;
+      }
+    }
+    node->stats.newest = newest;
+    node->stale = 0;
+  }
+  return node->stats.newest;
+}
+
+/*
+ * entry_digest
+ *  Digest of one entry: its path, and for a file its modification time and
+ *  size. Digests are combined by xor, so each is mixed well enough that
+ *  different sets of entries don't cancel out to the same sum
+ */
+static uint64_t entry_digest(TableEntry *entry)
+{
+  FileInfo_FS *file = entry->file;
+
+  uint64_t hash = 14695981039346656037ULL;
+  for (const char *c = file->filepath; *c != '\0'; c++) {
+    hash = (hash ^ (unsigned char) *c) * 1099511628211ULL;
+  }
+  if (file->is_dir) {
+    hash ^= 0x9e3779b97f4a7c15ULL;
+  }
+  else {
+    hash ^= (uint64_t) file->last_modified * 0xbf58476d1ce4e5b9ULL;
+    hash ^= (uint64_t) file->size * 0x94d049bb133111ebULL;
   }
 
-  // read in the filetable struct
-  if (recv(fd, table, sizeof(FileTable), MSG_WAITALL) < 0) {
+  // finish with splitmix64's mixer
+  hash ^= hash >> 30;
+  hash *= 0xbf58476d1ce4e5b9ULL;
+  hash ^= hash >> 27;
+  hash *= 0x94d049bb133111ebULL;
+  hash ^= hash >> 31;
+  return hash;
+}
+
+static int compare_change(const void *a, const void *b)
+{
+  return strcmp((*(PathChange **) a)->path, (*(PathChange **) b)->path);
+}
+
+
+
+FileTable *filetable_decode(WireReader *r)
+{
+  // the counts and version
+  unsigned long version = wire_get_varint(r);
+  uint32_t numfiles = wire_get_count(r);
+  uint32_t numremoved = wire_get_count(r);
+  if (r->error) {
     return NULL;
   }
 
-  // reset table pointers
-  table->head = NULL;
+  // every entry takes more than a byte, so a count past the bytes left is a
+  // lie, and wire_get_count turns it away before it can size the index
+  FileTable *table = filetable_init();
+  if (numfiles > INIT_BUCKETS) {
+    index_resize(table, numfiles);
+  }
+  table->version = version;
+
+  // then the peer registry, so the ids in each entry mean the same here
+  uint32_t nslots = wire_get_count(r);
+  for (uint32_t id = 0; id < nslots && !r->error; id++) {
+    IP addr;
+    uint32_t len;
+    const char *ip = wire_get_str(r, sizeof(addr.ip) - 1, &len);
+    addr.port = (int32_t) wire_get_varint(r);
+    if (!r->error && len > 0) {
+      memcpy(addr.ip, ip, len);
+      addr.ip[len] = '\0';
+      peerregistry_put(table->peers, id, addr.ip, addr.port);
+    }
+  }
 
   // for each entry we are expecting
-  for (int i = 0; i < table->numfiles; i++) {
+  for (uint32_t i = 0; i < numfiles && !r->error; i++) {
+    // its file, then its version and peer set
+    FileInfo_FS *info = fileinfo_decode(r);
+    if (info == NULL) {
+      break;
+    }
+    unsigned long entryversion = wire_get_varint(r);
+    uint32_t nwords = wire_get_count(r);
+    if (r->error) {
+      fileinfo_destroy(info);
+      break;
+    }
+
+    // entries arrive in sorted order, so append them at the tail; one out
+    // of order would corrupt the list
+    if (table->tail != NULL && strcmp(table->tail->file->filepath, info->filepath) >= 0) {
+      fileinfo_destroy(info);
+      r->error = 1;
+      break;
+    }
 
-    // create space for this entry
     TableEntry *entry = calloc(1, sizeof(TableEntry));
     if (entry == NULL) {
-      return NULL;
+      fprintf(stderr, "malloc\n");
+      exit(1);
+    }
+    entry->file = info;
+    entry->version = entryversion;
+    entry->registry = table->peers;
+    entry->peers.nwords = nwords;
+    if (nwords > 0) {
+      entry->peers.words = calloc(nwords, sizeof(uint32_t));
+      if (entry->peers.words == NULL) {
+        fprintf(stderr, "malloc\n");
+        exit(1);
+      }
+      for (uint32_t j = 0; j < nwords; j++) {
+        entry->peers.words[j] = (uint32_t) wire_get_varint(r);
+      }
     }
+    entry->numpeers = peerset_count(&entry->peers);
 
-    // read in the entry
-    if (recv(fd, entry, sizeof(TableEntry), MSG_WAITALL) < 0) {
-      return NULL;
+    list_link(table, table->tail, entry);
+    index_add(table, entry);
+    table->numfiles++;
+  }
+
+  // then the paths removed, each a reference to its path and a version
+  for (uint32_t i = 0; i < numremoved && !r->error; i++) {
+    uint32_t id;
+    char *path = fileref_decode(r, &id);
+    unsigned long removed = wire_get_varint(r);
+    if (path == NULL) {
+      r->error = 1;
+      break;
+    }
+    if (!r->error) {
+      tombstone_add(table, path, id, removed);
     }
+    path_release(path);
+  }
 
-    // reset pointers
-    entry->file = NULL;
-    entry->iphead = NULL;
+  if (r->error) {
+    filetable_destroy(table);
+    return NULL;
+  }
 
-    // next thing we expect is the fileinfo struct
-    FileInfo_FS *info = fileinfo_init();
-    if (info == NULL) {
-      return NULL;
+  // the entries came in path order; put them back in the order they changed
+  vlist_build(table);
+
+  return table;
+}
+
+void filetable_encode(WireBuf *w, FileTable *table)
+{
+  // the whole table is every change since version 0 made to an empty table,
+  // so it needs no removals
+  table_encode(w, table, NULL, table->numfiles, 0);
+}
+
+int filetable_encodeChanges(WireBuf *w, FileTable *table, unsigned long since)
+{
+  // removals before base are gone, so the changes can't be listed
+  if (since < table->base) {
+    return -2;
+  }
+
+  // send them in path order, so the receiver appends each at its tail
+  int n;
+  TableEntry **entries = changed_since(table, since, &n);
+
+  table_encode(w, table, entries, n, since);
+
+  free(entries);
+  return 1;
+}
+
+/*
+ * table_encode
+ *  Appends the table's counts and version, the peer registry, nentries
+ *  entries and every removal after since. Entries come from the array, or in
+ *  list order if entries is NULL, in which case no removals are sent.
+ */
+static void table_encode(WireBuf *w, FileTable *table, TableEntry **entries, int nentries,
+    unsigned long since)
+{
+  // count the removals to send
+  uint32_t nremoved = 0;
+  if (entries != NULL) {
+    for (Tombstone *t = table->removed; t != NULL; t = t->next) {
+      if (t->version > since) {
+        nremoved++;
+      }
     }
+  }
 
-    // read in the fileinfo
-    if (recv(fd, info, sizeof(FileInfo_FS), MSG_WAITALL) < 0) {
-      return NULL;
+  wire_put_varint(w, table->version);
+  wire_put_varint(w, nentries);
+  wire_put_varint(w, nremoved);
+
+  // then the peer registry, one slot per id; free ids have no address
+  PeerRegistry *reg = table->peers;
+  wire_put_varint(w, reg->nslots);
+  for (int id = 0; id < reg->nslots; id++) {
+    IP *slot = &reg->slots[id];
+    uint32_t len = 0;
+    while (len < sizeof(slot->ip) - 1 && slot->ip[len] != '\0') {
+      len++;
     }
+    wire_put_str(w, slot->ip, len);
+    wire_put_varint(w, (uint32_t) slot->port);
+  }
 
-    // set the entry's fileinfo
-    entry->file = info;
+  // then each entry: its file, version and peer set
+  TableEntry *entry = table->head;
+  for (int i = 0; i < nentries; i++) {
+    if (entries != NULL) {
+      entry = entries[i];
+    }
 
-    // read in all the peers
-    for (int j = 0; j < entry->numpeers; j++) {
-      IP *cur_ip = calloc(1, sizeof(IP));
-      if (cur_ip == NULL) {
-        return NULL;
-      }
+    fileinfo_encode(w, entry->file);
+    wire_put_varint(w, entry->version);
+    wire_put_varint(w, entry->peers.nwords);
+    for (int j = 0; j < entry->peers.nwords; j++) {
+      wire_put_varint(w, entry->peers.words[j]);
+    }
 
-      // read in this IP
-      if (recv(fd, cur_ip, sizeof(IP), MSG_WAITALL) < 0) {
-        return NULL;
-      }
+    entry = entry->next;
+  }
 
-      // link it to the entry's list
-      cur_ip->next = entry->iphead;
-      entry->iphead = cur_ip;
+  // and the removals, each a reference to its path and a version
+  for (Tombstone *t = table->removed; nremoved > 0 && t != NULL; t = t->next) {
+    if (t->version <= since) {
+      continue;
     }
 
-    // add this entry into the table
-    entry->next = table->head;
-    table->head = entry;
+    fileref_encode(w, t->id, t->filepath);
+    wire_put_varint(w, t->version);
   }
+}
 
-  return table;
+// checksum of a saved record, to tell a whole record from a torn one
+static uint32_t save_checksum(const char *buf, size_t len)
+{
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash = (hash ^ (unsigned char) buf[i]) * 16777619u;
+  }
+  return hash;
 }
 
-int filetable_send(int fd, FileTable *table) {
-  if (table == NULL) {
+int filetable_save(FileTable *ft, FILE *fp, unsigned long since)
+{
+  if (ft == NULL || fp == NULL) {
     return -1;
   }
 
-  // first send the table struct w/ the meta info
-  if (send(fd, table, sizeof(FileTable), 0) <= 0) {
-    perror("error sending");
-    return -1;
+  // removals before base are gone, so the changes can't be listed
+  if (since != 0 && since < ft->base) {
+    return -2;
   }
 
-  TableEntry *entry = table->head;
+  // the whole table in list order, or the changes in path order
+  int n = ft->numfiles;
+  TableEntry **entries = NULL;
+  if (since != 0) {
+    entries = changed_since(ft, since, &n);
+  }
+
+  // size the record
+  SaveHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = SAVE_MAGIC;
+  header.numfiles = n;
+  header.base = since;
+  header.version = ft->version;
+
+  TableEntry *cur = ft->head;
+  for (int i = 0; i < n; i++) {
+    if (entries != NULL) {
+      cur = entries[i];
+    }
+    header.length += sizeof(SavedEntry) + strlen(cur->file->filepath);
+    cur = cur->next;
+  }
+  for (Tombstone *t = ft->removed; since != 0 && t != NULL; t = t->next) {
+    if (t->version > since) {
+      header.length += sizeof(SavedEntry) + strlen(t->filepath);
+      header.numremoved++;
+    }
+  }
+
+  // and build it in memory, so it goes out in one write
+  char *buf = malloc(sizeof(SaveHeader) + header.length);
+  if (buf == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  char *pos = buf + sizeof(SaveHeader);
 
-  // then send each entry
-  while (entry != NULL) {
-    // send the struct
-    if (send(fd, entry, sizeof(TableEntry), 0) <= 0) {
-      perror("error sending");
-      return -1;
+  cur = ft->head;
+  for (int i = 0; i < n; i++) {
+    if (entries != NULL) {
+      cur = entries[i];
+    }
+    SavedEntry saved;
+    memset(&saved, 0, sizeof(saved));
+    saved.version = cur->version;
+    saved.last_modified = cur->file->last_modified;
+    saved.size = cur->file->size;
+    saved.is_dir = cur->file->is_dir;
+    saved.pathlen = strlen(cur->file->filepath);
+    memcpy(pos, &saved, sizeof(saved));
+    memcpy(pos + sizeof(saved), cur->file->filepath, saved.pathlen);
+    pos += sizeof(saved) + saved.pathlen;
+    cur = cur->next;
+  }
+  for (Tombstone *t = ft->removed; since != 0 && t != NULL; t = t->next) {
+    if (t->version > since) {
+      SavedEntry saved;
+      memset(&saved, 0, sizeof(saved));
+      saved.version = t->version;
+      saved.pathlen = strlen(t->filepath);
+      memcpy(pos, &saved, sizeof(saved));
+      memcpy(pos + sizeof(saved), t->filepath, saved.pathlen);
+      pos += sizeof(saved) + saved.pathlen;
     }
+  }
+  free(entries);
+
+  header.check = save_checksum(buf + sizeof(SaveHeader), header.length);
+  memcpy(buf, &header, sizeof(header));
+
+  size_t total = sizeof(SaveHeader) + header.length;
+  size_t written = fwrite(buf, 1, total, fp);
+  free(buf);
+
+  return (written == total) ? (int) total : -1;
+}
+
+FileTable *filetable_load(const char *buf, size_t len, size_t *used)
+{
+  if (buf == NULL || len < sizeof(SaveHeader)) {
+    return NULL;
+  }
+
+  // the header says how much follows; a record cut short or damaged is
+  // left alone
+  SaveHeader header;
+  memcpy(&header, buf, sizeof(header));
+  if (header.magic != SAVE_MAGIC || header.length > len - sizeof(SaveHeader) ||
+      save_checksum(buf + sizeof(SaveHeader), header.length) != header.check) {
+    return NULL;
+  }
 
-    // followed by the fileinfo
-    if (send(fd, entry->file, sizeof(FileInfo_FS), 0) <= 0) {
-      perror("error sending");
-      return -1;
+  FileTable *table = filetable_init();
+  index_resize(table, header.numfiles > INIT_BUCKETS ? header.numfiles : INIT_BUCKETS);
+  table->version = header.version;
+  table->base = header.base;
+
+  const char *pos = buf + sizeof(SaveHeader);
+  const char *end = pos + header.length;
+  char *path = NULL;
+  size_t pathsize = 0;
+
+  for (uint64_t i = 0; i < (uint64_t) header.numfiles + header.numremoved; i++) {
+    SavedEntry saved;
+    if ((size_t) (end - pos) < sizeof(saved)) {
+      break;
+    }
+    memcpy(&saved, pos, sizeof(saved));
+    pos += sizeof(saved);
+    if ((size_t) (end - pos) < saved.pathlen) {
+      break;
     }
 
-    // and finally all of the peers
-    IP *cur_ip = entry->iphead;
-    while (cur_ip != NULL) {
-      if (send(fd, cur_ip, sizeof(IP), 0) <= 0) {
-        perror("error sending");
-        return -1;
+    // paths are stored without their terminator
+    if (saved.pathlen + 1 > pathsize) {
+      pathsize = saved.pathlen + 1;
+      free(path);
+      path = malloc(pathsize);
+      if (path == NULL) {
+        fprintf(stderr, "malloc\n");
+        exit(1);
       }
-      cur_ip = cur_ip->next;
+    }
+    memcpy(path, pos, saved.pathlen);
+    path[saved.pathlen] = '\0';
+    pos += saved.pathlen;
+
+    // removals follow the entries
+    if (i >= header.numfiles) {
+      char *interned = path_intern(path);
+      tombstone_add(table, interned, 0, saved.version);
+      path_release(interned);
+      continue;
     }
 
-    entry = entry->next;
+    // entries were saved in path order, so they append at the tail
+    entry_append(table, path, saved.last_modified, saved.size, saved.is_dir, saved.version);
+  }
+  free(path);
+
+  if (pos != end) {
+    filetable_destroy(table);
+    return NULL;
+  }
+
+  vlist_build(table);
+
+  if (used != NULL) {
+    *used = sizeof(SaveHeader) + header.length;
+  }
+  return table;
+}
+
+// filetable_restore
+int filetable_restore(FileTable *ft, const char *path, time_t last_modified,
+    unsigned int size, int is_dir, unsigned long version)
+{
+  if (ft == NULL || path == NULL) {
+    return -1;
+  }
+
+  // only ever past the tail, so the list stays in path order
+  if (ft->tail != NULL && strcmp(ft->tail->file->filepath, path) >= 0) {
+    return -1;
   }
 
+  entry_append(ft, path, last_modified, size, is_dir, version);
   return 1;
 }
+
+// filetable_restoreDone
+void filetable_restoreDone(FileTable *ft, unsigned long version)
+{
+  if (ft == NULL) {
+    return;
+  }
+
+  vlist_build(ft);
+  if (version > ft->version) {
+    ft->version = version;
+  }
+}
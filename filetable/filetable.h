@@ -8,43 +8,176 @@
 #ifndef FILETABLE_H
 #define FILETABLE_H
 
-
+#include <stdio.h>
 #include "../monitor/fileinfo.h"
 #include "../monitor/fileevent.h"
+#include "dirtree.h"
+#include "peerset.h"
 
-/*										Structures									*/
-
+// Files listed on fewer peers than this count as thin in DirStats
+#define MIN_REPLICAS 2
 
-// An IP structure
-// Identifies a peer by its ip and port
-typedef struct IP {
-	// Ipaddress useful for up to ipv6
-	char ip[40];
-	// Port number
-	int port;
-	// Next element of the list
-	struct IP *next;
-} IP;
+/*										Structures									*/
 
 // An entry in the FileTable
 typedef struct TableEntry {
 	// Standard fileinfo struct
 	FileInfo_FS *file;
-	// Head of a list of peers
+	// Ids of the peers with the newest version of the file
+	PeerSet peers;
+	// Registry the ids refer to; NULL on detached copies
+	PeerRegistry *registry;
+	// The peers as a list of addresses; only set on copies made by
+	// tableentry_clone, which must outlive the table they came from
 	IP *iphead;
-	// Pointer to build the linked list
+	// Number of peers with the newest version
 	int numpeers;
+	// Pointer to build the linked list
 	struct TableEntry *next;
+	// Previous entry in sorted order, so entries can be unlinked in place
+	struct TableEntry *prev;
+	// Next entry in the same hash bucket
+	struct TableEntry *hnext;
+	// Hash of file->filepath, cached for rehashing
+	unsigned int hash;
+	// Node for this path in the table's directory tree
+	DirNode *node;
+	// Table version of the last change to this entry
+	unsigned long version;
+	// Neighbours in the order entries were last changed, oldest first
+	struct TableEntry *vnext;
+	struct TableEntry *vprev;
+	// What the entry adds to the stats of its node and the directories above
+	DirStats counted;
 } TableEntry;
 
+// A path removed from the FileTable, remembered so the removal can be
+// passed on to peers that haven't seen it yet
+typedef struct Tombstone {
+	// Interned path that was removed
+	char *filepath;
+	// Id the path came by, only a hint for naming it again, or 0
+	uint32_t id;
+	// Table version of the removal
+	unsigned long version;
+	// Next removal, in version order
+	struct Tombstone *next;
+} Tombstone;
+
+// The file metadata of a table, one row per entry in path order, laid out
+// column by column so scans that compare times and sizes read contiguous
+// arrays instead of following each entry to its file
+typedef struct FileColumns {
+	// Number of rows
+	int n;
+	// Paths, from the path pool
+	char **paths;
+	// The paths' ids in the path pool, so runs of rows can be matched a
+	// vector at a time, or NULL to match by path alone
+	uint32_t *ids;
+	time_t *last_modified;
+	unsigned int *sizes;
+	unsigned char *is_dir;
+	// The entry each row came from; NULL for a table kept without entries
+	struct TableEntry **entries;
+	// Table version and size the rows were taken at
+	unsigned long version;
+	int numfiles;
+} FileColumns;
+
+// How a file compares with the table's entry for the same path
+enum FileCompare { FILE_ABSENT, FILE_OLDER, FILE_SAME, FILE_NEWER };
+
+// A list of files lined up with a table's columns by filetable_compare
+typedef struct FileComparison {
+	// Number of files
+	int n;
+	// The files, in path order
+	FileInfo_FS **files;
+	// Each file's row in the table's columns, or -1 if the table hasn't it
+	int *rows;
+	// Each file's enum FileCompare against its row, by modification time
+	unsigned char *result;
+	// Whether each file's size differs from its row's
+	unsigned char *resized;
+	// The table's columns, which belong to the table
+	FileColumns *table;
+	// Whether each of the table's rows has a file lined up with it
+	unsigned char *matched;
+} FileComparison;
+
+// One node of a table's directory tree, with the digest of everything at
+// and below it, as exchanged to find where two sets of files differ
+typedef struct DigestNode {
+	// The node's path, and its entry's metadata if it has one
+	FileInfo_FS *file;
+	// Digest of the entry and everything below it; equal digests mean equal
+	// subtrees
+	uint64_t digest;
+	// Whether the path has an entry of its own, or only things below it
+	int has_entry;
+	// Whether anything is below the path
+	int has_children;
+	struct DigestNode *next;
+} DigestNode;
+
+// Source of versions shared by several tables, so that changes to any of
+// them are ordered against each other
+typedef struct VersionClock {
+	// Last version handed out
+	unsigned long version;
+	pthread_mutex_t lock;
+} VersionClock;
+
 // The FileTable
 typedef struct FileTable {
 	// Total number of files
 	int numfiles;
 
-	// Head of linked list
+	// Head of linked list, kept in sorted path order
 	TableEntry *head;
-	// Last modified?
+	// Last entry of the list, so sorted input appends in constant time
+	TableEntry *tail;
+	// Last entry inserted, where the next sorted insert resumes its walk
+	TableEntry *cursor;
+
+	// Path hash index over the same entries
+	TableEntry **buckets;
+	int nbuckets;
+	// Directory tree over the same entries, for subtree operations
+	DirTree *tree;
+	// Ids of every peer listed in the table
+	PeerRegistry *peers;
+
+	// Version of the table, advanced by every change
+	unsigned long version;
+	// Clock the versions come from if shared with other tables, else NULL
+	VersionClock *clock;
+	// Oldest version changes can be listed from; removals up to it have been
+	// forgotten. For a table of changes, the version they apply on top of
+	unsigned long base;
+	// Entries in the order they were last changed, oldest first
+	TableEntry *vhead;
+	TableEntry *vtail;
+	// Removals after base, oldest first
+	Tombstone *removed;
+	Tombstone *removedtail;
+	int numremoved;
+
+	// Column-wise copy of the entries, kept until the table changes
+	FileColumns *columns;
+	// Version and size the tree's digests were summed at
+	unsigned long digested;
+	int digestfiles;
+
+	// Removed entries kept for reuse
+	TableEntry *spare;
+	int numspare;
+
+	// References to a snapshot, counted under lock; 0 for a live table
+	int refs;
+	// Latest snapshot of a live table, reused until the table changes
+	struct FileTable *snap;
 
 	pthread_mutex_t *lock;
 } FileTable;
@@ -53,6 +186,8 @@ typedef struct FileTable {
 
 /*
  * Makes a copy of a table entry and returns it.
+ * The copy lists its peers in iphead, so it stays valid after the table
+ * it came from is changed or destroyed.
  */
 TableEntry *tableentry_clone(TableEntry *entry);
 
@@ -87,6 +222,15 @@ void filetable_destroy(FileTable *ft);
  */
 int filetable_insert(FileTable *ft, FileInfo_FS *file, char *creationip, int creationport);
 
+/*
+ * filetable_bulkload
+ *  Inserts a list of files, as filetable_insert does for each of them
+ *  The files are sorted first, so loading an empty table takes O(n) after
+ *  the sort; files itself is not reordered
+ * ret: 0 on success, -1 on null arg
+ */
+int filetable_bulkload(FileTable *ft, FileInfo_FS *files, char *creationip, int creationport);
+
 /*
  * filetable_deleteFile
  *  Delete a file from the filetable
@@ -112,11 +256,19 @@ int filetable_addPeer(FileTable *ft, char *filename, char *ip, int port, int siz
 
 /*
  * filetable_removePeerAll
- *  Remove peer from all files it is currently listed on
+ *  Remove peer from all files it is currently listed on, and free its id
  * Ret: 0 on success, -1 on failure
  */
 int filetable_removePeerAll(FileTable *ft, char *ip, int port);
 
+/*
+ * filetable_removePeers
+ *  Remove every peer in a list from all files it is listed on, and free
+ *  their ids, with one walk of the table for them all
+ * Ret: 0 on success, -1 on failure
+ */
+int filetable_removePeers(FileTable *ft, IP *peers);
+
 /*
  * filetable_entryContainsPeer
  * Check if peer is in the listed table entry 
@@ -131,11 +283,20 @@ int filetable_entryContainsPeer(TableEntry *entry, char *ip, int port);
  */
 TableEntry *filetable_getEntry(FileTable *ft, char *filename);
 
+/*
+ * filetable_getDir
+ *  Get the directory tree node for dirname; "" is the root of the table
+ *  Every entry at or below dirname can then be visited in O(subtree) with
+ *    for (DirNode *n = dir; n != NULL; n = dirtree_next(n, dir))
+ * Ret: the node, or NULL if nothing in the table is at or below dirname
+ */
+DirNode *filetable_getDir(FileTable *ft, char *dirname);
+
 /*
  * filetable_getPeers
  *  Finds and returns the peers with the newest version of the file
  * Ret: Linked-list of peers on success, NULL on failure
- *  Do not free the returned linked-list
+ *  The caller must free the returned list with filepeer_destroy
  */
 IP *filetable_getPeers(FileTable *ft, char *filename);
 
@@ -143,17 +304,103 @@ IP *filetable_getPeers(FileTable *ft, char *filename);
  * filetable_merge
  * 	Performs union of provided files and files in the table
  * 	Creates a linked list of FileEvents by which
- * 	files is added to filetable ft
+ * 	files is added to filetable ft, in path order
  */
 FileEvent *filetable_merge(FileTable *ft, FileInfo_FS *files, char *ip, int port);
 
 /*
  * filetable_fileDiff
  * 	Finds the file differences between ft1 and ft2
- * Ret: The file events needed to update ft1 as (ft1 U ft2)
+ * 	Sorts files and merge-joins them with the table in one pass; files
+ * 	itself is not reordered
+ * Ret: The file events needed to update ft1 as (ft1 U ft2), in path order,
+ * 	so directories come before their contents
  */
 FileEvent *filetable_fileDiff(FileTable *ft1, FileInfo_FS *files);
 
+/*
+ * filetable_columns
+ *  The table's file metadata by column, in path order. Built on first use
+ *  and kept until the table changes, so it belongs to the table: it is valid
+ *  until the next change, and the caller holds ft's lock while using it
+ * Ret: the columns, or NULL on null arg
+ */
+FileColumns *filetable_columns(FileTable *ft);
+
+/*
+ * filetable_compare
+ * 	Lines a list of files up with the table's columns in one pass in path
+ * 	order, matching runs of rows by path id, then classifies every file
+ * 	against its row with the vector kernels in colscan.h. files itself is
+ * 	not reordered
+ * Ret: the comparison, to be freed with filecomparison_destroy; it borrows
+ * 	the files and the table's columns, so is valid while both are
+ */
+FileComparison *filetable_compare(FileTable *ft, FileInfo_FS *files);
+
+/*
+ * filecolumns_compare
+ * 	Lines a list of files up with columns taken from any table, as
+ * 	filetable_compare does with a FileTable's
+ * Ret: the comparison, to be freed with filecomparison_destroy; it borrows
+ * 	the files and the columns
+ */
+FileComparison *filecolumns_compare(FileColumns *cols, FileInfo_FS *files);
+
+/*
+ * filecomparison_destroy
+ * 	Frees a comparison made by filetable_compare
+ */
+void filecomparison_destroy(FileComparison *cmp);
+
+/*
+ * filetable_digest
+ *  Digest of the entry at path and everything below it, "" for the whole
+ *  table: the entries' paths, modification times and sizes, combined so
+ *  that two tables with the same digest for a path have the same files
+ *  there. Directories count by path alone, as their contents speak for
+ *  them. Digests are summed for the whole tree on first use and kept until
+ *  the table changes
+ * Ret: the digest, 0 if nothing is at or below path
+ */
+uint64_t filetable_digest(FileTable *ft, char *path);
+
+/*
+ * filetable_digestChildren
+ *  Lists the nodes directly below dirname with their digests, so whoever
+ *  holds the other table can tell which of them differ
+ * Ret: list to be freed with digestnode_destroy_all, NULL if there are none
+ */
+DigestNode *filetable_digestChildren(FileTable *ft, char *dirname);
+
+/*
+ * filetable_addPeerUnder
+ *  Adds the peer at ip/port to the entry at dirname and every entry below
+ *  it, as one change, for a peer known to have exactly those files
+ * Ret: number of entries the peer was added to, -1 on null args
+ */
+int filetable_addPeerUnder(FileTable *ft, char *dirname, char *ip, int port);
+
+/*
+ * digestnode_destroy_all
+ *  Frees a list of digest nodes and their files
+ */
+void digestnode_destroy_all(DigestNode *nodes);
+
+/*
+ * digestnode_encode_all
+ *  Appends a list of digest nodes to a message, preceded by its length, each
+ *  as its file followed by its digest and flags
+ */
+void digestnode_encode_all(WireBuf *w, DigestNode *nodes);
+
+/*
+ * digestnode_decode_all
+ *  Reads a list written by digestnode_encode_all, setting n to its length
+ * Ret: the list, in the order written, or NULL on error or if it is empty
+ */
+DigestNode *digestnode_decode_all(WireReader *r, int *n);
+
 /*
  * filetable_eventmerge
  * 	Performs updates to filetable ft, as directed by events e
@@ -163,6 +410,18 @@ FileEvent *filetable_fileDiff(FileTable *ft1, FileInfo_FS *files);
  */
 void filetable_eventMerge(FileTable *ft, FileEvent *e, char *ip, int port);
 
+/*
+ * filetable_applyEvents
+ * 	Applies a batch of events from the peer at ip/port, leaving the table as
+ * 	filetable_eventMerge would. The events on each path are folded into what
+ * 	they add up to first, so superseded ones cost nothing, and the net
+ * 	changes are made in path order under a single version
+ * Ret: the net changes as events in path order, with their own copies of
+ * 	the files, to be freed with fileevent_destroy_all; NULL if the table
+ * 	didn't change
+ */
+FileEvent *filetable_applyEvents(FileTable *ft, FileEvent *events, char *ip, int port);
+
 /*
  * filetable_getNumPeers
  * Finds and returns the number of peers with the newest version of the file
@@ -170,12 +429,79 @@ void filetable_eventMerge(FileTable *ft, FileEvent *e, char *ip, int port);
  */
 int filetable_getNumPeers(FileTable *ft, char *filename);
 
+/*
+ * filetable_snapshot
+ *  Takes an immutable copy of the entries changed and the paths removed after
+ *  version since, or of every entry if since is 0. The copy can be printed
+ *  and sent with no lock held while ft keeps changing; filetable_encodeChanges
+ *  works on it for any version from since on.
+ *  Snapshots are shared while ft doesn't change, so the caller must hold
+ *  ft's lock, and must release the snapshot with filetable_release
+ * Ret: the snapshot, or NULL if the removals from since have been forgotten
+ */
+FileTable *filetable_snapshot(FileTable *ft, unsigned long since);
+
+/*
+ * filetable_retain
+ *  Takes another reference to a snapshot
+ * Ret: snap
+ */
+FileTable *filetable_retain(FileTable *snap);
+
+/*
+ * filetable_release
+ *  Drops a reference to a snapshot, freeing it with the last one
+ */
+void filetable_release(FileTable *snap);
+
+/*
+ * filetable_trimRemoved
+ *  Forgets removals at or before version, once every peer has seen them
+ *  Changes can no longer be listed from before version afterwards
+ */
+void filetable_trimRemoved(FileTable *ft, unsigned long version);
+
+/*
+ * filetable_applyChanges
+ *  Brings ft up to date with a table of changes received through
+ *  filetable_encodeChanges, removing, adding and updating entries as it says
+ *  Changes already applied are skipped, so a table of changes can overlap
+ *  what ft has seen
+ * Ret: 0 on success, -1 on null arg or if changes starts after ft->version
+ */
+int filetable_applyChanges(FileTable *ft, FileTable *changes);
+
+/*
+ * filetable_combine
+ *  Joins n snapshots of tables that hold no paths in common, like the shards
+ *  of a ShardedTable, into one snapshot at version. Peers are carried over
+ *  by address; the snapshots are left as they are
+ * Ret: the snapshot, which must be released with filetable_release
+ */
+FileTable *filetable_combine(FileTable **snaps, int n, unsigned long version);
+
+/*
+ * filetable_dirStats
+ *  Totals over the entries at and below dirname, "" for the whole table:
+ *  how many, their size, the newest modification time, and how many files
+ *  have fewer than MIN_REPLICAS peers. Kept as the table changes, so this
+ *  is O(depth) rather than a walk of the directory
+ * Ret: the totals, all zero if nothing is there
+ */
+DirStats filetable_dirStats(FileTable *ft, char *dirname);
+
 /*
  * filetable_print
  *  Prints out the filetable
  */
 void filetable_print(FileTable *ft);
 
+/*
+ * filetable_printDir
+ *  Prints out the entries at or below dirname, in no particular order
+ */
+void filetable_printDir(FileTable *ft, char *dirname);
+
 /*
  * filetable_entryprint
  * 	Prints out a TableEntry element
@@ -189,13 +515,71 @@ void filetable_entryprint(TableEntry *entry);
 void filepeer_print(IP *peers);
 
 /*
- * Receives a filetable struct and writes it to a local filetable struct.
+ * filepeer_destroy
+ * 	Frees a linked list of peers
+ */
+void filepeer_destroy(IP *peers);
+
+/*
+ * filetable_decode
+ *  Reads a table written by filetable_encode or filetable_encodeChanges.
+ *  Tables of changes carry the paths removed after the version they apply
+ *  on top of in table->removed; that version isn't part of the table, so
+ *  the caller sets table->base to it
+ * Ret: the table, or NULL if the message doesn't hold a whole table
+ */
+FileTable *filetable_decode(WireReader *r);
+
+/*
+ * filetable_encode
+ *  Appends the whole table to a message
+ */
+void filetable_encode(WireBuf *w, FileTable *table);
+
+/*
+ * filetable_encodeChanges
+ *  Appends, in the same format as filetable_encode, only the entries changed
+ *  and the paths removed after version since
+ * Ret: 1 on success, -2 if changes from since have been forgotten and the
+ *  whole table must be sent instead
+ */
+int filetable_encodeChanges(WireBuf *w, FileTable *table, unsigned long since);
+
+/*
+ * filetable_save
+ *  Writes the entries changed and the paths removed after version since to
+ *  fp as one record, or the whole table if since is 0. Peers are left out;
+ *  they only mean something while they are connected
+ * Ret: bytes written, -1 on error, -2 if changes from since have been
+ *  forgotten and the whole table must be saved instead
+ */
+int filetable_save(FileTable *ft, FILE *fp, unsigned long since);
+
+/*
+ * filetable_load
+ *  Reads back one record written by filetable_save from the len bytes at buf,
+ *  which can be a mapped file. A whole table loads as is; a record of changes
+ *  is brought into a table with filetable_applyChanges
+ * Ret: the table, with no peers, or NULL if buf doesn't start with a whole,
+ *  intact record; used is set to the bytes the record took up
+ */
+FileTable *filetable_load(const char *buf, size_t len, size_t *used);
+
+/*
+ * filetable_restore
+ *  Adds an entry read back from some other store to a table being rebuilt.
+ *  Entries must come in path order, and keep the version they were stored
+ *  with; the table has no peers for them
+ * Ret: 1 on success, -1 if path doesn't sort after the last entry added
  */
-FileTable *filetable_receive(int fd);
+int filetable_restore(FileTable *ft, const char *path, time_t last_modified,
+    unsigned int size, int is_dir, unsigned long version);
 
 /*
- * Sends a filetable struct.
+ * filetable_restoreDone
+ *  Finishes rebuilding a table with filetable_restore, bringing the table
+ *  up to version
  */
-int filetable_send(int fd, FileTable *table);
+void filetable_restoreDone(FileTable *ft, unsigned long version);
 
 #endif //FILETABLE_H
@@ -1,26 +1,708 @@
+/*
+ * filetabletest.c: checks what the file table keeps as it changes: the
+ * version every change is stamped with, the changes and removals listed
+ * after a version, and a copy kept up to date from those alone; and that a
+ * batch of events folded by filetable_applyEvents leaves the table as the
+ * events one at a time would; and that the digests summed over the table's
+ * directories are those of its content alone, and the totals kept for them
+ * those of the entries below
+ *
+ * written by team Fleetwood MAC
+ * CS60, May 2018
+ */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "filetable.h"
+#include "unittest.h"
 
+// peers the random changes come from
+static char *peer_ips[] = {"10.0.0.1", "10.0.0.2", "10.0.0.3"};
+#define NPEERS 3
 
-int main(const int argc, char *argv[])
+// paths the random changes are made to; the directories are always
+// directories and everything else always a file
+static char *dir_paths[] = {"a", "a/x", "b"};
+#define NDIRS 3
+static char *file_paths[] = {"a/f0", "a/f1", "a/f2", "a/x/f0", "a/x/f1", "a/x/f2",
+		"b/f0", "b/f1", "top0", "top1"};
+#define NFILES 10
+
+// a file to insert; the table keeps a copy
+static FileInfo_FS *file_of(char *path, unsigned int size, time_t last_modified, int is_dir)
+{
+	FileInfo_FS *file = fileinfo_init();
+	if (file == NULL || fileinfo_set_path(file, path) < 0) {
+		fprintf(stderr, "malloc\n");
+		exit(1);
+	}
+	file->size = size;
+	file->last_modified = last_modified;
+	file->is_dir = is_dir;
+	return file;
+}
+
+static int insert(FileTable *ft, char *path, unsigned int size, time_t last_modified,
+		int is_dir, char *ip)
+{
+	FileInfo_FS *file = file_of(path, size, last_modified, is_dir);
+	int ret = filetable_insert(ft, file, ip, 5000);
+	fileinfo_destroy(file);
+	return ret;
+}
+
+static int update(FileTable *ft, char *path, unsigned int size, time_t last_modified, char *ip)
+{
+	FileInfo_FS *file = file_of(path, size, last_modified, 0);
+	int ret = filetable_updateMod(ft, file, ip, 5000);
+	fileinfo_destroy(file);
+	return ret;
+}
+
+// appends an event to the list at *tail
+static void add_event(FileEvent ***tail, enum ActionType action, char *path, unsigned int size,
+		time_t last_modified, int is_dir)
+{
+	FileEvent *event = fileevent_init();
+	if (event == NULL) {
+		fprintf(stderr, "malloc\n");
+		exit(1);
+	}
+	event->action = action;
+	event->file = file_of(path, size, last_modified, is_dir);
+	**tail = event;
+	*tail = &event->next;
+}
+
+// one random change: an insert, update, removal or peer coming or going
+static void random_change(FileTable *ft)
+{
+	char *ip = peer_ips[rand() % NPEERS];
+	int is_dir = (rand() % 4 == 0);
+	char *path = is_dir ? dir_paths[rand() % NDIRS] : file_paths[rand() % NFILES];
+	TableEntry *entry = filetable_getEntry(ft, path);
+
+	switch (rand() % 6) {
+	case 0:
+	case 1:
+		insert(ft, path, is_dir ? 0 : rand() % 1000, 1000 + rand() % 1000, is_dir, ip);
+		break;
+	case 2:
+		// sometimes to an older time than it had
+		if (entry != NULL) {
+			update(ft, path, is_dir ? 0 : rand() % 1000, 1000 + rand() % 1000, ip);
+		}
+		break;
+	case 3:
+		filetable_remove(ft, path);
+		break;
+	case 4:
+		if (entry != NULL) {
+			filetable_addPeer(ft, path, ip, 5000, entry->file->size);
+		}
+		break;
+	default:
+		if (rand() % 4 == 0) {
+			filetable_removePeerAll(ft, ip, 5000);
+		}
+		break;
+	}
+}
+
+// whether the tables hold the same entries, and if versions is set,
+// changed at the same versions
+static int same_tables(FileTable *a, FileTable *b, int versions)
+{
+	if (a->numfiles != b->numfiles || (versions && a->version != b->version)) {
+		return 0;
+	}
+	TableEntry *x = a->head, *y = b->head;
+	for (; x != NULL && y != NULL; x = x->next, y = y->next) {
+		if (strcmp(x->file->filepath, y->file->filepath) != 0 || x->file->size != y->file->size ||
+				x->file->last_modified != y->file->last_modified ||
+				x->file->is_dir != y->file->is_dir || (versions && x->version != y->version) ||
+				x->numpeers != y->numpeers) {
+			return 0;
+		}
+		for (int i = 0; i < NPEERS; i++) {
+			if (filetable_entryContainsPeer(x, peer_ips[i], 5000) !=
+					filetable_entryContainsPeer(y, peer_ips[i], 5000)) {
+				return 0;
+			}
+		}
+	}
+	return x == NULL && y == NULL;
+}
+
+// the version a snapshot's tombstone for path has, or 0 if it hasn't one
+static unsigned long removed_at(FileTable *snap, char *path)
+{
+	for (Tombstone *t = snap->removed; t != NULL; t = t->next) {
+		if (strcmp(t->filepath, path) == 0) {
+			return t->version;
+		}
+	}
+	return 0;
+}
+
+static void test_versions()
+{
+	FileTable *ft = filetable_init();
+	CHECK(ft->version == 0 && ft->numfiles == 0, "a new table is empty at version 0");
+
+	// each change takes the next version, and stamps the entry with it
+	CHECK(insert(ft, "docs", 0, 100, 1, "10.0.0.1") == 0, "insert a new path");
+	insert(ft, "docs/b", 10, 100, 0, "10.0.0.1");
+	CHECK(ft->version == 2 && ft->numfiles == 2, "one version per insert");
+	CHECK(filetable_getEntry(ft, "docs/b")->version == 2, "entry has its insert's version");
+	CHECK(strcmp(ft->head->file->filepath, "docs") == 0 &&
+			strcmp(ft->head->next->file->filepath, "docs/b") == 0, "entries in path order");
+
+	// inserting it again updates it
+	CHECK(insert(ft, "docs/b", 20, 200, 0, "10.0.0.2") == 1, "insert of a path the table has");
+	TableEntry *b = filetable_getEntry(ft, "docs/b");
+	CHECK(ft->numfiles == 2 && b->version == 3 && b->file->size == 20 &&
+			filetable_entryContainsPeer(b, "10.0.0.2", 5000) && b->numpeers == 1,
+			"insert over a path updates it, from the inserting peer");
+
+	// a peer with the whole file is added once; one without isn't
+	CHECK(filetable_addPeer(ft, "docs/b", "10.0.0.1", 5000, 20) == 0 && b->numpeers == 2 &&
+			ft->version == 4 && b->version == 4, "peer with the file added");
+	filetable_addPeer(ft, "docs/b", "10.0.0.1", 5000, 20);
+	CHECK(b->numpeers == 2 && ft->version == 4, "peer added twice is no change");
+	filetable_addPeer(ft, "docs/b", "10.0.0.3", 5000, 19);
+	CHECK(b->numpeers == 2 && ft->version == 4, "peer with the wrong size isn't added");
+
+	// an update leaves the updating peer the only one
+	CHECK(update(ft, "docs/b", 30, 300, "10.0.0.3") == 0 && b->numpeers == 1 &&
+			filetable_entryContainsPeer(b, "10.0.0.3", 5000) && b->version == 5,
+			"update leaves only the updating peer");
+	CHECK(update(ft, "docs/none", 30, 300, "10.0.0.3") == -1 && ft->version == 5,
+			"update of a path the table hasn't");
+
+	// no change, no version
+	CHECK(filetable_remove(ft, "docs/none") == -1 && ft->version == 5,
+			"removal of a path the table hasn't");
+	CHECK(insert(ft, ".hidden", 1, 1, 0, "10.0.0.1") == 1 && ft->numfiles == 2 &&
+			ft->version == 5, "dotfiles are left out");
+
+	// a peer leaving changes every entry it was on at one version
+	filetable_addPeer(ft, "docs", "10.0.0.3", 5000, 0);
+	CHECK(ft->version == 6, "peer added to the directory");
+	filetable_removePeerAll(ft, "10.0.0.3", 5000);
+	CHECK(ft->version == 7 && b->version == 7 && filetable_getEntry(ft, "docs")->version == 7 &&
+			b->numpeers == 0 && filetable_getNumPeers(ft, "docs") == 1,
+			"peer leaving changes its entries at one version");
+	filetable_removePeerAll(ft, "10.0.0.9", 5000);
+	CHECK(ft->version == 7, "peer that was never there");
+
+	filetable_destroy(ft);
+}
+
+static void test_changes()
+{
+	FileTable *ft = filetable_init();
+	insert(ft, "docs", 0, 100, 1, "10.0.0.1");
+	insert(ft, "docs/a", 10, 100, 0, "10.0.0.1");
+	insert(ft, "docs/b", 10, 100, 0, "10.0.0.1");
+	insert(ft, "docs/sub", 0, 100, 1, "10.0.0.1");
+	insert(ft, "docs/sub/c", 10, 100, 0, "10.0.0.1");
+	insert(ft, "notes", 10, 100, 0, "10.0.0.1");
+	unsigned long since = ft->version;
+
+	// the whole table
+	FileTable *snap = filetable_snapshot(ft, 0);
+	CHECK(snap != NULL && snap->numfiles == 6 && snap->numremoved == 0 &&
+			snap->version == ft->version, "snapshot of the whole table");
+	filetable_release(snap);
+
+	// just what changed after since
+	update(ft, "docs/a", 20, 200, "10.0.0.2");
+	filetable_remove(ft, "notes");
+	snap = filetable_snapshot(ft, since);
+	CHECK(snap != NULL && snap->numfiles == 1 && filetable_getEntry(snap, "docs/a") != NULL &&
+			filetable_getEntry(snap, "docs/a")->file->size == 20, "snapshot holds the change");
+	CHECK(snap != NULL && snap->numremoved == 1 && removed_at(snap, "notes") == ft->version,
+			"snapshot holds the removal");
+	CHECK(snap != NULL && snap->base == since && snap->version == ft->version,
+			"snapshot is of the changes after since");
+	filetable_release(snap);
+
+	// removing a directory removes everything below, at one version
+	unsigned long before = ft->version;
+	filetable_remove(ft, "docs");
+	unsigned long gone = ft->version;
+	CHECK(gone == before + 1 && ft->numfiles == 0 && ft->head == NULL,
+			"directory removal takes everything below");
+	CHECK(filetable_getEntry(ft, "docs/sub/c") == NULL && filetable_getDir(ft, "docs") == NULL,
+			"nothing left below the directory");
+	snap = filetable_snapshot(ft, before);
+	CHECK(snap != NULL && snap->numfiles == 0 && snap->numremoved == 5 &&
+			removed_at(snap, "docs") == gone && removed_at(snap, "docs/a") == gone &&
+			removed_at(snap, "docs/b") == gone && removed_at(snap, "docs/sub") == gone &&
+			removed_at(snap, "docs/sub/c") == gone, "a tombstone for each path below");
+	filetable_release(snap);
+
+	// once the removals are forgotten, changes from before can't be listed
+	filetable_trimRemoved(ft, gone);
+	CHECK(ft->numremoved == 0 && ft->base == gone, "removals forgotten");
+	CHECK(filetable_snapshot(ft, since) == NULL, "no snapshot from before the trim");
+	WireBuf w = {.fd = -1};
+	CHECK(filetable_encodeChanges(&w, ft, since) == -2, "no changes from before the trim");
+	snap = filetable_snapshot(ft, gone);
+	CHECK(snap != NULL && snap->numfiles == 0, "snapshot from the trim");
+	filetable_release(snap);
+	wire_free(&w);
+
+	filetable_destroy(ft);
+}
+
+// brings copy up to date with the changes ft lists after copy's version
+static int catch_up(FileTable *copy, FileTable *ft)
+{
+	WireBuf w = {.fd = -1};
+	unsigned long since = copy->version;
+	if (filetable_encodeChanges(&w, ft, since) < 0) {
+		wire_free(&w);
+		return -1;
+	}
+
+	WireReader r;
+	memset(&r, 0, sizeof(r));
+	r.data = w.data;
+	r.len = w.len;
+	r.fd = -1;
+	FileTable *changes = filetable_decode(&r);
+	int ret = -1;
+	if (changes != NULL && wire_done(&r)) {
+		changes->base = since;
+		ret = filetable_applyChanges(copy, changes);
+	}
+	filetable_destroy(changes);
+	wire_release(&r);
+	wire_free(&w);
+	return ret;
+}
+
+static void test_replica()
+{
+	srand(5);
+	FileTable *ft = filetable_init();
+	FileTable *copy = filetable_init();
+
+	// kept up to date from the changes alone, at every step and after runs
+	// of them, with the removals forgotten as soon as the copy has them
+	int ok = 1;
+	for (int i = 0; i < 3000; i++) {
+		random_change(ft);
+		if (i % 7 == 0 || i > 2500) {
+			ok &= (catch_up(copy, ft) == 0 && same_tables(copy, ft, 1));
+			if (rand() % 2 == 0) {
+				filetable_trimRemoved(ft, copy->version);
+			}
+		}
+	}
+	CHECK(ok, "copy kept up to date from the changes");
+
+	// changes applied twice are skipped
+	WireBuf w = {.fd = -1};
+	filetable_encode(&w, ft);
+	WireReader r;
+	memset(&r, 0, sizeof(r));
+	r.data = w.data;
+	r.len = w.len;
+	r.fd = -1;
+	FileTable *whole = filetable_decode(&r);
+	CHECK(whole != NULL && filetable_applyChanges(copy, whole) == 0 && same_tables(copy, ft, 1),
+			"changes the copy has are skipped");
+	wire_release(&r);
+
+	// changes after a version the copy hasn't reached are turned down
+	if (whole != NULL) {
+		whole->base = copy->version + 1;
+		unsigned long version = copy->version;
+		CHECK(filetable_applyChanges(copy, whole) == -1 && copy->version == version,
+				"changes after a version the copy hasn't");
+	}
+	filetable_destroy(whole);
+	wire_free(&w);
+
+	filetable_destroy(copy);
+	filetable_destroy(ft);
+}
+
+// the number of events in a list
+static int count_events(FileEvent *events)
 {
-	filetable_print(NULL);
+	int n = 0;
+	for (; events != NULL; events = events->next) {
+		n++;
+	}
+	return n;
+}
+
+// whether every entry changed after version was changed at version + 1
+static int one_version(FileTable *ft, unsigned long version)
+{
+	for (TableEntry *cur = ft->head; cur != NULL; cur = cur->next) {
+		if (cur->version > version && cur->version != version + 1) {
+			return 0;
+		}
+	}
+	for (Tombstone *t = ft->removed; t != NULL; t = t->next) {
+		if (t->version > version && t->version != version + 1) {
+			return 0;
+		}
+	}
+	return ft->version == version + 1;
+}
+
+static void test_folding()
+{
+	FileTable *ft = filetable_init();
+	insert(ft, "docs", 0, 100, 1, "10.0.0.1");
+	insert(ft, "docs/a", 10, 100, 0, "10.0.0.1");
+	filetable_addPeer(ft, "docs/a", "10.0.0.2", 5000, 10);
+	unsigned long version = ft->version;
+
+	// a path created, modified and deleted in one batch comes to nothing
+	FileEvent *events = NULL, **tail = &events;
+	add_event(&tail, FILE_CREATED, "docs/new", 10, 200, 0);
+	add_event(&tail, FILE_MODIFIED, "docs/new", 20, 300, 0);
+	add_event(&tail, FILE_DELETED, "docs/new", 20, 300, 0);
+	FileEvent *net = filetable_applyEvents(ft, events, "10.0.0.3", 5000);
+	CHECK(net == NULL && ft->version == version && ft->numfiles == 2 &&
+			filetable_getEntry(ft, "docs/new") == NULL, "create, modify, delete is no change");
+	fileevent_destroy_all(events);
+
+	// created then modified is one creation, with the last size and time
+	events = NULL;
+	tail = &events;
+	add_event(&tail, FILE_CREATED, "docs/new", 10, 200, 0);
+	add_event(&tail, FILE_MODIFIED, "docs/new", 20, 300, 0);
+	net = filetable_applyEvents(ft, events, "10.0.0.3", 5000);
+	TableEntry *entry = filetable_getEntry(ft, "docs/new");
+	CHECK(count_events(net) == 1 && net->action == FILE_CREATED && net->file->size == 20 &&
+			net->file->last_modified == 300, "create, modify is one creation");
+	CHECK(entry != NULL && entry->file->size == 20 && entry->numpeers == 1 &&
+			filetable_entryContainsPeer(entry, "10.0.0.3", 5000) && one_version(ft, version),
+			"created with the last size, from the peer");
+	fileevent_destroy_all(events);
+	fileevent_destroy_all(net);
+	version = ft->version;
+
+	// deleted then created again is a modification from the one peer
+	events = NULL;
+	tail = &events;
+	add_event(&tail, FILE_DELETED, "docs/a", 10, 100, 0);
+	add_event(&tail, FILE_CREATED, "docs/a", 10, 100, 0);
+	net = filetable_applyEvents(ft, events, "10.0.0.3", 5000);
+	entry = filetable_getEntry(ft, "docs/a");
+	CHECK(count_events(net) == 1 && net->action == FILE_MODIFIED && entry != NULL &&
+			entry->numpeers == 1 && filetable_entryContainsPeer(entry, "10.0.0.3", 5000) &&
+			one_version(ft, version), "delete, create is a modification");
+	fileevent_destroy_all(events);
+	fileevent_destroy_all(net);
+	version = ft->version;
+
+	// a download of the whole file adds the peer, once
+	events = NULL;
+	tail = &events;
+	add_event(&tail, DOWNLOAD_COMPLETE, "docs/a", 10, 100, 0);
+	add_event(&tail, DOWNLOAD_COMPLETE, "docs/a", 10, 100, 0);
+	net = filetable_applyEvents(ft, events, "10.0.0.1", 5000);
+	CHECK(count_events(net) == 1 && net->action == DOWNLOAD_COMPLETE && entry->numpeers == 2 &&
+			filetable_entryContainsPeer(entry, "10.0.0.1", 5000) && one_version(ft, version),
+			"download complete adds the peer");
+	fileevent_destroy_all(net);
+	version = ft->version;
+	net = filetable_applyEvents(ft, events, "10.0.0.1", 5000);
+	CHECK(net == NULL && ft->version == version && entry->numpeers == 2,
+			"download complete from a peer with the file");
+	fileevent_destroy_all(events);
+
+	// but not of some other size
+	events = NULL;
+	tail = &events;
+	add_event(&tail, DOWNLOAD_COMPLETE, "docs/a", 11, 100, 0);
+	net = filetable_applyEvents(ft, events, "10.0.0.2", 5000);
+	CHECK(net == NULL && ft->version == version && entry->numpeers == 2,
+			"download complete of the wrong size");
+	fileevent_destroy_all(events);
+
+	// changes to several paths, and a directory taking them along, share
+	// one version
+	events = NULL;
+	tail = &events;
+	add_event(&tail, FILE_MODIFIED, "docs/a", 30, 400, 0);
+	add_event(&tail, FILE_CREATED, "notes", 10, 400, 0);
+	add_event(&tail, FILE_DELETED, "docs", 0, 100, 1);
+	add_event(&tail, FILE_CREATED, "docs/b", 10, 400, 0);
+	net = filetable_applyEvents(ft, events, "10.0.0.2", 5000);
+	CHECK(ft->numfiles == 2 && filetable_getEntry(ft, "notes") != NULL &&
+			filetable_getEntry(ft, "docs/b") != NULL && filetable_getEntry(ft, "docs/a") == NULL &&
+			one_version(ft, version), "batch with a directory removal at one version");
+	fileevent_destroy_all(events);
+	fileevent_destroy_all(net);
+
+	filetable_destroy(ft);
+}
+
+// a random batch of events from one peer, on the random paths
+static FileEvent *random_events(FileTable *ft, int n)
+{
+	FileEvent *events = NULL, **tail = &events;
+	for (int i = 0; i < n; i++) {
+		int is_dir = (rand() % 6 == 0);
+		char *path = is_dir ? dir_paths[rand() % NDIRS] : file_paths[rand() % NFILES];
+		unsigned int size = is_dir ? 0 : rand() % 3;
+		TableEntry *entry = filetable_getEntry(ft, path);
+		if (entry != NULL && rand() % 2 == 0) {
+			size = entry->file->size;
+		}
+		int action = rand() % 4;
+		add_event(&tail, action == 0 ? FILE_CREATED : action == 1 ? FILE_MODIFIED :
+				action == 2 ? FILE_DELETED : DOWNLOAD_COMPLETE, path, size,
+				1000 + rand() % 3, is_dir);
+	}
+	return events;
+}
+
+static void test_batches()
+{
+	// the same table three times over: one taking batches folded, one the
+	// same events one at a time, and one the folded batches' net changes
+	FileTable *tables[3];
+	for (int t = 0; t < 3; t++) {
+		srand(9);
+		tables[t] = filetable_init();
+		for (int i = 0; i < 200; i++) {
+			random_change(tables[t]);
+		}
+	}
+	FileTable *folded = tables[0], *merged = tables[1], *replayed = tables[2];
+
+	int same = 1, shared = 1, quiet = 1;
+	for (int i = 0; i < 2000; i++) {
+		char *ip = peer_ips[rand() % NPEERS];
+		FileEvent *events = random_events(folded, 1 + rand() % 12);
+		unsigned long version = folded->version;
+
+		FileEvent *net = filetable_applyEvents(folded, events, ip, 5000);
+		filetable_eventMerge(merged, events, ip, 5000);
+		filetable_eventMerge(replayed, net, ip, 5000);
+		same &= same_tables(folded, merged, 0) && same_tables(folded, replayed, 0);
+		shared &= (net == NULL || one_version(folded, version));
+		quiet &= (net != NULL || folded->version == version);
+
+		fileevent_destroy_all(events);
+		fileevent_destroy_all(net);
+	}
+	CHECK(same, "folded batches leave the table as the events one at a time");
+	CHECK(shared, "a batch's changes share one version");
+	CHECK(quiet, "a batch that changes nothing takes no version");
+
+	for (int t = 0; t < 3; t++) {
+		filetable_destroy(tables[t]);
+	}
+}
+
+// a new table of the same files as ft, inserted in a different order
+static FileTable *rebuilt(FileTable *ft)
+{
+	FileTable *copy = filetable_init();
+	for (int pass = 0; pass < 2; pass++) {
+		int i = 0;
+		for (TableEntry *cur = ft->head; cur != NULL; cur = cur->next, i++) {
+			if (i % 2 != pass) {
+				filetable_insert(copy, cur->file, "10.0.0.9", 5000);
+			}
+		}
+	}
+	return copy;
+}
+
+// whether each of dirname's children has the digest its path has
+static int children_agree(FileTable *ft, char *dirname)
+{
+	int ok = 1;
+	DigestNode *nodes = filetable_digestChildren(ft, dirname);
+	for (DigestNode *node = nodes; node != NULL; node = node->next) {
+		char *path = node->file->filepath;
+		ok &= (node->digest == filetable_digest(ft, path));
+		ok &= (node->has_entry == (filetable_getEntry(ft, path) != NULL));
+		ok &= (node->has_children == (filetable_getDir(ft, path)->children != NULL));
+	}
+	digestnode_destroy_all(nodes);
+	return ok;
+}
+
+static void test_digests()
+{
+	srand(11);
+	FileTable *ft = filetable_init();
+	char *dirs[] = {"", "a", "a/x", "b"};
+	int ndirs = 4;
+
+	// whatever changes got it there, a table's digests are those of a table
+	// built from its files afresh; taking them as it goes keeps them cached
+	int same = 1, children = 1;
+	for (int i = 0; i < 2000; i++) {
+		random_change(ft);
+		uint64_t root = filetable_digest(ft, "");
+		if (i % 10 == 0) {
+			FileTable *fresh = rebuilt(ft);
+			for (int d = 0; d < ndirs; d++) {
+				same &= (filetable_digest(ft, dirs[d]) == filetable_digest(fresh, dirs[d]));
+			}
+			same &= (root == filetable_digest(fresh, ""));
+			filetable_destroy(fresh);
+			children &= children_agree(ft, "") && children_agree(ft, "a");
+		}
+	}
+	CHECK(same, "digests are those of the same files afresh");
+	CHECK(children, "children's digests are their paths'");
+
+	// a change shows in every directory above it and nowhere else, and
+	// undoing it brings the digests back
+	insert(ft, "a/x/f0", 5, 1500, 0, "10.0.0.1");
+	insert(ft, "b/f0", 5, 1500, 0, "10.0.0.1");
+	uint64_t root = filetable_digest(ft, ""), a = filetable_digest(ft, "a");
+	uint64_t x = filetable_digest(ft, "a/x"), b = filetable_digest(ft, "b");
+	update(ft, "a/x/f0", 6, 1500, "10.0.0.1");
+	CHECK(filetable_digest(ft, "") != root && filetable_digest(ft, "a") != a &&
+			filetable_digest(ft, "a/x") != x && filetable_digest(ft, "b") == b,
+			"size change shows above the file");
+	update(ft, "a/x/f0", 5, 1501, "10.0.0.1");
+	CHECK(filetable_digest(ft, "a/x") != x, "time change shows above the file");
+	update(ft, "a/x/f0", 5, 1500, "10.0.0.2");
+	CHECK(filetable_digest(ft, "") == root && filetable_digest(ft, "a/x") == x,
+			"same content, same digest, whoever has it");
+	filetable_remove(ft, "a/x/f0");
+	CHECK(filetable_digest(ft, "a") != a && filetable_digest(ft, "b") == b,
+			"removal shows above the file");
+	insert(ft, "a/x/f0", 5, 1500, 0, "10.0.0.1");
+	CHECK(filetable_digest(ft, "") == root, "put back, same digest");
+	CHECK(filetable_digest(ft, "nowhere") == 0, "path with nothing at it");
+
+	filetable_destroy(ft);
+}
+
+// dirname's totals worked out from every entry, the slow way
+static DirStats stats_of(FileTable *ft, char *dirname)
+{
+	DirStats stats;
+	memset(&stats, 0, sizeof(stats));
+	size_t len = strlen(dirname);
+	for (TableEntry *cur = ft->head; cur != NULL; cur = cur->next) {
+		char *path = cur->file->filepath;
+		if (len > 0 && (strncmp(path, dirname, len) != 0 || (path[len] != '\0' && path[len] != '/'))) {
+			continue;
+		}
+		stats.files++;
+		stats.bytes += cur->file->size;
+		if (cur->file->last_modified > stats.newest) {
+			stats.newest = cur->file->last_modified;
+		}
+		stats.thin += !cur->file->is_dir && cur->numpeers < MIN_REPLICAS;
+	}
+	return stats;
+}
+
+static int same_stats(DirStats a, DirStats b)
+{
+	return a.files == b.files && a.bytes == b.bytes && a.newest == b.newest && a.thin == b.thin;
+}
+
+static void test_stats()
+{
+	srand(13);
 	FileTable *ft = filetable_init();
-	filetable_print(ft);
-	filetable_insert(ft, "/Usrs/", 10, 100, "0.0.0.0", 5000);
-	filetable_print(ft);
-	filetable_addPeer(ft, "/Usrs/", "0.0.0.1", 5000);
-	filetable_print(ft);
-	filetable_insert(ft, "/Usrs/b", 10, 100, "0.0.0.0", 5000);
-	filetable_print(ft);
-	filetable_updateMod(ft, "/Usrs/", 50, 500, "0.0.0.1", 5000);
-	filetable_print(ft);
-	filetable_entryprint(filetable_getEntry(ft, "/Usrs/"));
-	filetable_insert(ft, "/Usrs/a", 10, 100, "0.0.0.0", 5000);
-	filetable_print(ft);
-	filetable_remove(ft, "/Usrs/");
-	filetable_print(ft);
+	char *dirs[] = {"", "a", "a/x", "b"};
+	int ndirs = 4;
+
+	FileTable *copy = filetable_init();
+
+	// changed one at a time, in batches, and from a table of changes, and
+	// asked for now and then, so the newest times go stale in between
+	int ok = 1;
+	for (int i = 0; i < 5000; i++) {
+		if (i % 3 == 0) {
+			FileEvent *events = random_events(ft, 1 + rand() % 6);
+			fileevent_destroy_all(filetable_applyEvents(ft, events, peer_ips[rand() % NPEERS], 5000));
+			fileevent_destroy_all(events);
+		}
+		else {
+			random_change(ft);
+		}
+		if (i % 10 == 0) {
+			catch_up(copy, ft);
+		}
+		if (rand() % 5 == 0) {
+			char *dir = dirs[rand() % ndirs];
+			ok &= same_stats(filetable_dirStats(ft, dir), stats_of(ft, dir));
+			ok &= same_stats(filetable_dirStats(copy, dir), stats_of(copy, dir));
+		}
+	}
+	for (int d = 0; d < ndirs; d++) {
+		ok &= same_stats(filetable_dirStats(ft, dirs[d]), stats_of(ft, dirs[d]));
+	}
+	CHECK(ok, "totals are those of the entries below");
+	filetable_destroy(copy);
 	filetable_destroy(ft);
+
+	ft = filetable_init();
+	insert(ft, "a", 0, 100, 1, "10.0.0.1");
+	insert(ft, "a/x", 0, 100, 1, "10.0.0.1");
+	insert(ft, "a/x/f0", 10, 300, 0, "10.0.0.1");
+	insert(ft, "a/f0", 20, 200, 0, "10.0.0.1");
+	DirStats stats = filetable_dirStats(ft, "a");
+	CHECK(stats.files == 4 && stats.bytes == 30 && stats.newest == 300 && stats.thin == 2,
+			"totals of a directory");
+
+	// the newest going back in time, or away, leaves the next newest
+	update(ft, "a/x/f0", 10, 150, "10.0.0.1");
+	CHECK(filetable_dirStats(ft, "a").newest == 200 && filetable_dirStats(ft, "a/x").newest == 150,
+			"newest after it is set back");
+	filetable_remove(ft, "a/f0");
+	CHECK(filetable_dirStats(ft, "a").newest == 150 && filetable_dirStats(ft, "a").files == 3,
+			"newest after it is removed");
+	filetable_remove(ft, "a/x/f0");
+	filetable_remove(ft, "a/x");
+	CHECK(same_stats(filetable_dirStats(ft, "a"), stats_of(ft, "a")) &&
+			filetable_dirStats(ft, "a").newest == 100, "newest left with the directory alone");
+
+	// a second peer makes a file no longer thin, and its leaving thin again
+	insert(ft, "a/f1", 5, 100, 0, "10.0.0.1");
+	filetable_addPeer(ft, "a/f1", "10.0.0.2", 5000, 5);
+	CHECK(filetable_dirStats(ft, "a").thin == 0, "file on two peers isn't thin");
+	IP peer;
+	memset(&peer, 0, sizeof(peer));
+	strcpy(peer.ip, "10.0.0.2");
+	peer.port = 5000;
+	filetable_removePeers(ft, &peer);
+	CHECK(filetable_dirStats(ft, "a").thin == 1 && filetable_dirStats(ft, "").thin == 1,
+			"file thin again once a peer leaves");
+
+	// removing the directory takes its totals from above it
+	filetable_remove(ft, "a");
+	stats = filetable_dirStats(ft, "");
+	CHECK(stats.files == 0 && stats.bytes == 0 && stats.newest == 0 && stats.thin == 0,
+			"nothing left");
+	filetable_destroy(ft);
+}
+
+int main(const int argc, char *argv[])
+{
+	test_versions();
+	test_changes();
+	test_replica();
+	test_folding();
+	test_batches();
+	test_digests();
+	test_stats();
+
+	return check_report("filetabletest");
 }
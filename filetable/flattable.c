@@ -0,0 +1,904 @@
+/*
+ * flattable.c for laying a file table out flat in one buffer
+ *
+ * written by team Fleetwood MAC
+ * CS60, May 2018
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "flattable.h"
+#include "../monitor/pathpool.h"
+
+
+// sections start on this boundary, so the rows can be read where they lie
+#define ALIGN 8
+
+// bits in each word of a row's peer set, as in peerset.c
+#define WORD_BITS 32
+
+// A buffer grown as a section is read, before its size is known
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} Stretch;
+
+// A removal as read, with its path, to be sorted into path order
+typedef struct {
+  const char *path;
+  FlatRow row;
+} Removal;
+
+
+/*          Local function declarations           */
+
+static char *image_alloc(FlatHeader *header, uint64_t nstrings);
+static FlatTable *image_view(const char *buf, int own);
+static int image_check(FlatTable *t);
+static int section_fits(const FlatHeader *header, uint64_t offset, uint64_t count,
+    uint64_t size, uint64_t *end);
+static int row_check(FlatTable *t, const FlatRow *row, const FlatRow *prev);
+static uint32_t image_checksum(const char *buf, size_t length);
+static void *stretch(Stretch *s, size_t len);
+static uint64_t string_add(Stretch *strings, const char *path, uint32_t *pathlen);
+static int slot_find(const FlatSlot *slots, int nslots, const char *ip, int port);
+static int slot_put(FlatSlot *slots, int *nslots, const FlatSlot *slot);
+static int removed_after(FlatTable *changes, int *k, const char *path, uint64_t version);
+static int remapped_words(FlatTable *t, const FlatRow *row, const int *remap, uint32_t *words);
+static IP *row_peerlist(FlatTable *t, const FlatRow *row);
+static int compare_removal(const void *a, const void *b);
+static void columns_free(FileColumns *cols);
+
+
+/*      Public functions                */
+
+// flattable_build
+FlatTable *flattable_build(FileTable *ft)
+{
+  if (ft == NULL) {
+    return NULL;
+  }
+
+  FlatHeader header;
+  memset(&header, 0, sizeof(header));
+  header.numfiles = ft->numfiles;
+  header.version = ft->version;
+
+  uint64_t nstrings = 0;
+  for (TableEntry *cur = ft->head; cur != NULL; cur = cur->next) {
+    nstrings += strlen(cur->file->filepath) + 1;
+  }
+  char *buf = image_alloc(&header, nstrings);
+
+  // the list is in path order, so the rows come out sorted
+  FlatRow *rows = (FlatRow *) (buf + header.rows);
+  char *strings = buf + header.strings;
+  uint64_t pos = 0;
+  int i = 0;
+  for (TableEntry *cur = ft->head; cur != NULL; cur = cur->next, i++) {
+    FlatRow *row = &rows[i];
+    row->version = cur->version;
+    row->last_modified = cur->file->last_modified;
+    row->size = cur->file->size;
+    row->is_dir = (cur->file->is_dir != 0);
+    row->id = cur->file->id;
+    row->pathlen = strlen(cur->file->filepath);
+    row->path = pos;
+    memcpy(strings + pos, cur->file->filepath, row->pathlen + 1);
+    pos += row->pathlen + 1;
+  }
+
+  return image_view(buf, 1);
+}
+
+// flattable_write
+int flattable_write(FlatTable *t, FILE *fp)
+{
+  if (t == NULL || fp == NULL) {
+    return -1;
+  }
+
+  FlatHeader header = *t->header;
+  size_t rest = t->len - sizeof(header);
+  header.check = image_checksum(t->buf, t->len);
+  if (fwrite(&header, sizeof(header), 1, fp) != 1 ||
+      fwrite(t->buf + sizeof(header), 1, rest, fp) != rest) {
+    return -1;
+  }
+
+  return (int) t->len;
+}
+
+// flattable_open
+FlatTable *flattable_open(const char *buf, size_t len, int own)
+{
+  if (buf == NULL || len < sizeof(FlatHeader) || (uintptr_t) buf % ALIGN != 0) {
+    return NULL;
+  }
+
+  // the header says where everything is; check that the sections lie inside
+  // the buffer, one after another, before reading any of them
+  const FlatHeader *header = (const FlatHeader *) buf;
+  uint64_t end = sizeof(FlatHeader);
+  if (header->magic != FLAT_MAGIC || header->length < sizeof(FlatHeader) ||
+      header->length > len ||
+      !section_fits(header, header->rows, header->numfiles, sizeof(FlatRow), &end) ||
+      !section_fits(header, header->removed, header->numremoved, sizeof(FlatRow), &end) ||
+      !section_fits(header, header->words, header->nwords, sizeof(uint32_t), &end) ||
+      !section_fits(header, header->slots, header->nslots, sizeof(FlatSlot), &end) ||
+      !section_fits(header, header->strings, 0, 1, &end) ||
+      image_checksum(buf, header->length) != header->check) {
+    return NULL;
+  }
+
+  FlatTable *t = image_view(buf, own);
+  if (image_check(t) < 0) {
+    t->own = 0;
+    flattable_destroy(t);
+    return NULL;
+  }
+
+  return t;
+}
+
+// flattable_destroy
+void flattable_destroy(FlatTable *t)
+{
+  if (t == NULL) {
+    return;
+  }
+
+  if (t->own) {
+    free((char *) t->buf);
+  }
+  columns_free(t->columns);
+  free(t);
+}
+
+// flattable_find
+int flattable_find(FlatTable *t, const char *path)
+{
+  if (t == NULL || path == NULL) {
+    return -1;
+  }
+
+  int lo = 0;
+  int hi = t->numfiles;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    int order = strcmp(path, t->strings + t->rows[mid].path);
+    if (order == 0) {
+      return mid;
+    }
+    if (order < 0) {
+      hi = mid;
+    }
+    else {
+      lo = mid + 1;
+    }
+  }
+
+  return -1;
+}
+
+// flattable_path
+const char *flattable_path(FlatTable *t, int row)
+{
+  return t->strings + t->rows[row].path;
+}
+
+// flattable_numpeers
+int flattable_numpeers(FlatTable *t, int row)
+{
+  const FlatRow *r = &t->rows[row];
+  int count = 0;
+  for (int i = 0; i < r->nwords; i++) {
+    count += __builtin_popcount(t->words[r->words + i]);
+  }
+  return count;
+}
+
+// flattable_hasPeer
+int flattable_hasPeer(FlatTable *t, int row, const char *ip, int port)
+{
+  const FlatRow *r = &t->rows[row];
+  int id = slot_find(t->slots, t->nslots, ip, port);
+  if (id < 0 || id / WORD_BITS >= r->nwords) {
+    return 0;
+  }
+  return (t->words[r->words + id / WORD_BITS] >> (id % WORD_BITS)) & 1;
+}
+
+// flattable_entry
+TableEntry *flattable_entry(FlatTable *t, int row)
+{
+  if (t == NULL || row < 0 || row >= t->numfiles) {
+    return NULL;
+  }
+
+  const FlatRow *r = &t->rows[row];
+  TableEntry *entry = calloc(1, sizeof(TableEntry));
+  if (entry == NULL || (entry->file = fileinfo_init()) == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  fileinfo_set_path(entry->file, t->strings + r->path);
+  entry->file->id = r->id;
+  entry->file->size = r->size;
+  entry->file->last_modified = r->last_modified;
+  entry->file->is_dir = r->is_dir;
+  entry->version = r->version;
+
+  // resolve the peers now, as tableentry_clone does
+  entry->iphead = row_peerlist(t, r);
+  for (IP *peer = entry->iphead; peer != NULL; peer = peer->next) {
+    entry->numpeers++;
+  }
+
+  return entry;
+}
+
+// flattable_load
+FileTable *flattable_load(FlatTable *t)
+{
+  if (t == NULL) {
+    return NULL;
+  }
+
+  FileTable *ft = filetable_init();
+  for (int i = 0; i < t->numfiles; i++) {
+    const FlatRow *row = &t->rows[i];
+    filetable_restore(ft, t->strings + row->path, row->last_modified, row->size,
+        row->is_dir, row->version);
+  }
+  filetable_restoreDone(ft, t->version);
+
+  return ft;
+}
+
+// flattable_decode
+FlatTable *flattable_decode(WireReader *r, unsigned long base)
+{
+  FlatHeader header;
+  memset(&header, 0, sizeof(header));
+  header.version = wire_get_varint(r);
+  header.numfiles = wire_get_count(r);
+  header.numremoved = wire_get_count(r);
+  header.nslots = wire_get_count(r);
+  header.base = base;
+  if (r->error) {
+    return NULL;
+  }
+
+  // wire_get_count has held each count to the bytes left, so they can size
+  // the rows; the words and paths are gathered as they come
+  FlatRow *rows = calloc(header.numfiles + 1, sizeof(FlatRow));
+  Removal *removed = calloc(header.numremoved + 1, sizeof(Removal));
+  FlatSlot *slots = calloc(header.nslots + 1, sizeof(FlatSlot));
+  if (rows == NULL || removed == NULL || slots == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  Stretch words = {NULL, 0, 0};
+  Stretch strings = {NULL, 0, 0};
+
+  // the peer registry, one slot per id; free ids have no address
+  for (uint32_t id = 0; id < header.nslots && !r->error; id++) {
+    uint32_t len;
+    const char *ip = wire_get_str(r, sizeof(slots[id].ip) - 1, &len);
+    slots[id].port = (int32_t) wire_get_varint(r);
+    if (!r->error) {
+      memcpy(slots[id].ip, ip, len);
+    }
+  }
+
+  // then each entry: its file, version and peer set
+  for (uint32_t i = 0; i < header.numfiles && !r->error; i++) {
+    FileInfo_FS file;
+    memset(&file, 0, sizeof(file));
+    if (fileinfo_read(r, &file) < 0) {
+      r->error = 1;
+      break;
+    }
+
+    FlatRow *row = &rows[i];
+    row->version = wire_get_varint(r);
+    uint32_t nwords = wire_get_count(r);
+    row->last_modified = file.last_modified;
+    row->size = file.size;
+    row->is_dir = (file.is_dir != 0);
+    row->id = file.id;
+    row->words = words.len / sizeof(uint32_t);
+    row->nwords = nwords;
+    if (nwords > UINT16_MAX) {
+      r->error = 1;
+    }
+    for (uint32_t j = 0; j < nwords && !r->error; j++) {
+      uint32_t word = (uint32_t) wire_get_varint(r);
+      memcpy(stretch(&words, sizeof(word)), &word, sizeof(word));
+    }
+
+    // entries arrive in path order; one out of order would throw the binary
+    // search off
+    if (i > 0 && strcmp(strings.data + rows[i - 1].path, file.filepath) >= 0) {
+      r->error = 1;
+    }
+    row->path = string_add(&strings, file.filepath, &row->pathlen);
+    path_release(file.filepath);
+  }
+
+  // then the paths removed, each a reference to its path and a version
+  for (uint32_t i = 0; i < header.numremoved && !r->error; i++) {
+    char *path = fileref_decode(r, &removed[i].row.id);
+    removed[i].row.version = wire_get_varint(r);
+    if (path == NULL) {
+      r->error = 1;
+      break;
+    }
+    removed[i].row.path = string_add(&strings, path, &removed[i].row.pathlen);
+    path_release(path);
+  }
+
+  FlatTable *t = NULL;
+  if (!r->error) {
+    // removals come in the order they happened; sort them by path, keeping
+    // the latest of each
+    for (uint32_t i = 0; i < header.numremoved; i++) {
+      removed[i].path = strings.data + removed[i].row.path;
+    }
+    qsort(removed, header.numremoved, sizeof(Removal), compare_removal);
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < header.numremoved; i++) {
+      if (n > 0 && strcmp(removed[n - 1].path, removed[i].path) == 0) {
+        if (removed[i].row.version > removed[n - 1].row.version) {
+          removed[n - 1] = removed[i];
+        }
+        continue;
+      }
+      removed[n++] = removed[i];
+    }
+    header.numremoved = n;
+    header.nwords = words.len / sizeof(uint32_t);
+
+    // and lay it all out in one buffer
+    char *buf = image_alloc(&header, strings.len);
+    memcpy(buf + header.rows, rows, header.numfiles * sizeof(FlatRow));
+    FlatRow *out = (FlatRow *) (buf + header.removed);
+    for (uint32_t i = 0; i < n; i++) {
+      out[i] = removed[i].row;
+    }
+    if (words.len > 0) {
+      memcpy(buf + header.words, words.data, words.len);
+    }
+    memcpy(buf + header.slots, slots, header.nslots * sizeof(FlatSlot));
+    if (strings.len > 0) {
+      memcpy(buf + header.strings, strings.data, strings.len);
+    }
+    t = image_view(buf, 1);
+  }
+
+  free(rows);
+  free(removed);
+  free(slots);
+  free(words.data);
+  free(strings.data);
+  return t;
+}
+
+// flattable_apply
+FlatTable *flattable_apply(FlatTable *t, FlatTable *changes)
+{
+  if (t == NULL || changes == NULL || changes->base > t->version) {
+    return NULL;
+  }
+
+  // the ids are the sender's, so carry the peers over by address: each of
+  // the changes' slots goes to the one with its address here, or a new one
+  FlatSlot *slots = calloc(t->nslots + changes->nslots + 1, sizeof(FlatSlot));
+  int *remap = calloc(changes->nslots + 1, sizeof(int));
+  int *plan = calloc(t->numfiles + changes->numfiles + 1, sizeof(int));
+  if (slots == NULL || remap == NULL || plan == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  memcpy(slots, t->slots, t->nslots * sizeof(FlatSlot));
+  int nslots = t->nslots;
+  for (int id = 0; id < changes->nslots; id++) {
+    remap[id] = (changes->slots[id].ip[0] == '\0') ? -1 :
+      slot_put(slots, &nslots, &changes->slots[id]);
+  }
+
+  // walk the rows and the changes together in path order, choosing what
+  // filetable_applyChanges would leave: a row goes if it was removed after
+  // its version, and a change replaces a row older than it. Rows are planned
+  // as their index, changes as -1 - theirs
+  int n = 0;
+  int i = 0;
+  int j = 0;
+  int k = 0;
+  while (i < t->numfiles || j < changes->numfiles) {
+    const FlatRow *row = (i < t->numfiles) ? &t->rows[i] : NULL;
+    const FlatRow *change = (j < changes->numfiles) ? &changes->rows[j] : NULL;
+    int order;
+    if (row == NULL) {
+      order = 1;
+    }
+    else if (change == NULL) {
+      order = -1;
+    }
+    else {
+      order = strcmp(t->strings + row->path, changes->strings + change->path);
+    }
+
+    int keep = (order <= 0 && !removed_after(changes, &k, t->strings + row->path, row->version));
+    if (order < 0) {
+      if (keep) {
+        plan[n++] = i;
+      }
+      i++;
+    }
+    else if (order > 0) {
+      plan[n++] = -1 - j;
+      j++;
+    }
+    else {
+      plan[n++] = (keep && row->version >= change->version) ? i : -1 - j;
+      i++;
+      j++;
+    }
+  }
+
+  // size the new table
+  FlatHeader header;
+  memset(&header, 0, sizeof(header));
+  header.numfiles = n;
+  header.nslots = nslots;
+  header.version = (changes->version > t->version) ? changes->version : t->version;
+  uint64_t nstrings = 0;
+  for (int x = 0; x < n; x++) {
+    const FlatRow *src = (plan[x] >= 0) ? &t->rows[plan[x]] : &changes->rows[-1 - plan[x]];
+    nstrings += src->pathlen + 1;
+    header.nwords += (plan[x] >= 0) ? src->nwords : remapped_words(changes, src, remap, NULL);
+  }
+
+  // and fill it in
+  char *buf = image_alloc(&header, nstrings);
+  FlatRow *rows = (FlatRow *) (buf + header.rows);
+  uint32_t *words = (uint32_t *) (buf + header.words);
+  char *strings = buf + header.strings;
+  uint64_t wpos = 0;
+  uint64_t spos = 0;
+  for (int x = 0; x < n; x++) {
+    FlatTable *from = (plan[x] >= 0) ? t : changes;
+    const FlatRow *src = (plan[x] >= 0) ? &t->rows[plan[x]] : &changes->rows[-1 - plan[x]];
+    FlatRow *row = &rows[x];
+    *row = *src;
+
+    row->path = spos;
+    memcpy(strings + spos, from->strings + src->path, src->pathlen + 1);
+    spos += src->pathlen + 1;
+
+    row->words = wpos;
+    if (from == t) {
+      memcpy(words + wpos, t->words + src->words, src->nwords * sizeof(uint32_t));
+    }
+    else {
+      row->nwords = remapped_words(changes, src, remap, words + wpos);
+    }
+    wpos += row->nwords;
+  }
+  memcpy(buf + header.slots, slots, nslots * sizeof(FlatSlot));
+
+  free(slots);
+  free(remap);
+  free(plan);
+  return image_view(buf, 1);
+}
+
+// flattable_compare
+FileComparison *flattable_compare(FlatTable *t, FileInfo_FS *files)
+{
+  if (t == NULL) {
+    return NULL;
+  }
+
+  // the rows never change, so their columns are taken once. The paths are
+  // pooled for them, which is where the files' paths are too, so a match is
+  // the same pointer and the same id, and runs are matched by id
+  if (t->columns == NULL) {
+    FileColumns *cols = calloc(1, sizeof(FileColumns));
+    if (cols == NULL) {
+      fprintf(stderr, "malloc\n");
+      exit(1);
+    }
+    int n = t->numfiles > 0 ? t->numfiles : 1;
+    cols->paths = malloc(n * sizeof(char *));
+    cols->ids = malloc(n * sizeof(uint32_t));
+    cols->last_modified = malloc(n * sizeof(time_t));
+    cols->sizes = malloc(n * sizeof(unsigned int));
+    cols->is_dir = malloc(n * sizeof(unsigned char));
+    if (cols->paths == NULL || cols->ids == NULL || cols->last_modified == NULL ||
+        cols->sizes == NULL || cols->is_dir == NULL) {
+      fprintf(stderr, "malloc\n");
+      exit(1);
+    }
+
+    for (int i = 0; i < t->numfiles; i++) {
+      const FlatRow *row = &t->rows[i];
+      cols->paths[i] = path_intern(t->strings + row->path);
+      if (cols->paths[i] == NULL) {
+        fprintf(stderr, "malloc\n");
+        exit(1);
+      }
+      cols->ids[i] = path_id(cols->paths[i]);
+      cols->last_modified[i] = row->last_modified;
+      cols->sizes[i] = row->size;
+      cols->is_dir[i] = row->is_dir;
+    }
+    cols->n = t->numfiles;
+    cols->version = t->version;
+    cols->numfiles = t->numfiles;
+    t->columns = cols;
+  }
+
+  return filecolumns_compare(t->columns, files);
+}
+
+// flattable_print
+void flattable_print(FlatTable *t)
+{
+  if (t == NULL) {
+    printf("               (null)\n");
+    return;
+  }
+
+  printf("=============== filetable (%4d entries) ===============\n", t->numfiles);
+  printf("(version %lu, %d peer slots, %zu bytes flat)\n", t->version, t->nslots, t->len);
+  printf("# Peers | Size     | Last Modified | Filepath \n");
+  printf("--------------------------------------------\n");
+  for (int i = 0; i < t->numfiles; i++) {
+    const FlatRow *row = &t->rows[i];
+    printf("%6d | %8u | %13ld | %s\n      \\___ ", flattable_numpeers(t, i), row->size,
+      (long) row->last_modified, t->strings + row->path);
+    IP *peers = row_peerlist(t, row);
+    filepeer_print(peers);
+    filepeer_destroy(peers);
+  }
+  printf("==========================================================\n");
+}
+
+
+/*                  local functions                 */
+
+/*
+ * image_alloc
+ *  Lays out the sections for the counts in header, filling in their
+ *  offsets, the length and the magic, and allocates the buffer with the
+ *  header at its start and the sections zeroed for the caller to fill
+ * Ret: the buffer
+ */
+static char *image_alloc(FlatHeader *header, uint64_t nstrings)
+{
+  uint64_t pos = sizeof(FlatHeader);
+  header->rows = pos;
+  pos += (uint64_t) header->numfiles * sizeof(FlatRow);
+  header->removed = pos;
+  pos += (uint64_t) header->numremoved * sizeof(FlatRow);
+  header->words = pos;
+  pos += header->nwords * sizeof(uint32_t);
+  pos = (pos + ALIGN - 1) / ALIGN * ALIGN;
+  header->slots = pos;
+  pos += (uint64_t) header->nslots * sizeof(FlatSlot);
+  header->strings = pos;
+  pos += nstrings;
+  header->length = (pos + ALIGN - 1) / ALIGN * ALIGN;
+  header->magic = FLAT_MAGIC;
+
+  char *buf = calloc(1, header->length);
+  if (buf == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  memcpy(buf, header, sizeof(FlatHeader));
+  return buf;
+}
+
+/*
+ * image_view
+ *  Finds the sections of the table in buf, trusting its header
+ * Ret: the table
+ */
+static FlatTable *image_view(const char *buf, int own)
+{
+  FlatTable *t = calloc(1, sizeof(FlatTable));
+  if (t == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  const FlatHeader *header = (const FlatHeader *) buf;
+  t->buf = buf;
+  t->len = header->length;
+  t->own = own;
+  t->header = header;
+  t->rows = (const FlatRow *) (buf + header->rows);
+  t->removed = (const FlatRow *) (buf + header->removed);
+  t->words = (const uint32_t *) (buf + header->words);
+  t->slots = (const FlatSlot *) (buf + header->slots);
+  t->strings = buf + header->strings;
+  t->numfiles = header->numfiles;
+  t->numremoved = header->numremoved;
+  t->nslots = header->nslots;
+  t->version = header->version;
+  t->base = header->base;
+  return t;
+}
+
+/*
+ * image_check
+ *  Checks every row's path and peer words lie inside their sections, the
+ *  rows are in path order, and every slot's address ends, so that nothing
+ *  read through the table strays outside it
+ * Ret: 0 if so, else -1
+ */
+static int image_check(FlatTable *t)
+{
+  for (int i = 0; i < t->numfiles; i++) {
+    if (row_check(t, &t->rows[i], (i > 0) ? &t->rows[i - 1] : NULL) < 0) {
+      return -1;
+    }
+  }
+  for (int i = 0; i < t->numremoved; i++) {
+    if (row_check(t, &t->removed[i], (i > 0) ? &t->removed[i - 1] : NULL) < 0) {
+      return -1;
+    }
+  }
+  for (int id = 0; id < t->nslots; id++) {
+    if (memchr(t->slots[id].ip, '\0', sizeof(t->slots[id].ip)) == NULL) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * section_fits
+ *  Whether count items of size fit in the buffer at offset, which must be
+ *  aligned for them and not before end, the end of the section before;
+ *  moves end to the end of this one
+ */
+static int section_fits(const FlatHeader *header, uint64_t offset, uint64_t count,
+    uint64_t size, uint64_t *end)
+{
+  uint64_t align = (size < ALIGN) ? size : ALIGN;
+  if (offset < *end || offset > header->length || offset % align != 0 ||
+      count > (header->length - offset) / size) {
+    return 0;
+  }
+  *end = offset + count * size;
+  return 1;
+}
+
+/*
+ * row_check
+ *  Checks row's path ends where it says inside strings, its words lie inside
+ *  words, and it sorts after prev, if given
+ * Ret: 0 if so, else -1
+ */
+static int row_check(FlatTable *t, const FlatRow *row, const FlatRow *prev)
+{
+  uint64_t nstrings = t->len - t->header->strings;
+  if (row->path >= nstrings || row->pathlen >= nstrings - row->path ||
+      memchr(t->strings + row->path, '\0', row->pathlen + 1) !=
+        t->strings + row->path + row->pathlen) {
+    return -1;
+  }
+  if (row->words > t->header->nwords || row->nwords > t->header->nwords - row->words ||
+      row->is_dir > 1) {
+    return -1;
+  }
+  if (prev != NULL && strcmp(t->strings + prev->path, t->strings + row->path) >= 0) {
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * image_checksum
+ *  FNV-1a, as filetable_save sums its records, over the header up to its
+ *  check and everything after it, to length
+ */
+static uint32_t image_checksum(const char *buf, size_t length)
+{
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < offsetof(FlatHeader, check); i++) {
+    hash = (hash ^ (unsigned char) buf[i]) * 16777619u;
+  }
+  for (size_t i = sizeof(FlatHeader); i < length; i++) {
+    hash = (hash ^ (unsigned char) buf[i]) * 16777619u;
+  }
+  return hash;
+}
+
+/*
+ * stretch
+ *  Makes room for len more bytes at the end of s, doubling it as needed
+ * Ret: where they go
+ */
+static void *stretch(Stretch *s, size_t len)
+{
+  if (s->len + len > s->cap) {
+    size_t cap = (s->cap == 0) ? 4096 : s->cap * 2;
+    while (cap < s->len + len) {
+      cap *= 2;
+    }
+    char *data = realloc(s->data, cap);
+    if (data == NULL) {
+      fprintf(stderr, "malloc\n");
+      exit(1);
+    }
+    s->data = data;
+    s->cap = cap;
+  }
+
+  void *at = s->data + s->len;
+  s->len += len;
+  return at;
+}
+
+/*
+ * string_add
+ *  Appends path and its terminator to strings, setting pathlen to its length
+ * Ret: its offset in strings
+ */
+static uint64_t string_add(Stretch *strings, const char *path, uint32_t *pathlen)
+{
+  size_t len = strlen(path);
+  uint64_t offset = strings->len;
+  memcpy(stretch(strings, len + 1), path, len + 1);
+  *pathlen = len;
+  return offset;
+}
+
+/*
+ * slot_find
+ * Ret: the id of the slot with the address, or -1 if none has it
+ */
+static int slot_find(const FlatSlot *slots, int nslots, const char *ip, int port)
+{
+  for (int id = 0; id < nslots; id++) {
+    if (slots[id].port == port && slots[id].ip[0] != '\0' && strcmp(slots[id].ip, ip) == 0) {
+      return id;
+    }
+  }
+  return -1;
+}
+
+/*
+ * slot_put
+ *  Finds the slot with slot's address, or puts it in the first free one,
+ *  appended if none is, as peerregistry_add does
+ * Ret: the slot's id
+ */
+static int slot_put(FlatSlot *slots, int *nslots, const FlatSlot *slot)
+{
+  int id = slot_find(slots, *nslots, slot->ip, slot->port);
+  if (id >= 0) {
+    return id;
+  }
+
+  for (id = 0; id < *nslots && slots[id].ip[0] != '\0'; id++) {
+  }
+  if (id == *nslots) {
+    (*nslots)++;
+  }
+  slots[id] = *slot;
+  return id;
+}
+
+/*
+ * removed_after
+ *  Whether changes removed path after version, moving k, which must only be
+ *  asked about paths in order, up to the path's removal
+ */
+static int removed_after(FlatTable *changes, int *k, const char *path, uint64_t version)
+{
+  int order = -1;
+  while (*k < changes->numremoved &&
+      (order = strcmp(changes->strings + changes->removed[*k].path, path)) < 0) {
+    (*k)++;
+  }
+  return *k < changes->numremoved && order == 0 && version < changes->removed[*k].version;
+}
+
+/*
+ * remapped_words
+ *  Carries the peer set of row, a row of t, over to the ids in remap,
+ *  setting their bits in words if it is given
+ * Ret: how many words the set takes with the new ids
+ */
+static int remapped_words(FlatTable *t, const FlatRow *row, const int *remap, uint32_t *words)
+{
+  int nwords = 0;
+  for (int w = 0; w < row->nwords; w++) {
+    for (uint32_t bits = t->words[row->words + w]; bits != 0; bits &= bits - 1) {
+      int id = w * WORD_BITS + __builtin_ctz(bits);
+      int to = (id < t->nslots) ? remap[id] : -1;
+      if (to < 0) {
+        continue;
+      }
+      if (to / WORD_BITS >= nwords) {
+        nwords = to / WORD_BITS + 1;
+      }
+      if (words != NULL) {
+        words[to / WORD_BITS] |= 1u << (to % WORD_BITS);
+      }
+    }
+  }
+  return nwords;
+}
+
+/*
+ * row_peerlist
+ *  Builds a fresh list of the row's peers, in id order
+ * Ret: the list, which the caller must free with filepeer_destroy
+ */
+static IP *row_peerlist(FlatTable *t, const FlatRow *row)
+{
+  IP *head = NULL;
+  IP **tail = &head;
+
+  for (int w = 0; w < row->nwords; w++) {
+    for (uint32_t bits = t->words[row->words + w]; bits != 0; bits &= bits - 1) {
+      int id = w * WORD_BITS + __builtin_ctz(bits);
+      if (id >= t->nslots || t->slots[id].ip[0] == '\0') {
+        continue;
+      }
+
+      IP *peer = calloc(1, sizeof(IP));
+      if (peer == NULL) {
+        fprintf(stderr, "malloc\n");
+        exit(1);
+      }
+      strcpy(peer->ip, t->slots[id].ip);
+      peer->port = t->slots[id].port;
+      *tail = peer;
+      tail = &peer->next;
+    }
+  }
+
+  return head;
+}
+
+// qsort comparator for removals, by path
+static int compare_removal(const void *a, const void *b)
+{
+  return strcmp(((const Removal *) a)->path, ((const Removal *) b)->path);
+}
+
+/*
+ * columns_free
+ *  Frees columns taken by flattable_compare
+ */
+static void columns_free(FileColumns *cols)
+{
+  if (cols == NULL) {
+    return;
+  }
+
+  for (int i = 0; i < cols->n; i++) {
+    path_release(cols->paths[i]);
+  }
+  free(cols->paths);
+  free(cols->ids);
+  free(cols->last_modified);
+  free(cols->sizes);
+  free(cols->is_dir);
+  free(cols->entries);
+  free(cols);
+}
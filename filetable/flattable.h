@@ -0,0 +1,200 @@
+/*
+ * flattable.h
+ * 	A file table laid out flat in one buffer, to be searched where it lies
+ *
+ * 	A FileTable is a web of entries, file infos and lists, built one malloc
+ * 	at a time. A flat table holds the same rows in a single buffer, with
+ * 	offsets where the FileTable has pointers, so it can be written out and
+ * 	read back, or moved, as it is. The buffer is a FlatHeader, then at the
+ * 	offsets it gives:
+ *
+ * 	  rows     a FlatRow per file, in path order, for binary search
+ * 	  removed  a FlatRow per path removed after base, in path order, with
+ * 	           just its path and the version it went at
+ * 	  words    the words of every row's peer set, one run per row
+ * 	  slots    a FlatSlot per peer id, which the bits of the words index
+ * 	  strings  the paths, each '\0'-terminated
+ *
+ * 	Fields are fixed width, so an image reads back the same whatever build
+ * 	wrote it, on a machine of the same byte order. Peers decode the tracker's
+ * 	table straight into one, and look files up in it where it lies; the
+ * 	tracker writes its snapshots as one, and checks them in place when it
+ * 	maps them back in.
+ *
+ * written by team Fleetwood MAC
+ * CS60, May 2018
+ */
+
+#ifndef FLATTABLE_H
+#define FLATTABLE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "filetable.h"
+#include "../messaging/wire.h"
+
+#define FLAT_MAGIC 0x4c53464cu	// "LSFL"
+
+// At the start of the buffer; offsets are from there
+typedef struct {
+	uint32_t magic;
+	uint32_t numfiles;
+	uint32_t numremoved;
+	uint32_t nslots;
+	uint64_t nwords;
+	uint64_t version;
+	uint64_t base;		// the version the rows are changes after; 0 for a whole table
+	uint64_t length;	// of the whole buffer, header and all
+	uint64_t rows;
+	uint64_t removed;
+	uint64_t words;
+	uint64_t slots;
+	uint64_t strings;
+	uint32_t check;		// checksum of the fields above and everything after the header
+	uint32_t pad;
+} FlatHeader;
+
+typedef struct {
+	uint64_t version;
+	int64_t last_modified;
+	uint64_t path;		// offset of the path in strings
+	uint64_t words;		// index of the first of its peer set's words
+	uint32_t pathlen;
+	uint32_t size;
+	uint32_t id;		// the tracker's id for the path, or 0
+	uint16_t nwords;
+	uint8_t is_dir;
+	uint8_t pad;
+} FlatRow;
+
+typedef struct {
+	char ip[40];		// '\0' for an id no peer has
+	int32_t port;
+} FlatSlot;
+
+// A flat table, and where its sections are
+typedef struct FlatTable {
+	const char *buf;
+	size_t len;
+	int own;		// whether flattable_destroy frees buf
+	const FlatHeader *header;
+	const FlatRow *rows;
+	const FlatRow *removed;
+	const uint32_t *words;
+	const FlatSlot *slots;
+	const char *strings;
+	// From the header
+	int numfiles;
+	int numremoved;
+	int nslots;
+	unsigned long version;
+	unsigned long base;
+	// Column-wise copy of the rows for flattable_compare, made on first use
+	FileColumns *columns;
+} FlatTable;
+
+/*
+ * flattable_build
+ *  Lays the whole of a table out flat, to be written out; the peers are
+ *  left out, as filetable_save leaves them, since they only mean something
+ *  while they are connected
+ * ret: a table that must be free'd with flattable_destroy
+ */
+FlatTable *flattable_build(FileTable *ft);
+
+/*
+ * flattable_write
+ *  Writes the table to fp as it lies, with its checksum
+ * ret: bytes written, or -1 on error
+ */
+int flattable_write(FlatTable *t, FILE *fp);
+
+/*
+ * flattable_open
+ *  Checks the len bytes at buf are a whole flat table written by
+ *  flattable_write, and finds its sections; buf must stay put while the
+ *  table is open, and is free'd with it if own is set
+ * ret: the table, or NULL, leaving buf to the caller, if buf isn't one or
+ *  is damaged
+ */
+FlatTable *flattable_open(const char *buf, size_t len, int own);
+
+/*
+ * flattable_destroy
+ *  Frees the table, and its buffer if it owns it
+ */
+void flattable_destroy(FlatTable *t);
+
+/*
+ * flattable_find
+ *  Finds the row for path by binary search
+ * ret: the row, or -1 if the table hasn't the path
+ */
+int flattable_find(FlatTable *t, const char *path);
+
+/*
+ * flattable_path
+ * ret: the path in row, in the table's buffer
+ */
+const char *flattable_path(FlatTable *t, int row);
+
+/*
+ * flattable_numpeers
+ * ret: how many peers have the file in row
+ */
+int flattable_numpeers(FlatTable *t, int row);
+
+/*
+ * flattable_hasPeer
+ * ret: 1 if the peer at ip and port has the file in row, else 0
+ */
+int flattable_hasPeer(FlatTable *t, int row, const char *ip, int port);
+
+/*
+ * flattable_entry
+ *  Makes a standalone entry of a row, as tableentry_clone does, with the
+ *  peers resolved into its list
+ * ret: the entry, which must be free'd with tableentry_destroy
+ */
+TableEntry *flattable_entry(FlatTable *t, int row);
+
+/*
+ * flattable_load
+ *  Builds a FileTable of the rows, as filetable_restore does; the peers are
+ *  left out, and come back as they register
+ * ret: the table, which must be free'd with filetable_destroy
+ */
+FileTable *flattable_load(FlatTable *t);
+
+/*
+ * flattable_decode
+ *  Reads a table written by filetable_encode or filetable_encodeChanges
+ *  straight into a flat table, with base as the version the changes are
+ *  after, or 0 for a whole table
+ * ret: the table, or NULL on error, setting r->error
+ */
+FlatTable *flattable_decode(WireReader *r, unsigned long base);
+
+/*
+ * flattable_apply
+ *  Lays out afresh t with changes, a table decoded from
+ *  filetable_encodeChanges, applied as filetable_applyChanges would
+ * ret: the new table, or NULL if the changes aren't after a version t has
+ */
+FlatTable *flattable_apply(FlatTable *t, FlatTable *changes);
+
+/*
+ * flattable_compare
+ *  Lines a list of files up with the rows, as filetable_compare does; the
+ *  comparison's rows are the table's, and its columns have no entries
+ * ret: the comparison, which must be free'd with filecomparison_destroy
+ */
+FileComparison *flattable_compare(FlatTable *t, FileInfo_FS *files);
+
+/*
+ * flattable_print
+ *  Prints the rows of the table
+ */
+void flattable_print(FlatTable *t);
+
+#endif //FLATTABLE_H
@@ -0,0 +1,272 @@
+/*
+ * flattabletest.c: checks flattable_apply, which is how a peer brings its
+ * flat copy of the tracker's table up to date: each kind of row it merges,
+ * the peer ids it carries over by address, and that the result is what
+ * filetable_applyChanges leaves a FileTable with
+ *
+ * written by team Fleetwood MAC
+ * CS60, May 2018
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filetable.h"
+#include "flattable.h"
+#include "unittest.h"
+
+static char *peer_ips[] = {"10.0.0.1", "10.0.0.2", "10.0.0.3", "10.0.0.4"};
+#define NPEERS 4
+
+static char *paths[] = {"a/f0", "a/f1", "a/f2", "b/f0", "b/f1", "c", "d/e/f", "d/g"};
+#define NPATHS 8
+
+// a file to insert; the table keeps a copy
+static void insert(FileTable *ft, char *path, unsigned int size, time_t last_modified, char *ip)
+{
+  FileInfo_FS *file = fileinfo_init();
+  if (file == NULL || fileinfo_set_path(file, path) < 0) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  file->size = size;
+  file->last_modified = last_modified;
+  filetable_insert(ft, file, ip, 5000);
+  fileinfo_destroy(file);
+}
+
+// ft's changes after since, as a peer decodes them; since 0 for the whole
+// table
+static FlatTable *changes_of(FileTable *ft, unsigned long since)
+{
+  WireBuf w = {.fd = -1};
+  if (since == 0) {
+    filetable_encode(&w, ft);
+  }
+  else {
+    filetable_encodeChanges(&w, ft, since);
+  }
+
+  WireReader r;
+  memset(&r, 0, sizeof(r));
+  r.data = w.data;
+  r.len = w.len;
+  r.fd = -1;
+  FlatTable *t = flattable_decode(&r, since);
+  if (t == NULL || !wire_done(&r)) {
+    fprintf(stderr, "changes don't decode\n");
+    exit(1);
+  }
+  wire_release(&r);
+  wire_free(&w);
+  return t;
+}
+
+// applies ft's changes after t's version to t, replacing it
+static FlatTable *catch_up(FlatTable *t, FileTable *ft)
+{
+  FlatTable *changes = changes_of(ft, t->version);
+  FlatTable *applied = flattable_apply(t, changes);
+  flattable_destroy(changes);
+  if (applied == NULL) {
+    return t;
+  }
+  flattable_destroy(t);
+  return applied;
+}
+
+// whether the flat table's rows are ft's entries, with the same peers
+static int same_rows(FlatTable *t, FileTable *ft)
+{
+  if (t->numfiles != ft->numfiles || t->version != ft->version) {
+    return 0;
+  }
+  int row = 0;
+  for (TableEntry *e = ft->head; e != NULL; e = e->next, row++) {
+    if (strcmp(flattable_path(t, row), e->file->filepath) != 0 ||
+        flattable_find(t, e->file->filepath) != row ||
+        flattable_numpeers(t, row) != e->numpeers) {
+      return 0;
+    }
+    TableEntry *copy = flattable_entry(t, row);
+    int same = (copy->file->size == e->file->size &&
+        copy->file->last_modified == e->file->last_modified &&
+        copy->file->is_dir == e->file->is_dir && copy->version == e->version);
+    tableentry_destroy(copy);
+    for (int i = 0; i < NPEERS; i++) {
+      same &= (flattable_hasPeer(t, row, peer_ips[i], 5000) ==
+          filetable_entryContainsPeer(e, peer_ips[i], 5000));
+    }
+    if (!same) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void test_rows()
+{
+  FileTable *ft = filetable_init();
+  insert(ft, "a", 10, 100, "10.0.0.1");
+  insert(ft, "c", 10, 100, "10.0.0.1");
+  insert(ft, "e", 10, 100, "10.0.0.1");
+  FlatTable *t = changes_of(ft, 0);
+  CHECK(same_rows(t, ft), "whole table decodes to the same rows");
+
+  // a change replaces an older row
+  insert(ft, "c", 20, 200, "10.0.0.2");
+  t = catch_up(t, ft);
+  int row = flattable_find(t, "c");
+  CHECK(same_rows(t, ft) && row >= 0 && t->rows[row].size == 20 &&
+      t->rows[row].version == ft->version && flattable_hasPeer(t, row, "10.0.0.2", 5000) &&
+      !flattable_hasPeer(t, row, "10.0.0.1", 5000), "change replaces the older row");
+
+  // a new path goes between the rows around it
+  insert(ft, "b", 10, 100, "10.0.0.1");
+  insert(ft, "d", 10, 100, "10.0.0.1");
+  t = catch_up(t, ft);
+  CHECK(same_rows(t, ft) && flattable_find(t, "b") == 1 && flattable_find(t, "d") == 3 &&
+      flattable_find(t, "e") == 4, "new paths between existing rows");
+
+  // a removal after the row's version takes it
+  filetable_remove(ft, "b");
+  t = catch_up(t, ft);
+  CHECK(same_rows(t, ft) && flattable_find(t, "b") < 0, "removal newer than the row");
+
+  // but not one from before it, as when a path was removed and created
+  // again: changes from before both hold the removal and the new row
+  unsigned long since = ft->version;
+  filetable_remove(ft, "d");
+  insert(ft, "d", 30, 300, "10.0.0.1");
+  FlatTable *changes = changes_of(ft, since);
+  CHECK(changes->numremoved == 1 && changes->numfiles == 1, "removal and new row");
+  t = catch_up(t, ft);
+  FlatTable *again = flattable_apply(t, changes);
+  CHECK(again != NULL && same_rows(again, ft) && flattable_find(again, "d") >= 0,
+      "removal older than the row");
+  flattable_destroy(again);
+  flattable_destroy(changes);
+
+  // nor a removal alone from before the row's version
+  FileTable *other = filetable_init();
+  insert(other, "e", 10, 100, "10.0.0.1");
+  filetable_remove(other, "e");
+  changes = changes_of(other, 1);
+  CHECK(changes->numremoved == 1 && changes->numfiles == 0 &&
+      changes->removed[0].version < t->rows[flattable_find(t, "e")].version,
+      "removal of e from before its row");
+  again = flattable_apply(t, changes);
+  CHECK(again != NULL && flattable_find(again, "e") >= 0 && again->numfiles == t->numfiles,
+      "removal alone older than the row");
+  flattable_destroy(again);
+  flattable_destroy(changes);
+  filetable_destroy(other);
+
+  // changes after a version the table hasn't reached are turned down
+  insert(ft, "f", 10, 100, "10.0.0.1");
+  changes = changes_of(ft, t->version + 1);
+  CHECK(flattable_apply(t, changes) == NULL, "changes based after the table's version");
+  flattable_destroy(changes);
+
+  flattable_destroy(t);
+  filetable_destroy(ft);
+}
+
+static void test_slots()
+{
+  FileTable *ft = filetable_init();
+  insert(ft, "a", 10, 100, "10.0.0.1");
+  insert(ft, "b", 10, 100, "10.0.0.1");
+  filetable_addPeer(ft, "a", "10.0.0.2", 5000, 10);
+  FlatTable *t = changes_of(ft, 0);
+  int id1 = peerregistry_find(ft->peers, "10.0.0.2", 5000);
+
+  // the second peer goes and a third takes its id; the table still has the
+  // second peer's slot, so the third's changes must find one of their own
+  filetable_removePeerAll(ft, "10.0.0.2", 5000);
+  filetable_addPeer(ft, "a", "10.0.0.3", 5000, 10);
+  CHECK(peerregistry_find(ft->peers, "10.0.0.3", 5000) == id1, "third peer reuses the id");
+  t = catch_up(t, ft);
+  int a = flattable_find(t, "a"), b = flattable_find(t, "b");
+  CHECK(same_rows(t, ft) && flattable_hasPeer(t, a, "10.0.0.3", 5000) &&
+      !flattable_hasPeer(t, a, "10.0.0.2", 5000) && flattable_numpeers(t, a) == 2,
+      "slot remapped to a reused id");
+  CHECK(flattable_hasPeer(t, b, "10.0.0.1", 5000) && flattable_numpeers(t, b) == 1,
+      "rows kept keep their peers");
+
+  // a sender whose ids are the other way round
+  FileTable *other = filetable_init();
+  insert(other, "a", 10, 100, "10.0.0.3");
+  filetable_addPeer(other, "a", "10.0.0.1", 5000, 10);
+  insert(other, "z", 10, 100, "10.0.0.1");
+  filetable_addPeer(other, "z", "10.0.0.3", 5000, 10);
+  FlatTable *changes = changes_of(other, 0);
+  FlatTable *applied = flattable_apply(t, changes);
+  int z = (applied != NULL) ? flattable_find(applied, "z") : -1;
+  CHECK(z >= 0 && flattable_hasPeer(applied, z, "10.0.0.1", 5000) &&
+      flattable_hasPeer(applied, z, "10.0.0.3", 5000) && flattable_numpeers(applied, z) == 2,
+      "ids carried over by address");
+  flattable_destroy(applied);
+  flattable_destroy(changes);
+  filetable_destroy(other);
+
+  flattable_destroy(t);
+  filetable_destroy(ft);
+}
+
+// one random change to ft
+static void random_change(FileTable *ft)
+{
+  char *path = paths[rand() % NPATHS];
+  char *ip = peer_ips[rand() % NPEERS];
+  TableEntry *entry = filetable_getEntry(ft, path);
+  switch (rand() % 5) {
+    case 0:
+    case 1:
+      insert(ft, path, rand() % 3, 1000 + rand() % 100, ip);
+      break;
+    case 2:
+      filetable_remove(ft, path);
+      break;
+    case 3:
+      if (entry != NULL) {
+        filetable_addPeer(ft, path, ip, 5000, entry->file->size);
+      }
+      break;
+    default:
+      if (rand() % 3 == 0) {
+        filetable_removePeerAll(ft, ip, 5000);
+      }
+      break;
+  }
+}
+
+static void test_random()
+{
+  srand(7);
+  FileTable *ft = filetable_init();
+  FlatTable *t = changes_of(ft, 0);
+
+  // caught up now and then, after runs of changes of every kind
+  int ok = 1;
+  for (int i = 0; i < 3000; i++) {
+    random_change(ft);
+    if (rand() % 4 == 0) {
+      t = catch_up(t, ft);
+      ok &= same_rows(t, ft);
+    }
+  }
+  CHECK(ok, "flat copy kept up to date from the changes");
+
+  flattable_destroy(t);
+  filetable_destroy(ft);
+}
+
+int main()
+{
+  test_rows();
+  test_slots();
+  test_random();
+
+  return check_report("flattabletest");
+}
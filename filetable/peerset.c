@@ -0,0 +1,338 @@
+/*
+ * peerset.c for peer ids and per-entry peer bitsets
+ *
+ * written by team Fleetwood MAC
+ * CS60, May 2018
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "peerset.h"
+
+// initial number of registry hash buckets; doubled as peers are added
+#define INIT_BUCKETS 16
+
+// bits in a PeerSet word
+#define WORD_BITS 32
+
+
+/*          Local function declarations           */
+
+static unsigned int peer_hash(char *ip, int port);
+static void bucket_unlink(PeerRegistry *reg, int id);
+static void registry_rehash(PeerRegistry *reg, int nbuckets);
+
+
+/*      Registry functions                */
+
+// peerregistry_init
+PeerRegistry *peerregistry_init()
+{
+  PeerRegistry *reg = calloc(1, sizeof(PeerRegistry));
+  if (reg == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  registry_rehash(reg, INIT_BUCKETS);
+  return reg;
+}
+
+// peerregistry_destroy
+void peerregistry_destroy(PeerRegistry *reg)
+{
+  if (reg == NULL) {
+    return;
+  }
+
+  free(reg->slots);
+  free(reg->chain);
+  free(reg->buckets);
+  free(reg);
+}
+
+// look up the id of ip:port
+int peerregistry_find(PeerRegistry *reg, char *ip, int port)
+{
+  if (reg == NULL || ip == NULL) {
+    return -1;
+  }
+
+  int id = reg->buckets[peer_hash(ip, port) % reg->nbuckets];
+  while (id >= 0) {
+    if (reg->slots[id].port == port && strcmp(reg->slots[id].ip, ip) == 0) {
+      return id;
+    }
+    id = reg->chain[id];
+  }
+
+  return -1;
+}
+
+// give ip:port an id, reusing the lowest free one so sets stay short
+int peerregistry_add(PeerRegistry *reg, char *ip, int port)
+{
+  if (reg == NULL || ip == NULL || ip[0] == '\0' || strlen(ip) + 1 > sizeof(reg->slots->ip)) {
+    return -1;
+  }
+
+  int id = peerregistry_find(reg, ip, port);
+  if (id >= 0) {
+    return id;
+  }
+
+  for (id = 0; id < reg->nslots; id++) {
+    if (reg->slots[id].ip[0] == '\0') {
+      break;
+    }
+  }
+
+  return peerregistry_put(reg, id, ip, port);
+}
+
+// register ip:port under a specific id
+int peerregistry_put(PeerRegistry *reg, int id, char *ip, int port)
+{
+  if (reg == NULL || id < 0 || ip == NULL || ip[0] == '\0' ||
+      strlen(ip) + 1 > sizeof(reg->slots->ip) || peerregistry_get(reg, id) != NULL) {
+    return -1;
+  }
+
+  // grow the slots, doubling, until they cover the id
+  if (id >= reg->nslots) {
+    int nslots = (reg->nslots == 0) ? WORD_BITS : reg->nslots * 2;
+    while (nslots <= id) {
+      nslots *= 2;
+    }
+    IP *slots = realloc(reg->slots, nslots * sizeof(IP));
+    int *chain = realloc(reg->chain, nslots * sizeof(int));
+    if (slots == NULL || chain == NULL) {
+      fprintf(stderr, "malloc\n");
+      exit(1);
+    }
+    memset(slots + reg->nslots, 0, (nslots - reg->nslots) * sizeof(IP));
+    reg->slots = slots;
+    reg->chain = chain;
+    reg->nslots = nslots;
+  }
+
+  strcpy(reg->slots[id].ip, ip);
+  reg->slots[id].port = port;
+  reg->slots[id].next = NULL;
+
+  int *bucket = &reg->buckets[peer_hash(ip, port) % reg->nbuckets];
+  reg->chain[id] = *bucket;
+  *bucket = id;
+  reg->npeers++;
+
+  if (reg->npeers > reg->nbuckets) {
+    registry_rehash(reg, reg->nbuckets * 2);
+  }
+
+  return id;
+}
+
+// free an id
+void peerregistry_remove(PeerRegistry *reg, int id)
+{
+  if (peerregistry_get(reg, id) == NULL) {
+    return;
+  }
+
+  bucket_unlink(reg, id);
+  memset(&reg->slots[id], 0, sizeof(IP));
+  reg->npeers--;
+}
+
+// address of an id
+IP *peerregistry_get(PeerRegistry *reg, int id)
+{
+  if (reg == NULL || id < 0 || id >= reg->nslots || reg->slots[id].ip[0] == '\0') {
+    return NULL;
+  }
+  return &reg->slots[id];
+}
+
+
+/*      Set functions                */
+
+// peerset_add
+int peerset_add(PeerSet *set, int id)
+{
+  int word = id / WORD_BITS;
+
+  // grow to cover the id
+  if (word >= set->nwords) {
+    int nwords = word + 1;
+    uint32_t *words = realloc(set->words, nwords * sizeof(uint32_t));
+    if (words == NULL) {
+      fprintf(stderr, "malloc\n");
+      exit(1);
+    }
+    memset(words + set->nwords, 0, (nwords - set->nwords) * sizeof(uint32_t));
+    set->words = words;
+    set->nwords = nwords;
+  }
+
+  uint32_t bit = 1u << (id % WORD_BITS);
+  if (set->words[word] & bit) {
+    return 0;
+  }
+  set->words[word] |= bit;
+  return 1;
+}
+
+// peerset_remove
+int peerset_remove(PeerSet *set, int id)
+{
+  if (!peerset_contains(set, id)) {
+    return 0;
+  }
+  set->words[id / WORD_BITS] &= ~(1u << (id % WORD_BITS));
+  return 1;
+}
+
+// peerset_contains
+int peerset_contains(PeerSet *set, int id)
+{
+  if (id < 0 || id / WORD_BITS >= set->nwords) {
+    return 0;
+  }
+  return (set->words[id / WORD_BITS] >> (id % WORD_BITS)) & 1;
+}
+
+// peerset_count
+int peerset_count(PeerSet *set)
+{
+  int count = 0;
+  for (int i = 0; i < set->nwords; i++) {
+    count += __builtin_popcount(set->words[i]);
+  }
+  return count;
+}
+
+// peerset_next
+int peerset_next(PeerSet *set, int id)
+{
+  if (id < 0) {
+    id = 0;
+  }
+
+  int word = id / WORD_BITS;
+  if (word >= set->nwords) {
+    return -1;
+  }
+
+  // mask off the ids below id in the first word, then find the next set bit
+  uint32_t bits = set->words[word] & (~0u << (id % WORD_BITS));
+  while (bits == 0) {
+    if (++word >= set->nwords) {
+      return -1;
+    }
+    bits = set->words[word];
+  }
+
+  return word * WORD_BITS + __builtin_ctz(bits);
+}
+
+// peerset_clear
+void peerset_clear(PeerSet *set)
+{
+  if (set->nwords > 0) {
+    memset(set->words, 0, set->nwords * sizeof(uint32_t));
+  }
+}
+
+// peerset_copy
+void peerset_copy(PeerSet *dst, PeerSet *src)
+{
+  if (src->nwords == 0) {
+    peerset_free(dst);
+    return;
+  }
+
+  if (dst->nwords != src->nwords) {
+    uint32_t *words = realloc(dst->words, src->nwords * sizeof(uint32_t));
+    if (words == NULL) {
+      fprintf(stderr, "malloc\n");
+      exit(1);
+    }
+    dst->words = words;
+    dst->nwords = src->nwords;
+  }
+  memcpy(dst->words, src->words, src->nwords * sizeof(uint32_t));
+}
+
+// peerset_free
+void peerset_free(PeerSet *set)
+{
+  free(set->words);
+  set->words = NULL;
+  set->nwords = 0;
+}
+
+
+/*                  local functions                 */
+
+/*
+ * peer_hash
+ *  FNV-1a hash of ip:port
+ */
+static unsigned int peer_hash(char *ip, int port)
+{
+  unsigned int hash = 2166136261u;
+  for (const unsigned char *c = (const unsigned char *) ip; *c != '\0'; c++) {
+    hash ^= *c;
+    hash *= 16777619u;
+  }
+  hash ^= (unsigned int) port;
+  hash *= 16777619u;
+  return hash;
+}
+
+/*
+ * bucket_unlink
+ *  Removes id from its hash chain
+ */
+static void bucket_unlink(PeerRegistry *reg, int id)
+{
+  int *link = &reg->buckets[peer_hash(reg->slots[id].ip, reg->slots[id].port) % reg->nbuckets];
+  while (*link >= 0 && *link != id) {
+    link = &reg->chain[*link];
+  }
+  if (*link == id) {
+    *link = reg->chain[id];
+  }
+}
+
+/*
+ * registry_rehash
+ *  Rebuilds the hash with nbuckets buckets
+ */
+static void registry_rehash(PeerRegistry *reg, int nbuckets)
+{
+  int *buckets = malloc(nbuckets * sizeof(int));
+  if (buckets == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  for (int i = 0; i < nbuckets; i++) {
+    buckets[i] = -1;
+  }
+
+  for (int id = 0; id < reg->nslots; id++) {
+    if (reg->slots[id].ip[0] == '\0') {
+      continue;
+    }
+    int *bucket = &buckets[peer_hash(reg->slots[id].ip, reg->slots[id].port) % nbuckets];
+    reg->chain[id] = *bucket;
+    *bucket = id;
+  }
+
+  free(reg->buckets);
+  reg->buckets = buckets;
+  reg->nbuckets = nbuckets;
+}
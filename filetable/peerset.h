@@ -0,0 +1,144 @@
+/*
+ * peerset.h
+ * 	Compact peer bookkeeping for the FileTable
+ *
+ * 	A PeerRegistry gives every peer (ip:port) listed anywhere in a table a
+ * 	small integer id, reusing the lowest free id. Each table entry then keeps
+ * 	the peers that have its newest version as a PeerSet, a bitset over those
+ * 	ids, so adding, removing, testing and counting peers are word operations
+ * 	instead of walks over lists of address strings.
+ *
+ * written by team Fleetwood MAC
+ * CS60, May 2018
+ */
+
+#ifndef PEERSET_H
+#define PEERSET_H
+
+#include <stdint.h>
+
+// An IP structure
+// Identifies a peer by its ip and port
+typedef struct IP {
+	// Ipaddress useful for up to ipv6
+	char ip[40];
+	// Port number
+	int port;
+	// Next element of the list
+	struct IP *next;
+} IP;
+
+// Maps ip:port to a small id
+typedef struct PeerRegistry {
+	// slots[id] is the address of peer id; ip[0] is '\0' for a free id
+	IP *slots;
+	int nslots;
+	// Number of ids in use
+	int npeers;
+	// Hash of ip:port to the first id in the bucket, chained through chain[id]
+	int *buckets;
+	int *chain;
+	int nbuckets;
+} PeerRegistry;
+
+// A set of peer ids, one bit per id
+typedef struct PeerSet {
+	uint32_t *words;
+	int nwords;
+} PeerSet;
+
+/*
+ * peerregistry_init
+ * ret: an empty registry that must be free'd with peerregistry_destroy
+ */
+PeerRegistry *peerregistry_init();
+
+/*
+ * peerregistry_destroy
+ *  Frees the registry
+ */
+void peerregistry_destroy(PeerRegistry *reg);
+
+/*
+ * peerregistry_find
+ * ret: the id of ip:port, or -1 if it isn't registered
+ */
+int peerregistry_find(PeerRegistry *reg, char *ip, int port);
+
+/*
+ * peerregistry_add
+ *  Registers ip:port if it isn't already
+ * ret: the id of ip:port, or -1 if ip is too long
+ */
+int peerregistry_add(PeerRegistry *reg, char *ip, int port);
+
+/*
+ * peerregistry_put
+ *  Registers ip:port under a given free id, as when copying another registry
+ * ret: id, or -1 if the id is taken or ip is too long
+ */
+int peerregistry_put(PeerRegistry *reg, int id, char *ip, int port);
+
+/*
+ * peerregistry_remove
+ *  Frees id for reuse; no PeerSet should still contain it
+ */
+void peerregistry_remove(PeerRegistry *reg, int id);
+
+/*
+ * peerregistry_get
+ * ret: the address of peer id, or NULL if id is not in use
+ */
+IP *peerregistry_get(PeerRegistry *reg, int id);
+
+/*
+ * peerset_add
+ * ret: 1 if id was added, 0 if it was already in the set
+ */
+int peerset_add(PeerSet *set, int id);
+
+/*
+ * peerset_remove
+ * ret: 1 if id was removed, 0 if it wasn't in the set
+ */
+int peerset_remove(PeerSet *set, int id);
+
+/*
+ * peerset_contains
+ * ret: 1 if id is in the set, 0 otherwise
+ */
+int peerset_contains(PeerSet *set, int id);
+
+/*
+ * peerset_count
+ * ret: the number of ids in the set
+ */
+int peerset_count(PeerSet *set);
+
+/*
+ * peerset_next
+ *  Iterates a set in increasing order:
+ *    for (int id = peerset_next(set, 0); id >= 0; id = peerset_next(set, id + 1))
+ * ret: the smallest id in the set that is >= id, or -1 if there is none
+ */
+int peerset_next(PeerSet *set, int id);
+
+/*
+ * peerset_clear
+ *  Empties the set, keeping its storage
+ */
+void peerset_clear(PeerSet *set);
+
+/*
+ * peerset_copy
+ *  Makes dst hold the same ids as src
+ */
+void peerset_copy(PeerSet *dst, PeerSet *src);
+
+/*
+ * peerset_free
+ *  Releases the storage of the set, leaving it empty
+ */
+void peerset_free(PeerSet *set);
+
+#endif //PEERSET_H
@@ -0,0 +1,253 @@
+/*
+ * shardtable.c for splitting the file table into separately locked shards
+ *
+ * written by team Fleetwood MAC
+ * CS60, May 2018
+ */
+
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "shardtable.h"
+
+
+/*          Local function declarations           */
+
+static void parts_release(FileTable **parts, int n);
+
+
+/*      Public functions                */
+
+// shardtable_init
+ShardedTable *shardtable_init(int nshards, FileTable **tables)
+{
+  if (nshards < 1) {
+    return NULL;
+  }
+
+  ShardedTable *st = calloc(1, sizeof(ShardedTable));
+  if (st == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  st->nshards = nshards;
+  st->shards = calloc(nshards, sizeof(FileTable *));
+  st->parts = calloc(nshards, sizeof(FileTable *));
+  if (st->shards == NULL || st->parts == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  pthread_mutex_init(&st->clock.lock, NULL);
+
+  // every shard counts on from the newest version any of them has
+  for (int i = 0; i < nshards; i++) {
+    st->shards[i] = (tables != NULL) ? tables[i] : filetable_init();
+    st->shards[i]->clock = &st->clock;
+    if (st->shards[i]->version > st->clock.version) {
+      st->clock.version = st->shards[i]->version;
+    }
+  }
+
+  st->lock = calloc(1, sizeof(pthread_mutex_t));
+  if (st->lock == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  pthread_mutex_init(st->lock, NULL);
+
+  return st;
+}
+
+// release all memory associated with a sharded table
+void shardtable_destroy(ShardedTable *st)
+{
+  if (st == NULL) {
+    return;
+  }
+
+  filetable_release(st->snap);
+  parts_release(st->parts, st->nshards);
+  free(st->parts);
+
+  for (int i = 0; i < st->nshards; i++) {
+    filetable_destroy(st->shards[i]);
+  }
+  free(st->shards);
+
+  pthread_mutex_destroy(&st->clock.lock);
+  pthread_mutex_destroy(st->lock);
+  free(st->lock);
+  free(st);
+}
+
+// shard for the top-level directory of path
+int shardtable_shardOf(ShardedTable *st, const char *path)
+{
+  unsigned int hash = 2166136261u;
+  for (const char *c = path; *c != '\0' && *c != '/'; c++) {
+    hash = (hash ^ (unsigned char) *c) * 16777619u;
+  }
+  return hash % st->nshards;
+}
+
+// relink a list of files into one list per shard
+FileInfo_FS **shardtable_splitFiles(ShardedTable *st, FileInfo_FS *files)
+{
+  FileInfo_FS **lists = calloc(st->nshards, sizeof(FileInfo_FS *));
+  FileInfo_FS **tails = calloc(st->nshards, sizeof(FileInfo_FS *));
+  if (lists == NULL || tails == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  FileInfo_FS *next;
+  for (FileInfo_FS *f = files; f != NULL; f = next) {
+    next = f->next;
+    f->next = NULL;
+
+    int i = shardtable_shardOf(st, f->filepath);
+    if (tails[i] != NULL) {
+      tails[i]->next = f;
+    }
+    else {
+      lists[i] = f;
+    }
+    tails[i] = f;
+  }
+
+  free(tails);
+  return lists;
+}
+
+// relink a list of events into one list per shard
+FileEvent **shardtable_splitEvents(ShardedTable *st, FileEvent *events)
+{
+  FileEvent **lists = calloc(st->nshards, sizeof(FileEvent *));
+  FileEvent **tails = calloc(st->nshards, sizeof(FileEvent *));
+  if (lists == NULL || tails == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  FileEvent *next;
+  for (FileEvent *e = events; e != NULL; e = next) {
+    next = e->next;
+    e->next = NULL;
+
+    int i = shardtable_shardOf(st, e->file->filepath);
+    if (tails[i] != NULL) {
+      tails[i]->next = e;
+    }
+    else {
+      lists[i] = e;
+    }
+    tails[i] = e;
+  }
+
+  free(tails);
+  return lists;
+}
+
+// lock the whole table; always in the same order, so two callers can't
+// each hold a shard the other is waiting for
+void shardtable_lockAll(ShardedTable *st)
+{
+  for (int i = 0; i < st->nshards; i++) {
+    pthread_mutex_lock(st->shards[i]->lock);
+  }
+  pthread_mutex_lock(st->lock);
+}
+
+// shardtable_unlockAll
+void shardtable_unlockAll(ShardedTable *st)
+{
+  pthread_mutex_unlock(st->lock);
+  for (int i = st->nshards - 1; i >= 0; i--) {
+    pthread_mutex_unlock(st->shards[i]->lock);
+  }
+}
+
+// shardtable_version
+unsigned long shardtable_version(ShardedTable *st)
+{
+  // versions are only handed out under a shard's lock, so with every shard
+  // locked the clock is the version of the last change made
+  pthread_mutex_lock(&st->clock.lock);
+  unsigned long version = st->clock.version;
+  pthread_mutex_unlock(&st->clock.lock);
+  return version;
+}
+
+// snapshot of the whole table
+FileTable *shardtable_snapshot(ShardedTable *st, unsigned long since)
+{
+  if (st == NULL) {
+    return NULL;
+  }
+
+  // each shard's snapshot is reused for as long as the shard is unchanged
+  FileTable **parts = calloc(st->nshards, sizeof(FileTable *));
+  if (parts == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  for (int i = 0; i < st->nshards; i++) {
+    parts[i] = filetable_snapshot(st->shards[i], since);
+    if (parts[i] == NULL) {
+      parts_release(parts, i);
+      free(parts);
+      return NULL;
+    }
+  }
+
+  // so if no shard changed, neither did the combined snapshot
+  int same = (st->snap != NULL);
+  for (int i = 0; same && i < st->nshards; i++) {
+    same = (parts[i] == st->parts[i]);
+  }
+  if (same) {
+    parts_release(parts, st->nshards);
+    free(parts);
+    return filetable_retain(st->snap);
+  }
+
+  FileTable *snap = filetable_combine(parts, st->nshards, shardtable_version(st));
+
+  // keep it, and what it was built from, for the next caller
+  filetable_release(st->snap);
+  parts_release(st->parts, st->nshards);
+  free(st->parts);
+  st->parts = parts;
+  st->snap = filetable_retain(snap);
+
+  return snap;
+}
+
+// shardtable_trimRemoved
+void shardtable_trimRemoved(ShardedTable *st, unsigned long version)
+{
+  if (st == NULL) {
+    return;
+  }
+
+  for (int i = 0; i < st->nshards; i++) {
+    filetable_trimRemoved(st->shards[i], version);
+  }
+}
+
+
+/*                  local functions                 */
+
+/*
+ * parts_release
+ *  Releases the first n snapshots in parts
+ */
+static void parts_release(FileTable **parts, int n)
+{
+  for (int i = 0; i < n; i++) {
+    filetable_release(parts[i]);
+    parts[i] = NULL;
+  }
+}
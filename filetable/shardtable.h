@@ -0,0 +1,112 @@
+/*
+ * shardtable.h
+ * 	A FileTable split into shards, each with its own lock, so changes to
+ * 	unrelated directories can be made at the same time
+ *
+ * Paths are assigned to shards by their top-level directory, so a directory
+ * and everything below it always share a shard. The shards take their
+ * versions from one clock, so together they change like a single table:
+ * with every shard locked, the combined snapshot is one consistent version.
+ *
+ * written by team Fleetwood MAC
+ * CS60, May 2018
+ */
+
+#ifndef SHARDTABLE_H
+#define SHARDTABLE_H
+
+#include "filetable.h"
+
+typedef struct ShardedTable {
+	// Number of shards
+	int nshards;
+	// The shards, each an ordinary FileTable guarded by its own lock
+	FileTable **shards;
+	// Where every shard's versions come from
+	VersionClock clock;
+
+	// Held after every shard lock by shardtable_lockAll; on its own, guards
+	// state kept beside the whole table
+	pthread_mutex_t *lock;
+
+	// Shard snapshots the latest combined snapshot was built from
+	FileTable **parts;
+	// Latest combined snapshot, reused until a shard changes
+	FileTable *snap;
+} ShardedTable;
+
+/*
+ * shardtable_init
+ *  Creates a table of nshards shards. tables, if not NULL, holds the nshards
+ *  tables to use as the shards, as loaded from disk, and the sharded table
+ *  takes them over; otherwise every shard starts empty
+ * ret: initialized table that must be free'd with shardtable_destroy
+ */
+ShardedTable *shardtable_init(int nshards, FileTable **tables);
+
+/*
+ * shardtable_destroy
+ *  Free the table and all of its shards
+ */
+void shardtable_destroy(ShardedTable *st);
+
+/*
+ * shardtable_shardOf
+ *  Finds which shard path belongs in
+ * ret: the shard's index
+ */
+int shardtable_shardOf(ShardedTable *st, const char *path);
+
+/*
+ * shardtable_splitFiles
+ *  Splits a list of files into one list per shard, keeping their order.
+ *  The nodes are relinked, so files itself is used up
+ * ret: array of nshards lists, some NULL, which the caller must free along
+ *  with each list
+ */
+FileInfo_FS **shardtable_splitFiles(ShardedTable *st, FileInfo_FS *files);
+
+/*
+ * shardtable_splitEvents
+ *  Splits a list of events into one list per shard, as shardtable_splitFiles
+ *  does for files
+ */
+FileEvent **shardtable_splitEvents(ShardedTable *st, FileEvent *events);
+
+/*
+ * shardtable_lockAll
+ *  Locks every shard, in order, and then st->lock, so the whole table can
+ *  be read at one version
+ */
+void shardtable_lockAll(ShardedTable *st);
+
+/*
+ * shardtable_unlockAll
+ *  Releases what shardtable_lockAll took
+ */
+void shardtable_unlockAll(ShardedTable *st);
+
+/*
+ * shardtable_version
+ *  The version of the whole table; the caller holds every lock
+ */
+unsigned long shardtable_version(ShardedTable *st);
+
+/*
+ * shardtable_snapshot
+ *  Takes a snapshot of the whole table, as filetable_snapshot does for one
+ *  table: a single FileTable, with the changes after since or everything if
+ *  since is 0. The caller holds every lock, and must release the snapshot
+ *  with filetable_release
+ * ret: the snapshot, or NULL if the removals from since have been forgotten
+ */
+FileTable *shardtable_snapshot(ShardedTable *st, unsigned long since);
+
+/*
+ * shardtable_trimRemoved
+ *  Forgets removals at or before version in every shard; the caller holds
+ *  every lock
+ */
+void shardtable_trimRemoved(ShardedTable *st, unsigned long version);
+
+#endif //SHARDTABLE_H
@@ -0,0 +1,279 @@
+/*
+ * shardtest.c: checks that a sharded table keeps each top-level directory
+ * in one shard, splits lists between the shards without reordering them,
+ * and together changes like a single table: one clock for its versions,
+ * and snapshots that hold what the single table's would
+ *
+ * written by team Fleetwood MAC
+ * CS60, May 2018
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "filetable.h"
+#include "shardtable.h"
+#include "unittest.h"
+
+#define NSHARDS 4
+
+// top-level directories, and the paths below them changes are made to
+static char *tops[] = {"docs", "music", "photos", "src", "notes.txt"};
+#define NTOPS 5
+static char *below[] = {"", "/a", "/b", "/sub", "/sub/c", "/sub/d"};
+#define NBELOW 6
+
+static char *peer_ips[] = {"10.0.0.1", "10.0.0.2", "10.0.0.3"};
+#define NPEERS 3
+
+// a file to insert or list; the caller frees it
+static FileInfo_FS *file_of(char *path, unsigned int size, time_t last_modified, int is_dir)
+{
+  FileInfo_FS *file = fileinfo_init();
+  if (file == NULL || fileinfo_set_path(file, path) < 0) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  file->size = size;
+  file->last_modified = last_modified;
+  file->is_dir = is_dir;
+  return file;
+}
+
+// one random change, made to both ft and the shard of st the path is in
+static void random_change(FileTable *ft, ShardedTable *st)
+{
+  char path[64];
+  int top = rand() % NTOPS, sub = rand() % NBELOW;
+  if (strchr(tops[top], '.') != NULL) {
+    sub = 0;
+  }
+  sprintf(path, "%s%s", tops[top], below[sub]);
+  int is_dir = (sub == 0 && top != NTOPS - 1) || sub == 3;
+  char *ip = peer_ips[rand() % NPEERS];
+
+  FileTable *shard = st->shards[shardtable_shardOf(st, path)];
+  FileInfo_FS *file = file_of(path, is_dir ? 0 : rand() % 100, 1000 + rand() % 100, is_dir);
+  TableEntry *entry = filetable_getEntry(ft, path);
+
+  switch (rand() % 4) {
+    case 0:
+      filetable_insert(ft, file, ip, 5000);
+      filetable_insert(shard, file, ip, 5000);
+      break;
+    case 1:
+      filetable_updateMod(ft, file, ip, 5000);
+      filetable_updateMod(shard, file, ip, 5000);
+      break;
+    case 2:
+      filetable_remove(ft, path);
+      filetable_remove(shard, path);
+      break;
+    default:
+      if (entry != NULL) {
+        int size = entry->file->size;
+        filetable_addPeer(ft, path, ip, 5000, size);
+        filetable_addPeer(shard, path, ip, 5000, size);
+      }
+      break;
+  }
+  fileinfo_destroy(file);
+}
+
+// whether two entries are of the same file, changed at the same version
+static int same_entries(TableEntry *x, TableEntry *y)
+{
+  if (strcmp(x->file->filepath, y->file->filepath) != 0 || x->file->size != y->file->size ||
+      x->file->last_modified != y->file->last_modified || x->version != y->version ||
+      x->numpeers != y->numpeers) {
+    return 0;
+  }
+  for (int i = 0; i < NPEERS; i++) {
+    if (filetable_entryContainsPeer(x, peer_ips[i], 5000) !=
+        filetable_entryContainsPeer(y, peer_ips[i], 5000)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// whether tombstones hold a removal of path at version
+static int has_removal(Tombstone *removed, char *path, unsigned long version)
+{
+  for (Tombstone *t = removed; t != NULL; t = t->next) {
+    if (t->version == version && strcmp(t->filepath, path) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// whether snap holds every change ft made after since, in path order, and
+// nothing ft doesn't still have; a snapshot may reach back further than
+// asked, while its shard is unchanged
+static int holds_changes(FileTable *snap, FileTable *ft, unsigned long since)
+{
+  if (snap->version != ft->version) {
+    return 0;
+  }
+  for (TableEntry *x = snap->head; x != NULL; x = x->next) {
+    TableEntry *y = filetable_getEntry(ft, x->file->filepath);
+    if (y == NULL || !same_entries(x, y) ||
+        (x->next != NULL && strcmp(x->file->filepath, x->next->file->filepath) >= 0)) {
+      return 0;
+    }
+  }
+  for (TableEntry *y = ft->head; y != NULL; y = y->next) {
+    if (y->version > since && filetable_getEntry(snap, y->file->filepath) == NULL) {
+      return 0;
+    }
+  }
+  for (Tombstone *t = ft->removed; t != NULL; t = t->next) {
+    if (t->version > since && !has_removal(snap->removed, t->filepath, t->version)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void test_routing()
+{
+  ShardedTable *st = shardtable_init(NSHARDS, NULL);
+  CHECK(shardtable_init(0, NULL) == NULL, "no shards");
+
+  // everything below a top-level directory is in its shard
+  int ok = 1;
+  int used[NSHARDS] = {0};
+  char path[64];
+  for (int i = 0; i < 64; i++) {
+    sprintf(path, "dir%d", i);
+    int shard = shardtable_shardOf(st, path);
+    ok &= (shard >= 0 && shard < NSHARDS);
+    used[shard] = 1;
+    for (int j = 0; j < NBELOW; j++) {
+      sprintf(path, "dir%d%s", i, below[j]);
+      ok &= (shardtable_shardOf(st, path) == shard);
+    }
+  }
+  CHECK(ok, "a directory's subtree is in one shard");
+  int nused = 0;
+  for (int i = 0; i < NSHARDS; i++) {
+    nused += used[i];
+  }
+  CHECK(nused == NSHARDS, "directories spread over every shard");
+
+  // lists are split by shard, each in the order given
+  FileInfo_FS *files = NULL, **tail = &files;
+  FileEvent *events = NULL, **etail = &events;
+  int n = 0;
+  for (int i = 0; i < 40; i++) {
+    sprintf(path, "dir%d/f%02d", i % 7, i);
+    *tail = file_of(path, i, 1000, 0);
+    tail = &(*tail)->next;
+    *etail = fileevent_init();
+    if (*etail == NULL) {
+      fprintf(stderr, "malloc\n");
+      exit(1);
+    }
+    (*etail)->file = file_of(path, i, 1000, 0);
+    etail = &(*etail)->next;
+    n++;
+  }
+  FileInfo_FS **lists = shardtable_splitFiles(st, files);
+  FileEvent **elists = shardtable_splitEvents(st, events);
+  int count = 0, ecount = 0;
+  ok = 1;
+  for (int i = 0; i < NSHARDS; i++) {
+    unsigned int last = 0;
+    for (FileInfo_FS *f = lists[i]; f != NULL; f = f->next, count++) {
+      ok &= (shardtable_shardOf(st, f->filepath) == i && f->size >= last);
+      last = f->size;
+    }
+    last = 0;
+    for (FileEvent *e = elists[i]; e != NULL; e = e->next, ecount++) {
+      ok &= (shardtable_shardOf(st, e->file->filepath) == i && e->file->size >= last);
+      last = e->file->size;
+    }
+    fileinfo_destroy_all(lists[i]);
+    fileevent_destroy_all(elists[i]);
+  }
+  CHECK(ok && count == n && ecount == n, "lists split by shard, in order");
+  free(lists);
+  free(elists);
+
+  shardtable_destroy(st);
+}
+
+static void test_single()
+{
+  srand(3);
+  FileTable *ft = filetable_init();
+  ShardedTable *st = shardtable_init(NSHARDS, NULL);
+
+  // one clock: no two changes in different shards share a version
+  FileInfo_FS *a = file_of("docs/a", 1, 1000, 0), *b = file_of("src/b", 1, 1000, 0);
+  filetable_insert(st->shards[shardtable_shardOf(st, "docs")], a, "10.0.0.1", 5000);
+  filetable_insert(st->shards[shardtable_shardOf(st, "src")], b, "10.0.0.1", 5000);
+  TableEntry *ea = filetable_getEntry(st->shards[shardtable_shardOf(st, "docs")], "docs/a");
+  TableEntry *eb = filetable_getEntry(st->shards[shardtable_shardOf(st, "src")], "src/b");
+  CHECK(shardtable_shardOf(st, "docs") != shardtable_shardOf(st, "src"),
+      "paths for the clock test in different shards");
+  CHECK(ea->version == 1 && eb->version == 2 && shardtable_version(st) == 2,
+      "shards take their versions from one clock");
+  filetable_remove(st->shards[shardtable_shardOf(st, "docs")], "docs/a");
+  filetable_remove(st->shards[shardtable_shardOf(st, "src")], "src/b");
+  filetable_insert(ft, a, "10.0.0.1", 5000);
+  filetable_insert(ft, b, "10.0.0.1", 5000);
+  filetable_remove(ft, "docs/a");
+  filetable_remove(ft, "src/b");
+  fileinfo_destroy(a);
+  fileinfo_destroy(b);
+
+  // with the same changes made to both, the sharded table's snapshots hold
+  // what the single table has, whole and from any version, until the
+  // removals are forgotten
+  int whole = 1, changes = 1, trimmed = 1;
+  unsigned long since = 0;
+  for (int i = 0; i < 3000; i++) {
+    random_change(ft, st);
+    if (i % 20 != 0) {
+      continue;
+    }
+
+    shardtable_lockAll(st);
+    CHECK(shardtable_version(st) == ft->version, "sharded table at the single one's version");
+
+    FileTable *snap = shardtable_snapshot(st, 0);
+    whole &= (snap != NULL && snap->numfiles == ft->numfiles && holds_changes(snap, ft, 0));
+    filetable_release(snap);
+
+    snap = shardtable_snapshot(st, since);
+    changes &= (snap != NULL && snap->base <= since && holds_changes(snap, ft, since));
+    filetable_release(snap);
+
+    // now and then forget the removals up to since
+    if (rand() % 3 == 0 && since > 1) {
+      shardtable_trimRemoved(st, since);
+      filetable_trimRemoved(ft, since);
+      snap = shardtable_snapshot(st, since - 1);
+      trimmed &= (snap == NULL);
+      filetable_release(snap);
+    }
+    since = (rand() % 2 == 0) ? ft->version : since;
+    shardtable_unlockAll(st);
+  }
+  CHECK(whole, "whole snapshot is the single table's");
+  CHECK(changes, "snapshot of changes is the single table's");
+  CHECK(trimmed, "no snapshot from before the removals forgotten");
+
+  shardtable_destroy(st);
+  filetable_destroy(ft);
+}
+
+int main()
+{
+  test_routing();
+  test_single();
+
+  return check_report("shardtest");
+}
@@ -0,0 +1,190 @@
+/*
+ * compress.c: a small LZ77 compressor for message payloads
+ *
+ * Final project, CS60, Spring 2018
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include "compress.h"
+
+#define MIN_MATCH 4             // shortest match worth its offset
+#define MAX_OFFSET 65535        // furthest back a match can start
+#define HASH_BITS 12            // slots in the table of where 4 bytes were last seen
+#define SKIP_SHIFT 6            // after this many misses in a row, step 2 bytes, and so on
+
+static int put_sequence(char **out, char *end, const char *lit, size_t nlit,
+    size_t offset, size_t mlen);
+static char *put_count(char *p, size_t n);
+static int get_count(const unsigned char **in, const unsigned char *end, size_t *n);
+static size_t match_length(const char *a, const char *b, size_t max);
+static uint32_t hash4(const char *p);
+
+// greedy: at each position, take the match the hash table remembers if it
+// is one, else move on, faster the longer nothing has matched
+size_t compress_block(const char *src, size_t len, char *dst, size_t cap) {
+  uint32_t table[1 << HASH_BITS];         // 1 + where each hash was last seen
+  memset(table, 0, sizeof(table));
+
+  char *out = dst;
+  char *end = dst + cap;
+  size_t anchor = 0;                      // first byte not yet in a sequence
+  size_t i = 0;
+  while (len >= MIN_MATCH && i <= len - MIN_MATCH) {
+    uint32_t h = hash4(src + i);
+    size_t seen = table[h];
+    table[h] = (uint32_t) i + 1;
+    if (seen == 0 || i - (seen - 1) > MAX_OFFSET || memcmp(src + seen - 1, src + i, MIN_MATCH) != 0) {
+      i += 1 + ((i - anchor) >> SKIP_SHIFT);
+      continue;
+    }
+
+    size_t from = seen - 1;
+    size_t mlen = MIN_MATCH + match_length(src + from + MIN_MATCH, src + i + MIN_MATCH,
+        len - i - MIN_MATCH);
+    if (put_sequence(&out, end, src + anchor, i - anchor, i - from, mlen) < 0) {
+      return 0;
+    }
+    i += mlen;
+    anchor = i;
+  }
+
+  // whatever is left over goes as literals
+  if (put_sequence(&out, end, src + anchor, len - anchor, 0, 0) < 0) {
+    return 0;
+  }
+  return out - dst;
+}
+
+int decompress_block(const char *src, size_t len, char *dst, size_t outlen) {
+  const unsigned char *in = (const unsigned char *) src;
+  const unsigned char *end = in + len;
+  size_t out = 0;
+
+  while (in < end) {
+    unsigned token = *in++;
+
+    // the literals
+    size_t nlit = token >> 4;
+    if (get_count(&in, end, &nlit) < 0 || nlit > (size_t) (end - in) || nlit > outlen - out) {
+      return -1;
+    }
+    memcpy(dst + out, in, nlit);
+    in += nlit;
+    out += nlit;
+
+    // the last sequence is the one that fills dst, and ends the block
+    if (out == outlen) {
+      return (in == end) ? 0 : -1;
+    }
+
+    // then the match, which may overlap what it copies
+    if (end - in < 2) {
+      return -1;
+    }
+    size_t offset = ((size_t) in[0] << 8) | in[1];
+    in += 2;
+    size_t mlen = token & 0xf;
+    if (get_count(&in, end, &mlen) < 0) {
+      return -1;
+    }
+    mlen += MIN_MATCH;
+    if (offset == 0 || offset > out || mlen > outlen - out) {
+      return -1;
+    }
+    if (offset >= mlen) {
+      memcpy(dst + out, dst + out - offset, mlen);
+    }
+    else {
+      for (size_t k = 0; k < mlen; k++) {
+        dst[out + k] = dst[out + k - offset];
+      }
+    }
+    out += mlen;
+  }
+
+  // the block ran out before dst was full
+  return -1;
+}
+
+/*
+ * helpers
+ */
+
+// appends a sequence, of just literals if mlen is 0
+static int put_sequence(char **out, char *end, const char *lit, size_t nlit,
+    size_t offset, size_t mlen) {
+  size_t mcount = (mlen == 0) ? 0 : mlen - MIN_MATCH;
+  size_t need = 1 + nlit / 255 + 1 + nlit + (mlen == 0 ? 0 : 2 + mcount / 255 + 1);
+  if (need > (size_t) (end - *out)) {
+    return -1;
+  }
+
+  char *p = *out;
+  *p++ = (char) (((nlit < 15 ? nlit : 15) << 4) | (mcount < 15 ? mcount : 15));
+  p = put_count(p, nlit);
+  memcpy(p, lit, nlit);
+  p += nlit;
+  if (mlen != 0) {
+    *p++ = (char) (offset >> 8);
+    *p++ = (char) (offset & 0xff);
+    p = put_count(p, mcount);
+  }
+
+  *out = p;
+  return 0;
+}
+
+// the bytes that carry on a count too big for its 4 bits
+static char *put_count(char *p, size_t n) {
+  if (n < 15) {
+    return p;
+  }
+  for (n -= 15; n >= 255; n -= 255) {
+    *p++ = (char) 255;
+  }
+  *p++ = (char) n;
+  return p;
+}
+
+// adds to n, read from its 4 bits, the bytes that carry it on
+static int get_count(const unsigned char **in, const unsigned char *end, size_t *n) {
+  if (*n < 15) {
+    return 0;
+  }
+
+  unsigned char byte;
+  do {
+    if (*in >= end) {
+      return -1;
+    }
+    byte = *(*in)++;
+    *n += byte;
+  } while (byte == 255);
+
+  return 0;
+}
+
+// how many bytes a and b start with in common, up to max, a word at a time
+static size_t match_length(const char *a, const char *b, size_t max) {
+  size_t n = 0;
+  while (n + sizeof(uint64_t) <= max) {
+    uint64_t x, y;
+    memcpy(&x, a + n, sizeof(x));
+    memcpy(&y, b + n, sizeof(y));
+    if (x != y) {
+      break;
+    }
+    n += sizeof(uint64_t);
+  }
+  while (n < max && a[n] == b[n]) {
+    n++;
+  }
+  return n;
+}
+
+static uint32_t hash4(const char *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return (v * 2654435761u) >> (32 - HASH_BITS);
+}
@@ -0,0 +1,41 @@
+/*
+ * compress.h: a small LZ77 compressor for message payloads
+ *
+ * In the manner of LZ4: quick enough for a Pi to keep up with its network,
+ * good at the runs of similar paths and numbers in a file table, and with
+ * nothing to link against. A block is a run of sequences, each
+ *
+ *   token (1)      literal count in the high 4 bits, match length less 4 in
+ *                  the low 4; a count of 15 goes on in the bytes after it
+ *   literals       copied as they are
+ *   offset (2)     big-endian, how far back the match starts in the output;
+ *                  then any more of the match length
+ *
+ * where a count of 15 goes on as bytes of 255 and a last byte below 255,
+ * each added to it. The last sequence is only literals. A block doesn't
+ * record how long it decodes to, so whoever keeps it keeps that too.
+ *
+ * Final project, CS60, Spring 2018
+ */
+
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stddef.h>
+
+#define COMPRESS_MAX_RATIO 255  // no block decodes to more than this many bytes a byte
+
+/*
+ * Compresses len bytes from src into dst, which has room for cap.
+ * @return the length of the block, or 0 if it doesn't fit in cap
+ */
+size_t compress_block(const char *src, size_t len, char *dst, size_t cap);
+
+/*
+ * Decompresses the block of len bytes at src into dst, which it must fill
+ * exactly, with outlen bytes.
+ * @return 0 on success, -1 if the block is malformed or doesn't fill dst
+ */
+int decompress_block(const char *src, size_t len, char *dst, size_t outlen);
+
+#endif //COMPRESS_H
@@ -0,0 +1,225 @@
+/*
+ * compresstest.c: checks that blocks from compress_block decode back to what
+ * went in, that decompress_block turns down truncated and corrupt blocks,
+ * and that a compressed message claiming an impossible length is refused
+ * before anything is allocated for it
+ *
+ * Final project, CS60, Spring 2018
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "compress.h"
+#include "wire.h"
+#include "unittest.h"
+
+// room enough for a block of len bytes however badly it compresses
+static size_t worst(size_t len) {
+  return len + len / 255 + 16;
+}
+
+// compresses src, checks it decodes back exactly, and returns the block
+static char *round_trip(const char *what, const char *src, size_t len, size_t *blocklen) {
+  char *block = malloc(worst(len));
+  char *out = malloc(len + 1);
+  if (block == NULL || out == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  *blocklen = compress_block(src, len, block, worst(len));
+  CHECK(*blocklen > 0, what);
+  CHECK(decompress_block(block, *blocklen, out, len) == 0, what);
+  CHECK(memcmp(out, src, len) == 0, what);
+
+  free(out);
+  return block;
+}
+
+static void test_round_trips() {
+  size_t blocklen;
+  char *block;
+
+  // nothing, and less than a match
+  block = round_trip("empty", "", 0, &blocklen);
+  CHECK(blocklen == 1, "empty block is one token");
+  free(block);
+  block = round_trip("short", "abc", 3, &blocklen);
+  free(block);
+
+  // incompressible: every literal count is extended, by more than one byte
+  size_t n = 100000;
+  char *noise = malloc(n);
+  srand(60);
+  for (size_t i = 0; i < n; i++) {
+    noise[i] = (char) (rand() >> 7);
+  }
+  block = round_trip("incompressible", noise, n, &blocklen);
+  CHECK(blocklen > n, "incompressible input doesn't shrink");
+  free(block);
+
+  // and it reports it doesn't fit rather than overrun a smaller buffer
+  char *small = malloc(n);
+  CHECK(compress_block(noise, n, small, n - 4) == 0, "incompressible into too small a buffer");
+  free(small);
+
+  // literal counts of exactly 15, 15 + 255 and 15 + 254, either side of
+  // where a count goes on into another byte
+  size_t counts[] = {14, 15, 16, 269, 270, 271, 524, 525};
+  for (int i = 0; i < (int) (sizeof(counts) / sizeof(counts[0])); i++) {
+    block = round_trip("literal count", noise, counts[i], &blocklen);
+    free(block);
+  }
+
+  // overlapping matches: a run of one byte copies from one back, a
+  // repeated pattern from three back
+  char *run = malloc(n);
+  memset(run, 'a', n);
+  block = round_trip("run", run, n, &blocklen);
+  CHECK(blocklen < n / 200, "a run compresses to almost nothing");
+  free(block);
+  for (size_t i = 0; i < n; i++) {
+    run[i] = "abc"[i % 3];
+  }
+  block = round_trip("pattern", run, n, &blocklen);
+  free(block);
+
+  // match lengths either side of 15 + 4 and 15 + 255 + 4, each between
+  // literals, so each is a sequence of its own
+  size_t lengths[] = {4, 18, 19, 20, 273, 274, 275, 529, 5000};
+  for (int i = 0; i < (int) (sizeof(lengths) / sizeof(lengths[0])); i++) {
+    size_t len = 0;
+    memcpy(run + len, noise, 32);
+    len += 32;
+    memcpy(run + len, noise, lengths[i] < 32 ? lengths[i] : 32);
+    for (size_t k = 32; k < lengths[i]; k++) {
+      run[len + k] = run[len + k - 32];
+    }
+    len += lengths[i];
+    memcpy(run + len, noise + 1000, 40);
+    len += 40;
+    block = round_trip("match length", run, len, &blocklen);
+    free(block);
+  }
+
+  // something like what actually goes: a list of similar paths
+  size_t len = 0;
+  for (int i = 0; len + 64 < n; i++) {
+    len += sprintf(run + len, "photos/2018/05/IMG_%04d.jpg%c", i, 0);
+  }
+  block = round_trip("paths", run, len, &blocklen);
+  CHECK(blocklen < len / 3, "paths compress");
+  free(block);
+
+  free(run);
+  free(noise);
+}
+
+static void test_bad_blocks() {
+  // a block that ends in a match and then a bare token, and has literals
+  // and long counts before it
+  char src[2000];
+  for (int i = 0; i < (int) sizeof(src); i++) {
+    src[i] = (i < 300) ? (char) (i * 7 + i / 13) : 'x';
+  }
+  size_t blocklen;
+  char *block = round_trip("source", src, sizeof(src), &blocklen);
+  char out[sizeof(src) + 16];
+
+  // every truncation is refused
+  for (size_t cut = 0; cut < blocklen; cut++) {
+    if (decompress_block(block, cut, out, sizeof(src)) != -1) {
+      CHECK(0, "truncated block");
+      break;
+    }
+  }
+
+  // as is decoding to the wrong length, shorter or longer
+  CHECK(decompress_block(block, blocklen, out, sizeof(src) - 1) == -1, "decodes too long");
+  CHECK(decompress_block(block, blocklen, out, sizeof(src) + 1) == -1, "decodes too short");
+
+  // a match from before the start, or from no distance back
+  char before[] = {0x10, 'a', 0x00, 0x05};          // 1 literal, match from 5 back
+  CHECK(decompress_block(before, sizeof(before), out, 5) == -1, "offset past the start");
+  char zero[] = {0x10, 'a', 0x00, 0x00};
+  CHECK(decompress_block(zero, sizeof(zero), out, 5) == -1, "offset of 0");
+
+  // literals or a match running past the output, or past the block
+  char longlit[] = {0x50, 'a', 'b', 'c', 'd', 'e'};
+  CHECK(decompress_block(longlit, sizeof(longlit), out, 4) == -1, "literals past the output");
+  CHECK(decompress_block(longlit, sizeof(longlit) - 1, out, 5) == -1, "literals past the block");
+  char longmatch[] = {0x1f, 'a', 0x00, 0x01, (char) 255, 0x00, 0x00};
+  CHECK(decompress_block(longmatch, sizeof(longmatch), out, 100) == -1, "match past the output");
+
+  // a count that goes on past the end of the block
+  char count[] = {(char) 0xf0, (char) 255, (char) 255};
+  CHECK(decompress_block(count, sizeof(count), out, 600) == -1, "count past the block");
+
+  // whatever is flipped, decoding either fails or fills the output, and
+  // never reads or writes past either
+  srand(18);
+  for (int i = 0; i < 20000; i++) {
+    char *bad = malloc(blocklen);
+    memcpy(bad, block, blocklen);
+    bad[rand() % blocklen] ^= (char) (1 + rand() % 255);
+    int res = decompress_block(bad, blocklen, out, sizeof(src));
+    free(bad);
+    if (res != 0 && res != -1) {
+      CHECK(0, "corrupt block");
+      break;
+    }
+  }
+
+  free(block);
+}
+
+// a compressed message whose payload says it decodes to far more than its
+// block could is dropped, on a connection with buffers and on one without
+static void test_bad_length() {
+  for (int open = 0; open < 2; open++) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+      perror("socketpair");
+      exit(1);
+    }
+    if (open) {
+      wire_open(fds[1]);
+    }
+
+    char msg[WIRE_HEADER + 4 + 16];
+    memset(msg, 0, sizeof(msg));
+    uint32_t fields[] = {WIRE_MAGIC, 4 + 16, 16 << 20};
+    msg[0] = fields[0] >> 24; msg[1] = fields[0] >> 16; msg[2] = fields[0] >> 8; msg[3] = fields[0];
+    msg[4] = WIRE_VERSION;
+    msg[5] = 1;
+    msg[7] = WIRE_COMPRESSED;
+    msg[11] = fields[1];
+    msg[12] = fields[2] >> 24; msg[13] = fields[2] >> 16; msg[14] = fields[2] >> 8; msg[15] = fields[2];
+    if (write(fds[0], msg, sizeof(msg)) != sizeof(msg)) {
+      perror("write");
+      exit(1);
+    }
+
+    WireReader r;
+    CHECK(wire_recv(fds[1], &r) == -1, "impossible decompressed length");
+    wire_release(&r);
+
+    if (open) {
+      wire_close(fds[1]);
+    }
+    close(fds[0]);
+    close(fds[1]);
+  }
+}
+
+int main() {
+  test_round_trips();
+  test_bad_blocks();
+  test_bad_length();
+
+  return check_report("compresstest");
+}
@@ -20,296 +20,347 @@
 #include <stdio.h>
 #include <time.h>
 #include <pthread.h>
-#include <time.h>
-#include <stdlib.h>
 #include "segment.h"
 
-// Method to create an update packet. Called by the peer.
-/*void create_update_packet(seg_peer_t *segment, int port,
-  FileTable *file_table) {
-  segment->type = 0;
-  segment->port = port;
-  memcpy(segment->peer_ip, get_my_ip(), IP_LEN);
-  segment->file_table = file_table;
-}*/
-
 /*
- * FileTable send/receive helpers
+ * How each kind of field in LIST_OF_MESSAGES is encoded into w from body b,
+ * decoded from r into b, and freed. Numbers go as varints, but for U64s,
+ * which are hashes and no smaller for it. Lists go as their length and then
+ * each item; a TABLE goes whole, and CHANGES as the changes after the
+ * version in the body's since field. A table is sent from the FileTable in
+ * its field, and received flat, into the FlatTable named flat_ and the field.
  */
+#define PUT_I32(b, name) wire_put_varint(w, (uint32_t) (b)->name);
+#define GET_I32(b, name) (b)->name = (int32_t) (uint32_t) wire_get_varint(r);
+#define FREE_I32(b, name)
 
-int receive_table_update(int fd, Message *msg) {
-  // create space for body
-  TableUpdateBody *body = calloc(1, sizeof(TableUpdateBody));
-
-  // read the body in
-  if (recv(fd, body, sizeof(TableUpdateBody), MSG_WAITALL) < 0) {
-    return -1;
-  }
-
-  FileTable *table = filetable_receive(fd);
-  body->table = table;
+#define PUT_U64(b, name) wire_put_u64(w, (b)->name);
+#define GET_U64(b, name) (b)->name = wire_get_u64(r);
+#define FREE_U64(b, name)
 
-  // attach to the message
-  msg->body = body;
+#define PUT_VERSION(b, name) wire_put_varint(w, (b)->name);
+#define GET_VERSION(b, name) (b)->name = wire_get_varint(r);
+#define FREE_VERSION(b, name)
 
-  return 1;
-}
+#define PUT_TABLE(b, name) filetable_encode(w, (b)->name);
+#define GET_TABLE(b, name) (b)->flat_##name = get_table(r, 0);
+#define FREE_TABLE(b, name) flattable_destroy((b)->flat_##name);
 
-int send_table_update(int fd, FileTable *table) {
-  if (table == NULL) { 
-    return -1;
-  }
+#define PUT_CHANGES(b, name) filetable_encodeChanges(w, (b)->name, (b)->since);
+#define GET_CHANGES(b, name) (b)->flat_##name = get_table(r, (b)->since);
+#define FREE_CHANGES(b, name) flattable_destroy((b)->flat_##name);
 
-  Message header;
-  memset(&header, 0, sizeof(header));
+#define PUT_EVENTS(b, name) fileevent_encode_all(w, (b)->name);
+#define GET_EVENTS(b, name) (b)->name = fileevent_decode_all(r, &(b)->n_##name);
+#define FREE_EVENTS(b, name) fileevent_destroy_all((b)->name);
 
-  header.type = TABLE_UPDATE;
+#define PUT_FILES(b, name) fileinfo_encode_all(w, (b)->name);
+#define GET_FILES(b, name) (b)->name = fileinfo_decode_all(r, &(b)->n_##name);
+#define FREE_FILES(b, name) fileinfo_destroy_all((b)->name);
 
-  if (send(fd, &header, sizeof(header), 0) < 0) {
-    return -1;
-  }  
-
-  TableUpdateBody body;
-  memset(&body, 0, sizeof(body));
-
-  if (send(fd, &body, sizeof(body), 0) < 0) {
-    perror("error sending");
-    return -1;
-  }
-
-  if (filetable_send(fd, table) < 0) {
-    printf("Error sending tabe\n");
-  }
-
-  return 1;
-}
+#define PUT_NODES(b, name) digestnode_encode_all(w, (b)->name);
+#define GET_NODES(b, name) (b)->name = digestnode_decode_all(r, &(b)->n_##name);
+#define FREE_NODES(b, name) digestnode_destroy_all((b)->name);
 
+static FlatTable *get_table(WireReader *r, unsigned long base);
+static int decode_message(int type, WireReader *r, Message *msg);
 
 /*
- * REGISTER_ACK send/receive functions
+ * put_, get_ and free_ routines for each body, generated from the schema
  */
 
-// tracker sends acknowledgement to peer with interval and piece length
-int send_register_ack(int fd, int interval, int piece_len) {
-  Message header;
-  memset(&header, 0, sizeof(header));
-
-  header.type = REGISTER_ACK;
-
-  if (send(fd, &header, sizeof(header), 0) < 0) {
-    perror("error sending");
-    return -1;
-  }  
+#define M(type, body, fields) \
+  static void put_##body(WireBuf *w, void *arg) { body *b = arg; fields }
+#define E(type)
+#define F(kind, name) PUT_##kind(b, name)
+LIST_OF_MESSAGES(M, E, F)
+#undef M
+#undef E
+#undef F
+
+#define M(type, body, fields) \
+  static void get_##body(WireReader *r, void *arg) { body *b = arg; fields }
+#define E(type)
+#define F(kind, name) if (!r->error) { GET_##kind(b, name) }
+LIST_OF_MESSAGES(M, E, F)
+#undef M
+#undef E
+#undef F
+
+#define M(type, body, fields) \
+  static void free_##body(void *arg) { body *b = arg; (void) b; fields }
+#define E(type)
+#define F(kind, name) FREE_##kind(b, name)
+LIST_OF_MESSAGES(M, E, F)
+#undef M
+#undef E
+#undef F
+
+// How to encode, decode and free the body of one message type
+typedef struct {
+  size_t size;                              // of the body struct; 0 for none
+  void (*put)(WireBuf *w, void *body);
+  void (*get)(WireReader *r, void *body);
+  void (*free)(void *body);                 // frees what the body points to
+} BodyCodec;
+
+#define M(type, body, fields) [type] = {sizeof(body), put_##body, get_##body, free_##body},
+#define E(type) [type] = {0, NULL, NULL, NULL},
+#define F(kind, name)
+static const BodyCodec codecs[] = { LIST_OF_MESSAGES(M, E, F) };
+#undef M
+#undef E
+#undef F
+
+#define N_MESSAGE_TYPES (sizeof(codecs) / sizeof(codecs[0]))
 
-  RegisterAckBody body;
-  memset(&body, 0, sizeof(body));
-
-  body.interval = interval;
-  body.piece_len = piece_len;
+/*
+ * sending and receiving any message
+ */
 
-  if (send(fd, &body, sizeof(body), 0) < 0) {
-    perror("error sending");
-    return -1;
-  }
-  
-  return 1;
+void message_open(int fd, int names) {
+  fileinfo_session_open(fd, names);
+  wire_open(fd);
 }
 
-int receive_register_ack(int fd, Message *msg) {
-  // create space for body
-  RegisterBody *body = calloc(1, sizeof(RegisterAckBody));
-
-  // read the body in
-  if (recv(fd, body, sizeof(RegisterAckBody), MSG_WAITALL) < 0) {
-    return -1;
-  }
+void message_close(int fd) {
+  wire_close(fd);
+  fileinfo_session_close(fd);
+}
 
-  // attach to the message
-  msg->body = body;
+void message_cork(int fd) {
+  wire_cork(fd);
+}
 
-  return 1;
+int message_uncork(int fd) {
+  return wire_uncork(fd);
 }
 
-/*
- * REGISTER send/receive functions
- */
+int message_flush(int fd) {
+  return wire_flush(fd);
+}
 
-// send a REGISTER message to the tracker, along with all files we currently have
-int send_register(int fd, int listen_port, FileInfo_FS *files) {
-  Message header;
-  memset(&header, 0, sizeof(header));
+size_t message_pending(int fd) {
+  return wire_pending(fd);
+}
 
-  header.type = REGISTER;
+void message_compress(int fd) {
+  wire_compress(fd);
+}
 
-  if (send(fd, &header, sizeof(header), 0) < 0) {
-    perror("error sending");
+// encodes the header and body after any messages held back, and sends them
+// in one write
+int send_message(int fd, MessageType type, void *body) {
+  if (type >= N_MESSAGE_TYPES) {
     return -1;
-  }  
-  
-  // count how many files
-  int n_files = 0;
-  FileInfo_FS *tmp = files;
-  while (tmp != NULL) {
-    n_files++;
-    tmp = tmp->next;
   }
-
-  // create body with number of files and port we're listening on  
-  RegisterBody body;
-  memset(&body, 0, sizeof(body));
-
-  body.n_files = n_files;
-  body.listen_port = listen_port;
-
-  // send it off
-  if (send(fd, &body, sizeof(body), 0) < 0) {
+  const BodyCodec *codec = &codecs[type];
+  if (codec->put != NULL && body == NULL) {
     return -1;
   }
 
-  // and also send the list of files
-  fileinfo_send_all(fd, files);
+  WireBuf *w = wire_begin(fd, type);
+  if (codec->put != NULL) {
+    codec->put(w, body);
+  }
 
-  return 1;
+  return wire_end(w);
 }
 
-// populate a register message body
-int receive_register(int fd, Message *msg) {
-  // read the body
-  RegisterBody *body = calloc(1, sizeof(RegisterBody));
+// the same, for no fd in particular, into a buffer that becomes the shared
+// message's
+WireShared *share_message(MessageType type, void *body) {
+  if (type >= N_MESSAGE_TYPES) {
+    return NULL;
+  }
+  const BodyCodec *codec = &codecs[type];
+  if (codec->put != NULL && body == NULL) {
+    return NULL;
+  }
 
-  if (recv(fd, body, sizeof(RegisterBody), MSG_WAITALL) < 0) {
-    perror("error receiving");
-    return -1;
+  WireBuf *w = wire_begin(-1, type);
+  if (codec->put != NULL) {
+    codec->put(w, body);
   }
 
-  // a register message is followed by the file info list 
-  body->files = fileinfo_receive(fd, body->n_files);
+  return wire_share(w);
+}
 
-  msg->body = body;
+int send_shared(int fd, WireShared *msg) {
+  return wire_send_shared(fd, msg);
+}
 
-  return 1;
+void release_shared(WireShared *msg) {
+  wire_shared_release(msg);
 }
 
-/*
- * FILE_UPDATE send/receive functions
- */
-int send_file_update(int fd, FileEvent *events) {
-  Message header;
-  memset(&header, 0, sizeof(header));
+// do-it-all receive a message. Reads a whole message, then decodes whatever
+// structures are associated with its type. Pairs with send_message. Idea is
+// that tracker/client can send/receive linked structs that have pointers and
+// get everything all at once, without knowing about underlying transport
 
-  header.type = FILE_UPDATE;
+int recv_message(int fd, Message *msg) {
+  msg->body = NULL;
 
-  if (send(fd, &header, sizeof(header), 0) < 0) {
+  WireReader r;
+  int type = wire_recv(fd, &r);
+  if (type < 0) {
     return -1;
-  }  
-
-  // count how many events
-  int n_events = 0;
-  FileEvent *tmp = events;
-  while (tmp != NULL) {
-    n_events++;
-    tmp = tmp->next;
   }
-  
-  // create body with number of events 
-  FileUpdateBody body;
-  memset(&body, 0, sizeof(body));
+  return decode_message(type, &r, msg);
+}
 
-  body.n_events = n_events;
+// the same, for an event loop: only what has already arrived is read
+int poll_message(int fd, Message *msg) {
+  msg->body = NULL;
 
-  // send it off
-  if (send(fd, &body, sizeof(body), 0) < 0) {
+  WireReader r;
+  int type = wire_poll(fd, &r);
+  if (type == WIRE_AGAIN) {
+    return 0;
+  }
+  if (type < 0) {
     return -1;
   }
+  return decode_message(type, &r, msg);
+}
 
-  // and then finally send all the actual events
-  fileevent_send_all(fd, events);
+// decodes the body of the message r points at into msg, then releases r
+static int decode_message(int type, WireReader *r, Message *msg) {
+  msg->type = type;
 
-  return 1;
-}
+  // a type from a later version is passed on with no body, for the caller
+  // to ignore
+  if ((size_t) type >= N_MESSAGE_TYPES) {
+    wire_release(r);
+    return 1;
+  }
 
-// populate a file update message body
-int receive_file_update(int fd, Message *msg) {
-  // read the body
-  FileUpdateBody *body = calloc(1, sizeof(FileUpdateBody));
+  // now reconstruct body per message type
+  const BodyCodec *codec = &codecs[type];
+  void *body = NULL;
+  if (codec->get != NULL) {
+    body = calloc(1, codec->size);
+    if (body == NULL) {
+      fprintf(stderr, "malloc\n");
+      exit(1);
+    }
+    codec->get(r, body);
+  }
 
-  if (recv(fd, body, sizeof(FileUpdateBody), MSG_WAITALL) < 0) {
-    perror("error receiving");
+  // the body must take up exactly the payload
+  int done = wire_done(r);
+  wire_release(r);
+  if (!done) {
+    fprintf(stderr, "malformed message of type %d\n", type);
+    if (body != NULL) {
+      codec->free(body);
+      free(body);
+    }
     return -1;
   }
 
-  // a register message is followed by the file info list 
-  body->events = fileevent_receive(fd, body->n_events);
-
   msg->body = body;
-
   return 1;
 }
 
+// a table decoded from r, applying on top of version base
+static FlatTable *get_table(WireReader *r, unsigned long base) {
+  FlatTable *table = flattable_decode(r, base);
+  if (table == NULL) {
+    r->error = 1;
+  }
+  return table;
+}
+
 /*
- * KEEP_ALIVE send function
+ * the messages each end sends
  */
-int send_keep_alive(int fd) {
-  Message header;
-  memset(&header, 0, sizeof(header));
 
-  header.type = KEEP_ALIVE;
+// send a REGISTER message to the tracker, with the digest of the files we have
+int send_register(int fd, int listen_port, uint64_t digest, int features) {
+  RegisterBody body = {.listen_port = listen_port, .digest = digest, .features = features};
+  return send_message(fd, REGISTER, &body);
+}
 
-  if (send(fd, &header, sizeof(header), 0) < 0) {
-    return -1;
-  }  
+// tracker sends acknowledgement to peer with interval and piece length
+int send_register_ack(int fd, int interval, int piece_len, int features) {
+  RegisterAckBody body = {.interval = interval, .piece_len = piece_len, .features = features};
+  return send_message(fd, REGISTER_ACK, &body);
+}
 
-  return 1;
+int send_keep_alive(int fd) {
+  return send_message(fd, KEEP_ALIVE, NULL);
 }
 
+int send_file_update(int fd, FileEvent *events) {
+  FileUpdateBody body = {.events = events};
+  return send_message(fd, FILE_UPDATE, &body);
+}
 
-// do-it-all receive a message. First reads a message type, then
-// receives whatever structures are associated with that message.
-// pairs with send_message. Idea is that tracker/client can send/receive
-// linked structs that have pointers and get everything all at once, without
-// knowing about underlying transport
+int send_table_update(int fd, FileTable *table) {
+  if (table == NULL) {
+    return -1;
+  }
 
-int recv_message(int fd, Message *msg) {
-  // attempt to read a message in 
-  int n_read = recv(fd, msg, sizeof(Message), MSG_WAITALL);
+  TableUpdateBody body = {.table = table};
+  return send_message(fd, TABLE_UPDATE, &body);
+}
 
-  // client hung up
-  if (n_read == 0) {
+int send_table_delta(int fd, FileTable *table, unsigned long since) {
+  if (table == NULL) {
     return -1;
   }
 
-  if (n_read <= 0) {
-    perror("error receiving");
-    return -1;
+  // the peer is already up to date
+  if (since >= table->version) {
+    return 0;
   }
 
-  // now reconstruct body per message type
-  switch (msg->type) {
-    case REGISTER:
-      receive_register(fd, msg);
-      break;
+  // those changes have been forgotten, so the peer needs the whole table
+  if (since < table->base) {
+    return send_table_update(fd, table);
+  }
 
-    case REGISTER_ACK:
-      receive_register_ack(fd, msg);
-      break;
+  TableDeltaBody body = {.since = since, .table = table};
+  return send_message(fd, TABLE_DELTA, &body);
+}
 
-    case FILE_UPDATE:
-      receive_file_update(fd, msg);
-      break;
+WireShared *share_table_delta(FileTable *table, unsigned long since) {
+  if (table == NULL || since >= table->version) {
+    return NULL;
+  }
 
-    case TABLE_UPDATE:
-      receive_table_update(fd, msg);
-      break;
+  if (since < table->base) {
+    TableUpdateBody body = {.table = table};
+    return share_message(TABLE_UPDATE, &body);
+  }
 
-    case KEEP_ALIVE:
-      // no body content for keep-alive messages
-      break;
+  TableDeltaBody body = {.since = since, .table = table};
+  return share_message(TABLE_DELTA, &body);
+}
 
-    default:
-    break;
-  }
+int send_table_ack(int fd, unsigned long version) {
+  TableAckBody body = {.version = version};
+  return send_message(fd, TABLE_ACK, &body);
+}
 
-  return 1;
+// have the tracker check our files, summed up in digest, against its table
+int send_sync(int fd, uint64_t digest) {
+  SyncBody body = {.digest = digest};
+  return send_message(fd, SYNC, &body);
+}
+
+// ask the peer for the digests of everything directly below each of dirs
+int send_sync_request(int fd, FileInfo_FS *dirs) {
+  SyncRequestBody body = {.dirs = dirs};
+  return send_message(fd, SYNC_REQUEST, &body);
+}
+
+// answer a SYNC_REQUEST with the nodes below the requested directories
+int send_sync_digests(int fd, DigestNode *nodes) {
+  SyncDigestsBody body = {.nodes = nodes};
+  return send_message(fd, SYNC_DIGESTS, &body);
 }
 
 char *get_my_ip() {
@@ -327,4 +378,3 @@ char *get_my_ip() {
   char* ip = inet_ntoa(*(struct in_addr *)(host->h_addr_list[0]));
   return ip;
 }
-
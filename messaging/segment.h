@@ -22,60 +22,167 @@
 #include "../monitor/fileinfo.h"
 #include "../monitor/fileevent.h"
 #include "../filetable/filetable.h"
-
-// Segment type declarations for segments sent from peer to tracker:
-typedef enum {
-  ERROR,              // type should never be 0
-  REGISTER,
-  REGISTER_ACK,
-  KEEP_ALIVE,
-  TABLE_UPDATE,
-  FILE_UPDATE,        // used by peer to inform server of changes, and then broadcasted to others
-} MessageType;
+#include "../filetable/flattable.h"
+#include "wire.h"
 
 #define HANDSHAKE_PORT 9571
 #define IP_LEN INET_ADDRSTRLEN
 
-// layer of encapsulation to hide away how the structs are actually sent/reconstructed
-// over the socket. Depending on what `type` is, body will point to the corresponding Body
-// struct as defined below. The function `recv_message` will handle loading the body correctly,
-// so the external consumer only needs to call that and then can trust that the body will be
-// populated as needed.
+// What either end can offer in REGISTER and REGISTER_ACK
+#define FEATURE_COMPRESS 0x1      // can take compressed messages
+
+// Every message type, its body and the body's fields in the order they're
+// encoded: M(type, body, fields) for a message with a body, E(type) for one
+// without. Each field is F(kind, name); the kinds, and how each is encoded,
+// are in segment.c. The message types, the body structs and the routines that
+// encode and decode them are all generated from this list. Types are numbered
+// in order, so new ones go at the end.
+#define LIST_OF_MESSAGES(M, E, F) \
+  E(ERROR)                      /* type should never be 0 */ \
+  M(REGISTER, RegisterBody, \
+    F(I32, listen_port)         /* port that this peer is listening for p2p connections */ \
+    F(U64, digest)              /* digest of all the peer's files; those that differ are asked for */ \
+    F(I32, features))           /* FEATURE_ bits the peer offers */ \
+  M(REGISTER_ACK, RegisterAckBody, \
+    F(I32, interval)            /* seconds between the peer's heartbeats */ \
+    F(I32, piece_len)           /* how large the chunks of files are */ \
+    F(I32, features))           /* FEATURE_ bits the tracker offers */ \
+  E(KEEP_ALIVE) \
+  M(TABLE_UPDATE, TableUpdateBody, \
+    F(TABLE, table))            /* the new file table */ \
+  M(FILE_UPDATE, FileUpdateBody, /* used by peer to inform server of changes */ \
+    F(EVENTS, events))          /* file events that occurred, and n_events */ \
+  M(TABLE_DELTA, TableDeltaBody, /* changes to the file table since a version the peer acknowledged */ \
+    F(VERSION, since)           /* the version the changes apply on top of */ \
+    F(CHANGES, table))          /* the changes after since */ \
+  M(TABLE_ACK, TableAckBody,    /* used by peer to tell the tracker which table version it has */ \
+    F(VERSION, version))        /* version of the file table the peer now has */ \
+  M(SYNC, SyncBody,             /* used by peer to have the tracker check its files against the table */ \
+    F(U64, digest))             /* digest of all the peer's files, as in REGISTER */ \
+  M(SYNC_REQUEST, SyncRequestBody, /* tracker asks for the digests below directories that differ */ \
+    F(FILES, dirs))             /* directories whose children's digests are wanted, and n_dirs */ \
+  M(SYNC_DIGESTS, SyncDigestsBody, /* peer's answer to a SYNC_REQUEST */ \
+    F(NODES, nodes))            /* the children of every requested directory, and n_nodes */
+
+// What each kind of field is in a body struct
+#define FIELD_I32(name) int name;
+#define FIELD_U64(name) uint64_t name;
+#define FIELD_VERSION(name) unsigned long name;
+#define FIELD_TABLE(name) FileTable *name; FlatTable *flat_##name;
+#define FIELD_CHANGES(name) FileTable *name; FlatTable *flat_##name;
+#define FIELD_EVENTS(name) int n_##name; FileEvent *name;
+#define FIELD_FILES(name) int n_##name; FileInfo_FS *name;
+#define FIELD_NODES(name) int n_##name; DigestNode *name;
+
+#define M(type, body, fields) type,
+#define E(type) type,
+#define F(kind, name)
+typedef enum { LIST_OF_MESSAGES(M, E, F) } MessageType;
+#undef M
+#undef E
+#undef F
+
+#define M(type, body, fields) typedef struct { fields } body;
+#define E(type)
+#define F(kind, name) FIELD_##kind(name)
+LIST_OF_MESSAGES(M, E, F)
+#undef M
+#undef E
+#undef F
+
+// layer of encapsulation to hide away how the bodies are actually encoded
+// over the socket. Depending on what `type` is, body will point to the
+// corresponding body struct as generated above. The function `recv_message`
+// will handle decoding the body, so the external consumer only needs to call
+// that and then can trust that the body will be populated as needed.
 
 // generic message struct that will hold all communication sent between tracker/peer
 typedef struct {
   MessageType type;     // the type of the message being sent
-  void *body;           // will hold the correct body for the message type; one of the below 
+  void *body;           // will hold the correct body for the message type; NULL if it has none
 } Message;
 
-typedef struct {
-  int listen_port;      // port that this peer is listening for p2p connections
-  int n_files;          // number of files that are about to be sent
-  FileInfo_FS *files;      // files on the tracker at initialization 
-} RegisterBody;
+// Method to get the ip address of the current peer.
+char *get_my_ip();
 
-typedef struct {
-  int interval;         // port that this peer is listening for p2p connections
-  int piece_len;        // how large the chunks of files are
-} RegisterAckBody;
+/*
+ * Starts a connection at fd: paths are named in a session on it (see
+ * fileinfo_session_open), by the end that opens it with names set, and it
+ * keeps buffers for messages (see wire_open). Both ends open it before their
+ * first message, and close it before closing fd.
+ */
+void message_open(int fd, int names);
 
-typedef struct {
-  int n_events;         // number of file events 
-  FileEvent *events;    // file events that occurred
-} FileUpdateBody;
+void message_close(int fd);
 
-typedef struct {
-  FileTable *table;    // the new file table
-} TableUpdateBody;
+/*
+ * Holds back the messages sent on fd until message_uncork, which sends them
+ * all in one write. For messages sent one after another, under the lock
+ * that serializes sends on fd.
+ */
+void message_cork(int fd);
 
-// Method to get the ip address of the current peer.
-char *get_my_ip();
+int message_uncork(int fd);
+
+/*
+ * Sends what a non-blocking fd couldn't take when it was sent, as far as it
+ * takes it now; under the lock that serializes sends on fd.
+ * @return 1 if it all went, 0 if some is still waiting, -1 on error
+ */
+int message_flush(int fd);
 
+/*
+ * @return the bytes sent on fd that it hasn't taken yet
+ */
+size_t message_pending(int fd);
+
+/*
+ * Compresses the large messages sent on fd from now on; for once the other
+ * end has offered FEATURE_COMPRESS.
+ */
+void message_compress(int fd);
+
+/*
+ * Receives one message, decoding its body into a newly allocated struct in
+ * msg->body, which the caller frees along with what it points to.
+ * @return 1 on success, -1 on error, hang-up or a message that doesn't
+ * decode
+ */
 int recv_message(int fd, Message *msg);
 
-int send_register(int fd, int listen_port, FileInfo_FS *files);
+/*
+ * As recv_message, for a non-blocking fd served from an event loop: takes
+ * the next message if the whole of it has arrived, without waiting for one.
+ * @return 1 with a message, 0 if there is no whole message yet, -1 on error,
+ * hang-up or a message that doesn't decode
+ */
+int poll_message(int fd, Message *msg);
+
+/*
+ * Encodes body, a struct of the type's body or NULL if it has none, and
+ * sends it as one message. The send_ functions below wrap this.
+ * @return 1 on success, -1 on error
+ */
+int send_message(int fd, MessageType type, void *body);
+
+/*
+ * Encodes body once, as send_message would, to be sent as it is on many
+ * connections with send_shared; its paths go whole, since they are named in
+ * no one connection's session.
+ * @return the message, to be released with release_shared, or NULL on error
+ */
+WireShared *share_message(MessageType type, void *body);
+
+// sends a message made by share_message on fd, after anything queued there
+int send_shared(int fd, WireShared *msg);
+
+void release_shared(WireShared *msg);
 
-int send_register_ack(int fd, int interval, int piece_size);
+// registers with the digest of the peer's files rather than the files; the
+// tracker then asks for whatever differs from its table with SYNC_REQUESTs
+int send_register(int fd, int listen_port, uint64_t digest, int features);
+
+int send_register_ack(int fd, int interval, int piece_size, int features);
 
 int send_keep_alive(int fd);
 
@@ -83,4 +190,20 @@ int send_file_update(int fd, FileEvent *event);
 
 int send_table_update(int fd, FileTable *table);
 
+// sends the changes to table after version since, the whole table if those
+// changes are no longer known, or nothing if there are none
+int send_table_delta(int fd, FileTable *table, unsigned long since);
+
+// what send_table_delta sends, encoded once for every peer that has
+// acknowledged since; NULL if there is nothing to send
+WireShared *share_table_delta(FileTable *table, unsigned long since);
+
+int send_table_ack(int fd, unsigned long version);
+
+int send_sync(int fd, uint64_t digest);
+
+int send_sync_request(int fd, FileInfo_FS *dirs);
+
+int send_sync_digests(int fd, DigestNode *nodes);
+
 #endif //SEGMENT_H
@@ -0,0 +1,966 @@
+/*
+ * wire.c: framing and encoding of the messages sent between the tracker
+ * and peers
+ *
+ * Final project, CS60, Spring 2018
+ */
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <pthread.h>
+#include "wire.h"
+#include "compress.h"
+
+// The buffers kept for one connection
+typedef struct {
+  WireBuf out;          // messages encoded and not yet sent
+  size_t sent;          // bytes of out a non-blocking fd has taken so far
+  WireShared *shared;   // a shared message to send before out, if any
+  size_t sharedpos;     // and how much of it has gone
+  int corked;           // whether they are being held back
+  int compress;         // whether to compress large messages
+  char *in;             // bytes read from the fd, in[inpos] onwards not yet
+  size_t inlen;         // decoded; inlen bytes in all
+  size_t incap;
+  size_t inpos;
+  size_t last;          // bytes of the message last received, dropped by the next
+} WireConn;
+
+static WireConn **conns;          // by fd
+static int nconns;
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;   // for every WireShared
+
+static WireConn *conn_get(int fd);
+static void conn_free(WireConn *conn);
+static int flush(WireConn *conn);
+static int send_all(int fd, const char *data, size_t len);
+static int fill(int fd, WireConn *conn, size_t want, int flags);
+static void compress_payload(WireBuf *w);
+static WireShared *shared_packed(WireShared *m);
+static int inflate(WireReader *r);
+static int check_header(const char *header, int *type, int *flags, uint32_t *len);
+static void reserve(WireBuf *w, size_t len);
+static void put_be(char *dst, uint64_t value, int n);
+static uint64_t get_be(const char *src, int n);
+static uint64_t get_n(WireReader *r, int n);
+static uint32_t shared_prefix(const char *a, uint32_t alen, const char *b, uint32_t blen);
+static void set_path(WireReader *r, uint32_t keep, const char *rest, uint32_t len);
+
+/*
+ * connections
+ */
+
+void wire_open(int fd) {
+  if (fd < 0) {
+    return;
+  }
+
+  WireConn *conn = calloc(1, sizeof(WireConn));
+  if (conn == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  conn->out.fd = fd;
+
+  pthread_mutex_lock(&conns_lock);
+  if (fd >= nconns) {
+    int n = (fd + 1 > 2 * nconns) ? fd + 1 : 2 * nconns;
+    WireConn **grown = realloc(conns, n * sizeof(WireConn *));
+    if (grown == NULL) {
+      fprintf(stderr, "malloc\n");
+      exit(1);
+    }
+    memset(grown + nconns, 0, (n - nconns) * sizeof(WireConn *));
+    conns = grown;
+    nconns = n;
+  }
+
+  // an fd closed without closing its buffers starts over
+  conn_free(conns[fd]);
+  conns[fd] = conn;
+  pthread_mutex_unlock(&conns_lock);
+}
+
+void wire_close(int fd) {
+  pthread_mutex_lock(&conns_lock);
+  if (fd >= 0 && fd < nconns) {
+    conn_free(conns[fd]);
+    conns[fd] = NULL;
+  }
+  pthread_mutex_unlock(&conns_lock);
+}
+
+void wire_cork(int fd) {
+  WireConn *conn = conn_get(fd);
+  if (conn != NULL) {
+    conn->corked = 1;
+  }
+}
+
+int wire_uncork(int fd) {
+  WireConn *conn = conn_get(fd);
+  if (conn == NULL) {
+    return 1;
+  }
+
+  conn->corked = 0;
+  return (flush(conn) >= 0) ? 1 : -1;
+}
+
+int wire_flush(int fd) {
+  WireConn *conn = conn_get(fd);
+  return (conn == NULL) ? 1 : flush(conn);
+}
+
+size_t wire_pending(int fd) {
+  WireConn *conn = conn_get(fd);
+  if (conn == NULL) {
+    return 0;
+  }
+
+  size_t shared = (conn->shared == NULL) ? 0 : conn->shared->len - conn->sharedpos;
+  return shared + conn->out.len - conn->sent;
+}
+
+void wire_compress(int fd) {
+  WireConn *conn = conn_get(fd);
+  if (conn != NULL) {
+    conn->compress = 1;
+  }
+}
+
+/*
+ * encoding
+ */
+
+// starts a message after those already in fd's buffer, leaving room for the
+// header
+WireBuf *wire_begin(int fd, int type) {
+  WireConn *conn = conn_get(fd);
+  WireBuf *w;
+  if (conn != NULL) {
+    w = &conn->out;
+  }
+  else {
+    w = calloc(1, sizeof(WireBuf));
+    if (w == NULL) {
+      fprintf(stderr, "malloc\n");
+      exit(1);
+    }
+    w->fd = fd;
+    w->own = 1;
+  }
+
+  w->start = w->len;
+  reserve(w, WIRE_HEADER);
+  char *header = w->data + w->start;
+  put_be(header, WIRE_MAGIC, 4);
+  put_be(header + 4, WIRE_VERSION, 1);
+  put_be(header + 5, type, 1);
+  put_be(header + 6, 0, 2);               // flags, set as it is finished
+  put_be(header + 8, 0, 4);               // filled in by wire_end
+  w->len += WIRE_HEADER;
+
+  // the first path and time in a message are coded against nothing
+  w->prevpath = NULL;
+  w->prevlen = 0;
+  w->prevtime = 0;
+
+  return w;
+}
+
+// fills in the payload length, then sends everything not held back
+int wire_end(WireBuf *w) {
+  size_t len = w->len - w->start - WIRE_HEADER;
+  if (len > WIRE_MAX_PAYLOAD) {
+    fprintf(stderr, "message of %zu bytes is too long to send\n", len);
+    w->len = w->start;
+    if (w->own) {
+      wire_free(w);
+      free(w);
+    }
+    return -1;
+  }
+  put_be(w->data + w->start + 8, len, 4);
+
+  if (!w->own && ((WireConn *) w)->compress && len >= WIRE_COMPRESS_MIN) {
+    compress_payload(w);
+  }
+
+  if (w->own) {
+    int res = send_all(w->fd, w->data, w->len);
+    wire_free(w);
+    free(w);
+    return res;
+  }
+
+  WireConn *conn = (WireConn *) w;
+  return (conn->corked || flush(conn) >= 0) ? 1 : -1;
+}
+
+// the buffer itself becomes the shared message's
+WireShared *wire_share(WireBuf *w) {
+  size_t len = w->len - w->start - WIRE_HEADER;
+  if (len > WIRE_MAX_PAYLOAD) {
+    fprintf(stderr, "message of %zu bytes is too long to send\n", len);
+    wire_free(w);
+    free(w);
+    return NULL;
+  }
+  put_be(w->data + w->start + 6, WIRE_SHARED, 2);
+  put_be(w->data + w->start + 8, len, 4);
+
+  WireShared *m = calloc(1, sizeof(WireShared));
+  if (m == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  m->data = w->data;
+  m->len = w->len;
+  m->refs = 1;
+
+  free(w);
+  return m;
+}
+
+WireShared *wire_shared_retain(WireShared *m) {
+  pthread_mutex_lock(&shared_lock);
+  m->refs++;
+  pthread_mutex_unlock(&shared_lock);
+  return m;
+}
+
+void wire_shared_release(WireShared *m) {
+  if (m == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&shared_lock);
+  int refs = --m->refs;
+  pthread_mutex_unlock(&shared_lock);
+  if (refs > 0) {
+    return;
+  }
+
+  if (m->packed != m) {
+    wire_shared_release(m->packed);
+  }
+  free(m->data);
+  free(m);
+}
+
+int wire_send_shared(int fd, WireShared *m) {
+  WireConn *conn = conn_get(fd);
+  if (conn == NULL) {
+    return send_all(fd, m->data, m->len);
+  }
+  if (conn->compress) {
+    m = shared_packed(m);
+  }
+
+  // nothing ahead of it, so it needn't be copied
+  if (conn->shared == NULL && conn->out.len == 0 && !conn->corked) {
+    conn->shared = wire_shared_retain(m);
+    conn->sharedpos = 0;
+    return (flush(conn) >= 0) ? 1 : -1;
+  }
+
+  WireBuf *w = &conn->out;
+  reserve(w, m->len);
+  memcpy(w->data + w->len, m->data, m->len);
+  w->len += m->len;
+  return (conn->corked || flush(conn) >= 0) ? 1 : -1;
+}
+
+void wire_free(WireBuf *w) {
+  free(w->data);
+  w->data = NULL;
+  w->len = w->cap = w->start = 0;
+}
+
+void wire_put_u8(WireBuf *w, uint8_t value) {
+  reserve(w, 1);
+  put_be(w->data + w->len, value, 1);
+  w->len += 1;
+}
+
+void wire_put_u16(WireBuf *w, uint16_t value) {
+  reserve(w, 2);
+  put_be(w->data + w->len, value, 2);
+  w->len += 2;
+}
+
+void wire_put_u32(WireBuf *w, uint32_t value) {
+  reserve(w, 4);
+  put_be(w->data + w->len, value, 4);
+  w->len += 4;
+}
+
+void wire_put_u64(WireBuf *w, uint64_t value) {
+  reserve(w, 8);
+  put_be(w->data + w->len, value, 8);
+  w->len += 8;
+}
+
+void wire_put_bytes(WireBuf *w, const void *bytes, size_t len) {
+  if (len == 0) {
+    return;
+  }
+  reserve(w, len);
+  memcpy(w->data + w->len, bytes, len);
+  w->len += len;
+}
+
+void wire_put_varint(WireBuf *w, uint64_t value) {
+  reserve(w, 10);
+  while (value >= 0x80) {
+    w->data[w->len++] = (char) ((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  w->data[w->len++] = (char) value;
+}
+
+void wire_put_str(WireBuf *w, const char *str, uint32_t len) {
+  wire_put_varint(w, len);
+  wire_put_bytes(w, str, len);
+}
+
+void wire_put_path(WireBuf *w, const char *path, uint32_t len) {
+  uint32_t keep = shared_prefix(w->prevpath, w->prevlen, path, len);
+  wire_put_varint(w, keep);
+  wire_put_str(w, path + keep, len - keep);
+  wire_skip_path(w, path, len);
+}
+
+void wire_skip_path(WireBuf *w, const char *path, uint32_t len) {
+  w->prevpath = path;
+  w->prevlen = len;
+}
+
+// the difference, zigzagged so small ones either way take a byte or two
+void wire_put_time(WireBuf *w, int64_t time) {
+  uint64_t delta = (uint64_t) time - (uint64_t) w->prevtime;
+  wire_put_varint(w, (delta << 1) ^ (uint64_t) ((int64_t) delta >> 63));
+  w->prevtime = time;
+}
+
+/*
+ * decoding
+ */
+
+// reads the header, checks it, then reads the payload it announces, from
+// what was read ahead if the fd has buffers, else straight from the fd
+int wire_recv(int fd, WireReader *r) {
+  memset(r, 0, sizeof(WireReader));
+  r->fd = fd;
+
+  WireConn *conn = conn_get(fd);
+  if (conn == NULL) {
+    char header[WIRE_HEADER];
+    ssize_t n = recv(fd, header, WIRE_HEADER, MSG_WAITALL);
+    if (n != WIRE_HEADER) {
+      if (n < 0) {
+        perror("error receiving");
+      }
+      return -1;
+    }
+
+    int type, flags;
+    uint32_t len;
+    if (check_header(header, &type, &flags, &len) < 0) {
+      return -1;
+    }
+    // the payload, into a buffer grown as it arrives rather than to the
+    // length the header claims
+    size_t got = 0, cap = 0;
+    do {
+      if (got == cap) {
+        cap = (cap < WIRE_BLOCK) ? WIRE_BLOCK : cap * 2;
+        if (cap > (size_t) len + 1) {
+          cap = (size_t) len + 1;
+        }
+        char *grown = realloc(r->own, cap);
+        if (grown == NULL) {
+          fprintf(stderr, "no room for a message of %u bytes\n", len);
+          wire_release(r);
+          return -1;
+        }
+        r->own = grown;
+      }
+      size_t chunk = ((cap < (size_t) len) ? cap : (size_t) len) - got;
+      if (chunk > 0 && recv(fd, r->own + got, chunk, MSG_WAITALL) != (ssize_t) chunk) {
+        perror("error receiving");
+        wire_release(r);
+        return -1;
+      }
+      got += chunk;
+    } while (got < len);
+    r->data = r->own;
+    r->len = len;
+    r->shared = (flags & WIRE_SHARED) != 0;
+    if ((flags & WIRE_COMPRESSED) && inflate(r) < 0) {
+      wire_release(r);
+      return -1;
+    }
+    return type;
+  }
+
+  // drop the message decoded last time
+  conn->inpos += conn->last;
+  conn->last = 0;
+
+  // the header, with whatever else has arrived behind it
+  while (conn->inlen - conn->inpos < WIRE_HEADER) {
+    if (fill(fd, conn, WIRE_HEADER, 0) < 0) {
+      return -1;
+    }
+  }
+
+  int type, flags;
+  uint32_t len;
+  if (check_header(conn->in + conn->inpos, &type, &flags, &len) < 0) {
+    return -1;
+  }
+
+  // then the rest of the payload, all at once
+  size_t need = WIRE_HEADER + (size_t) len;
+  while (conn->inlen - conn->inpos < need) {
+    if (fill(fd, conn, need, MSG_WAITALL) < 0) {
+      return -1;
+    }
+  }
+
+  conn->last = need;
+  r->data = conn->in + conn->inpos + WIRE_HEADER;
+  r->len = len;
+  r->shared = (flags & WIRE_SHARED) != 0;
+  if ((flags & WIRE_COMPRESSED) && inflate(r) < 0) {
+    return -1;
+  }
+  return type;
+}
+
+// as wire_recv, but takes only what has already arrived, and rather than
+// wait for the rest of a message leaves it for the next call
+int wire_poll(int fd, WireReader *r) {
+  memset(r, 0, sizeof(WireReader));
+  r->fd = fd;
+
+  WireConn *conn = conn_get(fd);
+  if (conn == NULL) {
+    return -1;
+  }
+
+  // drop the message decoded last time
+  conn->inpos += conn->last;
+  conn->last = 0;
+
+  // the header, then the payload it announces, reading for as long as
+  // there is something to read
+  int type, flags;
+  uint32_t len;
+  size_t need = WIRE_HEADER;
+  while (1) {
+    size_t have = conn->inlen - conn->inpos;
+    if (have >= WIRE_HEADER) {
+      if (check_header(conn->in + conn->inpos, &type, &flags, &len) < 0) {
+        return -1;
+      }
+      need = WIRE_HEADER + (size_t) len;
+      if (have >= need) {
+        break;
+      }
+    }
+
+    int res = fill(fd, conn, need, MSG_DONTWAIT);
+    if (res <= 0) {
+      return (res == 0) ? WIRE_AGAIN : -1;
+    }
+  }
+
+  conn->last = need;
+  r->data = conn->in + conn->inpos + WIRE_HEADER;
+  r->len = len;
+  r->shared = (flags & WIRE_SHARED) != 0;
+  if ((flags & WIRE_COMPRESSED) && inflate(r) < 0) {
+    return -1;
+  }
+  return type;
+}
+
+void wire_release(WireReader *r) {
+  free(r->own);
+  r->own = NULL;
+  free(r->path);
+  r->path = NULL;
+  r->pathlen = r->pathcap = 0;
+  r->data = NULL;
+  r->len = r->pos = 0;
+}
+
+uint8_t wire_get_u8(WireReader *r) {
+  return get_n(r, 1);
+}
+
+uint16_t wire_get_u16(WireReader *r) {
+  return get_n(r, 2);
+}
+
+uint32_t wire_get_u32(WireReader *r) {
+  return get_n(r, 4);
+}
+
+uint64_t wire_get_u64(WireReader *r) {
+  return get_n(r, 8);
+}
+
+uint64_t wire_get_varint(WireReader *r) {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    const char *byte = wire_get_bytes(r, 1);
+    if (byte == NULL) {
+      return 0;
+    }
+    // the tenth byte has room for the one bit left
+    if (shift == 63 && (*byte & 0x7e) != 0) {
+      break;
+    }
+    value |= (uint64_t) (*byte & 0x7f) << shift;
+    if ((*byte & 0x80) == 0) {
+      return value;
+    }
+  }
+
+  // more than ten bytes, or 64 bits, is no varint we send
+  r->error = 1;
+  return 0;
+}
+
+int64_t wire_get_time(WireReader *r) {
+  uint64_t zigzag = wire_get_varint(r);
+  uint64_t delta = (zigzag >> 1) ^ (0 - (zigzag & 1));
+  r->prevtime = (int64_t) ((uint64_t) r->prevtime + delta);
+  return r->prevtime;
+}
+
+uint32_t wire_get_count(WireReader *r) {
+  uint64_t count = wire_get_varint(r);
+  if (count > r->len - r->pos) {
+    r->error = 1;
+  }
+  return r->error ? 0 : (uint32_t) count;
+}
+
+const char *wire_get_bytes(WireReader *r, size_t len) {
+  if (r->error || len > r->len - r->pos) {
+    r->error = 1;
+    return NULL;
+  }
+  const char *bytes = r->data + r->pos;
+  r->pos += len;
+  return bytes;
+}
+
+const char *wire_get_str(WireReader *r, uint32_t max, uint32_t *len) {
+  uint64_t n = wire_get_varint(r);
+  if (n > max) {
+    r->error = 1;
+  }
+  if (r->error) {
+    *len = 0;
+    return NULL;
+  }
+  *len = (uint32_t) n;
+  return wire_get_bytes(r, *len);
+}
+
+// the prefix kept from the last path, then the rest
+const char *wire_get_path(WireReader *r, uint32_t max, uint32_t *len) {
+  *len = 0;
+  uint64_t keep = wire_get_varint(r);
+  if (keep > r->pathlen) {
+    r->error = 1;
+  }
+  uint32_t restlen;
+  const char *rest = wire_get_str(r, max, &restlen);
+  if (r->error || keep + restlen > max) {
+    r->error = 1;
+    return NULL;
+  }
+
+  set_path(r, (uint32_t) keep, rest, restlen);
+  *len = r->pathlen;
+  return r->path;
+}
+
+void wire_saw_path(WireReader *r, const char *path, uint32_t len) {
+  set_path(r, 0, path, len);
+}
+
+int wire_done(WireReader *r) {
+  return !r->error && r->pos == r->len;
+}
+
+/*
+ * helpers
+ */
+
+// the buffers kept for fd, or NULL
+static WireConn *conn_get(int fd) {
+  pthread_mutex_lock(&conns_lock);
+  WireConn *conn = (fd >= 0 && fd < nconns) ? conns[fd] : NULL;
+  pthread_mutex_unlock(&conns_lock);
+  return conn;
+}
+
+static void conn_free(WireConn *conn) {
+  if (conn == NULL) {
+    return;
+  }
+
+  wire_shared_release(conn->shared);
+  wire_free(&conn->out);
+  free(conn->in);
+  free(conn);
+}
+
+// sends the shared message being sent, then what's in the send buffer,
+// emptying it; a buffer grown for one big message isn't kept. A
+// non-blocking fd that won't take it all leaves the rest where it is, ahead
+// of any messages added after it, and returns 0
+static int flush(WireConn *conn) {
+  WireBuf *w = &conn->out;
+  int res = 1;
+  while (conn->shared != NULL) {
+    WireShared *m = conn->shared;
+    ssize_t n = send(w->fd, m->data + conn->sharedpos, m->len - conn->sharedpos, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return 0;
+    }
+    if (n <= 0) {
+      perror("error sending");
+      conn->shared = NULL;
+      wire_shared_release(m);
+      res = -1;
+      break;
+    }
+    conn->sharedpos += n;
+    if (conn->sharedpos == m->len) {
+      conn->shared = NULL;
+      wire_shared_release(m);
+    }
+  }
+  while (res > 0 && conn->sent < w->len) {
+    ssize_t n = send(w->fd, w->data + conn->sent, w->len - conn->sent, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      // move what's left to the front once most of the buffer has gone, so
+      // a connection that is always a little behind doesn't grow it forever
+      if (conn->sent > w->len / 2) {
+        memmove(w->data, w->data + conn->sent, w->len - conn->sent);
+        w->len -= conn->sent;
+        conn->sent = 0;
+      }
+      return 0;
+    }
+    if (n <= 0) {
+      perror("error sending");
+      res = -1;
+      break;
+    }
+    conn->sent += n;
+  }
+
+  w->len = w->start = 0;
+  conn->sent = 0;
+  if (w->cap > WIRE_KEEP) {
+    wire_free(w);
+  }
+  return res;
+}
+
+// a blocking socket takes it all at once unless interrupted
+static int send_all(int fd, const char *data, size_t len) {
+  size_t sent = 0;
+  while (sent < len) {
+    ssize_t n = send(fd, data + sent, len - sent, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      perror("error sending");
+      return -1;
+    }
+    sent += n;
+  }
+
+  return 1;
+}
+
+// reads more of fd into the receive buffer, working towards holding want
+// bytes from inpos. The buffer grows with what has actually arrived, by
+// doubling, rather than to whatever length a header announces, so a peer
+// can't make it allocate more than it has sent. With MSG_WAITALL it waits
+// for as much of want as fits; without, it takes whatever has arrived, up
+// to a block ahead, and with MSG_DONTWAIT returns 0 if nothing has
+static int fill(int fd, WireConn *conn, size_t want, int flags) {
+  size_t have = conn->inlen - conn->inpos;
+
+  // the buffer grows once it hasn't a block free for the message, to room
+  // for a block more or for what has arrived again, but never past want; it
+  // shrinks again once a message that needed it to be big is done
+  size_t cap = conn->incap;
+  if (cap < want && cap - have < WIRE_BLOCK) {
+    cap = (have > WIRE_BLOCK) ? have * 2 : have + WIRE_BLOCK;
+  }
+  if (cap > conn->incap || (conn->incap > WIRE_KEEP && want <= WIRE_KEEP)) {
+    if (cap > want) {
+      cap = want;
+    }
+    if (cap < WIRE_BLOCK) {
+      cap = WIRE_BLOCK;
+    }
+  }
+
+  // move what's left to the front, into the new buffer if there is one
+  if (cap != conn->incap) {
+    char *in = malloc(cap);
+    if (in == NULL) {
+      fprintf(stderr, "no room for a message of %zu bytes\n", want);
+      return -1;
+    }
+    if (have > 0) {
+      memcpy(in, conn->in + conn->inpos, have);
+    }
+    free(conn->in);
+    conn->in = in;
+    conn->incap = cap;
+  }
+  else if (conn->inpos > 0 && have > 0) {
+    memmove(conn->in, conn->in + conn->inpos, have);
+  }
+  conn->inpos = 0;
+  conn->inlen = have;
+
+  size_t len = conn->incap - conn->inlen;
+  if ((flags & MSG_WAITALL) && want - have < len) {
+    len = want - have;
+  }
+  ssize_t n = recv(fd, conn->in + conn->inlen, len, flags);
+  if (n < 0 && errno == EINTR) {
+    return 1;
+  }
+  if (n < 0 && (flags & MSG_DONTWAIT) && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    return 0;
+  }
+  if (n <= 0) {
+    if (n < 0) {
+      perror("error receiving");
+    }
+    return -1;
+  }
+
+  conn->inlen += n;
+  return 1;
+}
+
+// checks a header is one this end can read, and takes the type and payload
+// length from it
+static int check_header(const char *header, int *type, int *flags, uint32_t *len) {
+  uint32_t magic = get_be(header, 4);
+  int version = get_be(header + 4, 1);
+  *type = get_be(header + 5, 1);
+  *flags = get_be(header + 6, 2);
+  *len = get_be(header + 8, 4);
+  if (magic != WIRE_MAGIC) {
+    fprintf(stderr, "not a LocalSync message\n");
+    return -1;
+  }
+  if (version != WIRE_VERSION) {
+    fprintf(stderr, "message version %d, expected %d\n", version, WIRE_VERSION);
+    return -1;
+  }
+  if (*flags & ~WIRE_FLAGS) {
+    fprintf(stderr, "message with unknown flags %#x\n", *flags);
+    return -1;
+  }
+  if (*len > WIRE_MAX_PAYLOAD) {
+    fprintf(stderr, "message of %u bytes is too long\n", *len);
+    return -1;
+  }
+
+  return 0;
+}
+
+// replaces the payload of the message just finished in w with its length and
+// the compressed block, if that is shorter
+static void compress_payload(WireBuf *w) {
+  char *payload = w->data + w->start + WIRE_HEADER;
+  size_t len = w->len - w->start - WIRE_HEADER;
+  char *block = malloc(len);
+  if (block == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  size_t blocklen = compress_block(payload, len, block, len - 4);
+  if (blocklen > 0) {
+    put_be(payload, len, 4);
+    memcpy(payload + 4, block, blocklen);
+    w->len = w->start + WIRE_HEADER + 4 + blocklen;
+
+    char *header = w->data + w->start;
+    put_be(header + 6, get_be(header + 6, 2) | WIRE_COMPRESSED, 2);
+    put_be(header + 8, 4 + blocklen, 4);
+  }
+
+  free(block);
+}
+
+// the shared message compressed, made once for every connection that
+// compresses
+static WireShared *shared_packed(WireShared *m) {
+  if (m->len - WIRE_HEADER < WIRE_COMPRESS_MIN) {
+    return m;
+  }
+
+  pthread_mutex_lock(&shared_lock);
+  if (m->packed == NULL) {
+    WireBuf w;
+    memset(&w, 0, sizeof(w));
+    w.fd = -1;
+    reserve(&w, m->len);
+    memcpy(w.data, m->data, m->len);
+    w.len = m->len;
+    compress_payload(&w);
+
+    if (w.len < m->len) {
+      WireShared *packed = calloc(1, sizeof(WireShared));
+      if (packed == NULL) {
+        fprintf(stderr, "malloc\n");
+        exit(1);
+      }
+      packed->data = w.data;
+      packed->len = w.len;
+      packed->refs = 1;     // m's
+      m->packed = packed;
+    } else {
+      wire_free(&w);
+      m->packed = m;
+    }
+  }
+  WireShared *packed = m->packed;
+  pthread_mutex_unlock(&shared_lock);
+
+  return packed;
+}
+
+// points r at the decompressed payload, in a buffer of r's own. The length
+// it claims is checked against what the block could possibly decode to
+// before anything is allocated for it
+static int inflate(WireReader *r) {
+  uint32_t len = (r->len < 4) ? 0 : get_be(r->data, 4);
+  if (r->len < 4 || len > WIRE_MAX_PAYLOAD
+      || (uint64_t) len > (uint64_t) (r->len - 4) * COMPRESS_MAX_RATIO) {
+    fprintf(stderr, "bad compressed message\n");
+    return -1;
+  }
+
+  char *payload = malloc((size_t) len + 1);
+  if (payload == NULL) {
+    fprintf(stderr, "no room for a message of %u bytes\n", len);
+    return -1;
+  }
+  if (decompress_block(r->data + 4, r->len - 4, payload, len) < 0) {
+    fprintf(stderr, "bad compressed message\n");
+    free(payload);
+    return -1;
+  }
+
+  free(r->own);
+  r->own = payload;
+  r->data = payload;
+  r->len = len;
+  return 0;
+}
+
+// make room for len more bytes, growing by half again so appends stay cheap
+static void reserve(WireBuf *w, size_t len) {
+  if (w->len + len <= w->cap) {
+    return;
+  }
+
+  size_t cap = (w->cap < 256) ? 256 : w->cap + w->cap / 2;
+  if (cap < w->len + len) {
+    cap = w->len + len;
+  }
+  char *grown = realloc(w->data, cap);
+  if (grown == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  w->data = grown;
+  w->cap = cap;
+}
+
+static void put_be(char *dst, uint64_t value, int n) {
+  for (int i = n - 1; i >= 0; i--) {
+    dst[i] = (char) (value & 0xff);
+    value >>= 8;
+  }
+}
+
+static uint64_t get_be(const char *src, int n) {
+  uint64_t value = 0;
+  for (int i = 0; i < n; i++) {
+    value = (value << 8) | (unsigned char) src[i];
+  }
+  return value;
+}
+
+static uint64_t get_n(WireReader *r, int n) {
+  const char *bytes = wire_get_bytes(r, n);
+  return (bytes == NULL) ? 0 : get_be(bytes, n);
+}
+
+// how many bytes the two start with in common
+static uint32_t shared_prefix(const char *a, uint32_t alen, const char *b, uint32_t blen) {
+  uint32_t n = 0;
+  uint32_t max = (alen < blen) ? alen : blen;
+  while (n < max && a[n] == b[n]) {
+    n++;
+  }
+  return n;
+}
+
+// makes r's path the first keep bytes of the last one, then len from rest
+static void set_path(WireReader *r, uint32_t keep, const char *rest, uint32_t len) {
+  if (keep + len + 1 > r->pathcap) {
+    uint32_t cap = (r->pathcap < 64) ? 64 : 2 * r->pathcap;
+    if (cap < keep + len + 1) {
+      cap = keep + len + 1;
+    }
+    char *grown = realloc(r->path, cap);
+    if (grown == NULL) {
+      fprintf(stderr, "malloc\n");
+      exit(1);
+    }
+    r->path = grown;
+    r->pathcap = cap;
+  }
+  if (len > 0) {
+    memcpy(r->path + keep, rest, len);
+  }
+  r->pathlen = keep + len;
+  r->path[r->pathlen] = '\0';
+}
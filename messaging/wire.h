@@ -0,0 +1,301 @@
+/*
+ * wire.h: framing and encoding of the messages sent between the tracker
+ * and peers
+ *
+ * Every message is a header followed by its payload:
+ *
+ *   magic (4) version (1) type (1) flags (2) payload length (4)
+ *
+ * Fixed-size integers are sent big-endian, whatever their size in memory.
+ * Counts, lengths and other small numbers go as varints: seven bits a byte,
+ * low bits first, the top bit set on every byte but the last. Strings and
+ * byte runs are preceded by their length. A message is encoded whole into a
+ * WireBuf and read whole before it is decoded from a WireReader, which checks
+ * every read against the payload's length.
+ *
+ * Lists of files are mostly runs of similar paths and times, so within a
+ * message each path is sent as how much of the one before it to keep and
+ * what follows, and each time as the difference from the one before.
+ *
+ * A connection opened with wire_open keeps a send buffer, reused from one
+ * message to the next, and a receive buffer that fd is read into in large
+ * blocks, so a run of small messages costs one recv. Messages sent between
+ * wire_cork and wire_uncork go out together in one write.
+ *
+ * A connection can also be served without blocking, from an event loop, on a
+ * non-blocking fd: wire_poll reads whatever has arrived and hands over each
+ * message as soon as the whole of it is in, and what a send can't write at
+ * once stays in the send buffer, ahead of later messages, for wire_flush to
+ * send when the fd can take more.
+ *
+ * A message going to many connections can be encoded once, for no fd, and
+ * made a WireShared: immutable and reference-counted, sent on each
+ * connection as it is, and compressed at most once for all those that
+ * compress. A connection with nothing else queued sends it straight from the
+ * shared buffer. Its header has the WIRE_SHARED flag set: the paths in it
+ * went whole and named in no session, and the receiver doesn't name them in
+ * its own, so both ends' sessions stay the same.
+ *
+ * Once wire_compress is called on a connection, its messages of
+ * WIRE_COMPRESS_MIN bytes or more are compressed (see compress.h), when that
+ * makes them smaller: the header's WIRE_COMPRESSED flag is set, and the
+ * payload is the length it decompresses to (4) and then the block.
+ * Compressed messages are always accepted, so an end only needs to know the
+ * other can take them before it starts sending them.
+ *
+ * Final project, CS60, Spring 2018
+ */
+
+#ifndef WIRE_H
+#define WIRE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define WIRE_MAGIC 0x4c53594eu            // "LSYN"
+#define WIRE_VERSION 3
+#define WIRE_HEADER 12                    // bytes in a message header
+#ifndef WIRE_MAX_PAYLOAD
+#define WIRE_MAX_PAYLOAD (32u << 20)      // longest payload sent or accepted: a whole
+                                          // table takes about 16 bytes a file, so
+                                          // this is room for some two million
+#endif
+#define WIRE_BLOCK (64 * 1024)            // most read ahead at once
+#define WIRE_KEEP (1024 * 1024)           // a buffer grown past this is shrunk
+                                          // once the message that needed it is done
+#define WIRE_COMPRESS_MIN 1024            // shortest payload worth compressing
+#define WIRE_AGAIN (-2)                   // wire_poll: no whole message yet
+
+// Header flags
+#define WIRE_COMPRESSED 0x1               // the payload is compressed
+#define WIRE_SHARED 0x2                   // encoded once for many connections
+#define WIRE_FLAGS (WIRE_COMPRESSED | WIRE_SHARED)  // all those understood
+
+// A message being encoded
+typedef struct WireBuf {
+  char *data;           // messages, each a header and then its payload
+  size_t len;
+  size_t cap;
+  size_t start;         // where the message being encoded begins
+  int fd;               // connection the message is for; paths are named in
+                        // its session (see fileref_encode)
+  int own;              // whether wire_end frees it; if not, it is fd's
+  const char *prevpath; // the path and time last put in this message, which
+  uint32_t prevlen;     // the next are coded against; the path is the
+  int64_t prevtime;     // caller's, and must last until the message is done
+} WireBuf;
+
+// A message encoded once for many connections
+typedef struct WireShared {
+  char *data;           // the whole message, header and all
+  size_t len;
+  int refs;             // references held; freed with the last one
+  struct WireShared *packed;  // compressed, made for the first connection that
+                        // compresses; the message itself if that doesn't shrink it
+} WireShared;
+
+// A message being decoded
+typedef struct WireReader {
+  const char *data;     // payload
+  size_t len;
+  size_t pos;           // next byte to read
+  int error;            // set by any read past the end; later reads return 0
+  int fd;               // connection the message came from
+  int shared;           // whether it was a shared message, whose paths
+                        // aren't named in fd's session
+  char *own;            // buffer freed by wire_release, if fd has none
+  char *path;           // the path last read from this message, '\0'-
+  uint32_t pathlen;     // terminated, which the next is coded against
+  uint32_t pathcap;
+  int64_t prevtime;     // and the time last read
+} WireReader;
+
+/*
+ * Keeps buffers for the connection at fd from now on. Both ends open it
+ * before their first message, and close it before closing fd. Opening an fd
+ * that is still open starts it afresh.
+ */
+void wire_open(int fd);
+
+/*
+ * Frees the buffers kept for fd, dropping anything corked or read ahead.
+ */
+void wire_close(int fd);
+
+/*
+ * Starts a message of the given type for fd, at the end of fd's send buffer
+ * if it has one, or else in a buffer of its own. Callers serialize the
+ * messages they send on one fd, from wire_begin to wire_end.
+ * @return the buffer to encode the payload into
+ */
+WireBuf *wire_begin(int fd, int type);
+
+/*
+ * Finishes the message begun in w, and unless fd is corked sends it, along
+ * with any held back before it, in one write. On a non-blocking fd, whatever
+ * it doesn't take is left for wire_flush.
+ * @return 1 on success, -1 on error
+ */
+int wire_end(WireBuf *w);
+
+/*
+ * Holds back the messages sent on fd, an open connection, until
+ * wire_uncork.
+ */
+void wire_cork(int fd);
+
+/*
+ * Sends the messages held back on fd in one write.
+ * @return 1 on success, -1 on error
+ */
+int wire_uncork(int fd);
+
+/*
+ * Sends as much of what's left in the send buffer of fd, a non-blocking
+ * connection, as it takes without blocking.
+ * @return 1 if all of it went, 0 if some is still waiting, -1 on error
+ */
+int wire_flush(int fd);
+
+/*
+ * @return the bytes in fd's send buffer that haven't gone yet
+ */
+size_t wire_pending(int fd);
+
+/*
+ * Finishes the message begun in w, a buffer of its own begun for fd -1, as a
+ * message to be sent on many connections. Its paths were named in no
+ * session, so they went whole.
+ * @return the message, with one reference, the caller's; or NULL if it is
+ *   too long to send
+ */
+WireShared *wire_share(WireBuf *w);
+
+// Take and drop a reference to a shared message
+WireShared *wire_shared_retain(WireShared *m);
+void wire_shared_release(WireShared *m);
+
+/*
+ * Sends a shared message on fd, an open connection, compressed if fd
+ * compresses, after anything queued there before it. With nothing queued
+ * it goes straight from the shared buffer, which fd holds a reference to
+ * while a non-blocking send leaves some of it for wire_flush; otherwise it
+ * is copied in behind the rest.
+ * @return 1 on success, -1 on error
+ */
+int wire_send_shared(int fd, WireShared *m);
+
+/*
+ * Compresses the large messages sent on fd, an open connection, from now
+ * on; only once the other end has said it can take them.
+ */
+void wire_compress(int fd);
+
+/*
+ * Frees the memory held by a buffer that isn't fd's.
+ */
+void wire_free(WireBuf *w);
+
+// Appends to the payload
+void wire_put_u8(WireBuf *w, uint8_t value);
+void wire_put_u16(WireBuf *w, uint16_t value);
+void wire_put_u32(WireBuf *w, uint32_t value);
+void wire_put_u64(WireBuf *w, uint64_t value);
+void wire_put_bytes(WireBuf *w, const void *bytes, size_t len);
+
+// Appends a varint
+void wire_put_varint(WireBuf *w, uint64_t value);
+
+// Appends len and then the bytes of a string, which need not end in '\0'
+void wire_put_str(WireBuf *w, const char *str, uint32_t len);
+
+/*
+ * Appends the path of len bytes at path, as the length of the prefix it
+ * shares with the path before it in the message, then the length and bytes
+ * of the rest.
+ */
+void wire_put_path(WireBuf *w, const char *path, uint32_t len);
+
+/*
+ * Makes path the one the next is coded against without sending it, for a
+ * path the other end can tell from something else; it does the same with
+ * wire_saw_path.
+ */
+void wire_skip_path(WireBuf *w, const char *path, uint32_t len);
+
+// Appends a time as its difference from the time before it in the message
+void wire_put_time(WireBuf *w, int64_t time);
+
+/*
+ * Reads a whole message from fd, checking its header, and points r at its
+ * payload, decompressed if need be, which stays valid until the next
+ * wire_recv on fd or wire_release. Only one thread receives on an fd.
+ * @return the message type, or -1 on error, hang-up or a bad header
+ */
+int wire_recv(int fd, WireReader *r);
+
+/*
+ * As wire_recv, for an open connection on a non-blocking fd: reads whatever
+ * has arrived without waiting, and points r at the next message if the whole
+ * of it is in. Call it until it returns WIRE_AGAIN to take every message.
+ * @return the message type; WIRE_AGAIN if no whole message has arrived yet;
+ *   or -1 on error, hang-up or a bad header
+ */
+int wire_poll(int fd, WireReader *r);
+
+/*
+ * Frees the payload r was pointed at, if it was read into a buffer of its
+ * own, and the last path read.
+ */
+void wire_release(WireReader *r);
+
+// Read from the payload; past its end, r->error is set and they return 0
+uint8_t wire_get_u8(WireReader *r);
+uint16_t wire_get_u16(WireReader *r);
+uint32_t wire_get_u32(WireReader *r);
+uint64_t wire_get_u64(WireReader *r);
+uint64_t wire_get_varint(WireReader *r);
+int64_t wire_get_time(WireReader *r);
+
+/*
+ * Reads the varint count of a list whose items each take at least a byte; a
+ * count past the bytes left is an error.
+ * @return the count, or 0 on error
+ */
+uint32_t wire_get_count(WireReader *r);
+
+/*
+ * Reads len bytes.
+ * @return a pointer to them in the payload, or NULL past its end
+ */
+const char *wire_get_bytes(WireReader *r, size_t len);
+
+/*
+ * Reads a string written by wire_put_str, setting len to its length. Strings
+ * longer than max are an error.
+ * @return a pointer to it in the payload, not '\0'-terminated, or NULL
+ */
+const char *wire_get_str(WireReader *r, uint32_t max, uint32_t *len);
+
+/*
+ * Reads a path written by wire_put_path, setting len to its length. Paths
+ * longer than max are an error.
+ * @return the path, '\0'-terminated, valid until the next path is read from
+ *   r or it is released; or NULL
+ */
+const char *wire_get_path(WireReader *r, uint32_t max, uint32_t *len);
+
+/*
+ * Makes path the one the next is coded against, for one the sender passed
+ * to wire_skip_path.
+ */
+void wire_saw_path(WireReader *r, const char *path, uint32_t len);
+
+/*
+ * Whether the whole payload was read without error; anything left over
+ * means the sender and receiver disagree about the message.
+ * @return 1 if so, 0 if not
+ */
+int wire_done(WireReader *r);
+
+#endif //WIRE_H
@@ -39,84 +39,73 @@ void fileevent_destroy(FileEvent *event) {
 
 // frees all memory associated with a list of FileInfo_FSs
 void fileevent_destroy_all(FileEvent *event) {
-  if (event == NULL) {
-    return;
+  // walk the list rather than recursing, so a long batch can't run out of
+  // stack
+  FileEvent *next;
+  while (event != NULL) {
+    next = event->next;
+    fileevent_destroy(event);
+    event = next;
   }
-
-  // free the next item
-  fileevent_destroy_all(event->next);
-
-  // then destroy myself
-  fileevent_destroy(event);
 }
 
 /*
- * FileEvent send/receive helpers
+ * FileEvent encode/decode helpers
  */
 
-FileEvent *fileevent_receive(int fd, int n_events) {
-  if (n_events <= 0) {
-    return NULL;
+// the count, then each event's file and action, in list order
+void fileevent_encode_all(WireBuf *w, FileEvent *events) {
+  uint32_t n = 0;
+  for (FileEvent *event = events; event != NULL; event = event->next) {
+    n++;
   }
 
+  wire_put_varint(w, n);
+  for (FileEvent *event = events; event != NULL; event = event->next) {
+    fileinfo_encode(w, event->file);
+    wire_put_u8(w, event->action);
+  }
+}
+
+FileEvent *fileevent_decode_all(WireReader *r, int *n) {
   FileEvent *head = NULL;
+  FileEvent **tail = &head;
+  *n = 0;
 
-  for (int i = 0; i < n_events; i++) {
-    // create space for fileinfo for this event 
-    FileInfo_FS *info = fileinfo_init();
+  uint32_t count = wire_get_count(r);
+  for (uint32_t i = 0; i < count && !r->error; i++) {
+    // read in the fileinfo for this event
+    FileInfo_FS *info = fileinfo_decode(r);
     if (info == NULL) {
+      fileevent_destroy_all(head);
       return NULL;
     }
 
-    // read in the fileinfo
-    if (recv(fd, info, sizeof(FileInfo_FS), MSG_WAITALL) < 0) {
-      return NULL;
-    }
-
-
     // create space for the event itself
     FileEvent *event = fileevent_init();
     if (event == NULL) {
+      fileinfo_destroy(info);
+      fileevent_destroy_all(head);
       return NULL;
     }
-    
-    // read in the event
-    if (recv(fd, event, sizeof(FileEvent), MSG_WAITALL) < 0) {
-      return NULL;
-    }
-
-    // set the file pointer to the received fileinfo
     event->file = info;
+    event->action = wire_get_u8(r);
 
-    // add this event at the front of the received list
-    event->next = head;
-    head = event;
-  }
-
-  return head;
-
-  return NULL;
-}
-
-int fileevent_send_all(int fd, FileEvent *event) {
-  if (event == NULL) {
-    return -1;
-  }
+    // add this event at the end of the received list, keeping the order the
+    // events happened in
+    *tail = event;
+    tail = &event->next;
 
-  while (event != NULL) {
-    // send fileinfo first
-    if (send(fd, event->file, sizeof(FileInfo_FS), 0) <= 0) {
-      perror("error sending");
-      return -1;
+    if (event->action > DOWNLOAD_COMPLETE) {
+      r->error = 1;
     }
+  }
 
-    // followed by the rest of the event data
-    if (send(fd, event, sizeof(FileEvent), 0) <= 0) {
-      perror("error sending");
-      return -1;
-    }
-    event = event->next;
+  if (r->error) {
+    fileevent_destroy_all(head);
+    return NULL;
   }
 
-  return 1;
+  *n = count;
+  return head;
 }
@@ -59,17 +59,16 @@ void fileevent_destroy(FileEvent *event);
 void fileevent_destroy_all(FileEvent *events);
 
 /*
- * Send a list of file info over the specified socket.
- * @return -1 on error, 1 on success
+ * Appends a list of file events to a message, preceded by its length.
  */
-int fileevent_send_all(int fd, FileEvent *event);
+void fileevent_encode_all(WireBuf *w, FileEvent *events);
 
 /*
- * Receive a list of file events over the specified socket.
- * Caller must free those events.
- * @return a list of FileEvent on success, NULL on error
+ * Reads a list written by fileevent_encode_all, in the same order, setting
+ * n to its length. Caller must free those events.
+ * @return a list of FileEvent on success, NULL on error or if it is empty
  */
-FileEvent *fileevent_receive(int fd, int n_events);
+FileEvent *fileevent_decode_all(WireReader *r, int *n);
 
 
 #endif
@@ -7,6 +7,7 @@
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include <time.h>
@@ -60,8 +61,8 @@ FileInfo_FS *fileinfo_get_by_name(char *directory, const char *filepath) {
     info->size = 0;
   }
 
-  // copy in the path to the file
-  strcpy(info->filepath, filepath);
+  // point at the pooled copy of the path
+  fileinfo_set_path(info, filepath);
 
   // free the full path we created
   free(fullpath);
@@ -69,6 +70,41 @@ FileInfo_FS *fileinfo_get_by_name(char *directory, const char *filepath) {
   return info;
 }
 
+// swaps in the interned copy of filepath
+int fileinfo_set_path(FileInfo_FS *info, const char *filepath) {
+  if (info == NULL || filepath == NULL) {
+    return -1;
+  }
+
+  char *interned = path_intern(filepath);
+  if (interned == NULL) {
+    return -1;
+  }
+
+  path_release(info->filepath);
+  info->filepath = interned;
+
+  return 1;
+}
+
+// copies a single FileInfo_FS, sharing the path
+FileInfo_FS *fileinfo_clone(FileInfo_FS *info) {
+  if (info == NULL) {
+    return NULL;
+  }
+
+  FileInfo_FS *clone = fileinfo_init();
+  if (clone == NULL) {
+    return NULL;
+  }
+
+  memcpy(clone, info, sizeof(FileInfo_FS));
+  path_retain(clone->filepath);
+  clone->next = NULL;
+
+  return clone;
+}
+
 void fileinfo_print(FileInfo_FS *info) {
   if (info == NULL) {
     return;
@@ -83,6 +119,7 @@ void fileinfo_destroy(FileInfo_FS *info) {
     return;
   }
 
+  path_release(info->filepath);
   free(info);
 }
 
@@ -100,48 +137,82 @@ void fileinfo_destroy_all(FileInfo_FS *info) {
 }
 
 /*
- * functions to send/receive a list of FileInfo_FSs over a socket  
+ * functions to encode/decode FileInfo_FSs in a message
  */
 
-// reads n_files many FileInfo_FS structs over the socket and reconstructs
-// them into a linked list
-FileInfo_FS *fileinfo_receive(int fd, int n_files) {
-  if (n_files <= 0) {
-    return NULL;
+// the reference to the path, then the size with whether it is a directory
+// in its low bit, then the time
+void fileinfo_encode(WireBuf *w, FileInfo_FS *file) {
+  fileref_encode(w, file->id, file->filepath);
+  wire_put_varint(w, ((uint64_t) (uint32_t) file->size << 1) | (file->is_dir != 0));
+  wire_put_time(w, file->last_modified);
+}
+
+// the count, then each file in list order
+void fileinfo_encode_all(WireBuf *w, FileInfo_FS *files) {
+  uint32_t n = 0;
+  for (FileInfo_FS *file = files; file != NULL; file = file->next) {
+    n++;
   }
 
-  FileInfo_FS *head = NULL;
+  wire_put_varint(w, n);
+  for (FileInfo_FS *file = files; file != NULL; file = file->next) {
+    fileinfo_encode(w, file);
+  }
+}
 
-  for (int i = 0; i < n_files; i++) {
-    // create space for new file and put it at the front of the list
-    FileInfo_FS *cur = fileinfo_init();
+FileInfo_FS *fileinfo_decode(WireReader *r) {
+  FileInfo_FS *file = fileinfo_init();
+  if (file == NULL) {
+    return NULL;
+  }
 
-    // read into the new fileinfo
-    if (recv(fd, cur, sizeof(FileInfo_FS), MSG_WAITALL) < 0) {
-      return NULL;
-    }
+  if (fileinfo_read(r, file) < 0) {
+    fileinfo_destroy(file);
+    return NULL;
+  }
 
-    cur->next = head;
+  return file;
+}
 
-    // prep for next file to come over the socket
-    head = cur;
+int fileinfo_read(WireReader *r, FileInfo_FS *file) {
+  file->filepath = fileref_decode(r, &file->id);
+  uint64_t size = wire_get_varint(r);
+  file->size = (uint32_t) (size >> 1);
+  file->is_dir = size & 1;
+  file->last_modified = (time_t) wire_get_time(r);
+  if (file->filepath == NULL || r->error) {
+    path_release(file->filepath);
+    file->filepath = NULL;
+    return -1;
   }
 
-  return head;
+  return 1;
 }
 
-// send all files in the list over the socket
-int fileinfo_send_all(int fd, FileInfo_FS *file) {
-  while (file != NULL) {
-    fileinfo_print(file);
-    if (send(fd, file, sizeof(FileInfo_FS), 0) <= 0) {
-      perror("error sending");
-      return -1;
+// reads the list back in the order it was written
+FileInfo_FS *fileinfo_decode_all(WireReader *r, int *n) {
+  FileInfo_FS *head = NULL;
+  FileInfo_FS **tail = &head;
+
+  uint32_t count = wire_get_count(r);
+  for (uint32_t i = 0; i < count && !r->error; i++) {
+    FileInfo_FS *file = fileinfo_decode(r);
+    if (file == NULL) {
+      fileinfo_destroy_all(head);
+      *n = 0;
+      return NULL;
     }
-    file = file->next;
+    *tail = file;
+    tail = &file->next;
   }
 
-  return 1;
+  *n = r->error ? 0 : count;
+  if (r->error) {
+    fileinfo_destroy_all(head);
+    return NULL;
+  }
+  return head;
 }
 
 // allocates and returns a string containing path to the file
@@ -161,3 +232,389 @@ char *get_full_filepath(char *dir, char *filepath) {
 
   return filename;
 }
+
+/*
+ * sessions: the paths named on each connection, so each is sent in full once
+ */
+
+// the most paths a session names; once it has, the rest always go in full
+#define MAX_SESSION_ID (1 << 20)
+
+// how far past the last id it named the other end may name one. Ids go up
+// one at a time, so only a message that was never sent leaves a gap
+#define SESSION_WINDOW 64
+
+// longest path accepted from the other end
+#define MAX_REF_PATH (1 << 16)
+
+// longest reference accepted: the path and the varints around it
+#define MAX_REF (MAX_REF_PATH + 32)
+
+// The paths named on one connection, both by id and by path. Only one end
+// of a connection names paths, each with the next id
+typedef struct {
+  int names;            // whether this end is the one that names them
+  char **byid;          // retained path named with each id
+  uint32_t nids;        // one past the last id named
+  uint32_t capids;
+  char **keys;          // the same paths, hashed on the interned pointer; an
+  uint32_t *ids;        // entry whose path has since been renamed is stale
+  uint32_t nslots;
+  uint32_t used;
+} FileSession;
+
+static FileSession **sessions;    // by fd
+static int nsessions;
+static pthread_mutex_t sessions_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static FileSession *session_get(int fd);
+static int session_outgoing(int fd, uint32_t *id, char *path);
+static char *session_incoming(int fd, uint32_t id, const char *path);
+static void session_free(FileSession *session);
+static char *session_path(FileSession *session, uint32_t id);
+static uint32_t session_id(FileSession *session, const char *path);
+static void session_name(FileSession *session, uint32_t id, char *path);
+static uint32_t pointer_hash(const char *path);
+
+// starts remembering the paths named on fd
+void fileinfo_session_open(int fd, int names) {
+  if (fd < 0) {
+    return;
+  }
+
+  FileSession *session = calloc(1, sizeof(FileSession));
+  if (session == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  session->names = names;
+  session->nids = 1;      // 0 names nothing
+
+  pthread_mutex_lock(&sessions_lock);
+  if (fd >= nsessions) {
+    int n = (fd + 1 > 2 * nsessions) ? fd + 1 : 2 * nsessions;
+    FileSession **grown = realloc(sessions, n * sizeof(FileSession *));
+    if (grown == NULL) {
+      fprintf(stderr, "malloc\n");
+      exit(1);
+    }
+    memset(grown + nsessions, 0, (n - nsessions) * sizeof(FileSession *));
+    sessions = grown;
+    nsessions = n;
+  }
+
+  // an fd closed without closing its session starts over
+  session_free(sessions[fd]);
+  sessions[fd] = session;
+  pthread_mutex_unlock(&sessions_lock);
+}
+
+// forgets the paths named on fd
+void fileinfo_session_close(int fd) {
+  pthread_mutex_lock(&sessions_lock);
+  if (fd >= 0 && fd < nsessions) {
+    session_free(sessions[fd]);
+    sessions[fd] = NULL;
+  }
+  pthread_mutex_unlock(&sessions_lock);
+}
+
+// the id, shifted up to make room for whether the path follows, then the
+// path unless the session already has it by its id
+void fileref_encode(WireBuf *w, uint32_t id, char *path) {
+  int whole = session_outgoing(w->fd, &id, path);
+  uint32_t pathlen = (path == NULL) ? 0 : strlen(path);
+
+  wire_put_varint(w, ((uint64_t) id << 1) | whole);
+  if (whole) {
+    wire_put_path(w, (path == NULL) ? "" : path, pathlen);
+  }
+  else {
+    wire_skip_path(w, path, pathlen);
+  }
+}
+
+char *fileref_decode(WireReader *r, uint32_t *id) {
+  uint64_t ref = wire_get_varint(r);
+  uint32_t refid = (uint32_t) (ref >> 1);
+  if ((ref >> 1) > UINT32_MAX) {
+    r->error = 1;
+  }
+  if (id != NULL) {
+    *id = refid;
+  }
+
+  const char *bytes = NULL;
+  uint32_t pathlen = 0;
+  if (!r->error && (ref & 1)) {
+    bytes = wire_get_path(r, MAX_REF_PATH, &pathlen);
+  }
+  if (r->error) {
+    return NULL;
+  }
+
+  // a reference that names nothing spoils the message as surely as a short
+  // one; the paths in a shared message were named in no session, so they
+  // aren't named in this one either
+  char *path = session_incoming(r->shared ? -1 : r->fd, refid, bytes);
+  if (path == NULL) {
+    r->error = 1;
+  }
+  else if (bytes == NULL) {
+    wire_saw_path(r, path, strlen(path));
+  }
+  return path;
+}
+
+// head, then the reference preceded by its length, packed into one buffer so
+// they go in a single send
+int fileref_send(int fd, const void *head, int len, uint32_t id, char *path) {
+  WireBuf w;
+  memset(&w, 0, sizeof(w));
+  w.fd = fd;
+  wire_put_bytes(&w, head, len);
+  wire_put_u32(&w, 0);
+  fileref_encode(&w, id, path);
+
+  size_t reflen = w.len - len - 4;
+  uint32_t netlen = htonl(reflen);
+  memcpy(w.data + len, &netlen, 4);
+
+  int res = 1;
+  if (send(fd, w.data, w.len, 0) != (ssize_t) w.len) {
+    perror("error sending");
+    res = -1;
+  }
+
+  wire_free(&w);
+  return res;
+}
+
+// the length of the reference, then the reference
+char *fileref_receive(int fd, uint32_t *id) {
+  uint32_t netlen;
+  if (recv(fd, &netlen, sizeof(netlen), MSG_WAITALL) != sizeof(netlen)) {
+    return NULL;
+  }
+  uint32_t reflen = ntohl(netlen);
+  if (reflen > MAX_REF) {
+    return NULL;
+  }
+
+  WireReader r;
+  memset(&r, 0, sizeof(r));
+  r.fd = fd;
+  r.own = malloc(reflen + 1);
+  if (r.own == NULL) {
+    return NULL;
+  }
+  if (reflen > 0 && recv(fd, r.own, reflen, MSG_WAITALL) != (ssize_t) reflen) {
+    wire_release(&r);
+    return NULL;
+  }
+  r.data = r.own;
+  r.len = reflen;
+
+  char *path = fileref_decode(&r, id);
+  if (path != NULL && !wire_done(&r)) {
+    path_release(path);
+    path = NULL;
+  }
+  wire_release(&r);
+  return path;
+}
+
+// whether to send the path: not if fd's session already knows it. id is the
+// id the caller knows the path by on fd, or 0, and is set to the id it goes
+// with: the session's for it, or if it has none and this end names paths,
+// the next one; else 0
+static int session_outgoing(int fd, uint32_t *id, char *path) {
+  uint32_t known_id = *id;
+  *id = 0;
+  if (path == NULL || path[0] == '\0') {
+    return 1;
+  }
+
+  int whole = 1;
+  pthread_mutex_lock(&sessions_lock);
+  FileSession *session = session_get(fd);
+  if (session != NULL) {
+    char *known = session_path(session, known_id);
+    if (known == NULL || (known != path && strcmp(known, path) != 0)) {
+      known_id = session_id(session, path);
+      known = session_path(session, known_id);
+    }
+
+    if (known != NULL) {
+      *id = known_id;
+      whole = 0;
+    }
+    else if (session->names && session->nids < MAX_SESSION_ID) {
+      *id = session->nids;
+      session_name(session, *id, path);
+    }
+  }
+  pthread_mutex_unlock(&sessions_lock);
+
+  return whole;
+}
+
+// the path a reference received on fd stands for: the path sent with it,
+// named id in the session, or if none was the path named id
+static char *session_incoming(int fd, uint32_t id, const char *sent) {
+  // just the id, of a path named before
+  if (sent == NULL) {
+    pthread_mutex_lock(&sessions_lock);
+    FileSession *session = session_get(fd);
+    char *path = (session != NULL) ? session_path(session, id) : NULL;
+    if (path != NULL) {
+      path_retain(path);
+    }
+    pthread_mutex_unlock(&sessions_lock);
+
+    if (path == NULL) {
+      fprintf(stderr, "Unknown file id %u\n", id);
+    }
+    return path;
+  }
+
+  char *path = path_intern(sent);
+
+  // the other end may only name a path if it is the end that names them,
+  // and only with the next id, or one a little past it
+  if (path != NULL && id != 0) {
+    pthread_mutex_lock(&sessions_lock);
+    FileSession *session = session_get(fd);
+    if (session != NULL && (session->names || id >= MAX_SESSION_ID
+        || id >= session->nids + SESSION_WINDOW)) {
+      fprintf(stderr, "Unexpected file id %u\n", id);
+      path_release(path);
+      path = NULL;
+    }
+    else if (session != NULL) {
+      session_name(session, id, path);
+    }
+    pthread_mutex_unlock(&sessions_lock);
+  }
+
+  return path;
+}
+
+// the session on fd, or NULL; the caller holds sessions_lock
+static FileSession *session_get(int fd) {
+  return (fd >= 0 && fd < nsessions) ? sessions[fd] : NULL;
+}
+
+static void session_free(FileSession *session) {
+  if (session == NULL) {
+    return;
+  }
+
+  for (uint32_t id = 0; id < session->capids; id++) {
+    path_release(session->byid[id]);
+  }
+  free(session->byid);
+  free(session->keys);
+  free(session->ids);
+  free(session);
+}
+
+// the path named with id, or NULL
+static char *session_path(FileSession *session, uint32_t id) {
+  return (id != 0 && id < session->capids) ? session->byid[id] : NULL;
+}
+
+// the id path was last named with, or 0
+static uint32_t session_id(FileSession *session, const char *path) {
+  if (session->nslots == 0) {
+    return 0;
+  }
+
+  uint32_t mask = session->nslots - 1;
+  for (uint32_t i = pointer_hash(path) & mask; session->keys[i] != NULL; i = (i + 1) & mask) {
+    if (session->keys[i] == path) {
+      uint32_t id = session->ids[i];
+      return (session_path(session, id) == path) ? id : 0;
+    }
+  }
+  return 0;
+}
+
+// remember that id names path, an interned string
+static void session_name(FileSession *session, uint32_t id, char *path) {
+  if (id == 0 || id >= MAX_SESSION_ID) {
+    return;
+  }
+
+  if (id >= session->capids) {
+    uint32_t n = (id + 1 > 2 * session->capids) ? id + 1 : 2 * session->capids;
+    char **grown = realloc(session->byid, n * sizeof(char *));
+    if (grown == NULL) {
+      fprintf(stderr, "malloc\n");
+      exit(1);
+    }
+    memset(grown + session->capids, 0, (n - session->capids) * sizeof(char *));
+    session->byid = grown;
+    session->capids = n;
+  }
+  if (id >= session->nids) {
+    session->nids = id + 1;
+  }
+  if (session->byid[id] == path) {
+    return;
+  }
+  path_release(session->byid[id]);
+  session->byid[id] = path_retain(path);
+
+  // keep the hash at most half full, dropping stale entries as it grows
+  if (2 * (session->used + 1) > session->nslots) {
+    char **keys = session->keys;
+    uint32_t *ids = session->ids;
+    uint32_t nslots = session->nslots;
+
+    session->nslots = (nslots == 0) ? 64 : 2 * nslots;
+    session->keys = calloc(session->nslots, sizeof(char *));
+    session->ids = calloc(session->nslots, sizeof(uint32_t));
+    if (session->keys == NULL || session->ids == NULL) {
+      fprintf(stderr, "malloc\n");
+      exit(1);
+    }
+    session->used = 0;
+
+    uint32_t mask = session->nslots - 1;
+    for (uint32_t i = 0; i < nslots; i++) {
+      if (keys[i] == NULL || session_path(session, ids[i]) != keys[i]) {
+        continue;
+      }
+      uint32_t j = pointer_hash(keys[i]) & mask;
+      while (session->keys[j] != NULL) {
+        j = (j + 1) & mask;
+      }
+      session->keys[j] = keys[i];
+      session->ids[j] = ids[i];
+      session->used++;
+    }
+    free(keys);
+    free(ids);
+  }
+
+  uint32_t mask = session->nslots - 1;
+  uint32_t i = pointer_hash(path) & mask;
+  while (session->keys[i] != NULL && session->keys[i] != path) {
+    i = (i + 1) & mask;
+  }
+  if (session->keys[i] == NULL) {
+    session->keys[i] = path;
+    session->used++;
+  }
+  session->ids[i] = id;
+}
+
+// interned paths are equal only if their pointers are, so hash the pointer
+static uint32_t pointer_hash(const char *path) {
+  uint64_t x = (uintptr_t) path;
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  return (uint32_t) x;
+}
@@ -16,12 +16,14 @@
 
 #include <pthread.h>
 #include <stdbool.h>
-
-#define MAX_DEPTH 5
-#define FILEPATH_LEN 255*MAX_DEPTH
+#include <stdint.h>
+#include <time.h>
+#include "pathpool.h"
+#include "../messaging/wire.h"
 
 typedef struct FileInfo_FS {
-  char filepath[FILEPATH_LEN];// path of the file, relative to root dir being watched
+  char *filepath;             // interned path of the file, relative to root dir being watched
+  uint32_t id;                // id the path was named with on the connection it came by, or 0
   unsigned int size;          // size of the file
   time_t last_modified;       // timestamp of last modification
   int is_dir;                // true if this path is a directory
@@ -42,6 +44,20 @@ FileInfo_FS *fileinfo_init();
  */
 FileInfo_FS *fileinfo_get_by_name(char *directory, const char *filepath);
 
+/*
+ * Sets the path of a FileInfo_FS, interning it in the path pool and
+ * releasing whatever path it had before.
+ * @return 1 on success, -1 on error
+ */
+int fileinfo_set_path(FileInfo_FS *info, const char *filepath);
+
+/*
+ * Creates a copy of a single FileInfo_FS that shares its interned path.
+ * The copy's next pointer is NULL.
+ * @return FileInfo_FS* on success, NULL on error
+ */
+FileInfo_FS *fileinfo_clone(FileInfo_FS *info);
+
 void fileinfo_print(FileInfo_FS *info);
 
 /*
@@ -62,15 +78,85 @@ void fileinfo_destroy_all(FileInfo_FS *info);
 char *get_full_filepath(char *dir, char *filepath);
 
 /*
- * Send a list of file info over the specified socket.
+ * Appends a file info to a message: a reference to its path as written by
+ * fileref_encode, then its size and whether it is a directory, then its
+ * modification time as the difference from the one before it.
+ */
+void fileinfo_encode(WireBuf *w, FileInfo_FS *file);
+
+/*
+ * Appends a list of file info to a message, preceded by its length.
+ */
+void fileinfo_encode_all(WireBuf *w, FileInfo_FS *files);
+
+/*
+ * Reads a file info written by fileinfo_encode.
+ * @return FileInfo_FS* on success, NULL on error
+ */
+FileInfo_FS *fileinfo_decode(WireReader *r);
+
+/*
+ * Reads a file info written by fileinfo_encode into file, as fileinfo_decode
+ * does but without allocating one; the caller must path_release its path.
+ * @return 1 on success, -1 on error
+ */
+int fileinfo_read(WireReader *r, FileInfo_FS *file);
+
+/*
+ * Reads a list written by fileinfo_encode_all, in the same order, setting n
+ * to its length.
+ * @return a list of FileInfo on success, NULL on error or if it is empty
+ */
+FileInfo_FS *fileinfo_decode_all(WireReader *r, int *n);
+
+/*
+ * Starts a session on the connection at fd: from now on, each end remembers
+ * the ids the paths sent either way were named with, and a path already
+ * named is sent as its id alone. Only one end names paths, the one that
+ * opens its session with names set: it gives each path it sends the next
+ * id, counting up from 1, and the other end accepts no other. Both ends open
+ * the session before their first message, and close it before closing fd.
+ * Opening a session on an fd that still has one starts it afresh.
+ */
+void fileinfo_session_open(int fd, int names);
+
+/*
+ * Forgets the paths named on fd.
+ */
+void fileinfo_session_close(int fd);
+
+/*
+ * Appends a reference to path to a message: the path's id, then the path
+ * itself, coded against the one before it in the message, unless the
+ * session on the message's connection has already named the path. id is
+ * the id the caller last had the path by on that connection, or 0, and only
+ * saves looking the path up.
+ */
+void fileref_encode(WireBuf *w, uint32_t id, char *path);
+
+/*
+ * Reads a reference written by fileref_encode, setting id to its id. A path
+ * sent whole is named in the session, unless the message is a shared one
+ * (see wire_share), which was encoded in none.
+ * @return the interned path, which the caller must path_release, or NULL on
+ * error or if the id was never named on the message's connection
+ */
+char *fileref_decode(WireReader *r, uint32_t *id);
+
+/*
+ * Sends len bytes from head followed by the length of a reference to path
+ * and the reference, as written by fileref_encode, all in one send, with no
+ * message header. For connections
+ * between peers, which exchange no messages.
  * @return -1 on error, 1 on success
  */
-int fileinfo_send_all(int fd, FileInfo_FS *file);
+int fileref_send(int fd, const void *head, int len, uint32_t id, char *path);
 
 /*
- * Receive a list of file info over the specified socket.
- * @return a list of FileInfo on success, NULL on error
+ * Receives a reference sent by fileref_send, setting id to its id.
+ * @return the interned path, which the caller must path_release, or NULL on
+ * error or if the id was never named on fd
  */
-FileInfo_FS *fileinfo_receive(int fd, int n_files);
+char *fileref_receive(int fd, uint32_t *id);
 
 #endif
@@ -145,7 +145,7 @@ void eventHandler(
         return;
       }
       // set fileinfo name 
-      strcpy(event->file->filepath, relative_name);
+      fileinfo_set_path(event->file, relative_name);
       event->file->size = 0;
       event->file->last_modified = time(NULL);
     } else {
@@ -17,6 +17,7 @@
 #include <stdio.h>
 #include <poll.h>
 #include <unistd.h>
+#include <limits.h>
 #include "fileobserver.h"
 
 // quick n dirty for recursive watching
@@ -48,7 +49,7 @@ FileEvent *inotify_to_fileevent(char *dir, const struct inotify_event *inotify_e
     return NULL;
   }
 
-  char event_filename[FILEPATH_LEN];
+  char event_filename[PATH_MAX];
   // default it to just the event file name
   strcpy(event_filename, inotify_event->name);
 
@@ -80,7 +81,7 @@ FileEvent *inotify_to_fileevent(char *dir, const struct inotify_event *inotify_e
       return NULL;
     }
     // set fileinfo name from inotify event
-    strcpy(event->file->filepath, event_filename);
+    fileinfo_set_path(event->file, event_filename);
     event->file->size = 0;
     event->file->last_modified = time(NULL);
   } else {
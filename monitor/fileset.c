@@ -54,8 +54,12 @@ int fileset_insert(FileSet *set, char *filepath) {
     return 0;
   }
 
-  // copy in the filepath
-  strcpy(new_item->filepath, filepath);
+  // share the pooled copy of the filepath
+  new_item->filepath = path_intern(filepath);
+  if (new_item->filepath == NULL) {
+    free(new_item);
+    return 0;
+  }
   
   // then link it at the head
   new_item->next = set->items;
@@ -80,11 +84,13 @@ int fileset_remove(FileSet *set, char *filepath) {
       // if prev is null, we're at the head
       if (prev == NULL) {
         set->items = set->items->next;
+        path_release(cur->filepath);
         free(cur);
         return 1;
       } else {
         // otherwise, skip over cur from prev
         prev->next = cur->next;
+        path_release(cur->filepath);
         free(cur);
         return 1;
       }
@@ -107,6 +113,7 @@ void fileset_destroy(FileSet *set) {
   FileSetItem *tmp;
   while (set->items != NULL) {
     tmp = set->items->next;
+    path_release(set->items->filepath);
     free(set->items);
     set->items = tmp;
   }
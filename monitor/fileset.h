@@ -16,7 +16,7 @@
 
 // set items essentially just form a list of strings
 typedef struct FileSetItem {
-  char filepath[FILEPATH_LEN];
+  char *filepath;               // interned, see pathpool.h
   struct FileSetItem *next;
 } FileSetItem;
 
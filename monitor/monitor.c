@@ -62,8 +62,8 @@ monitor *monitor_init(char *rootDir) {
 static int display_info(const char *fpath, const struct stat *sb,
             int tflag, struct FTW *ftwbuf)
 {
-   // if the depth is above the max sub dirs, continue to next file
-   if (ftwbuf->level == 0 || ftwbuf->level > MAX_DEPTH) {
+   // skip the directory the walk started from
+   if (ftwbuf->level == 0) {
        return 0;
    }
 
@@ -80,7 +80,18 @@ static int display_info(const char *fpath, const struct stat *sb,
 
 // returns ground truth of all files currently in the directory
 FileInfo_FS *monitor_get_current_files(monitor *m) {
-  if (m == NULL) {
+  return monitor_get_files_under(m, "");
+}
+
+// returns ground truth of all files currently below subdir
+FileInfo_FS *monitor_get_files_under(monitor *m, char *subdir) {
+  if (m == NULL || subdir == NULL) {
+    return NULL;
+  }
+
+  // the walk starts at the subdir, but paths stay relative to the root
+  char *start = (subdir[0] == '\0') ? strdup(m->dir) : get_full_filepath(m->dir, subdir);
+  if (start == NULL) {
     return NULL;
   }
 
@@ -92,11 +103,12 @@ FileInfo_FS *monitor_get_current_files(monitor *m) {
   prefix_len = strlen(m->dir) + 1;
   root_dir = m->dir;
 
-  // do the directory traverse
-  if (nftw(m->dir, display_info, 20, 0) == -1) {
+  // do the directory traverse; a subdir that no longer exists just has no files
+  if (nftw(start, display_info, 20, 0) == -1 && subdir[0] == '\0') {
     perror("nftw");
     exit(EXIT_FAILURE);
   }
+  free(start);
 
   // create a new pointer to the head of the list, since any other call to this
   // will destroy it
@@ -231,6 +243,19 @@ int monitor_resume_modify(monitor *m, char *filepath) {
   return res;
 }
 
+// check whether a file's create/modify events are being ignored
+bool monitor_is_ignoring_modify(monitor *m, char *filepath) {
+  if (m == NULL) {
+    return false;
+  }
+
+  pthread_mutex_lock(&m->ignore_modify->lock);
+  bool res = fileset_contains(m->ignore_modify, filepath);
+  pthread_mutex_unlock(&m->ignore_modify->lock);
+
+  return res;
+}
+
 
 
 // start ignoring a file, so that events from it won't appear in
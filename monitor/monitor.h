@@ -48,6 +48,14 @@ monitor *monitor_init(char *baseDir);
  */
 FileInfo_FS *monitor_get_current_files(monitor *m);
 
+/*
+ * Return a list of the info about all files below subdir, a path relative to
+ * the watched directory. Paths in the list are still relative to the watched
+ * directory, and subdir itself is not included.
+ * @return FileInfo_FS* list, or NULL on error
+ */
+FileInfo_FS *monitor_get_files_under(monitor *m, char *subdir);
+
 /*
  * Start watching the directory
  * @return 1 on success, -1 on error
@@ -84,6 +92,13 @@ int monitor_ignore_modify(monitor *m, char *filepath);
  */
 int monitor_resume_modify(monitor *m, char *filepath);
 
+/*
+ * Check whether modification/creation events at filepath are being ignored,
+ * as they are while the file is being written by a download
+ * @return true if they are, false if not or on error
+ */
+bool monitor_is_ignoring_modify(monitor *m, char *filepath);
+
 /*
  * Returns all events in the event queue. The caller must
  * free them. 
@@ -0,0 +1,273 @@
+/*
+ * pathpool.c: implementation of the interned path pool
+ *
+ * See full header comments in pathpool.h
+ *
+ * written by team Fleetwood MAC
+ * CS60, May 2018.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "pathpool.h"
+
+// initial number of hash buckets in a shard; doubled whenever its load
+// factor passes 1
+#define INIT_BUCKETS 64
+
+// the pool is split by hash into this many shards, each with its own lock,
+// so threads interning different paths seldom wait on each other
+#define POOL_SHARD_BITS 6
+#define POOL_SHARDS (1 << POOL_SHARD_BITS)
+
+// a pooled string; callers only ever see str
+typedef struct PathStr {
+  struct PathStr *next;   // next string in the same bucket
+  unsigned int hash;      // hash of str
+  atomic_int refs;        // number of holders
+  uint32_t id;            // number for the path while pooled, or 0
+  char str[];             // the path itself
+} PathStr;
+
+// one part of the pool; the pool is shared by everything in the process
+typedef struct {
+  pthread_mutex_t lock;
+  PathStr **buckets;
+  int n_buckets;
+  int n_paths;
+  long n_bytes;
+  uint32_t n_ids;         // ids handed out so far, never reused
+  uint32_t *free_ids;     // ids of released paths, to hand out again
+  int n_free;
+  int cap_free;
+} PoolShard;
+
+static PoolShard shards[POOL_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+// get back to the header from the string handed out
+#define PATHSTR(s) ((PathStr *) ((s) - offsetof(PathStr, str)))
+
+// FNV-1a hash of a path
+static unsigned int hash_path(const char *path) {
+  unsigned int hash = 2166136261u;
+  for (const unsigned char *c = (const unsigned char *) path; *c != '\0'; c++) {
+    hash ^= *c;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void shards_init(void) {
+  for (int i = 0; i < POOL_SHARDS; i++) {
+    pthread_mutex_init(&shards[i].lock, NULL);
+  }
+}
+
+// ids above this can't be told apart from their shard's bits, so a shard
+// that has handed them all out gives the rest no id
+#define MAX_SHARD_ID ((uint32_t) -1 >> POOL_SHARD_BITS)
+
+// the shard a hash belongs to, by its top bits, as the buckets use the bottom
+static PoolShard *shard_of(unsigned int hash) {
+  pthread_once(&shards_once, shards_init);
+  return &shards[hash >> (32 - POOL_SHARD_BITS)];
+}
+
+// rehash a shard into nbuckets buckets; caller holds its lock
+static int resize(PoolShard *shard, int nbuckets) {
+  PathStr **fresh = calloc(nbuckets, sizeof(PathStr *));
+  if (fresh == NULL) {
+    return -1;
+  }
+
+  for (int i = 0; i < shard->n_buckets; i++) {
+    PathStr *cur = shard->buckets[i];
+    while (cur != NULL) {
+      PathStr *next = cur->next;
+      cur->next = fresh[cur->hash % nbuckets];
+      fresh[cur->hash % nbuckets] = cur;
+      cur = next;
+    }
+  }
+
+  free(shard->buckets);
+  shard->buckets = fresh;
+  shard->n_buckets = nbuckets;
+  return 1;
+}
+
+// an id for a new path in shard, reusing a released one first; the shard's
+// index is in the low bits, so every shard's ids are its own. Caller holds
+// its lock
+static uint32_t id_take(PoolShard *shard) {
+  uint32_t local;
+  if (shard->n_free > 0) {
+    local = shard->free_ids[--shard->n_free];
+  }
+  else if (shard->n_ids < MAX_SHARD_ID) {
+    local = ++shard->n_ids;
+  }
+  else {
+    return 0;
+  }
+  return (local << POOL_SHARD_BITS) | (uint32_t) (shard - shards);
+}
+
+// hand a released path's id back to shard; if there's no room to keep it,
+// it is just never reused. Caller holds its lock
+static void id_give(PoolShard *shard, uint32_t id) {
+  if (id == 0) {
+    return;
+  }
+  if (shard->n_free == shard->cap_free) {
+    int cap = shard->cap_free > 0 ? shard->cap_free * 2 : 64;
+    uint32_t *grown = realloc(shard->free_ids, cap * sizeof(uint32_t));
+    if (grown == NULL) {
+      return;
+    }
+    shard->free_ids = grown;
+    shard->cap_free = cap;
+  }
+  shard->free_ids[shard->n_free++] = id >> POOL_SHARD_BITS;
+}
+
+// find or add path in the pool
+char *path_intern(const char *path) {
+  if (path == NULL) {
+    return NULL;
+  }
+
+  unsigned int hash = hash_path(path);
+  PoolShard *shard = shard_of(hash);
+
+  pthread_mutex_lock(&shard->lock);
+
+  if (shard->buckets == NULL && resize(shard, INIT_BUCKETS) < 0) {
+    pthread_mutex_unlock(&shard->lock);
+    return NULL;
+  }
+
+  // already pooled: just take a reference. Its last one can only be dropped
+  // under the lock, so it can't be on its way out
+  for (PathStr *cur = shard->buckets[hash % shard->n_buckets]; cur != NULL; cur = cur->next) {
+    if (cur->hash == hash && strcmp(cur->str, path) == 0) {
+      atomic_fetch_add_explicit(&cur->refs, 1, memory_order_relaxed);
+      pthread_mutex_unlock(&shard->lock);
+      return cur->str;
+    }
+  }
+
+  // otherwise add a copy sized to the path
+  int len = strlen(path);
+  PathStr *item = malloc(sizeof(PathStr) + len + 1);
+  if (item == NULL) {
+    pthread_mutex_unlock(&shard->lock);
+    return NULL;
+  }
+  memcpy(item->str, path, len + 1);
+  item->hash = hash;
+  item->id = id_take(shard);
+  atomic_init(&item->refs, 1);
+
+  if (shard->n_paths + 1 > shard->n_buckets) {
+    resize(shard, shard->n_buckets * 2);
+  }
+  item->next = shard->buckets[hash % shard->n_buckets];
+  shard->buckets[hash % shard->n_buckets] = item;
+  shard->n_paths++;
+  shard->n_bytes += len + 1;
+
+  pthread_mutex_unlock(&shard->lock);
+
+  return item->str;
+}
+
+// take another reference to an interned path
+char *path_retain(char *path) {
+  if (path == NULL) {
+    return NULL;
+  }
+
+  // the caller holds a reference, so the count can't reach 0 meanwhile
+  atomic_fetch_add_explicit(&PATHSTR(path)->refs, 1, memory_order_relaxed);
+
+  return path;
+}
+
+// drop a reference, removing the path from the pool with the last one
+void path_release(char *path) {
+  if (path == NULL) {
+    return;
+  }
+
+  PathStr *item = PATHSTR(path);
+
+  // any reference but the last is dropped without the lock
+  int refs = atomic_load_explicit(&item->refs, memory_order_relaxed);
+  while (refs > 1) {
+    if (atomic_compare_exchange_weak_explicit(&item->refs, &refs, refs - 1,
+          memory_order_release, memory_order_relaxed)) {
+      return;
+    }
+  }
+
+  // what may be the last one is dropped under the lock, so path_intern
+  // can't hand the path out again as it goes
+  PoolShard *shard = shard_of(item->hash);
+  pthread_mutex_lock(&shard->lock);
+
+  if (atomic_fetch_sub_explicit(&item->refs, 1, memory_order_acq_rel) > 1) {
+    pthread_mutex_unlock(&shard->lock);
+    return;
+  }
+
+  // unlink it from its bucket
+  PathStr **link = &shard->buckets[item->hash % shard->n_buckets];
+  while (*link != NULL && *link != item) {
+    link = &(*link)->next;
+  }
+  if (*link != NULL) {
+    *link = item->next;
+  }
+  shard->n_paths--;
+  shard->n_bytes -= strlen(item->str) + 1;
+  id_give(shard, item->id);
+
+  pthread_mutex_unlock(&shard->lock);
+
+  free(item);
+}
+
+// the id of an interned path
+uint32_t path_id(const char *path) {
+  if (path == NULL) {
+    return 0;
+  }
+  return PATHSTR(path)->id;
+}
+
+// report how much is pooled
+void path_stats(int *paths, long *bytes) {
+  int n_paths = 0;
+  long n_bytes = 0;
+  pthread_once(&shards_once, shards_init);
+  for (int i = 0; i < POOL_SHARDS; i++) {
+    pthread_mutex_lock(&shards[i].lock);
+    n_paths += shards[i].n_paths;
+    n_bytes += shards[i].n_bytes;
+    pthread_mutex_unlock(&shards[i].lock);
+  }
+
+  if (paths != NULL) {
+    *paths = n_paths;
+  }
+  if (bytes != NULL) {
+    *bytes = n_bytes;
+  }
+}
@@ -0,0 +1,56 @@
+/*
+ * pathpool.h: a process-wide pool of interned path strings
+ *
+ * Every FileInfo_FS, FileSetItem and (through them) FileTable entry refers to
+ * its path through this pool, so a path is stored once, at its real length,
+ * no matter how many structures mention it. Strings are reference counted and
+ * freed when the last holder releases them. Equal paths intern to the same
+ * pointer, and interned strings must never be written to.
+ *
+ * All functions are thread-safe. The pool is split by hash into shards with
+ * a lock each, and references are counted atomically, so retaining a path,
+ * or releasing any but its last reference, takes no lock at all.
+ *
+ * written by team Fleetwood MAC
+ * CS60, May 2018.
+ */
+
+#ifndef PATHPOOL_H
+#define PATHPOOL_H
+
+#include <stdint.h>
+
+/*
+ * Returns the pooled copy of path, adding it to the pool if needed.
+ * The caller holds one reference and must path_release it.
+ * @return interned string, or NULL on error
+ */
+char *path_intern(const char *path);
+
+/*
+ * Takes another reference to an interned string.
+ * @return path
+ */
+char *path_retain(char *path);
+
+/*
+ * Drops a reference to an interned string, freeing it with the last one.
+ * Does nothing if path is NULL.
+ */
+void path_release(char *path);
+
+/*
+ * A number for an interned string, unique among the paths pooled at the
+ * time, so comparing ids compares paths. The id is handed out again once
+ * the path leaves the pool.
+ * @return the id, never 0 for a pooled path; 0 for NULL, or in the unlikely
+ *  case the pool has run out of ids
+ */
+uint32_t path_id(const char *path);
+
+/*
+ * Number of distinct paths and total bytes of path data currently pooled
+ */
+void path_stats(int *paths, long *bytes);
+
+#endif
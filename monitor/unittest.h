@@ -0,0 +1,41 @@
+/*
+ * unittest.h: what every unit test program shares
+ *
+ * A test checks conditions with CHECK, which reports each one that doesn't
+ * hold and carries on, and ends main with check_report. Include it from the
+ * test's own .c file only: each program gets its own count of failures.
+ *
+ * written by team Fleetwood MAC
+ * CS60, May 2018.
+ */
+
+#ifndef UNITTEST_H
+#define UNITTEST_H
+
+#include <stdio.h>
+
+// checks failed so far
+static int failures = 0;
+
+// report and count cond if it doesn't hold, saying what was being checked
+#define CHECK(cond, what) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "FAIL %s:%d: %s\n", __FILE__, __LINE__, what); \
+      failures++; \
+    } \
+  } while (0)
+
+/*
+ * Prints how the test program called name went.
+ * @return what main returns: 0 if every check held, 1 otherwise
+ */
+static inline int check_report(const char *name) {
+  if (failures > 0) {
+    fprintf(stderr, "%s: %d failed\n", name, failures);
+    return 1;
+  }
+  printf("%s: ok\n", name);
+  return 0;
+}
+
+#endif
@@ -18,6 +18,10 @@
 // an event from a file in order to ensure we actually ignore it 
 #define WAIT_TIME (const struct timespec[]){{0, 300000000L}}
 
+// every this many heartbeats, the tracker checks our files against its table
+// instead, catching anything an update missed
+#define SYNC_BEATS 12
+
 /***************** Global Variables *****************************************/
 // A record of the files contained on this peer and other peers.
 
@@ -44,6 +48,14 @@ char *dir;
 
 monitor *filemonitor;
 
+// the tracker's file table as of the last update, flat as it was received;
+// deltas are applied to it
+FlatTable *file_table;
+
+// our files as of the last REGISTER or SYNC, which the tracker's
+// SYNC_REQUESTs are answered from; guarded by comm_lock
+FileTable *sync_table;
+
 // pthread sending keep alives
 pthread_t heartbeat_thread_id;
 pthread_t monitor_thread_id;
@@ -156,19 +168,52 @@ int main(const int argc, char *argv[]) {
 
     switch (msg.type) {
       case TABLE_UPDATE:
+      case TABLE_DELTA:
         {
-          TableUpdateBody *b = msg.body;
-          FileTable *ft = b->table;
-
-          // Manually set lock to null
-          ft->lock = NULL;
+          if (msg.type == TABLE_UPDATE) {
+            // a whole table replaces what we had
+            flattable_destroy(file_table);
+            file_table = ((TableUpdateBody *) msg.body)->flat_table;
+          } else {
+            // changes are applied on top of it, into a new table without
+            // the removals, since we never pass them on
+            FlatTable *ft = ((TableDeltaBody *) msg.body)->flat_table;
+            FlatTable *applied = flattable_apply(file_table, ft);
+            if (applied == NULL) {
+              fprintf(stderr, "Couldn't apply table changes\n");
+            } else {
+              flattable_destroy(file_table);
+              file_table = applied;
+            }
+            flattable_destroy(ft);
+          }
+          free(msg.body);
+
+          if (file_table == NULL) {
+            break;
+          }
+
+          flattable_print(file_table);
+
+          update_from_filetable(file_table);
+
+          // tell the tracker what we have, so it only sends what's newer
+          pthread_mutex_lock(&comm_lock);
+          send_table_ack(tracker_conn, file_table->version);
+          pthread_mutex_unlock(&comm_lock);
+        }
+        break;
 
-          filetable_print(ft);
+      // the tracker is checking our files, and wants to look further down
+      case SYNC_REQUEST:
+        {
+          SyncRequestBody *b = msg.body;
 
-          update_from_filetable(ft);
+          pthread_mutex_lock(&comm_lock);
+          answer_sync_request(b);
+          pthread_mutex_unlock(&comm_lock);
 
-          // clean up from this message
-          filetable_destroy(ft);
+          fileinfo_destroy_all(b->dirs);
           free(b);
         }
         break;
@@ -228,6 +273,12 @@ void download_file(TableEntry *fileentry) {
     return;
   }
 
+  // a file no connected peer has can't be fetched yet; the table changes,
+  // and this is called again, once one registers with it
+  if (!fileentry->file->is_dir && fileentry->numpeers == 0) {
+    return;
+  }
+
   // don't download anything that's already being downloaded
   nanosleep(WAIT_TIME, NULL); // but only after waiting for as long as it would take to remove
   if (fileset_contains(filemonitor->ignore_modify, fileentry->file->filepath)) {
@@ -330,71 +381,68 @@ void delete_file(char *filepath) {
   monitor_resume_delete(filemonitor, filepath);
 }
 
-void update_from_filetable(FileTable *ft) {
-  if (ft == NULL) {
+// downloads the file in a row of the table, as download_file does for an entry
+void download_row(FlatTable *ft, int row) {
+  TableEntry *entry = flattable_entry(ft, row);
+  download_file(entry);
+  tableentry_destroy(entry);
+}
+
+void update_from_filetable(FlatTable *ft) {
+  update_dir_from_filetable(ft, "");
+}
+
+void update_dir_from_filetable(FlatTable *ft, char *dirname) {
+  if (ft == NULL || dirname == NULL) {
     return;
   }
 
-  // get current status of files
-  FileInfo_FS *files = monitor_get_current_files(filemonitor);
+  // get current status of files below the directory, lined up with the table
+  FileInfo_FS *files = monitor_get_files_under(filemonitor, dirname);
+  FileComparison *cmp = flattable_compare(ft, files);
+  FileColumns *table = cmp->table;
 
-  FileInfo_FS *cur = files;
-  while (cur != NULL) {
-    // then, for each file, look it up in the filetable
-    TableEntry *entry = filetable_getEntry(ft, cur->filepath);
+  for (int i = 0; i < cmp->n; i++) {
+    FileInfo_FS *cur = cmp->files[i];
 
     // if we didn't find it, that means we need to delete it locally
-    if (entry == NULL) {
+    if (cmp->result[i] == FILE_ABSENT) {
       // only delete if it's not a dotfile
       if (cur->filepath[0] != '.') {
         printf("Deleting %s\n", cur->filepath);
         delete_file(cur->filepath);
       }
-    } else {
-      // we only download when 1. the tracker thinks we don't have the latest
-      // and 2. the modification times are off or the size is off
-      int hasLatest = filetable_entryContainsPeer(entry, my_ip, port_num);
-      if (!hasLatest && (cur->last_modified < entry->file->last_modified || cur->size != entry->file->size)) {
-        // if our version is out of date or the wrong size
-        // then start downloading the latest copy
-        download_file(entry);
-      } else {
-        //printf("%s is up to date\n", cur->filepath);
-      }
+      continue;
     }
 
-    cur = cur->next;
+    // we only download when 1. the tracker thinks we don't have the latest
+    // and 2. the modification times are off or the size is off
+    int row = cmp->rows[i];
+    if ((cmp->result[i] == FILE_OLDER || cmp->resized[i]) &&
+        !flattable_hasPeer(ft, row, my_ip, port_num)) {
+      // if our version is out of date or the wrong size
+      // then start downloading the latest copy
+      download_row(ft, row);
+    }
   }
 
-
-  // now we need to determine which files are new and need to be downloaded
-  // done by inefficiently looking through both lists again.
-  // This could be made more efficient if we ensured the lists were always sorted.
-  TableEntry *entry = ft->head;
-
-  while (entry != NULL) {
-    FileInfo_FS *cur = files;
-
-    // flag for whether to download this new file
-    bool fileExists = false;
-
-    while (cur != NULL) {
-      // if the file in the table is here, don't need to download
-      if (strcmp(cur->filepath, entry->file->filepath) == 0) {
-        fileExists = true;
-        break;
-      }
-
-      cur = cur->next;
+  // now we need to determine which files are new and need to be downloaded:
+  // the rows below the directory that none of our files lined up with. Rows
+  // are in path order, so those below the directory sit together
+  size_t len = strlen(dirname);
+  for (int row = 0; row < table->n; row++) {
+    char *path = table->paths[row];
+    if (len > 0 && (strncmp(path, dirname, len) != 0 || path[len] != '/')) {
+      continue;
     }
 
-    if (!fileExists) {
-      download_file(entry);
+    // if the file in the table is here, don't need to download
+    if (!cmp->matched[row]) {
+      download_row(ft, row);
     }
-
-    entry = entry->next;
   }
 
+  filecomparison_destroy(cmp);
   fileinfo_destroy_all(files);
 }
 
@@ -422,19 +470,73 @@ void *read_monitor_thread(void *arg) {
   }
 }
 
-// sends initial REGISTER packet to the tracker and waits for acknowledgement
-int register_with_tracker() {
-  // get all the files we currently have
+// take stock of the files we have, for the tracker to check against its table
+uint64_t take_sync_snapshot() {
   FileInfo_FS *files = monitor_get_current_files(filemonitor);
 
-  // send files and registration info to the server
-  send_register(tracker_conn, port_num, files);
+  // files being downloaded are neither the old copy nor the new one yet
+  FileInfo_FS **link = &files;
+  while (*link != NULL) {
+    FileInfo_FS *cur = *link;
+    if (monitor_is_ignoring_modify(filemonitor, cur->filepath)) {
+      *link = cur->next;
+      fileinfo_destroy(cur);
+    } else {
+      link = &cur->next;
+    }
+  }
 
-  // then wait for initial acknowledgement with the filetable
+  filetable_destroy(sync_table);
+  sync_table = filetable_init();
+  filetable_bulkload(sync_table, files, "", 0);
+  fileinfo_destroy_all(files);
+
+  return filetable_digest(sync_table, "");
+}
+
+// send the digests of everything directly below the directories asked for
+void answer_sync_request(SyncRequestBody *b) {
+  DigestNode *nodes = NULL;
+  for (FileInfo_FS *d = b->dirs; d != NULL; d = d->next) {
+    DigestNode *children = filetable_digestChildren(sync_table, d->filepath);
+    if (children == NULL) {
+      continue;
+    }
+
+    DigestNode *last = children;
+    while (last->next != NULL) {
+      last = last->next;
+    }
+    last->next = nodes;
+    nodes = children;
+  }
+
+  send_sync_digests(tracker_conn, nodes);
+  digestnode_destroy_all(nodes);
+}
+
+// sends initial REGISTER packet to the tracker and waits for acknowledgement
+int register_with_tracker() {
+  // send the digest of the files we have and registration info to the server
+  send_register(tracker_conn, port_num, take_sync_snapshot(), FEATURE_COMPRESS);
+
+  // then answer its questions about what differs, until the initial
+  // acknowledgement with the filetable
   Message msg;
-  if (recv_message(tracker_conn, &msg) == -1) {
-    fprintf(stderr, "Couldn't receive register ack\n");
-    exit(1);
+  while (1) {
+    if (recv_message(tracker_conn, &msg) == -1) {
+      fprintf(stderr, "Couldn't receive register ack\n");
+      exit(1);
+    }
+
+    if (msg.type != SYNC_REQUEST) {
+      break;
+    }
+
+    SyncRequestBody *req = msg.body;
+    answer_sync_request(req);
+    fileinfo_destroy_all(req->dirs);
+    free(req);
   }
 
   // should always be a REGISTER_ACK; assert so
@@ -451,8 +553,12 @@ int register_with_tracker() {
   piece_len = b->piece_len;
   printf("Successfully registered. Piecelen: %d, interval: %d \n", piece_len, interval);
 
+  // and compress large messages if it can take them
+  if (b->features & FEATURE_COMPRESS) {
+    message_compress(tracker_conn);
+  }
+
   // clean up from registration
-  fileinfo_destroy_all(files);
   free(b);
 
   return 1;
@@ -460,10 +566,20 @@ int register_with_tracker() {
 
 // thread to loop forever, sending keep alive messages on every interval
 void *heartbeat_thread(void *arg) {
-  while (1) {
+  for (int beats = 1; ; beats++) {
     sleep(interval);
 
-    if (send_keep_alive(tracker_conn) == -1) {
+    // a SYNC keeps us alive just as well
+    pthread_mutex_lock(&comm_lock);
+    int res;
+    if (beats % SYNC_BEATS == 0) {
+      res = send_sync(tracker_conn, take_sync_snapshot());
+    } else {
+      res = send_keep_alive(tracker_conn);
+    }
+    pthread_mutex_unlock(&comm_lock);
+
+    if (res == -1) {
       fprintf(stderr, "Couldn't send heartbeat.\n");
       exit(1);
     }
@@ -504,6 +620,9 @@ int initialize_connection(char *host_ip) {
   }
 
   printf("Connected to the server.\n");
+
+  // buffers for its messages, and the paths the tracker names on it
+  message_open(comm_sock, 0);
   return comm_sock;
 }
 
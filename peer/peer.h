@@ -46,7 +46,19 @@ int heartbeat_init(pthread_t *t_id);
 int register_with_tracker();
 
 /*
- * thread to send a KEEP_ALIVE to tracker at the proper interval
+ * takes stock of the files we have, keeping them to answer the tracker's
+ * SYNC_REQUESTs from, and returns their digest
+ */
+uint64_t take_sync_snapshot();
+
+/*
+ * answers a SYNC_REQUEST with the digests below the directories it asks for
+ */
+void answer_sync_request(SyncRequestBody *b);
+
+/*
+ * thread to send a KEEP_ALIVE to tracker, or now and then a SYNC, at the
+ * proper interval
  */
 void *heartbeat_thread(void *arg);
 
@@ -63,7 +75,13 @@ void stop_peer();
 /*
  * updates local files to match the provided filetable
  */
-void update_from_filetable(FileTable *table);
+void update_from_filetable(FlatTable *table);
+
+/*
+ * updates local files at or below dirname to match the provided filetable,
+ * without looking at the rest of the table or the watched directory
+ */
+void update_dir_from_filetable(FlatTable *table, char *dirname);
 
 /*
  * Deletes the file at filepath.
@@ -5,6 +5,16 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include "peertable.h"
+#include "../messaging/segment.h"
+
+// references to peers and peer lists are counted under one lock
+static pthread_mutex_t ref_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define MIN_BUCKETS 64
+
+static void publish(PeerTable *table);
+static int unlink_peer(PeerTable *table, Peer *peer);
+static void grow(PeerTable *table);
 
 Peer *peer_init() {
   Peer *p = calloc(1, sizeof(Peer));
@@ -12,6 +22,8 @@ Peer *peer_init() {
     return NULL;
   }
 
+  pthread_mutex_init(&p->send_lock, NULL);
+  p->refs = 1;
 
   return p;
 }
@@ -21,21 +33,51 @@ void peer_print(Peer *peer) {
     return;
   }
 
-  printf("%s:%d \t last seen: %s", peer->ip, peer->listen_port, ctime(&peer->last_timestamp));
+  printf("%s:%d \t queued: %zu (peak %zu) \t last seen: %s", peer->ip, peer->listen_port,
+    peer->queued, peer->queued_peak, ctime(&peer->last_timestamp));
 }
 
-void peer_destroy(Peer *peer) {
+void peer_disconnect(Peer *peer) {
   if (peer == NULL) {
     return;
   }
 
-  printf("Destroying peer %s\n", peer->ip);
+  printf("Disconnecting peer %s\n", peer->ip);
+
+  // the event loop sees the hang-up; the socket itself stays open until no
+  // one can still be sending on it
+  shutdown(peer->sockfd, SHUT_RDWR);
+}
+
+Peer *peer_retain(Peer *peer) {
+  if (peer == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&ref_lock);
+  peer->refs++;
+  pthread_mutex_unlock(&ref_lock);
 
-  pthread_cancel(peer->thread_id);
-  pthread_join(peer->thread_id, NULL);
+  return peer;
+}
+
+void peer_release(Peer *peer) {
+  if (peer == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&ref_lock);
+  int refs = --peer->refs;
+  pthread_mutex_unlock(&ref_lock);
+
+  if (refs > 0) {
+    return;
+  }
 
-  // close the socket
+  // close the socket, forgetting the paths named on it
+  message_close(peer->sockfd);
   close(peer->sockfd);
+  pthread_mutex_destroy(&peer->send_lock);
 
   free(peer);
 }
@@ -46,12 +88,20 @@ PeerTable *peertable_init() {
     return NULL;
   }
 
+  pt->buckets = calloc(MIN_BUCKETS, sizeof(Peer *));
+  if (pt->buckets == NULL) {
+    free(pt);
+    return NULL;
+  }
+  pt->n_buckets = MIN_BUCKETS;
+
   pthread_mutex_init(&pt->lock, NULL);
+  publish(pt);
 
   return pt;
 }
 
-// insert the peer at the front of the table
+// insert the peer at the front of its socket's bucket
 int peertable_add(PeerTable *table, Peer *peer) {
   if (table == NULL || peer == NULL) {
     return -1;
@@ -59,47 +109,96 @@ int peertable_add(PeerTable *table, Peer *peer) {
 
   pthread_mutex_lock(&table->lock);
 
-  peer->next = table->head;
-  table->head = peer;
+  if (table->n_peers >= table->n_buckets) {
+    grow(table);
+  }
+  Peer **bucket = &table->buckets[peer->sockfd % table->n_buckets];
+  peer->next = *bucket;
+  *bucket = peer;
+  table->n_peers++;
+  publish(table);
 
   pthread_mutex_unlock(&table->lock);
 
   return 1;
 }
 
-// find and remove the specified peer from the table
+// find and remove the specified peer from its socket's bucket
 int peertable_remove(PeerTable *table, Peer *peer) {
-  if (table == NULL || peer == NULL) {
+  return (peertable_removeMany(table, &peer, 1) == 1) ? 1 : -1;
+}
+
+// take every peer out of its bucket, then publish the list once
+int peertable_removeMany(PeerTable *table, Peer **peers, int n_peers) {
+  if (table == NULL || peers == NULL) {
     return -1;
   }
 
   pthread_mutex_lock(&table->lock);
 
-  Peer *cur = table->head;
-  Peer *prev = NULL;
-
-  while (cur != NULL) { 
-    // find the peer we wanted to remove
-    if (cur == peer) {
-      // if prev is null, that means we're at the head
-      if (prev == NULL) {
-        // just advance the head
-        table->head = table->head->next;
-      } else {
-        // otherwise skip over the found peer
-        prev->next = cur->next;
-      }
-      break;
+  int removed = 0;
+  for (int i = 0; i < n_peers; i++) {
+    if (peers[i] != NULL && unlink_peer(table, peers[i])) {
+      removed++;
     }
+  }
+  if (removed > 0) {
+    publish(table);
+  }
 
-    prev = cur;
+  pthread_mutex_unlock(&table->lock);
+
+  return removed;
+}
+
+Peer *peertable_find(PeerTable *table, int sockfd) {
+  if (table == NULL || sockfd < 0) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&table->lock);
+  Peer *cur = table->buckets[sockfd % table->n_buckets];
+  while (cur != NULL && cur->sockfd != sockfd) {
     cur = cur->next;
   }
+  pthread_mutex_unlock(&table->lock);
+
+  return cur;
+}
 
+// hand out the current list of peers
+PeerSnapshot *peertable_snapshot(PeerTable *table) {
+  if (table == NULL) {
+    return NULL;
+  }
 
+  pthread_mutex_lock(&table->lock);
+  PeerSnapshot *snap = table->current;
+  pthread_mutex_lock(&ref_lock);
+  snap->refs++;
+  pthread_mutex_unlock(&ref_lock);
   pthread_mutex_unlock(&table->lock);
 
-  return 1;
+  return snap;
+}
+
+void peersnapshot_release(PeerSnapshot *snap) {
+  if (snap == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&ref_lock);
+  int refs = --snap->refs;
+  pthread_mutex_unlock(&ref_lock);
+
+  if (refs > 0) {
+    return;
+  }
+
+  for (int i = 0; i < snap->n_peers; i++) {
+    peer_release(snap->peers[i]);
+  }
+  free(snap);
 }
 
 void peertable_print(PeerTable *table) {
@@ -107,12 +206,13 @@ void peertable_print(PeerTable *table) {
     return;
   }
 
-  Peer *cur = table->head;
+  PeerSnapshot *snap = peertable_snapshot(table);
 
-  while (cur != NULL) {
-    peer_print(cur);
-    cur = cur->next;
+  for (int i = 0; i < snap->n_peers; i++) {
+    peer_print(snap->peers[i]);
   }
+
+  peersnapshot_release(snap);
 }
 
 void peertable_destroy(PeerTable *table) {
@@ -120,13 +220,82 @@ void peertable_destroy(PeerTable *table) {
     return;
   }
 
-  Peer *tmp;
-  while (table->head != NULL) {
-    tmp = table->head;
+  for (int i = 0; i < table->n_buckets; i++) {
+    while (table->buckets[i] != NULL) {
+      Peer *tmp = table->buckets[i];
 
-    peertable_remove(table, tmp);
-    peer_destroy(tmp);
+      unlink_peer(table, tmp);
+      peer_disconnect(tmp);
+      peer_release(tmp);
+    }
   }
 
+  peersnapshot_release(table->current);
+  pthread_mutex_destroy(&table->lock);
+  free(table->buckets);
   free(table);
 }
+
+// replace the published list of peers with one of those in the buckets
+// caller holds table->lock
+static void publish(PeerTable *table) {
+  PeerSnapshot *snap = calloc(1, sizeof(PeerSnapshot) + table->n_peers * sizeof(Peer *));
+  if (snap == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  snap->refs = 1;
+  for (int i = 0; i < table->n_buckets; i++) {
+    for (Peer *cur = table->buckets[i]; cur != NULL; cur = cur->next) {
+      snap->peers[snap->n_peers++] = peer_retain(cur);
+    }
+  }
+
+  // readers still holding the old list keep it, and its peers, alive
+  PeerSnapshot *old = table->current;
+  table->current = snap;
+  peersnapshot_release(old);
+}
+
+// take peer out of its bucket, without publishing the change
+// @return 1 if it was in the table, 0 if not
+// caller holds table->lock
+static int unlink_peer(PeerTable *table, Peer *peer) {
+  Peer **link = &table->buckets[peer->sockfd % table->n_buckets];
+  while (*link != NULL && *link != peer) {
+    link = &(*link)->next;
+  }
+  if (*link == NULL) {
+    return 0;
+  }
+  *link = peer->next;
+  peer->next = NULL;
+  table->n_peers--;
+  return 1;
+}
+
+// double the buckets, rehashing every peer into them
+// caller holds table->lock
+static void grow(PeerTable *table) {
+  int n_buckets = 2 * table->n_buckets;
+  Peer **buckets = calloc(n_buckets, sizeof(Peer *));
+  if (buckets == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  for (int i = 0; i < table->n_buckets; i++) {
+    Peer *next;
+    for (Peer *cur = table->buckets[i]; cur != NULL; cur = next) {
+      next = cur->next;
+      Peer **bucket = &buckets[cur->sockfd % n_buckets];
+      cur->next = *bucket;
+      *bucket = cur;
+    }
+  }
+
+  free(table->buckets);
+  table->buckets = buckets;
+  table->n_buckets = n_buckets;
+}
@@ -1,6 +1,7 @@
 /*
  * peertable.h: structure and functions used by tracker to maintain 
- * a list of all the peers currently connected
+ * a list of all the peers currently connected, hashed by socket so the
+ * event loop can find the peer an fd belongs to
  */
 
 #ifndef PEERTABLE_H
@@ -9,20 +10,59 @@
 #include <pthread.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include "../filetable/filetable.h"
+#include "timerwheel.h"
+
+// Where a peer's check of its files against the table has got to. The peer
+// sends the digest of all its files; wherever that differs from the table's,
+// the tracker asks for the digests one level further down, until it has the
+// files that differ and the directories that match
+typedef struct {
+  int port;             // port the peer's files are listed under
+  int registering;      // whether the check is the peer's registration
+  int pending;          // SYNC_REQUESTs the peer hasn't answered yet
+  FileInfo_FS *files;   // the peer's files that differ from the table
+  DigestNode *same;     // directories where the peer has what the table has
+} SyncState;
 
 typedef struct Peer {
   // how to access this peer
   char ip[INET_ADDRSTRLEN];
   int listen_port;
   time_t last_timestamp;  // last checkin time
+  Timer liveness;         // fires if the peer goes PEER_TIMEOUT without a message
+  unsigned long acked;    // newest file table version the peer has acknowledged,
+                          // under the file table's own lock
   int sockfd;             // socket to talk to this peer from the tracker
-  pthread_t thread_id;    // handshake thread id for the peer
+  SyncState sync;         // the check of the peer's files under way, if any
+
+  // What's waiting to go to the peer, under send_lock. While anything is,
+  // broadcasts aren't queued behind it: the peer is owed the table, and gets
+  // one delta of it as it is then once the queue drains
+  size_t queued;          // bytes sockfd hasn't taken yet
+  size_t queued_peak;     // the most there have ever been
+  time_t behind_since;    // when the queue last stopped being empty; 0 while it is
+  int owed;               // whether broadcasts were held back
+  unsigned long coalesced;  // broadcasts held back and folded into a later delta
+  pthread_mutex_t send_lock;  // held while writing a message to sockfd
+  int refs;               // references held; freed with the last one
 
-  struct Peer *next;
+  struct Peer *next;      // next in its bucket of the table
 } Peer;
 
+// An immutable list of the peers in the table at one point in time, so
+// threads can walk the peers without holding the table's lock
 typedef struct {
-  Peer *head;
+  int refs;               // references held; freed with the last one
+  int n_peers;
+  Peer *peers[];          // each holds a reference
+} PeerSnapshot;
+
+typedef struct {
+  Peer **buckets;         // peers by sockfd, chained through next
+  int n_buckets;          // grown to keep about a peer a bucket
+  int n_peers;
+  PeerSnapshot *current;  // published list, replaced whenever a peer comes or goes
   pthread_mutex_t lock;
 } PeerTable;
 
@@ -33,9 +73,21 @@ typedef struct {
 Peer *peer_init();
 
 /*
- * Destroy a peer/release all memory associated
+ * Shut a peer's socket down, for the event loop to see it hang up and drop
+ * it. The socket itself is closed with the last reference.
+ */
+void peer_disconnect(Peer *peer);
+
+/*
+ * Take another reference to a peer
+ * @return peer
+ */
+Peer *peer_retain(Peer *peer);
+
+/*
+ * Drop a reference to a peer, closing and freeing it with the last one
  */
-void peer_destroy(Peer *peer);
+void peer_release(Peer *peer);
 
 /*
  * Creates and returns a new peer table
@@ -55,13 +107,40 @@ int peertable_add(PeerTable *table, Peer *peer);
  */
 int peertable_remove(PeerTable *table, Peer *peer);
 
+/*
+ * Remove several peers from the table at once, publishing the new list of
+ * peers once rather than after each
+ * @return the number that were in the table and removed, -1 on error
+ */
+int peertable_removeMany(PeerTable *table, Peer **peers, int n_peers);
+
+/*
+ * Find the peer talking on sockfd. The table's reference is lent, so only
+ * the thread that removes peers from the table may hold on to it.
+ * @return the peer, or NULL if sockfd isn't one
+ */
+Peer *peertable_find(PeerTable *table, int sockfd);
+
+/*
+ * Returns the current list of peers, which stays valid and unchanged until
+ * released, however the table changes in the meantime
+ * @return PeerSnapshot* that must be released with peersnapshot_release
+ */
+PeerSnapshot *peertable_snapshot(PeerTable *table);
+
+/*
+ * Drop a reference to a list of peers
+ */
+void peersnapshot_release(PeerSnapshot *snap);
+
 /*
  * Print the table in a human-readable way
  */
 void peertable_print(PeerTable *table);
 
 /*
- * Destroy a peer table/release all memory associated
+ * Destroy a peer table/release all memory associated, dropping the
+ * reference to each peer held by whoever added it
  */
 void peertable_destroy(PeerTable *table);
 
@@ -0,0 +1,269 @@
+#define _XOPEN_SOURCE 500
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "tablestore.h"
+
+// the log is never checkpointed while it is smaller than this
+#define MIN_CHECKPOINT 65536
+
+static char *store_path(const char *dir, const char *name, const char *ext);
+static char *tmp_path(const char *path);
+static const char *map_file(const char *path, size_t *len);
+static FileTable *snap_load(TableStore *store);
+static int snap_checkpoint(TableStore *store, FileTable *ft);
+
+TableStore *tablestore_open(const char *dir, const char *name, FileTable **table) {
+  if (dir == NULL || name == NULL || table == NULL) {
+    return NULL;
+  }
+
+  if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+    perror("Error creating table store");
+    return NULL;
+  }
+
+  TableStore *store = calloc(1, sizeof(TableStore));
+  if (store == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  store->snappath = store_path(dir, name, "snap");
+  store->logpath = store_path(dir, name, "log");
+
+  // start from the snapshot, if there is one
+  FileTable *ft = snap_load(store);
+  if (ft == NULL) {
+    ft = filetable_init();
+  }
+
+  // then replay the log; it ends at the first record that didn't make it to
+  // disk whole, and anything after that is cut off so appends start clean
+  size_t len;
+  size_t off = 0;
+  const char *buf = map_file(store->logpath, &len);
+  if (buf != NULL) {
+    while (off < len) {
+      size_t used;
+      FileTable *changes = filetable_load(buf + off, len - off, &used);
+      if (changes == NULL) {
+        break;
+      }
+      int res = filetable_applyChanges(ft, changes);
+      filetable_destroy(changes);
+      if (res < 0) {
+        break;
+      }
+      off += used;
+    }
+    munmap((void *) buf, len);
+
+    if (off < len) {
+      fprintf(stderr, "Dropping %lu damaged bytes at the end of %s\n",
+          (unsigned long) (len - off), store->logpath);
+      if (truncate(store->logpath, off) < 0) {
+        perror("Error truncating table log");
+      }
+    }
+  }
+  store->logsize = off;
+  store->logged = ft->version;
+
+  store->log = fopen(store->logpath, "a");
+  if (store->log == NULL) {
+    perror("Error opening table log");
+    filetable_destroy(ft);
+    tablestore_close(store);
+    return NULL;
+  }
+
+  // no peer has seen any of it, so the removals along the way aren't needed
+  filetable_trimRemoved(ft, ft->version);
+
+  *table = ft;
+  return store;
+}
+
+int tablestore_log(TableStore *store, FileTable *ft) {
+  if (store == NULL || ft == NULL) {
+    return -1;
+  }
+
+  if (ft->version == store->logged) {
+    return 1;
+  }
+
+  int n = filetable_save(ft, store->log, store->logged);
+
+  // the changes can't be listed any more, so save the whole table instead
+  if (n == -2) {
+    return tablestore_checkpoint(store, ft);
+  }
+
+  if (n < 0 || fflush(store->log) != 0) {
+    perror("Error writing table log");
+    return -1;
+  }
+  store->logged = ft->version;
+  store->logsize += n;
+
+  // replaying a log longer than the snapshot costs more than writing one
+  if (store->logsize > MIN_CHECKPOINT && store->logsize > store->snapsize) {
+    return tablestore_checkpoint(store, ft);
+  }
+
+  return 1;
+}
+
+int tablestore_checkpoint(TableStore *store, FileTable *ft) {
+  if (store == NULL || ft == NULL) {
+    return -1;
+  }
+
+  if (snap_checkpoint(store, ft) < 0) {
+    return -1;
+  }
+
+  // the snapshot has everything the log did; if the log outlives it after a
+  // crash, replaying it again skips what was already applied
+  if (ftruncate(fileno(store->log), 0) < 0) {
+    perror("Error truncating table log");
+  }
+
+  store->logsize = 0;
+  store->logged = ft->version;
+
+  return 1;
+}
+
+void tablestore_close(TableStore *store) {
+  if (store == NULL) {
+    return;
+  }
+
+  if (store->log != NULL) {
+    fclose(store->log);
+  }
+  free(store->snappath);
+  free(store->logpath);
+  free(store);
+}
+
+// dir/name.ext, which the caller must free
+static char *store_path(const char *dir, const char *name, const char *ext) {
+  size_t len = strlen(dir) + strlen(name) + strlen(ext) + 3;
+  char *path = malloc(len);
+  if (path == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  snprintf(path, len, "%s/%s.%s", dir, name, ext);
+  return path;
+}
+
+// map a whole file read-only; NULL if it is missing or empty
+static const char *map_file(const char *path, size_t *len) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size == 0) {
+    close(fd);
+    return NULL;
+  }
+
+  void *buf = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (buf == MAP_FAILED) {
+    perror("Error mapping table store");
+    return NULL;
+  }
+
+  *len = st.st_size;
+  return buf;
+}
+
+// path.tmp, which the caller must free
+static char *tmp_path(const char *path) {
+  size_t len = strlen(path) + 5;
+  char *tmppath = malloc(len);
+  if (tmppath == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  snprintf(tmppath, len, "%s.tmp", path);
+  return tmppath;
+}
+
+// the table in the snapshot, or NULL if there is none or it is damaged
+static FileTable *snap_load(TableStore *store) {
+  size_t len;
+  const char *buf = map_file(store->snappath, &len);
+  if (buf == NULL) {
+    return NULL;
+  }
+
+  // a snapshot is a flat table, checked where it lies; one written before
+  // they were is a record as filetable_save writes it
+  FileTable *ft = NULL;
+  FlatTable *flat = flattable_open(buf, len, 0);
+  if (flat != NULL) {
+    ft = flattable_load(flat);
+    flattable_destroy(flat);
+  }
+  else {
+    ft = filetable_load(buf, len, NULL);
+  }
+  munmap((void *) buf, len);
+  if (ft == NULL) {
+    fprintf(stderr, "Ignoring damaged snapshot %s\n", store->snappath);
+    return NULL;
+  }
+  store->snapsize = len;
+  return ft;
+}
+
+// write the whole table as a new snapshot
+static int snap_checkpoint(TableStore *store, FileTable *ft) {
+  // write the new snapshot beside the old one and swap it in, so a crash
+  // leaves one or the other whole
+  char *tmppath = tmp_path(store->snappath);
+
+  FILE *fp = fopen(tmppath, "w");
+  if (fp == NULL) {
+    perror("Error writing table snapshot");
+    free(tmppath);
+    return -1;
+  }
+
+  FlatTable *flat = flattable_build(ft);
+  int n = flattable_write(flat, fp);
+  flattable_destroy(flat);
+  if (n < 0 || fflush(fp) != 0 || fsync(fileno(fp)) < 0) {
+    perror("Error writing table snapshot");
+    fclose(fp);
+    unlink(tmppath);
+    free(tmppath);
+    return -1;
+  }
+  fclose(fp);
+
+  if (rename(tmppath, store->snappath) < 0) {
+    perror("Error replacing table snapshot");
+    unlink(tmppath);
+    free(tmppath);
+    return -1;
+  }
+  free(tmppath);
+
+  store->snapsize = n;
+  return 1;
+}
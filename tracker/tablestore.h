@@ -0,0 +1,56 @@
+/*
+ * tablestore.h: keeps the tracker's file table on disk, so a restarted
+ * tracker comes back with the table it had
+ *
+ * The store is a snapshot of the whole table plus a log of the changes made
+ * since, each appended as it happens. Once the log outgrows the snapshot,
+ * a checkpoint writes a fresh snapshot and empties the log. The snapshot is
+ * a flat table (see flattable.h), mapped and checked in place to load.
+ */
+
+#ifndef TABLESTORE_H
+#define TABLESTORE_H
+
+#include <stdio.h>
+#include "../filetable/filetable.h"
+#include "../filetable/flattable.h"
+
+typedef struct {
+  char *snappath;         // the whole table as of the last checkpoint
+  char *logpath;          // changes since the checkpoint, oldest first
+  FILE *log;
+  unsigned long logged;   // table version the snapshot and log reach
+  long logsize;           // bytes in the log
+  long snapsize;          // bytes in the snapshot
+} TableStore;
+
+/*
+ * Opens the store called name in directory dir, creating the directory if
+ * needed, and loads the table it holds into a new table: the snapshot, then
+ * every change logged after it. A damaged end of the log, as left by a crash
+ * mid-write, is dropped. The table has no peers; they are added back as they register.
+ * @return TableStore* on success, NULL on error
+ */
+TableStore *tablestore_open(const char *dir, const char *name, FileTable **table);
+
+/*
+ * Appends the changes made to ft since the last call to the log, and
+ * checkpoints if the log has grown past the snapshot. The caller holds ft's
+ * lock, and calls this after each change, before removals are trimmed.
+ * @return 1 on success, -1 on error
+ */
+int tablestore_log(TableStore *store, FileTable *ft);
+
+/*
+ * Replaces the snapshot with the whole of ft and empties the log.
+ * The caller holds ft's lock.
+ * @return 1 on success, -1 on error
+ */
+int tablestore_checkpoint(TableStore *store, FileTable *ft);
+
+/*
+ * Closes the store and releases all memory associated
+ */
+void tablestore_close(TableStore *store);
+
+#endif
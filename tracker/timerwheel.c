@@ -0,0 +1,161 @@
+/*
+ * timerwheel.c: a hierarchical timer wheel, as described in timerwheel.h
+ */
+
+#include <stdlib.h>
+#include <limits.h>
+#include "timerwheel.h"
+
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN (1UL << (WHEEL_BITS * WHEEL_LEVELS))  // ticks the wheel reaches
+
+static void place(TimerWheel *wheel, Timer *timer);
+static void unlink_timer(Timer *timer);
+static void cascade(TimerWheel *wheel, int level, int slot);
+
+TimerWheel *timerwheel_init(long tick_ms, long now) {
+  TimerWheel *wheel = calloc(1, sizeof(TimerWheel));
+  if (wheel == NULL) {
+    return NULL;
+  }
+
+  wheel->tick_ms = tick_ms;
+  wheel->start = now;
+  return wheel;
+}
+
+void timerwheel_set(TimerWheel *wheel, Timer *timer, long deadline) {
+  if (timer->pprev != NULL) {
+    unlink_timer(timer);
+  } else {
+    wheel->n_timers++;
+  }
+
+  // the first tick that begins at or after the deadline
+  long since = deadline - wheel->start;
+  timer->expires = (since > 0) ? (since + wheel->tick_ms - 1) / wheel->tick_ms : 0;
+  place(wheel, timer);
+}
+
+void timerwheel_cancel(TimerWheel *wheel, Timer *timer) {
+  if (timer->pprev == NULL) {
+    return;
+  }
+  unlink_timer(timer);
+  wheel->n_timers--;
+}
+
+Timer *timerwheel_expire(TimerWheel *wheel, long now) {
+  Timer *fired = NULL;
+  Timer **tail = &fired;
+
+  // with nothing set, there's nothing to run the ticks for
+  if (wheel->n_timers == 0 && now >= wheel->start) {
+    wheel->now = (now - wheel->start) / wheel->tick_ms + 1;
+    return NULL;
+  }
+
+  while (wheel->start + (long) wheel->now * wheel->tick_ms <= now) {
+    int slot = wheel->now & WHEEL_MASK;
+
+    // as the first level comes round, the next level's slot for the ticks
+    // ahead moves down, and so on up while each of those comes round too
+    if (slot == 0) {
+      for (int level = 1; level < WHEEL_LEVELS; level++) {
+        int up = (wheel->now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+        cascade(wheel, level, up);
+        if (up != 0) {
+          break;
+        }
+      }
+    }
+
+    Timer *timer = wheel->slots[0][slot];
+    wheel->slots[0][slot] = NULL;
+    while (timer != NULL) {
+      Timer *next = timer->next;
+      timer->pprev = NULL;
+      timer->next = NULL;
+      *tail = timer;
+      tail = &timer->next;
+      wheel->n_timers--;
+      timer = next;
+    }
+
+    wheel->now++;
+  }
+
+  return fired;
+}
+
+int timerwheel_timeout(TimerWheel *wheel, long now) {
+  if (wheel->n_timers == 0) {
+    return -1;
+  }
+
+  // the first tick with timers on the first level, or the next one that
+  // moves timers down to it
+  unsigned long next = wheel->now;
+  while ((next & WHEEL_MASK) != 0 && wheel->slots[0][next & WHEEL_MASK] == NULL) {
+    next++;
+  }
+
+  long wait = wheel->start + (long) next * wheel->tick_ms - now;
+  if (wait <= 0) {
+    return 0;
+  }
+  return (wait > INT_MAX) ? INT_MAX : (int) wait;
+}
+
+void timerwheel_destroy(TimerWheel *wheel) {
+  free(wheel);
+}
+
+/*
+ * helpers
+ */
+
+// puts a timer in the slot for its tick, on the lowest level that reaches it
+static void place(TimerWheel *wheel, Timer *timer) {
+  unsigned long expires = timer->expires;
+  if (expires < wheel->now) {
+    expires = wheel->now;
+  }
+  if (expires - wheel->now >= WHEEL_SPAN) {
+    expires = wheel->now + WHEEL_SPAN - 1;
+  }
+
+  unsigned long ahead = expires - wheel->now;
+  int level = 0;
+  while (level < WHEEL_LEVELS - 1 && ahead >= (1UL << (WHEEL_BITS * (level + 1)))) {
+    level++;
+  }
+
+  Timer **slot = &wheel->slots[level][(expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+  timer->next = *slot;
+  if (*slot != NULL) {
+    (*slot)->pprev = &timer->next;
+  }
+  timer->pprev = slot;
+  *slot = timer;
+}
+
+static void unlink_timer(Timer *timer) {
+  *timer->pprev = timer->next;
+  if (timer->next != NULL) {
+    timer->next->pprev = timer->pprev;
+  }
+  timer->next = NULL;
+  timer->pprev = NULL;
+}
+
+// moves every timer in a slot to where it belongs now its time is nearer
+static void cascade(TimerWheel *wheel, int level, int slot) {
+  Timer *timer = wheel->slots[level][slot];
+  wheel->slots[level][slot] = NULL;
+  while (timer != NULL) {
+    Timer *next = timer->next;
+    place(wheel, timer);
+    timer = next;
+  }
+}
@@ -0,0 +1,70 @@
+/*
+ * timerwheel.h: a hierarchical timer wheel, for deadlines that are pushed
+ * back far more often than they are reached, like a peer's liveness
+ *
+ * Time goes in ticks. The first level has a slot for each of the next
+ * WHEEL_SLOTS ticks; each level above has a slot for WHEEL_SLOTS times as
+ * many, and its timers move down a level as their time comes nearer. Setting,
+ * resetting and cancelling a timer are O(1), and each tick looks at one slot.
+ * A timer fires on the first tick at or after its deadline, so up to a tick
+ * late.
+ */
+
+#ifndef TIMERWHEEL_H
+#define TIMERWHEEL_H
+
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4      // 64^4 ticks ahead; later deadlines wait in the last slot
+
+typedef struct Timer {
+  unsigned long expires;  // tick it fires on
+  void *data;             // whatever it is the timer of
+  struct Timer *next;     // next in its slot, or in the list of those that fired
+  struct Timer **pprev;   // the link to it, NULL while it isn't set
+} Timer;
+
+typedef struct {
+  long tick_ms;           // length of a tick
+  long start;             // ms on the caller's clock when tick 0 began
+  unsigned long now;      // the next tick to run
+  int n_timers;
+  Timer *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} TimerWheel;
+
+/*
+ * Creates a wheel of tick_ms ticks, starting at now on the caller's clock,
+ * which must only go forward
+ * @return TimerWheel* on success, NULL on error
+ */
+TimerWheel *timerwheel_init(long tick_ms, long now);
+
+/*
+ * Sets a timer to fire at deadline, on the wheel's clock, moving it if it is
+ * already set
+ */
+void timerwheel_set(TimerWheel *wheel, Timer *timer, long deadline);
+
+/*
+ * Stops a timer, if it is set
+ */
+void timerwheel_cancel(TimerWheel *wheel, Timer *timer);
+
+/*
+ * Runs every tick up to now, taking off the timers whose deadline has come
+ * @return the timers that fired, chained through next, or NULL
+ */
+Timer *timerwheel_expire(TimerWheel *wheel, long now);
+
+/*
+ * @return ms from now until the next tick that has anything to do, 0 if one
+ * is due, or -1 if no timer is set
+ */
+int timerwheel_timeout(TimerWheel *wheel, long now);
+
+/*
+ * Frees the wheel; the timers on it are the caller's
+ */
+void timerwheel_destroy(TimerWheel *wheel);
+
+#endif
@@ -0,0 +1,239 @@
+/*
+ * timerwheeltest.c: checks timers fire on the first tick at or after their
+ * deadline, across the ticks where one level of the wheel moves timers down
+ * to the next, beyond the furthest the wheel reaches, when moved or
+ * cancelled, and that timerwheel_timeout never sleeps past one
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include "timerwheel.h"
+#include "unittest.h"
+
+#define START 1000000     // where the wheel's clock starts
+#define SPAN (1L << (WHEEL_BITS * WHEEL_LEVELS))
+
+typedef struct {
+  Timer timer;
+  long deadline;
+  long fired;         // when it fired, or 0
+  int times;          // how often it fired
+} Deadline;
+
+// records when each fired timer fired
+static int fire(Timer *fired, long now) {
+  int n = 0;
+  for (Timer *t = fired; t != NULL; t = t->next) {
+    Deadline *d = t->data;
+    d->fired = now;
+    d->times++;
+    n++;
+  }
+  return n;
+}
+
+// sets n timers, none of them on a wheel, at their deadlines
+static void set_all(TimerWheel *wheel, Deadline *d, int n) {
+  for (int i = 0; i < n; i++) {
+    memset(&d[i].timer, 0, sizeof(Timer));
+    d[i].timer.data = &d[i];
+    d[i].fired = 0;
+    d[i].times = 0;
+    timerwheel_set(wheel, &d[i].timer, d[i].deadline);
+  }
+}
+
+// runs the wheel from one step after from to until, step ms at a time
+static void run(TimerWheel *wheel, long from, long until, long step) {
+  for (long now = from + step; now <= until; now += step) {
+    fire(timerwheel_expire(wheel, now), now);
+  }
+}
+
+// each fired once, at the first step at or after its deadline
+static int on_time(Deadline *d, int n, long step) {
+  int ok = 1;
+  for (int i = 0; i < n; i++) {
+    ok &= (d[i].times == 1 && d[i].fired >= d[i].deadline && d[i].fired < d[i].deadline + step);
+  }
+  return ok;
+}
+
+// deadlines either side of the ticks where each level comes round, so a
+// timer moves down as the one before it fires
+static void test_cascade(void) {
+  long ticks[] = {0, 1, 62, 63, 64, 65, 127, 128, 4095, 4096, 4097, 4160,
+      8191, 8192, 262143, 262144, 262145, 266240};
+  int n = sizeof(ticks) / sizeof(ticks[0]);
+  Deadline d[sizeof(ticks) / sizeof(ticks[0])];
+
+  // a tick a ms, run a ms at a time, so each must fire exactly on time
+  TimerWheel *wheel = timerwheel_init(1, START);
+  for (int i = 0; i < n; i++) {
+    d[i].deadline = START + ticks[i];
+  }
+  set_all(wheel, d, n);
+  CHECK(wheel->n_timers == n, "timers counted");
+  run(wheel, START - 1, START + 300000, 1);
+  CHECK(on_time(d, n, 1), "fire on the tick, across cascades");
+  CHECK(wheel->n_timers == 0, "no timers left");
+  timerwheel_destroy(wheel);
+
+  // longer ticks, run in strides that don't line up with them
+  wheel = timerwheel_init(10, START);
+  for (int i = 0; i < n; i++) {
+    d[i].deadline = START + ticks[i] * 10 + 3;
+  }
+  set_all(wheel, d, n);
+  run(wheel, START, START + 3000000, 7);
+  CHECK(on_time(d, n, 10 + 7), "fire within a tick of the deadline, in strides");
+  timerwheel_destroy(wheel);
+
+  // and set from well past the start, so the slots are not at their first
+  // time round
+  wheel = timerwheel_init(1, START);
+  run(wheel, START, START + 4096 * 3 + 17, 1);
+  long now = START + 4096 * 3 + 17;
+  for (int i = 0; i < n; i++) {
+    d[i].deadline = now + ticks[i] + 1;
+  }
+  set_all(wheel, d, n);
+  run(wheel, now, now + 300000, 1);
+  CHECK(on_time(d, n, 1), "fire on the tick, from later in the wheel");
+  timerwheel_destroy(wheel);
+}
+
+// deadlines past the furthest the wheel reaches wait in its last slot, and
+// mustn't fire when that slot comes round
+static void test_beyond_span(void) {
+  Deadline d[4];
+  d[0].deadline = START + SPAN - 1;
+  d[1].deadline = START + SPAN;
+  d[2].deadline = START + SPAN + 5000;
+  d[3].deadline = START + 3 * SPAN + 7;
+
+  TimerWheel *wheel = timerwheel_init(1, START);
+  set_all(wheel, d, 4);
+
+  // in strides, but not so long that a stride could hide an early firing
+  long step = 997;
+  run(wheel, START, START + 3 * SPAN + 2 * step, step);
+  CHECK(on_time(d, 4, step), "fire no earlier than a deadline beyond the wheel");
+  CHECK(wheel->n_timers == 0, "no timers left");
+  timerwheel_destroy(wheel);
+
+  // and a deadline before the start, or already gone, fires at once
+  wheel = timerwheel_init(1, START);
+  d[0].deadline = START - 50;
+  set_all(wheel, d, 1);
+  CHECK(fire(timerwheel_expire(wheel, START), START) == 1, "past deadline fires at once");
+  timerwheel_destroy(wheel);
+}
+
+// a timer pushed back, brought forward, set again once fired, or cancelled
+static void test_rearm(void) {
+  Deadline d[4];
+  TimerWheel *wheel = timerwheel_init(1, START);
+  d[0].deadline = START + 100;
+  set_all(wheel, d, 1);
+
+  // pushed back again and again, as touch_peer does: fires only at the last
+  long now;
+  for (now = START; now < START + 5000; now += 50) {
+    fire(timerwheel_expire(wheel, now), now);
+    d[0].deadline = now + 100;
+    timerwheel_set(wheel, &d[0].timer, d[0].deadline);
+  }
+  now -= 50;
+  CHECK(d[0].times == 0, "timer pushed back doesn't fire");
+
+  // pushed far out onto a higher level, then brought back to the first;
+  // cancelled, twice, which is as good as once; and set for a deadline
+  // that has already gone by
+  d[1].deadline = START + 10000000;
+  d[2].deadline = START + 5500;
+  d[3].deadline = START + 4000;
+  set_all(wheel, d + 1, 3);
+  d[1].deadline = START + 6000;
+  timerwheel_set(wheel, &d[1].timer, d[1].deadline);
+  timerwheel_cancel(wheel, &d[2].timer);
+  timerwheel_cancel(wheel, &d[2].timer);
+  CHECK(wheel->n_timers == 3, "moving and cancelling keep the count");
+
+  run(wheel, now, START + 7000, 1);
+  CHECK(d[0].times == 1 && d[0].fired == d[0].deadline, "pushed back fires at the last deadline");
+  CHECK(d[1].times == 1 && d[1].fired == d[1].deadline, "brought forward fires at the new deadline");
+  CHECK(d[2].times == 0, "cancelled doesn't fire");
+  CHECK(d[3].times == 1 && d[3].fired == now + 1, "missed deadline fires on the next tick");
+
+  // set again once fired, and cancelling one that isn't set does nothing
+  d[3].deadline = START + 9000;
+  d[3].times = 0;
+  timerwheel_set(wheel, &d[3].timer, d[3].deadline);
+  timerwheel_cancel(wheel, &d[0].timer);
+  CHECK(wheel->n_timers == 1, "fired timers are off the wheel");
+  run(wheel, START + 7000, START + 10000, 1);
+  CHECK(d[3].times == 1 && d[3].fired == d[3].deadline, "set again after firing");
+  CHECK(wheel->n_timers == 0, "no timers left");
+  timerwheel_destroy(wheel);
+}
+
+// sleeping for what timerwheel_timeout says, and nothing else, gets to each
+// deadline within a tick, and never past it by more
+static void test_timeout(void) {
+  TimerWheel *wheel = timerwheel_init(100, START);
+  CHECK(timerwheel_timeout(wheel, START) == -1, "nothing set, no timeout");
+
+  long after[] = {1, 99, 100, 101, 6399, 6400, 6401, 409600, 409700, 30000000};
+  int n = sizeof(after) / sizeof(after[0]);
+  Deadline d[sizeof(after) / sizeof(after[0])];
+  for (int i = 0; i < n; i++) {
+    d[i].deadline = START + 250 + after[i];
+  }
+
+  // the wheel has run a while before they're set
+  fire(timerwheel_expire(wheel, START + 250), START + 250);
+  set_all(wheel, d, n);
+
+  long now = START + 250;
+  int wakeups = 0, ok = 1;
+  while (wheel->n_timers > 0 && wakeups < 100000) {
+    int wait = timerwheel_timeout(wheel, now);
+    ok &= (wait >= 0);
+    now += (wait > 0) ? wait : 0;
+    int fired = fire(timerwheel_expire(wheel, now), now);
+
+    // waking for nothing is only allowed as a level comes round
+    ok &= (fired > 0 || wait == 0 || ((now - START) / 100) % WHEEL_SLOTS == 0);
+    wakeups++;
+  }
+  CHECK(ok, "timeout is never negative and never wakes for nothing");
+  CHECK(on_time(d, n, 100), "sleeping the timeout reaches each deadline within a tick");
+  CHECK(wakeups <= n + (after[n - 1] + 250) / 100 / WHEEL_SLOTS + 2, "a wakeup a timer, or a level");
+  CHECK(timerwheel_timeout(wheel, now) == -1, "all fired, no timeout");
+
+  // a tick that is due is 0
+  d[0].deadline = now;
+  set_all(wheel, d, 1);
+  CHECK(timerwheel_timeout(wheel, now + 100) == 0, "due now");
+  timerwheel_destroy(wheel);
+
+  // ticks so long the wait doesn't fit in an int
+  wheel = timerwheel_init(LONG_MAX / (2L * SPAN), 0);
+  d[0].deadline = LONG_MAX / 4;
+  set_all(wheel, d, 1);
+  timerwheel_expire(wheel, 0);
+  CHECK(timerwheel_timeout(wheel, 0) == INT_MAX, "wait clamped to INT_MAX");
+  timerwheel_destroy(wheel);
+}
+
+int main() {
+  test_cascade();
+  test_beyond_span();
+  test_rearm();
+  test_timeout();
+
+  return check_report("timerwheeltest");
+}
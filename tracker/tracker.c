@@ -5,22 +5,91 @@
  */
 
 #include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
 #include "tracker.h"
 #include "peertable.h"
+#include "tablestore.h"
 
 
 // Globals
 PeerTable *peer_table;
-FileTable *file_table;
+ShardedTable *file_table;
+TableStore *table_stores[TABLE_SHARDS];   // where each shard is kept on disk
 pthread_t monitor_tid;
+int epoll_fd = -1;        // the listening socket and every peer's, for serve_peers
+TimerWheel *liveness;     // when each peer is taken for dead, pushed back by every message
+
+// A peer's file events, waiting to be applied with the rest of the batch
+typedef struct IngestItem {
+  char ip[IP_LEN];
+  int port;
+  FileEvent *events;
+  FileEvent **parts;        // the events split by shard, while they're applied
+  struct IngestItem *next;
+} IngestItem;
+
+// What has come in since the table last changed: events to apply, and
+// whether a broadcast is owed for changes already applied. It is committed
+// once it holds INGEST_BATCH_MAX events or has waited INGEST_LATENCY_MS
+typedef struct {
+  IngestItem *head;
+  IngestItem **tail;
+  int n_events;
+  int broadcast;            // a sync changed the table
+  int pending;              // anything at all waiting
+  long deadline;            // when it must be committed, in ms since boot
+  Peer *source;             // the one peer everything came from, held, or NULL
+  int from_many;            // whether it came from more than one
+} IngestBatch;
+
+static IngestBatch batch = { NULL, &batch.head, 0, 0, 0, 0, NULL, 0 };
 
 void accept_peers();
+void broadcast_table(Peer *exclude);
+static int read_peer(Peer *peer);
+static void handle_message(Peer *peer, Message *msg);
+static void close_peer(Peer *peer);
+static void drop_peers(Peer **peers, int n_peers);
+static void expire_peers(Timer *fired);
+static void touch_peer(Peer *peer);
+static void track_queue(Peer *peer);
+static void catch_up(Peer *peer);
+static int merge_files(FileInfo_FS *files, char *ip, int port);
+static int merge_batch(IngestItem *items);
+static void ingest_events(Peer *peer, FileEvent *events);
+static void ingest_broadcast(Peer *peer);
+static void ingest_from(Peer *peer);
+static int ingest_timeout();
+static void commit_batch();
+static long now_ms();
+static uint64_t table_digest(char *path);
+static int add_peer_under(char *path, char *ip, int port);
+static void sync_start(Peer *peer, SyncState *sync, int port, int registering, uint64_t digest);
+static void sync_compare(Peer *peer, SyncState *sync, DigestNode *nodes);
+static void sync_finish(Peer *peer, SyncState *sync);
+static void sync_clear(SyncState *sync);
+static void finish_register(Peer *peer, int port);
 
 int listen_sock = -1;
+static volatile sig_atomic_t stopping = 0;  // set by SIGINT
 
-int main() {
-  // register handler to exit tracker nicely
-  signal(SIGINT, end_tracker);
+// SIGINT ends serve_peers, which leaves the cleaning up to main
+static void stop_tracker(int sig) {
+  stopping = 1;
+}
+
+int main(int argc, char *argv[]) {
+  // register handler to exit tracker nicely. SIGINT is blocked everywhere
+  // but where serve_peers waits for events, so it never lands in the middle
+  // of handling a message, or in another thread; threads started from here
+  // on start with it blocked
+  signal(SIGINT, stop_tracker);
+  sigset_t sigint;
+  sigemptyset(&sigint);
+  sigaddset(&sigint, SIGINT);
+  pthread_sigmask(SIG_BLOCK, &sigint, NULL);
 
   // ignore any SIGPIPEs from the kernel
   signal(SIGPIPE, SIG_IGN);
@@ -35,8 +104,25 @@ int main() {
   printf("Listening on %d for peer connections; socket is %d.\n",
     HANDSHAKE_PORT, listen_sock);
 
-  // Initialize file table and peer table.
-  file_table = filetable_init();
+  // Load the file table kept from the last run, each shard from its own
+  // store, and start the peer table.
+  char *state_dir = (argc > 1) ? argv[1] : STATE_DIR;
+  FileTable *shards[TABLE_SHARDS];
+  int n_files = 0;
+  for (int i = 0; i < TABLE_SHARDS; i++) {
+    char name[32];
+    snprintf(name, sizeof(name), "filetable.%d", i);
+    table_stores[i] = tablestore_open(state_dir, name, &shards[i]);
+    if (table_stores[i] == NULL) {
+      fprintf(stderr, "Error opening table store in %s\n", state_dir);
+      exit(1);
+    }
+    n_files += shards[i]->numfiles;
+  }
+  file_table = shardtable_init(TABLE_SHARDS, shards);
+  printf("Loaded %d files at version %lu from %s\n",
+    n_files, file_table->clock.version, state_dir);
+
   peer_table = peertable_init();
 
   // Create monitor thread.
@@ -47,14 +133,11 @@ int main() {
 
   printf("Current ip is %s\n", get_my_ip());
 
-  // loops forever, accepting peers as they connect
-  accept_peers();
+  // loops until SIGINT, serving every peer from this one thread
+  serve_peers();
 
-  // When the tracker is done, close the connection and exit.
-  if (listen_sock != -1) {
-    close(listen_sock);
-    listen_sock = -1;
-  }
+  // When the tracker is done, save the table, close the connections and exit.
+  end_tracker();
 
   exit(0);
 }
@@ -67,12 +150,28 @@ int start_peer(int peer_fd, char *peer_ipstr) {
 
   peer->sockfd = peer_fd;
   strcpy(peer->ip, peer_ipstr); // copy the ip address into this peer
+  peer->liveness.data = peer;
+  touch_peer(peer);
+
+  // the loop never waits on one peer: reads take what has arrived, and what
+  // the socket won't take yet waits in its send buffer
+  fcntl(peer_fd, F_SETFL, fcntl(peer_fd, F_GETFL) | O_NONBLOCK);
+
+  // buffers for its messages, and the paths named on it, which the tracker
+  // names
+  message_open(peer_fd, 1);
 
   printf("Connection started with client: %s\n", peer->ip);
 
-  // Create a handshake thread to deal with this peer.
-  if (pthread_create(&peer->thread_id, NULL, handshake_thread, peer) < 0) {
-    perror("Error creating thread");
+  // edge-triggered: each read and flush goes on until the socket would
+  // block, so it is woken only when there is something new
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.fd = peer_fd;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, peer_fd, &ev) < 0) {
+    perror("Error watching peer socket");
+    peer_release(peer);
     return -1;
   }
 
@@ -82,28 +181,133 @@ int start_peer(int peer_fd, char *peer_ipstr) {
   return 1;
 }
 
+void serve_peers() {
+  liveness = timerwheel_init(LIVENESS_TICK_MS, now_ms());
+  if (liveness == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  epoll_fd = epoll_create1(0);
+  if (epoll_fd < 0) {
+    perror("Error creating epoll instance");
+    return;
+  }
+
+  // the listening socket is level-triggered, so connections left waiting
+  // once MAX_PEERS are served wake the loop again
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.fd = listen_sock;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_sock, &ev) < 0) {
+    perror("Error watching listening socket");
+    return;
+  }
+
+  // SIGINT is let in only while waiting
+  sigset_t waiting;
+  pthread_sigmask(SIG_SETMASK, NULL, &waiting);
+  sigdelset(&waiting, SIGINT);
+
+  struct epoll_event events[MAX_EVENTS];
+  while (!stopping) {
+    // wait no longer than the batch has left, or the next peer
+    int timeout = ingest_timeout();
+    int next_expiry = timerwheel_timeout(liveness, now_ms());
+    if (timeout < 0 || (next_expiry >= 0 && next_expiry < timeout)) {
+      timeout = next_expiry;
+    }
+    int n = epoll_pwait(epoll_fd, events, MAX_EVENTS, timeout, &waiting);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      perror("Error waiting for peers");
+      break;
+    }
+
+    for (int i = 0; i < n; i++) {
+      if (events[i].data.fd == listen_sock) {
+        accept_peers();
+        continue;
+      }
+
+      // each fd comes up once a wait, so a peer closed earlier in this batch
+      // can't come up again
+      Peer *peer = peertable_find(peer_table, events[i].data.fd);
+      if (peer == NULL) {
+        continue;
+      }
+
+      // send what an earlier send left behind, now there's room for it,
+      // and once it has all gone, the table as it is now if the peer is
+      // owed it
+      int ok = 1;
+      if (events[i].events & EPOLLOUT) {
+        pthread_mutex_lock(&peer->send_lock);
+        int res = message_flush(peer->sockfd);
+        track_queue(peer);
+        int owed = (res == 1 && peer->owed);
+        pthread_mutex_unlock(&peer->send_lock);
+
+        ok = (res >= 0);
+        if (owed) {
+          catch_up(peer);
+        }
+      }
+
+      // then whatever it sent; a hang-up leaves its last messages to read
+      if (ok && (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))) {
+        ok = (read_peer(peer) >= 0);
+      }
+
+      if (!ok) {
+        close_peer(peer);
+      }
+    }
+
+    if (batch.pending && ingest_timeout() == 0) {
+      commit_batch();
+    }
+
+    // peers that have gone quiet past their deadline
+    expire_peers(timerwheel_expire(liveness, now_ms()));
+  }
+
+  // what came in last still goes into the table that is saved
+  commit_batch();
+}
+
 void accept_peers() {
   // Prepare to receive peer connections.
   int comm_socket;
   char addrstr[INET_ADDRSTRLEN];
 
   struct sockaddr_in client;            // address for this node to create socket
-  socklen_t client_len = sizeof(client);
+  socklen_t client_len;
 
-
-  // while the tracker is alive, continously accept new peers
+  // take every connection waiting; the listening socket doesn't block
   while (1) {
+    client_len = sizeof(client);
     comm_socket = accept(listen_sock, (struct sockaddr *) &client, &client_len);
     if (comm_socket < 0) {
-      perror("Error accepting peer connection");
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        perror("Error accepting peer connection");
+      }
       return;
     }
 
     inet_ntop(AF_INET, &client.sin_addr, addrstr, INET_ADDRSTRLEN);
 
+    if (peer_table->n_peers >= MAX_PEERS) {
+      fprintf(stderr, "Turning away %s: already serving %d peers\n", addrstr, MAX_PEERS);
+      close(comm_socket);
+      continue;
+    }
+
     printf("Accepting on %d\n", comm_socket);
 
-    // for each peer, start up handshake threads etc.
     start_peer(comm_socket, addrstr);
   }
 }
@@ -124,196 +328,787 @@ int start_listening() {
     return -1;
   }
 
-  if (listen(sockfd, MAX_PEERS) < 0) {
+  if (listen(sockfd, LISTEN_BACKLOG) < 0) {
     return -1;
   }
 
+  // accept_peers takes connections until there are none left
+  fcntl(sockfd, F_SETFL, fcntl(sockfd, F_GETFL) | O_NONBLOCK);
+
   return sockfd;
 }
 
-// send events to all peers except the specified one
-void broadcast_table(Peer *exclude) {
-  Peer *cur = peer_table->head;
+// merge a registering peer's files into the shards they belong in, one shard
+// at a time, logging each shard's changes before its lock is released
+// files is used up
+// @return the number of file events the files made
+static int merge_files(FileInfo_FS *files, char *ip, int port) {
+  FileInfo_FS **parts = shardtable_splitFiles(file_table, files);
+  int n_events = 0;
+
+  for (int i = 0; i < file_table->nshards; i++) {
+    if (parts[i] == NULL) {
+      continue;
+    }
+
+    FileTable *shard = file_table->shards[i];
+    pthread_mutex_lock(shard->lock);
+    FileEvent *events = filetable_merge(shard, parts[i], ip, port);
+    tablestore_log(table_stores[i], shard);
+    pthread_mutex_unlock(shard->lock);
+
+    // free all the file events we got
+    FileEvent *tmp;
+    while (events != NULL) {
+      fileevent_print(events);
+      tmp = events->next;
+      free(events);
+      events = tmp;
+      n_events++;
+    }
+
+    fileinfo_destroy_all(parts[i]);
+  }
+
+  free(parts);
+  return n_events;
+}
+
+// apply a batch of peers' file events to the shards they belong in, as
+// merge_files does, with each shard locked once and its changes logged once
+// for the whole batch; the items' events are used up
+// @return the number of changes the events added up to
+static int merge_batch(IngestItem *items) {
+  for (IngestItem *item = items; item != NULL; item = item->next) {
+    item->parts = shardtable_splitEvents(file_table, item->events);
+    item->events = NULL;
+  }
+  int n_changes = 0;
 
-  while (cur != NULL) {
-    if (cur == exclude) {
-      cur = cur->next;
+  for (int i = 0; i < file_table->nshards; i++) {
+    IngestItem *item = items;
+    while (item != NULL && item->parts[i] == NULL) {
+      item = item->next;
+    }
+    if (item == NULL) {
       continue;
     }
 
-    // send a filetable message
-    send_table_update(cur->sockfd, file_table);
+    FileTable *shard = file_table->shards[i];
+    pthread_mutex_lock(shard->lock);
+    for (; item != NULL; item = item->next) {
+      if (item->parts[i] == NULL) {
+        continue;
+      }
+      FileEvent *changes = filetable_applyEvents(shard, item->parts[i], item->ip, item->port);
+      for (FileEvent *e = changes; e != NULL; e = e->next) {
+        fileevent_print(e);
+        n_changes++;
+      }
+      fileevent_destroy_all(changes);
+      fileevent_destroy_all(item->parts[i]);
+      item->parts[i] = NULL;
+    }
+    tablestore_log(table_stores[i], shard);
+    pthread_mutex_unlock(shard->lock);
+  }
+
+  for (IngestItem *item = items; item != NULL; item = item->next) {
+    free(item->parts);
+    item->parts = NULL;
+  }
+  return n_changes;
+}
+
+// queue a peer's file events for the next batch; events is used up
+static void ingest_events(Peer *peer, FileEvent *events) {
+  IngestItem *item = calloc(1, sizeof(IngestItem));
+  if (item == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+  strcpy(item->ip, peer->ip);
+  item->port = peer->listen_port;
+  item->events = events;
+  for (FileEvent *e = events; e != NULL; e = e->next) {
+    batch.n_events++;
+  }
+
+  *batch.tail = item;
+  batch.tail = &item->next;
+  ingest_from(peer);
 
-    cur = cur->next;
+  // a batch that's full goes in now, however young
+  if (batch.n_events >= INGEST_BATCH_MAX) {
+    commit_batch();
   }
 }
 
-void *handshake_thread(void *arg) {
-  Peer *peer = (Peer *) arg;
+// owe the other peers a broadcast, for changes a sync made, with the batch's
+static void ingest_broadcast(Peer *peer) {
+  batch.broadcast = 1;
+  ingest_from(peer);
+}
+
+// note that peer added to the batch, starting its clock if it's the first
+static void ingest_from(Peer *peer) {
+  if (!batch.pending) {
+    batch.pending = 1;
+    batch.deadline = now_ms() + INGEST_LATENCY_MS;
+    batch.source = peer_retain(peer);
+  } else if (peer != batch.source) {
+    batch.from_many = 1;
+  }
+}
+
+// ms until the batch is due, 0 if it is, -1 if there is none
+static int ingest_timeout() {
+  if (!batch.pending) {
+    return -1;
+  }
+  long left = batch.deadline - now_ms();
+  return (left > 0) ? (int) left : 0;
+}
+
+// apply everything in the batch to the table and, if that changed anything,
+// send the peers one broadcast of it all. The peer everything came from
+// already has it, and isn't sent it
+static void commit_batch() {
+  if (!batch.pending) {
+    return;
+  }
+
+  printf("---- net changes of %d events ----\n", batch.n_events);
+  int n_changes = merge_batch(batch.head);
+  while (batch.head != NULL) {
+    IngestItem *next = batch.head->next;
+    free(batch.head);
+    batch.head = next;
+  }
+
+  if (n_changes > 0 || batch.broadcast) {
+    broadcast_table(batch.from_many ? NULL : batch.source);
+  }
+
+  peer_release(batch.source);
+  batch = (IngestBatch) { NULL, &batch.head, 0, 0, 0, 0, NULL, 0 };
+}
+
+// milliseconds on a clock that only goes forward
+static long now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
 
+// digest of everything at and below path in the table, "" for all of it; a
+// top-level directory and everything below it share a shard, so only the
+// whole table spans more than one
+static uint64_t table_digest(char *path) {
+  uint64_t digest = 0;
+
+  for (int i = 0; i < file_table->nshards; i++) {
+    if (path[0] != '\0' && i != shardtable_shardOf(file_table, path)) {
+      continue;
+    }
+
+    FileTable *shard = file_table->shards[i];
+    pthread_mutex_lock(shard->lock);
+    digest ^= filetable_digest(shard, path);
+    pthread_mutex_unlock(shard->lock);
+  }
+
+  return digest;
+}
+
+// list a peer on everything at and below path, logging each shard's changes
+// @return the number of entries the peer was added to
+static int add_peer_under(char *path, char *ip, int port) {
+  int n_added = 0;
+
+  for (int i = 0; i < file_table->nshards; i++) {
+    if (path[0] != '\0' && i != shardtable_shardOf(file_table, path)) {
+      continue;
+    }
+
+    FileTable *shard = file_table->shards[i];
+    pthread_mutex_lock(shard->lock);
+    int n = filetable_addPeerUnder(shard, path, ip, port);
+    if (n > 0) {
+      tablestore_log(table_stores[i], shard);
+      n_added += n;
+    }
+    pthread_mutex_unlock(shard->lock);
+  }
+
+  return n_added;
+}
+
+// start checking a peer's files, summed up in digest, against the table
+static void sync_start(Peer *peer, SyncState *sync, int port, int registering, uint64_t digest) {
+  sync->port = port;
+  sync->registering = registering;
+
+  if (digest == table_digest("")) {
+    // the peer has exactly what the table has
+    DigestNode *all = calloc(1, sizeof(DigestNode));
+    if (all == NULL) {
+      fprintf(stderr, "malloc\n");
+      exit(1);
+    }
+    all->file = fileinfo_init();
+    fileinfo_set_path(all->file, "");
+    sync->same = all;
+  } else if (digest != 0) {
+    // something differs, so find out what, starting from the top; a peer
+    // with no files has nothing to tell
+    FileInfo_FS *top = fileinfo_init();
+    fileinfo_set_path(top, "");
+
+    pthread_mutex_lock(&peer->send_lock);
+    send_sync_request(peer->sockfd, top);
+    track_queue(peer);
+    pthread_mutex_unlock(&peer->send_lock);
+
+    fileinfo_destroy(top);
+    sync->pending++;
+    return;
+  }
+
+  sync_finish(peer, sync);
+}
+
+// compare the digests of the nodes a peer sent with the table's, asking for
+// what's below those that differ; nodes is used up
+static void sync_compare(Peer *peer, SyncState *sync, DigestNode *nodes) {
+  FileInfo_FS *dirs = NULL;
+
+  DigestNode *next;
+  for (DigestNode *node = nodes; node != NULL; node = next) {
+    next = node->next;
+
+    // the same digest means the same files all the way down
+    if (node->digest == table_digest(node->file->filepath)) {
+      node->next = sync->same;
+      sync->same = node;
+      continue;
+    }
+
+    // otherwise look further down, if the peer has anything there
+    if (node->has_children) {
+      FileInfo_FS *dir = fileinfo_clone(node->file);
+      dir->next = dirs;
+      dirs = dir;
+    }
+
+    // and merge the node's own entry as a registration would
+    if (node->has_entry) {
+      node->file->next = sync->files;
+      sync->files = node->file;
+      node->file = NULL;
+    }
+
+    node->next = NULL;
+    digestnode_destroy_all(node);
+  }
+
+  sync->pending--;
+
+  if (dirs != NULL) {
+    pthread_mutex_lock(&peer->send_lock);
+    send_sync_request(peer->sockfd, dirs);
+    track_queue(peer);
+    pthread_mutex_unlock(&peer->send_lock);
+
+    fileinfo_destroy_all(dirs);
+    sync->pending++;
+    return;
+  }
+
+  if (sync->pending == 0) {
+    sync_finish(peer, sync);
+  }
+}
+
+// merge what a check found into the table, then answer the registration or
+// tell the other peers, as the check was for
+static void sync_finish(Peer *peer, SyncState *sync) {
+  int n_files = 0, n_same = 0;
+  for (FileInfo_FS *f = sync->files; f != NULL; f = f->next) {
+    fileinfo_print(f);
+    n_files++;
+  }
+  for (DigestNode *d = sync->same; d != NULL; d = d->next) {
+    n_same++;
+  }
+  printf("SYNC with %s : %d. %d files differ, %d directories match\n",
+    peer->ip, sync->port, n_files, n_same);
+
+  // merge the files that differ into the file table, and list the peer on
+  // everything it has the same of
+  int n_changes = merge_files(sync->files, peer->ip, sync->port);
+  sync->files = NULL;
+  for (DigestNode *d = sync->same; d != NULL; d = d->next) {
+    n_changes += add_peer_under(d->file->filepath, peer->ip, sync->port);
+  }
+
+  if (sync->registering) {
+    finish_register(peer, sync->port);
+  } else if (n_changes > 0) {
+    // broadcast updated table to other clients, if anything changed, with
+    // whatever else comes in meanwhile
+    ingest_broadcast(peer);
+  }
+
+  sync_clear(sync);
+}
+
+// forget a check, finished or not
+static void sync_clear(SyncState *sync) {
+  fileinfo_destroy_all(sync->files);
+  digestnode_destroy_all(sync->same);
+  memset(sync, 0, sizeof(SyncState));
+}
+
+// send a peer whose files are in the table the whole table
+static void finish_register(Peer *peer, int port) {
+  shardtable_lockAll(file_table);
+
+  // the new peer starts from the whole table; the stream is ordered,
+  // so it has this version once it reads it
+  FileTable *table = shardtable_snapshot(file_table, 0);
+  peer->listen_port = port;
+  peer->acked = table->version;
+
+  // hold the peer's socket until the table is out, so no broadcast
+  // reaches it first
+  pthread_mutex_lock(&peer->send_lock);
+
+  shardtable_unlockAll(file_table);
+
+  filetable_print(table);
+
+  // both go out in one write
+  message_cork(peer->sockfd);
+  send_register_ack(peer->sockfd, INTERVAL, PIECE_LENGTH, FEATURES);
+  send_table_update(peer->sockfd, table);
+  message_uncork(peer->sockfd);
+  peer->owed = 0;
+  track_queue(peer);
+
+  pthread_mutex_unlock(&peer->send_lock);
+  filetable_release(table);
+
+  // and the others get just the changes, with the next batch
+  ingest_broadcast(peer);
+}
+
+// send table changes to all peers except the specified one
+// takes file_table's locks just long enough to snapshot the changes, then sends
+// them with no table lock held. Peers that have acknowledged the same
+// version get the same delta, encoded once and shared, so a broadcast costs
+// an encoding per distinct version rather than per peer. A peer still
+// taking what was sent to it before isn't sent them yet, but gets them with
+// any later ones when it catches up, so its queue holds at most one table
+// however far behind it is
+void broadcast_table(Peer *exclude) {
+  PeerSnapshot *peers = peertable_snapshot(peer_table);
+
+  // what each peer has acknowledged, read together with the table; peers
+  // that haven't registered are skipped, and get the whole table when they do
+  unsigned long *acked = calloc(peers->n_peers + 1, sizeof(unsigned long));
+  int *registered = calloc(peers->n_peers + 1, sizeof(int));
+
+  // the deltas encoded so far, and the version each is from
+  WireShared **deltas = calloc(peers->n_peers + 1, sizeof(WireShared *));
+  unsigned long *delta_since = calloc(peers->n_peers + 1, sizeof(unsigned long));
+  int n_deltas = 0;
+
+  if (acked == NULL || registered == NULL || deltas == NULL || delta_since == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  shardtable_lockAll(file_table);
+
+  // removals every registered peer has acknowledged are no longer needed
+  unsigned long oldest = shardtable_version(file_table);
+  for (int i = 0; i < peers->n_peers; i++) {
+    Peer *cur = peers->peers[i];
+    if (cur->listen_port != 0) {
+      registered[i] = 1;
+      acked[i] = cur->acked;
+      if (cur->acked < oldest) {
+        oldest = cur->acked;
+      }
+    }
+  }
+  shardtable_trimRemoved(file_table, oldest);
+
+  // every peer's changes are in the ones since the oldest acknowledgement
+  FileTable *changes = shardtable_snapshot(file_table, oldest);
+
+  shardtable_unlockAll(file_table);
+
+  filetable_print(changes);
+
+  for (int i = 0; i < peers->n_peers; i++) {
+    Peer *cur = peers->peers[i];
+    if (cur == exclude || !registered[i]) {
+      continue;
+    }
+
+    // send only what changed since the peer's last acknowledged version
+    pthread_mutex_lock(&cur->send_lock);
+    if (message_pending(cur->sockfd) > 0) {
+      cur->owed = 1;
+      cur->coalesced++;
+    } else {
+      cur->owed = 0;
+
+      int k = 0;
+      while (k < n_deltas && delta_since[k] != acked[i]) {
+        k++;
+      }
+      if (k == n_deltas) {
+        delta_since[k] = acked[i];
+        deltas[k] = share_table_delta(changes, acked[i]);
+        n_deltas++;
+      }
+      if (deltas[k] != NULL) {
+        send_shared(cur->sockfd, deltas[k]);
+      }
+      track_queue(cur);
+    }
+    pthread_mutex_unlock(&cur->send_lock);
+  }
+
+  printf("Broadcast version %lu in %d encodings\n", changes->version, n_deltas);
+  for (int k = 0; k < n_deltas; k++) {
+    release_shared(deltas[k]);
+  }
+
+  filetable_release(changes);
+  free(acked);
+  free(registered);
+  free(deltas);
+  free(delta_since);
+  peersnapshot_release(peers);
+}
+
+// handle every whole message that has arrived from a peer
+// @return 1 once none is left, -1 if it hung up or sent something bad
+static int read_peer(Peer *peer) {
   Message msg;
 
-  // Handle packets received from the connection described by sockfd.
-  //while (receive_peer_segment(peer->sockfd, &segment)) {
   while (1) {
     memset(&msg, 0, sizeof(msg));
 
-    int n_read = recv_message(peer->sockfd, &msg);
+    int n_read = poll_message(peer->sockfd, &msg);
     if (n_read <= 0) {
-      break;
+      return (n_read == 0) ? 1 : -1;
     }
 
-    // after reading, recv_message will have updated msg.body to be the correct type
-    // for each message
+    // any message at all shows the peer is alive
+    touch_peer(peer);
 
-    switch (msg.type) {
-      case REGISTER:
-        {
-          RegisterBody *b = msg.body;
+    // after reading, poll_message will have updated msg.body to be the
+    // correct type for each message
+    handle_message(peer, &msg);
+  }
+}
 
-          // update timestamp and port that the peer is listening on
-          peer->last_timestamp = time(NULL);
-          peer->listen_port = b->listen_port;
+static void handle_message(Peer *peer, Message *msg) {
+  switch (msg->type) {
+    case REGISTER:
+      {
+        RegisterBody *b = msg->body;
 
-          printf("REGISTER message from %s : %d. %d files\n", peer->ip, peer->listen_port, b->n_files);
+        printf("REGISTER message from %s : %d\n", peer->ip, b->listen_port);
 
-          FileInfo_FS *f = b->files;
-          while (f != NULL) {
-            fileinfo_print(f);
-            f = f->next;
-          }
+        // large messages to a peer that can take them go compressed
+        if (b->features & FEATURES & FEATURE_COMPRESS) {
+          message_compress(peer->sockfd);
+        }
 
+        // check the peer's files against the table; once the differences
+        // are merged, the peer gets the table
+        if (peer->listen_port == 0 && peer->sync.pending == 0) {
+          sync_start(peer, &peer->sync, b->listen_port, 1, b->digest);
+        }
 
-          pthread_mutex_lock(file_table->lock);
+        // then free the body itself
+        free(b);
+      }
 
-          // merge those files into the file table
-          // note that this entire section is critical, since we need to ensure if two peers
-          // join, any events received are also sent in the correct order
-          FileEvent *events = filetable_merge(file_table, b->files, peer->ip, b->listen_port);
+      break;
 
-          filetable_print(file_table);
+    // The peer wants its files checked against the table
+    case SYNC:
+      {
+        SyncBody *b = msg->body;
 
-          send_register_ack(peer->sockfd, INTERVAL, PIECE_LENGTH);
+        // only once registered, and one check at a time
+        if (peer->listen_port != 0 && peer->sync.pending == 0) {
+          sync_start(peer, &peer->sync, peer->listen_port, 0, b->digest);
+        }
 
-          // broadcast updated table to all clients
-          broadcast_table(NULL);
+        free(b);
+      }
+      break;
 
-          pthread_mutex_unlock(file_table->lock);
+    // The digests below directories that differed
+    case SYNC_DIGESTS:
+      {
+        SyncDigestsBody *b = msg->body;
 
-          // free all the file events we got
-          FileEvent *tmp;
-          while (events != NULL) {
-            fileevent_print(events);
-            tmp = events->next;
-            free(events);
-            events = tmp;
-          }
+        if (peer->sync.pending > 0) {
+          sync_compare(peer, &peer->sync, b->nodes);
+        } else {
+          digestnode_destroy_all(b->nodes);
+        }
 
-          // free the fileinfo list
-          fileinfo_destroy_all(b->files);
-					// free the fileevents list
-					//fileevent_destroy_all(((FileUpdateBody*)(msg.body))->events);
-          // then free the body itself
-          free(b);
+        free(b);
+      }
+      break;
+
+    // The peer has applied the table up to this version
+    case TABLE_ACK:
+      {
+        TableAckBody *b = msg->body;
+
+        // acknowledgements are kept beside the whole table
+        pthread_mutex_lock(file_table->lock);
+        if (b->version > peer->acked) {
+          peer->acked = b->version;
         }
+        pthread_mutex_unlock(file_table->lock);
 
-        break;
+        free(b);
+      }
+      break;
 
-      // If the packet is a heartbeat, update peer entry.
-      case KEEP_ALIVE:
-        // update this peer's timestamp
-        peer->last_timestamp = time(NULL);
+    // A heartbeat only needs to have arrived
+    case KEEP_ALIVE:
+      break;
 
+    // If the packet is an update type packet, do file table stuff.
+    case FILE_UPDATE:
+      {
+        // update the peer's timestamp
+        FileUpdateBody *b = msg->body;
+
+        printf("===== FILE_UPDATE from %s ====\n", peer->ip);
+        FileEvent *e = b->events;
+        while (e != NULL) {
+          fileevent_print(e);
+          e = e->next;
+        }
+        printf("============================================\n");
 
-        break;
+        // applied with whatever else comes in within INGEST_LATENCY_MS,
+        // and broadcast together
+        ingest_events(peer, b->events);
+        b->events = NULL;
 
-      // If the packet is an update type packet, do file table stuff.
-      case FILE_UPDATE:
-        {
-          // update the peer's timestamp
-          peer->last_timestamp = time(NULL);
+					// free memory
+					free(b);
+				}
+      break;
 
-          FileUpdateBody *b = msg.body;
+    default:
+      fprintf(stderr, "Got other message type\n");
+      break;
+  }
+}
 
-          printf("===== FILE_UPDATE from %s ====\n", peer->ip);
-          FileEvent *e = b->events;
-          while (e != NULL) {
-            fileevent_print(e);
-            e = e->next;
-          }
-          printf("============================================\n");
+// note how much is waiting to go to a peer after sending to it, under its
+// send_lock; a peer with more than PEER_QUEUE_MAX waiting is cut off
+static void track_queue(Peer *peer) {
+  size_t queued = message_pending(peer->sockfd);
 
-          pthread_mutex_lock(file_table->lock);
-          filetable_eventMerge(file_table, b->events, peer->ip, peer->listen_port);
+  if (queued == 0) {
+    peer->behind_since = 0;
+  } else if (peer->behind_since == 0) {
+    peer->behind_since = time(NULL);
+  }
+  peer->queued = queued;
+  if (queued > peer->queued_peak) {
+    peer->queued_peak = queued;
+  }
 
-          filetable_print(file_table);
+  if (queued > PEER_QUEUE_MAX) {
+    fprintf(stderr, "%s : %d has %zu bytes queued, too far behind\n",
+      peer->ip, peer->listen_port, queued);
+    peer_disconnect(peer);
+  }
+}
 
-          // broadcast updated table to other clients
-          broadcast_table(peer);
+// send a peer whose queue has drained what it was owed while it was full:
+// one delta, from what it has acknowledged to the table as it is now
+static void catch_up(Peer *peer) {
+  shardtable_lockAll(file_table);
+  unsigned long acked = peer->acked;
+  FileTable *changes = shardtable_snapshot(file_table, acked);
+  shardtable_unlockAll(file_table);
+
+  pthread_mutex_lock(&peer->send_lock);
+  peer->owed = 0;
+  send_table_delta(peer->sockfd, changes, acked);
+  track_queue(peer);
+  pthread_mutex_unlock(&peer->send_lock);
+
+  filetable_release(changes);
+}
 
-          pthread_mutex_unlock(file_table->lock);
-        	
-					// free memory
-					fileevent_destroy_all(b->events);
-					free(b);
-				}
-        break;
+// forget a peer that hung up or sent something bad
+static void close_peer(Peer *peer) {
+  drop_peers(&peer, 1);
+}
 
-      default:
-        fprintf(stderr, "Got other message type\n");
-        break;
+// forget peers all at once: they come out of the peer table together, out
+// of the file table in one walk of each shard, and the others are told in
+// one broadcast
+static void drop_peers(Peer **peers, int n_peers) {
+  // the peers' last events go in before they're taken out of the table, so
+  // they can't list them again after
+  commit_batch();
+
+  IP *gone = NULL;
+  for (int i = 0; i < n_peers; i++) {
+    Peer *peer = peers[i];
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, peer->sockfd, NULL);
+    timerwheel_cancel(liveness, &peer->liveness);
+
+    // drop whatever check was under way
+    sync_clear(&peer->sync);
+
+    // only a registered peer is listed in the file table
+    if (peer->listen_port != 0) {
+      IP *ip = calloc(1, sizeof(IP));
+      if (ip == NULL) {
+        fprintf(stderr, "malloc\n");
+        exit(1);
+      }
+      strcpy(ip->ip, peer->ip);
+      ip->port = peer->listen_port;
+      ip->next = gone;
+      gone = ip;
     }
   }
 
-  // remove peer from all places it appears in the file table
-  pthread_mutex_lock(file_table->lock); 
-  filetable_removePeerAll(file_table, peer->ip, peer->listen_port);
-  pthread_mutex_unlock(file_table->lock); 
+  peertable_removeMany(peer_table, peers, n_peers);
+
+  // remove the peers from all places they appear in the file table
+  if (gone != NULL) {
+    for (int i = 0; i < file_table->nshards; i++) {
+      FileTable *shard = file_table->shards[i];
+      pthread_mutex_lock(shard->lock);
+      filetable_removePeers(shard, gone);
+      tablestore_log(table_stores[i], shard);
+      pthread_mutex_unlock(shard->lock);
+    }
+    // so the others stop asking them for files
+    ingest_broadcast(NULL);
+  }
+  while (gone != NULL) {
+    IP *next = gone->next;
+    free(gone);
+    gone = next;
+  }
 
-  filetable_print(file_table);
+  printf("Dropped %d peer%s\n", n_peers, (n_peers == 1) ? "" : "s");
 
-  // exit thread
-  pthread_exit(0);
+  // the reference start_peer took; the socket closes with the last one
+  for (int i = 0; i < n_peers; i++) {
+    peer_release(peers[i]);
+  }
 }
 
-void *monitor_thread(void *arg) {
-  // Every INTERVAL seconds, remove any peers from the table that are past their
-  // timeout length and end their threads.
-  while(1) {
-    sleep(INTERVAL + 5); // allow a small buffer zone over the interval
+// forget the peers whose liveness timers fired, together
+static void expire_peers(Timer *fired) {
+  if (fired == NULL) {
+    return;
+  }
 
-    time_t time_now = time(NULL);
+  int n_peers = 0;
+  for (Timer *t = fired; t != NULL; t = t->next) {
+    n_peers++;
+  }
+  Peer **peers = malloc(n_peers * sizeof(Peer *));
+  if (peers == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  n_peers = 0;
+  for (Timer *t = fired; t != NULL; t = t->next) {
+    Peer *peer = t->data;
+    printf("%s : %d timed out\n", peer->ip, peer->listen_port);
+    peers[n_peers++] = peer;
+  }
 
-    Peer *p = peer_table->head;
-    Peer *tmp;
+  drop_peers(peers, n_peers);
+  free(peers);
+}
 
-    while (p != NULL) {
-      tmp = p->next;
-      // Check if the peer has timed out.
+// note that a peer was heard from, putting its deadline back
+static void touch_peer(Peer *peer) {
+  peer->last_timestamp = time(NULL);
+  timerwheel_set(liveness, &peer->liveness, now_ms() + PEER_TIMEOUT);
+}
 
-      if (difftime(time_now, p->last_timestamp) > INTERVAL) {
-        // update file table, removing this peer's ip from all places it appears
-        pthread_mutex_lock(file_table->lock); 
-        filetable_removePeerAll(file_table, p->ip, p->listen_port);
-        pthread_mutex_unlock(file_table->lock); 
+void *monitor_thread(void *arg) {
+  // Every INTERVAL seconds, report the peers with anything queued, and
+  // disconnect any too far behind. Peers that go quiet are the liveness
+  // wheel's, in serve_peers.
+  while(1) {
+    sleep(INTERVAL);
 
-        // this is marginally inefficient (we could just update pointers here)
-        // but it's worth it for maintaining clarity/permitting peertable design to change
-        peertable_remove(peer_table, p);
+    time_t time_now = time(NULL);
 
-        // stop that peer's thread/free it
-        peer_destroy(p);
+    shardtable_lockAll(file_table);
+    unsigned long version = shardtable_version(file_table);
+    shardtable_unlockAll(file_table);
+
+    // walk the peers as they are now; removing one publishes a new list but
+    // leaves this one, and its peers, intact
+    PeerSnapshot *peers = peertable_snapshot(peer_table);
+
+    for (int i = 0; i < peers->n_peers; i++) {
+      Peer *p = peers->peers[i];
+
+      // who is lagging, and by how much: the queue as of the last send to
+      // it, under its send_lock, and what it has acknowledged, which is
+      // kept beside the whole table
+      pthread_mutex_lock(&p->send_lock);
+      time_t behind_since = p->behind_since;
+      size_t queued = p->queued;
+      size_t queued_peak = p->queued_peak;
+      unsigned long coalesced = p->coalesced;
+      pthread_mutex_unlock(&p->send_lock);
+      if (behind_since == 0) {
+        continue;
       }
 
-      p = tmp;
-    }
-
-    // Reset the file table if no peers remain.
-    if (peer_table->head == NULL) {
-      filetable_destroy(file_table);
-      file_table = NULL;
-      file_table = filetable_init();
+      pthread_mutex_lock(file_table->lock);
+      unsigned long acked = p->acked;
+      pthread_mutex_unlock(file_table->lock);
+
+      int lag = (int) difftime(time_now, behind_since);
+      printf("QUEUE %s : %d: %zu bytes queued (peak %zu) for %ds, %lu versions behind, "
+        "%lu broadcasts coalesced\n", p->ip, p->listen_port, queued, queued_peak,
+        lag, (version > acked) ? version - acked : 0, coalesced);
+
+      // one that can't take even one table in PEER_LAG_MAX seconds is
+      // better off registering again when it can
+      if (lag > PEER_LAG_MAX) {
+        fprintf(stderr, "%s : %d hasn't drained its queue in %ds, too far behind\n",
+          p->ip, p->listen_port, lag);
+        peer_disconnect(p);
+      }
     }
+    peersnapshot_release(peers);
   }
 
   pthread_exit(0);
@@ -328,8 +1123,27 @@ void end_tracker() {
     close(listen_sock);
     listen_sock = -1;
   }
+  if (epoll_fd != -1) {
+    close(epoll_fd);
+    epoll_fd = -1;
+  }
 
-  // clean up peer and file tables
+  // clean up peer and file tables, saving the whole file table so the next
+  // run starts without a log to replay
   peertable_destroy(peer_table);
-  filetable_destroy(file_table);
+  if (liveness != NULL) {
+    timerwheel_destroy(liveness);
+    liveness = NULL;
+  }
+
+  shardtable_lockAll(file_table);
+  for (int i = 0; i < file_table->nshards; i++) {
+    tablestore_checkpoint(table_stores[i], file_table->shards[i]);
+  }
+  shardtable_unlockAll(file_table);
+  for (int i = 0; i < file_table->nshards; i++) {
+    tablestore_close(table_stores[i]);
+  }
+
+  shardtable_destroy(file_table);
 }
@@ -20,26 +20,43 @@
 #include <pthread.h>
 #include "../messaging/segment.h"
 #include "../filetable/filetable.h"
+#include "../filetable/shardtable.h"
 #include "peertable.h"
 
 // Definitions
-#define MAX_PEERS 100
+#define MAX_PEERS 4096      // peers served at once; more are turned away
+#define LISTEN_BACKLOG 1024 // connections left waiting to be accepted
+#define MAX_EVENTS 256      // socket events handled per wake-up of the loop
+#define PEER_QUEUE_MAX (64 * 1024 * 1024)  // bytes waiting for a peer before it is cut off
+#define PEER_LAG_MAX 60     // seconds a peer's queue may go without draining
+#define INGEST_LATENCY_MS 5     // longest a file event waits to be applied with others
+#define INGEST_BATCH_MAX 4096   // file events applied and broadcast together at most
 #define INTERVAL 5
+#define PEER_TIMEOUT ((INTERVAL + 2) * 1000)  // ms without a message before a peer is dead
+#define LIVENESS_TICK_MS 100  // how late past PEER_TIMEOUT a peer may be noticed
 #define PIECE_LENGTH 2048
 #define IP_LEN INET_ADDRSTRLEN
+#define STATE_DIR "tracker_state"   // where the file table is kept by default
+#define FEATURES FEATURE_COMPRESS   // offered to peers; 0 sends every message uncompressed
+#define TABLE_SHARDS 16   // file table shards; a state dir only loads with the count that saved it
 
 // A method to start listening on the handshake_port.
 int start_listening();
 
-// Started by the main thread when a new peer connects to the tracker. Adds the
-// peer to the peer table then listens for update messages from it.
-void *handshake_thread(void *arg);
+// Serves every peer from the calling thread: one epoll loop accepts peers as
+// they connect, adds them to the peer table, and handles each message as
+// soon as the whole of it has arrived, dropping peers that go quiet. Sockets
+// never block it; what a peer can't take yet waits in its send buffer until
+// it can. Returns once SIGINT stops the tracker, or on error.
+void serve_peers();
 
-// Monitors and accepts alive messages from peers. Removes dead peers from the
-// peer table.
+// Reports each peer with anything queued, and disconnects those whose queue
+// hasn't drained in PEER_LAG_MAX seconds. Peers that go PEER_TIMEOUT without
+// a message are dropped by serve_peers, on a timer wheel.
 void *monitor_thread(void *arg);
 
-// Method to clean up after tracker is done.
+// Method to clean up after tracker is done: saves the file table and closes
+// every connection.
 void end_tracker();
 
 #endif 
@@ -0,0 +1,134 @@
+/*
+ * wirebench.c: what compressing the tracker's messages costs and saves
+ *
+ * usage: ./wirebench [files]
+ *
+ * Encodes a whole table of the given number of files, as a registering peer
+ * gets it, and the changes after 1% of them change, as a broadcast sends
+ * them. For each: its size before and after compressing, how fast it
+ * compresses and decompresses, and then how long it takes a peer to get it
+ * at a few link speeds, sent as it is and compressed first. The tracker
+ * compresses for each peer it sends to, so the compressing time is per peer.
+ */
+
+#define _XOPEN_SOURCE 500
+#include <time.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include "../messaging/segment.h"
+#include "../messaging/compress.h"
+#include "../filetable/filetable.h"
+
+#define MIN_TIME 0.25     // seconds to repeat each timing for, at least
+
+static double now(void);
+static void bench(const char *name, WireBuf *w);
+
+int main(int argc, char *argv[]) {
+  int n = (argc > 1) ? atoi(argv[1]) : 100000;
+  if (n < 100) {
+    fprintf(stderr, "usage: %s [files]\n", argv[0]);
+    exit(1);
+  }
+
+  // a tree of 100 files to a directory, 100 directories to a directory,
+  // built in path order, so each entry appends at the tail
+  char path[1024];
+  FileTable *ft = filetable_init();
+  for (int i = 0; i < n; i++) {
+    snprintf(path, sizeof(path), "d%04d/d%02d/file%07d.txt", i / 10000, i / 100 % 100, i);
+    filetable_restore(ft, path, 1500000000 + i, 4096 + i % 65536, 0, i + 1);
+  }
+  filetable_restoreDone(ft, n);
+
+  printf("%d files\n", n);
+  printf("%-8s %10s %10s %6s %12s %12s   %s\n", "message", "bytes", "compressed", "ratio",
+      "comp (MB/s)", "decomp (MB/s)", "to a peer at 10 / 100 / 1000 Mbit/s, raw -> compressed (ms)");
+
+  WireBuf *w = wire_begin(-1, TABLE_UPDATE);
+  filetable_encode(w, ft);
+  bench("table", w);
+  wire_free(w);
+  free(w);
+
+  // 1% of the files change, spread across the table, as two peers report them
+  unsigned long since = ft->version;
+  FileInfo_FS *file = fileinfo_init();
+  srand(60);
+  for (int i = 0; i < n / 100; i++) {
+    int k = rand() % n;
+    snprintf(path, sizeof(path), "d%04d/d%02d/file%07d.txt", k / 10000, k / 100 % 100, k);
+    fileinfo_set_path(file, path);
+    file->last_modified = 1600000000 + i;
+    file->size = i;
+    filetable_updateMod(ft, file, (i % 2) ? "10.0.0.1" : "10.0.0.2", 9000);
+  }
+  fileinfo_destroy(file);
+
+  w = wire_begin(-1, TABLE_DELTA);
+  filetable_encodeChanges(w, ft, since);
+  bench("changes", w);
+  wire_free(w);
+  free(w);
+
+  filetable_destroy(ft);
+  return 0;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// times compressing and decompressing the payload of the message in w
+static void bench(const char *name, WireBuf *w) {
+  const char *payload = w->data + WIRE_HEADER;
+  size_t len = w->len - WIRE_HEADER;
+  char *block = malloc(len);
+  char *back = malloc(len);
+  if (block == NULL || back == NULL) {
+    fprintf(stderr, "malloc\n");
+    exit(1);
+  }
+
+  size_t blocklen = 0;
+  int reps = 0;
+  double start = now();
+  do {
+    blocklen = compress_block(payload, len, block, len);
+    reps++;
+  } while (now() - start < MIN_TIME);
+  double comp = (now() - start) / reps;
+  if (blocklen == 0) {
+    printf("%-8s %10zu doesn't compress\n", name, len);
+    free(block);
+    free(back);
+    return;
+  }
+
+  reps = 0;
+  start = now();
+  do {
+    if (decompress_block(block, blocklen, back, len) < 0 || memcmp(back, payload, len) != 0) {
+      fprintf(stderr, "%s: decompressed wrong\n", name);
+      exit(1);
+    }
+    reps++;
+  } while (now() - start < MIN_TIME);
+  double decomp = (now() - start) / reps;
+
+  printf("%-8s %10zu %10zu %6.1f %12.1f %12.1f  ", name, len, blocklen,
+      (double) len / blocklen, len / comp / 1e6, len / decomp / 1e6);
+  double mbits[] = {10, 100, 1000};
+  for (int i = 0; i < 3; i++) {
+    double raw = len * 8 / (mbits[i] * 1e6);
+    double packed = comp + blocklen * 8 / (mbits[i] * 1e6) + decomp;
+    printf(" %8.1f -> %-8.1f", raw * 1e3, packed * 1e3);
+  }
+  printf("\n");
+
+  free(block);
+  free(back);
+}
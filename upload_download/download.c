@@ -37,7 +37,7 @@ void *download(void *handlingInformation);
 
 
 /******************* globals *******************/
-char *baseDir;
+static char *baseDir;
 int data_len; // TODO: why not just define this as a macro?
 int stream_num;
 
@@ -224,6 +224,9 @@ int peer_connect(IP *ip)
     //exit(1);
   }
 
+  // the file is named by path on the first request, and by id after that
+  fileinfo_session_open(sock, 1);
+
   // return the socket fd
   return sock;
 }
@@ -310,11 +313,13 @@ void *peer_thread(void *sequenceInfos)
   }
 
   // Write termination message
-  seqInfos->arr[0]->initSeg = -1;
-  if (write(sock, seqInfos->arr[0], sizeof(SequenceInfo)) < 0) {
+  PieceRequest req = {-1, 0};
+  FileInfo_FS *file = seqInfos->arr[0]->tableEntry->file;
+  if (fileref_send(sock, &req, sizeof(req), file->id, file->filepath) < 0) {
     fprintf(stderr, "Download stopped by peer\n");
   }
   // Close the socket
+  fileinfo_session_close(sock);
   close(sock);
 
   // Use peer[0] to signal how many threads/peers are done
@@ -358,13 +363,11 @@ int seg_handler(SequenceInfo *seqInf, int sock)
   // allocate a buffer to hold segment
   char *buf = calloc(segLength, sizeof(char));
 
-  // send over the sequence info
-  if (write(sock, seqInf, sizeof(SequenceInfo)) < 0) {
-    return -1;
-  }
-
-  // then send over the file info
-  if (write(sock, seqInf->tableEntry->file,sizeof(FileInfo_FS)) < 0) {
+  // ask for the segment; the file's path only goes with the first request
+  // on this connection, and its id alone with the rest
+  PieceRequest req = {initSeg, segLength};
+  FileInfo_FS *file = seqInf->tableEntry->file;
+  if (fileref_send(sock, &req, sizeof(req), file->id, file->filepath) < 0) {
     return -1;
   }
 
@@ -35,7 +35,7 @@ void *upload(void *nothin);
 #define LISTEN_BACKLOG 40 // number of peers we will service
 
 pthread_t upload_thread;
-char *baseDir;
+static char *baseDir;
 
 
 
@@ -118,6 +118,9 @@ void *upload(void *port)
 
     //printf("Accepted upload request.\n");
 
+    // the downloader names its file once, and by id after that
+    fileinfo_session_open(comm_sock, 0);
+
     // allocate a handling info struct
     UpHandlingInfo *handlingInfo = calloc(1, sizeof(UpHandlingInfo));
     handlingInfo->sock = comm_sock;
@@ -155,32 +158,31 @@ void *send_file(void *handlingInf)
   // get the socket
   int sock = handlingInfo->sock;
 
-  SequenceInfo *seqInf = calloc(1,sizeof(SequenceInfo));
+  PieceRequest req;
 
 	while (true) {
-		// read the sequence info
-  	if (read(sock, seqInf, sizeof(SequenceInfo)) <= 0) {
+		// read the request, and the path of the file it's for; only the first
+		// request on the connection carries the path, the rest just its id
+  	if (recv(sock, &req, sizeof(req), MSG_WAITALL) <= 0) {
+			fprintf(stderr, "Download stopped by peer\n");
+			break;
+		}
+  	char *fileName = fileref_receive(sock, NULL);
+  	if (fileName == NULL) {
 			fprintf(stderr, "Download stopped by peer\n");
 			break;
 		}
-
-  	// read the fileinfo
-  	FileInfo_FS *fileInfo = fileinfo_receive(sock, 1);
-  	//fileinfo_print(fileInfo);
 
   	// get initSeg
-  	int initSeg = seqInf->initSeg;
+  	int initSeg = req.offset;
 
 		// breakout condition (termination message from downloaded)
 		if (initSeg == -1) {
-			fileinfo_destroy_all(fileInfo);
+			path_release(fileName);
 			break;
 		}
   	// get length
-  	int length = seqInf->length;
-
-  	// get the filename
-  	char *fileName = fileInfo->filepath;
+  	int length = req.length;
 
   	// allocate a buffer to hold the sequence of chars
   	char *buf = calloc(length, sizeof(char));
@@ -225,8 +227,8 @@ void *send_file(void *handlingInf)
   	// close the file
   	fclose(fd);
 
-		// destroy fileinfo
-  	fileinfo_destroy_all(fileInfo);
+		// done with the path
+  	path_release(fileName);
 
   	// unlock the file
   	pthread_mutex_unlock(handlingInfo->fileMutex);
@@ -243,10 +245,8 @@ void *send_file(void *handlingInf)
 
 	}
 
-	// free seqInf
-	free (seqInf);
-
-  // close the sock
+  // close the sock, forgetting the paths named on it
+  fileinfo_session_close(sock);
   close(sock);
 
   // free passed arg
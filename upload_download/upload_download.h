@@ -51,6 +51,16 @@ typedef struct SequenceinfoArr {
 } SequenceInfoArr;
 
 
+/*
+ * what a downloader sends a peer for each segment it wants, followed by a
+ * reference to the file's path (see fileref_send)
+ */
+typedef struct PieceRequest {
+  int32_t offset; // first byte of the segment, or -1 when the download is done
+  int32_t length; // length of the segment
+} PieceRequest;
+
+
 /*
  * holds information about the sequence of data we've received from a peer,
  * as well as the data itself. implemented as a linked list node